@@ -0,0 +1,342 @@
+﻿// Benchmark of the change queue (`DirChangeQueue`) on replayed storms of change events against the `std::list` which was scanned on every event before.
+// It runs anywhere.
+// Build:
+//   g++ -O2 -std=c++14 -pthread -I../clientapp changebench.cpp ../clientapp/dir_change_queue.cpp -o changebench
+// Usage:
+//   changebench [--files N] [--producers N] [--old-max N] [--seed N]
+// Storms: `unzip` creates `--files` files in 100 directories, each written by a few modifications interleaved with other files; `build` modifies
+// a working set of `--files` object files again and again; `churn` creates, modifies and deletes `--files` temporary files. Events are stamped
+// by a simulated clock (1 event per 10 microseconds), and settled changes are taken every 250 ms of it (the list with the settle time of 500 ms, as the applier
+// did, and the queue with its own settle detection, every file is probed as a small one).
+// For every storm it prints one JSON object per line with the time per event of pushing and taking (coalescing included) of the queue and of the list,
+// the peak number of pending changes and memory per pending change at the peak. Net effects of changes taken from both (which files are to be copied,
+// deleted or renamed at last) are compared: the queue takes changes earlier, so it coalesces fewer of them (the list is skipped for storms of more than
+// `--old-max` files, as it is quadratic). At last `--producers` threads push events of the `build` storm concurrently, while a consumer takes them,
+// and the time per event is printed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dir_change_queue.h"
+#include "spin_lock.h"
+
+const uint32_t TAKE_INTERVAL = 250, SETTLE_TIME = 500;
+
+struct Options
+{
+    int files = 100000;
+    int producers = 4;
+    int old_max = 20000;
+    uint64_t seed = 1;
+};
+
+// What `add_dir_change()` did before: the list was scanned under a spin lock, and every change held copies of the name of its watched directory
+struct OldDirChange
+{
+    int root_dir_entry_index;
+    PathString dir_name;
+    DirChange::Operation operation;
+    PathString fname;
+    PathString new_fname;
+    uint32_t time;
+};
+
+class OldQueue
+{
+public:
+    std::list<OldDirChange> dir_changes;
+    SpinLock dir_changes_lock;
+
+    void add(const PathString &dir_name, const DirChange &c)
+    {
+        if (c.operation == DirChange::Operation::MOVE && c.fname == c.new_fname)
+            return;
+        dir_changes_lock.acquire();
+        if (c.operation == DirChange::Operation::MODIFY) {
+            for (auto &&d : dir_changes)
+                if ((d.operation == DirChange::Operation::MODIFY || d.operation == DirChange::Operation::CREATE) && d.fname == c.fname && d.root_dir_entry_index == 0 && d.dir_name == dir_name) {
+                    d.time = c.time;
+                    goto skip_add;
+                }
+        }
+        else if (c.operation == DirChange::Operation::DELETE) {
+            for (auto it = dir_changes.begin(); it != dir_changes.end(); it++)
+                if (it->operation == DirChange::Operation::CREATE && it->fname == c.fname && it->root_dir_entry_index == 0 && it->dir_name == dir_name) {
+                    dir_changes.erase(it);
+                    goto skip_add;
+                }
+        }
+        {
+            OldDirChange dc = {0, dir_name, c.operation, c.fname, c.new_fname, c.time};
+            dir_changes.push_back(std::move(dc));
+        }
+    skip_add:
+        dir_changes_lock.release();
+    }
+
+    void take_settled(uint32_t time, std::vector<DirChange> &settled)
+    {
+        dir_changes_lock.acquire();
+        for (auto it = dir_changes.begin(); it != dir_changes.end();) {
+            if ((it->operation == DirChange::Operation::MODIFY || it->operation == DirChange::Operation::CREATE) && int32_t(time - it->time) < int32_t(SETTLE_TIME)) {
+                ++it;
+                continue;
+            }
+            DirChange dc;
+            dc.tree = 0;
+            dc.operation = it->operation;
+            dc.fname = it->fname;
+            dc.new_fname = it->new_fname;
+            dc.time = it->time;
+            settled.push_back(std::move(dc));
+            it = dir_changes.erase(it);
+        }
+        dir_changes_lock.release();
+    }
+
+    size_t memory_usage() const
+    {
+        size_t short_capacity = PathString().capacity();
+        size_t r = 0;
+        for (auto &&d : dir_changes) {
+            r += sizeof(d) + sizeof(void*) * 2;
+            for (auto s : {&d.dir_name, &d.fname, &d.new_fname})
+                if (s->capacity() > short_capacity)
+                    r += (s->capacity() + 1) * sizeof(PathChar);
+        }
+        return r;
+    }
+};
+
+static DirChange change(DirChange::Operation operation, const PathString &fname)
+{
+    DirChange c;
+    c.tree = 0;
+    c.operation = operation;
+    c.fname = fname;
+    c.time = 0;
+    return c;
+}
+
+static PathString file_name(const char *dir, int d, const char *file, int f, const char *ext)
+{
+    return dir + std::to_string(d) + '/' + file + std::to_string(f) + ext;
+}
+
+static std::vector<DirChange> make_storm(const std::string &name, int files, std::mt19937_64 &rng)
+{
+    std::vector<DirChange> events;
+    if (name == "unzip") { // a few files are written at once, each by several modifications
+        const int OPEN_FILES = 4;
+        std::vector<int> open, writes_left;
+        int next = 0;
+        while (next < files || !open.empty()) {
+            while (int(open.size()) < OPEN_FILES && next < files) {
+                events.push_back(change(DirChange::Operation::CREATE, file_name("archive/dir", next % 100, "file", next, ".dat")));
+                open.push_back(next++);
+                writes_left.push_back(1 + rng() % 8);
+            }
+            size_t i = rng() % open.size();
+            events.push_back(change(DirChange::Operation::MODIFY, file_name("archive/dir", open[i] % 100, "file", open[i], ".dat")));
+            if (--writes_left[i] == 0) {
+                open.erase(open.begin() + i);
+                writes_left.erase(writes_left.begin() + i);
+            }
+        }
+    }
+    else if (name == "build") { // object files of a working set are rewritten in rounds
+        for (int round = 0; round < 4; round++)
+            for (int i = 0; i < files; i++)
+                events.push_back(change(DirChange::Operation::MODIFY, file_name("build/module", i % 100, "unit", i, ".obj")));
+    }
+    else { // `churn`: temporary files live for a short while
+        for (int i = 0; i < files; i++) {
+            PathString fname = file_name("tmp/session", i % 10, "tmp", i, ".tmp");
+            events.push_back(change(DirChange::Operation::CREATE, fname));
+            events.push_back(change(DirChange::Operation::MODIFY, fname));
+            events.push_back(change(DirChange::Operation::DELETE, fname));
+        }
+    }
+    for (size_t i = 0; i < events.size(); i++)
+        events[i].time = uint32_t(i / 100); // 1 event per 10 microseconds
+    return events;
+}
+
+struct Result
+{
+    double seconds_per_event;
+    size_t peak_pending;
+    double bytes_per_pending;
+    std::vector<DirChange> taken;
+};
+
+template <class Queue, class Push, class MemoryUsage> static Result replay(const std::vector<DirChange> &events, Queue &queue, Push push, MemoryUsage memory_usage)
+{
+    Result r = {0, 0, 0};
+    auto start = std::chrono::steady_clock::now();
+    double measured = 0;
+    uint32_t next_take = TAKE_INTERVAL;
+    size_t pending = 0;
+    for (size_t i = 0; i <= events.size(); i++) {
+        uint32_t time = i < events.size() ? events[i].time : events.back().time + SETTLE_TIME * 4;
+        while (time >= next_take) {
+            size_t taken = r.taken.size();
+            queue.take_settled(next_take, r.taken);
+            pending = queue.size();
+            if (pending > r.peak_pending) { // memory is measured at the peak, outside of the timed part
+                measured += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                r.peak_pending = pending;
+                r.bytes_per_pending = double(memory_usage()) / pending;
+                start = std::chrono::steady_clock::now();
+            }
+            next_take += taken == r.taken.size() && i == events.size() && pending == 0 ? 0 : TAKE_INTERVAL;
+            if (i == events.size() && pending == 0)
+                break;
+        }
+        if (i < events.size()) {
+            DirChange c = events[i];
+            push(std::move(c));
+        }
+    }
+    measured += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    r.seconds_per_event = measured / events.size();
+    return r;
+}
+
+static bool probe_small(const DirChange&, FileState &state)
+{
+    state.size = 0;
+    state.last_write_time = 0;
+    return true;
+}
+
+struct NewQueue // with the same interface as `OldQueue` for `replay()`
+{
+    DirChangeQueue q;
+    void take_settled(uint32_t time, std::vector<DirChange> &settled) {q.take_settled(time, probe_small, settled);}
+    size_t size() const {return q.size();}
+};
+
+struct OldQueueAdapter
+{
+    OldQueue q;
+    void take_settled(uint32_t time, std::vector<DirChange> &settled) {q.take_settled(time, settled);}
+    size_t size() const {return q.dir_changes.size();}
+};
+
+enum class NetEffect {COPIED, DELETED};
+
+// What the applier is left to do after all changes are applied: files which are to be copied and files which are to be deleted from the backup
+static std::map<PathString, NetEffect> net_effect(const std::vector<DirChange> &changes)
+{
+    std::map<PathString, NetEffect> r;
+    for (auto &&c : changes)
+        switch (c.operation)
+        {
+        case DirChange::Operation::CREATE:
+        case DirChange::Operation::MODIFY:
+            r[c.fname] = NetEffect::COPIED;
+            break;
+        case DirChange::Operation::DELETE: {
+            auto it = r.find(c.fname);
+            if (it != r.end() && it->second == NetEffect::COPIED) // a file which has not been there before
+                r.erase(it);
+            else
+                r[c.fname] = NetEffect::DELETED;
+            break; }
+        default: {
+            auto it = r.find(c.fname);
+            NetEffect e = it != r.end() ? it->second : NetEffect::COPIED; // a renamed file is copied under its new name (unless it is in the backup already)
+            r[c.fname] = NetEffect::DELETED;
+            r[c.new_fname] = e;
+            break; }
+        }
+    return r;
+}
+
+static bool same(const std::vector<DirChange> &a, const std::vector<DirChange> &b)
+{
+    return net_effect(a) == net_effect(b);
+}
+
+int main(int argc, char *argv[])
+{
+    Options o;
+    for (int i = 1; i < argc; i++) {
+        if      (strcmp(argv[i], "--files") == 0 && i + 1 < argc)     o.files = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--producers") == 0 && i + 1 < argc) o.producers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--old-max") == 0 && i + 1 < argc)   o.old_max = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)      o.seed = strtoull(argv[++i], NULL, 10);
+        else {
+            fprintf(stderr, "Unknown option `%s`\n", argv[i]);
+            return 1;
+        }
+    }
+
+    int mismatches = 0;
+    PathString watched_dir_name = "/home/user/projects/guardofdata";
+    for (const char *storm : {"unzip", "build", "churn"}) {
+        std::mt19937_64 rng(o.seed);
+        std::vector<DirChange> events = make_storm(storm, o.files, rng);
+
+        NewQueue nq;
+        Result n = replay(events, nq, [&](DirChange &&c) {nq.q.push(std::move(c));}, [&]() {return nq.q.memory_usage();});
+        printf("{\"storm\": \"%s\", \"files\": %d, \"events\": %zu, \"taken\": %zu, \"queue_seconds_per_event\": %.9f, \"queue_peak_pending\": %zu, \"queue_bytes_per_pending\": %.1f",
+               storm, o.files, events.size(), n.taken.size(), n.seconds_per_event, n.peak_pending, n.bytes_per_pending);
+        if (o.files <= o.old_max) {
+            OldQueueAdapter oq;
+            Result r = replay(events, oq, [&](DirChange &&c) {oq.q.add(watched_dir_name, c);}, [&]() {return oq.q.memory_usage();});
+            bool equal = same(n.taken, r.taken);
+            mismatches += !equal;
+            printf(", \"list_taken\": %zu, \"list_seconds_per_event\": %.9f, \"list_peak_pending\": %zu, \"list_bytes_per_pending\": %.1f, \"same_effect\": %s",
+                   r.taken.size(), r.seconds_per_event, r.peak_pending, r.bytes_per_pending, equal ? "true" : "false");
+        }
+        printf("}\n");
+        fflush(stdout);
+    }
+
+    // Concurrent producers push shares of the `build` storm while the consumer takes settled changes
+    {
+        std::mt19937_64 rng(o.seed);
+        std::vector<DirChange> events = make_storm("build", o.files, rng);
+        DirChangeQueue q;
+        std::atomic<bool> done(false);
+        std::vector<DirChange> taken;
+        auto start = std::chrono::steady_clock::now();
+        uint32_t time = events.back().time + DirChangeQueue::MIN_QUIET_TIME * 2;
+        std::thread consumer([&]() {
+            while (!done) {
+                q.take_settled(time, probe_small, taken);
+                std::this_thread::yield();
+            }
+            q.take_settled(time, probe_small, taken);
+            while (q.size() != 0) { // files which events came at intervals are quiet later
+                time += DirChangeQueue::MIN_QUIET_TIME;
+                q.take_settled(time, probe_small, taken);
+            }
+        });
+        std::vector<std::thread> producers;
+        for (int p = 0; p < o.producers; p++)
+            producers.push_back(std::thread([&, p]() {
+                for (size_t i = p; i < events.size(); i += o.producers) {
+                    DirChange c = events[i];
+                    q.push(std::move(c));
+                }
+            }));
+        for (auto &&t : producers)
+            t.join();
+        done = true;
+        consumer.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("{\"test\": \"producers\", \"producers\": %d, \"events\": %zu, \"taken\": %zu, \"seconds_per_event\": %.9f}\n", o.producers, events.size(), taken.size(), seconds / events.size());
+    }
+    return mismatches != 0 ? 1 : 0;
+}
@@ -1,195 +1,34 @@
 ﻿#include "precompiled.h"
 #include "tabs.h"
+#include "dir_scanner.h"
+#include "dir_enumerator.h"
+#include "dir_rules.h"
+#include "dir_tree_view.h"
+#include "dir_name_index.h"
+#include "dir_watcher.h"
+#include "dir_change_queue.h"
+#include "dir_notify_decoder.h"
+#include "number_format.h"
 
 const int DIR_SIZE_COLUMN_WIDTH = mul_by_system_scaling_factor(70);
 const int FILES_COUNT_COLUMN_WIDTH = mul_by_system_scaling_factor(52);
 const int TREEVIEW_LEVEL_OFFSET = mul_by_system_scaling_factor(16);
-const int DIR_MODE_LEVELS_AUTO = 3;
 
 TabBackup::SortBy TabBackup::sort_by = SortBy::NAME;
 volatile bool TabBackup::stop_scan = false, TabBackup::cancel_scan = false;
 bool popup_menu_is_open = false;
 
-std::unordered_set<std::wstring> always_excluded_directories = {
-    L"$Recycle.Bin",
-    L"Program Files",
-    L"Program Files (x86)",
-    L"Users",
-    L"Windows",
-    // For Windows XP:
-    L"WINDOWS",
-    L"Documents and Settings",
-};
-// By default ‘<UserProfile>\AppData\Local’ and ‘<UserProfile>\AppData\LocalLow’ are excluded (also .git directories which size is more than 100MB are excluded)
-// C/<UserProfile> <- %USERPROFILE% or [UserProfiles]/<UserName>
-//   ^           ^
-//   └───────────┴─────────────────────────────────── — because `<` and `>` are not allowed in the file name
-
-enum class DirMode
-{
-    EXCLUDED,
-    NORMAL,
-    FROZEN,
-    APPEND_ONLY,
-    INHERIT_FROM_PARENT,
-    AUTO,
-    COUNT
-};
-const float DIR_PRIORITY_ULTRA_HIGH =  2;
-const float DIR_PRIORITY_HIGH       =  1;
-const float DIR_PRIORITY_NORMAL     =  0;
-const float DIR_PRIORITY_LOW        = -1;
-const float DIR_PRIORITY_ULTRA_LOW  = -2;
-const float DIR_PRIORITY_AUTO       = FLT_MIN;
 HICON mode_icons[4], mode_mixed_icon, mode_manual_icon, priority_icons[4];
 HBITMAP mode_bitmaps[4], mode_bitmaps_selected[4];
 HBITMAP priority_bitmaps[5], priority_bitmaps_selected[5];
 
-class DirEntry
-{
-public:
-    DirEntry *parent = nullptr;
-    const std::wstring *dir_name = nullptr;
-    std::wstring full_dir_name() const
-    {
-        std::wstring full_dir_name = *dir_name;
-        for (DirEntry *p = parent; p; p = p->parent)
-            full_dir_name = *p->dir_name / full_dir_name;
-        return full_dir_name;
-    }
-    struct Less
-    {
-        wchar_t fast_get_lowercase_en(wchar_t c) const
-        {
-            if (unsigned(int(c) - int(L'A')) <= unsigned(L'Z' - L'A'))
-                return c + (L'a' - L'A');
-            return c;
-        }
-
-        bool operator()(const std::wstring &left, const std::wstring &right) const
-        {
-            for (const wchar_t *l = left.c_str(), *r = right.c_str(); ; l++, r++) {
-                wchar_t lower_l = fast_get_lowercase_en(*l),
-                        lower_r = fast_get_lowercase_en(*r);
-                if (lower_l != lower_r)
-                    return lower_l < lower_r;
-                if (lower_l == 0)
-                    return false;
-            }
-        }
-    };
-    using SubDirs = std::map<std::wstring, DirEntry, Less>;
-    SubDirs subdirs;
-    SpinLock subdirs_lock;
-    int32_t dir_num_of_files = 0; // number of files just in this directory
-    int32_t num_of_files = 0; // total number of files including subdirectories
-    int32_t num_of_files_excluded = 0;
-    int64_t dir_files_size = 0; // size of files just in this directory
-    int64_t size = 0; // total size of files including subdirectories
-    int64_t size_excluded = 0;
-    FILETIME max_last_write_time = FILETIME{}; // zero initialization
-    DirMode mode_auto = DirMode::INHERIT_FROM_PARENT;
-    DirMode mode_manual = DirMode::AUTO;
-    DirMode mode() const {return mode_manual != DirMode::AUTO ? mode_manual : mode_auto;}
-    DirMode mode_no_ifp() const
-    {
-        if (mode() != DirMode::INHERIT_FROM_PARENT)
-            return mode();
-        for (DirEntry *pd = parent; pd; pd = pd->parent)
-            if (pd->mode() != DirMode::INHERIT_FROM_PARENT)
-                return pd->mode();
-        return DirMode::INHERIT_FROM_PARENT;
-    }
-    float priority_auto = DIR_PRIORITY_NORMAL;
-    float priority_manual = DIR_PRIORITY_AUTO;
-    float priority() const {return priority_manual == DIR_PRIORITY_AUTO ? priority_auto : priority_manual;}
-    bool mode_mixed = false;
-    bool scan_started = false;
-    bool expanded = false;
-    //bool deleted = false;
-    bool not_traversed = false; // directory entry was not scanned
-
-    void update_mode_mixed()
-    {
-        for (DirEntry *pd = parent; pd; pd = pd->parent) {
-            pd->mode_mixed = false;
-            DirMode pd_mode_no_ifp = pd->mode_no_ifp();
-            for (auto &&sd : pd->subdirs)
-                if ((sd.second.mode() != pd_mode_no_ifp && sd.second.mode() != DirMode::INHERIT_FROM_PARENT) || sd.second.mode_mixed) {
-                    pd->mode_mixed = true;
-                    break;
-                }
-        }
-    }
-
-    void exclude_auto(bool set_priority_to_normal_and_update_mode_mixed = false)
-    {
-        std::function<void(DirEntry&)> set_inherit_from_parent_and_excluded = [&set_inherit_from_parent_and_excluded, set_priority_to_normal_and_update_mode_mixed](DirEntry &de) {
-            if (set_priority_to_normal_and_update_mode_mixed)
-                de.priority_auto = DIR_PRIORITY_NORMAL;
-            de.size_excluded = de.size;
-            de.num_of_files_excluded = de.num_of_files;
-            for (auto &&sd : de.subdirs) {
-                sd.second.mode_auto = DirMode::INHERIT_FROM_PARENT;
-                set_inherit_from_parent_and_excluded(sd.second);
-            }
-        };
-
-        mode_auto = DirMode::EXCLUDED;
-        set_inherit_from_parent_and_excluded(*this);
-        for (DirEntry *pde = parent; pde != nullptr; pde = pde->parent) {
-            pde->size_excluded += size;
-            pde->num_of_files_excluded += num_of_files;
-        }
-
-        if (set_priority_to_normal_and_update_mode_mixed)
-            update_mode_mixed();
-    }
-
-    void set_mode_manual(DirMode new_mode_manual)
-    {
-        DirMode prev_mode_no_ifp = mode_no_ifp();
-        mode_manual = new_mode_manual;
-
-        // Update `mode_mixed`
-        update_mode_mixed();
-
-        // Update `num_of_files_excluded` and `size_excluded` if necessary
-        if ((prev_mode_no_ifp == DirMode::EXCLUDED) != (mode_no_ifp() == DirMode::EXCLUDED)) {
-            int64_t prev_size_excluded         = size_excluded;
-            int32_t prev_num_of_files_excluded = num_of_files_excluded;
-            std::function<void(DirEntry&)> recalc_excluded = [&recalc_excluded](DirEntry &de) {
-                if (de.mode_no_ifp() == DirMode::EXCLUDED) {
-                    de.size_excluded = de.dir_files_size;
-                    de.num_of_files_excluded = de.dir_num_of_files;
-                }
-                else {
-                    de.size_excluded = 0;
-                    de.num_of_files_excluded = 0;
-                }
-                for (auto &&sd : de.subdirs) {
-                    recalc_excluded(sd.second);
-                    de.size_excluded += sd.second.size_excluded;
-                    de.num_of_files_excluded += sd.second.num_of_files_excluded;
-                }
-            };
-            recalc_excluded(*this);
-            int64_t delta_size_excluded         = size_excluded         - prev_size_excluded;
-            int32_t delta_num_of_files_excluded = num_of_files_excluded - prev_num_of_files_excluded;
-            for (DirEntry *pde = parent; pde != nullptr; pde = pde->parent) {
-                pde->size_excluded += delta_size_excluded;
-                pde->num_of_files_excluded += delta_num_of_files_excluded;
-            }
-        }
-    }
-};
-
-class RootDirEntry : public DirEntry
+class RootDirEntry
 {
 public:
     std::wstring path, name;
+    DirEntry *de;
 
-    RootDirEntry(const std::wstring &path) : path(path)
+    RootDirEntry(const std::wstring &path) : path(path), de(dir_tree.add_root(path))
     {
         if (path.back() == L':') {
             wchar_t label[MAX_PATH+1] = L"\0";
@@ -201,9 +40,8 @@ public:
         }
         else
             name = path;
-        dir_name = &this->path;
     }
-    RootDirEntry(const std::wstring &path, const std::wstring &name) : path(path), name(name) {dir_name = &this->path;}
+    RootDirEntry(const std::wstring &path, const std::wstring &name) : path(path), name(name), de(dir_tree.add_root(path)) {}
 };
 std::vector<std::unique_ptr<RootDirEntry>> root_dir_entries;
 class InitRootDirEntries
@@ -212,7 +50,7 @@ public:
     InitRootDirEntries()
     {
         root_dir_entries.push_back(std::make_unique<RootDirEntry>(L"C:"));
-        root_dir_entries.back()->expanded = true;
+        root_dir_entries.back()->de->expanded = true;
 
         wchar_t user_profile_dir[MAX_PATH];
         size_t rsz;
@@ -221,301 +59,485 @@ public:
     }
 } init_root_dir_entries;
 
-FILETIME cur_ft;
-
-void enum_files_recursively(const std::wstring &dir_name, DirEntry &de, int level)
+HANDLE initial_scan_thread, scan_thread = NULL;
+HANDLE reconcile_done_event = CreateEvent(NULL, TRUE, TRUE, NULL); // reset while `apply_directory_changes_thread_proc()` reconciles a suspect tree, which is a scan too
+volatile bool stop_reconcile = false; // set by `restart_scan()`, `cancel_scan()` and on exit, so that they do not wait for the whole rescan of a suspect tree
+CriticalSection scan_start_cs; // a reconcile is started under it, so that it is not started while a scan is being started or a menu action is editing the tree
+bool guarded_folders_configured = false; // the first scan was completed, so the user has already been asked to configure guarded folders
+const uint32_t SNAPSHOT_GUARDED_FOLDERS_CONFIGURED = 1; // user flag of the snapshot
+const std::chrono::seconds SCAN_CHECKPOINT_INTERVAL(60);
+
+bool scan_is_running()
 {
-    de.scan_started = true;
-
-    WIN32_FIND_DATA fd;
-    HANDLE h = FindFirstFile((dir_name / L"*.*").c_str(), &fd);
-    if (h == INVALID_HANDLE_VALUE) return;
-
-    DirEntry::SubDirs subdirs;
-
-    do
-    {
-        if (TabBackup::stop_scan) {
-            FindClose(h);
-            return;
-        }
-
-        if ((fd.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM) && !(!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && wcscmp(fd.cFileName, L"desktop.ini") == 0))
-            continue;
-
-        if (fd.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN|FILE_ATTRIBUTE_REPARSE_POINT)) // skip hidden files and directories and symbolic links
-            if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && (wcscmp(fd.cFileName, L".git") == 0 || wcscmp(fd.cFileName, L"AppData") == 0))
-                ASSERT((fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0);
-            else
-                continue;
-
-        std::wstring file_name(fd.cFileName);
-        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            if (file_name == L"." || file_name == L"..")
-                continue;
-            if (!de.parent && always_excluded_directories.find(file_name) != always_excluded_directories.end())
-                continue;
-
-            auto it = subdirs.emplace(file_name, DirEntry());
-            it.first->second.parent = &de;
-            it.first->second.dir_name = &it.first->first;
-        }
-        else {
-            de.dir_files_size += (uint64_t(fd.nFileSizeHigh) << 32) | fd.nFileSizeLow;
-            de.dir_num_of_files++;
-            if ((uint64_t&)fd.ftLastWriteTime > (uint64_t&)de.max_last_write_time // CompareFileTime() is much slower
-                    && (int64_t&)cur_ft - (int64_t&)fd.ftLastWriteTime >= 0) // ignore time in future
-                de.max_last_write_time = fd.ftLastWriteTime;
-        }
-    } while (FindNextFile(h, &fd));
-
-    FindClose(h);
-
-    de.size = de.dir_files_size;
-    de.num_of_files = de.dir_num_of_files;
+    return WaitForSingleObject(initial_scan_thread, 0) == WAIT_TIMEOUT || (scan_thread != NULL &&
+           WaitForSingleObject(        scan_thread, 0) == WAIT_TIMEOUT)
+        || WaitForSingleObject(reconcile_done_event, 0) == WAIT_TIMEOUT;
+}
 
-    de.subdirs_lock.acquire();
-    de.subdirs = std::move(subdirs);
-    de.subdirs_lock.release();
+void reset_dir_tree_view();
+void start_filter_thread();
+void stop_filter_thread();
 
-    for (DirEntry *pde = de.parent; pde != nullptr; pde = pde->parent) {
-        pde->size += de.size;
-        pde->num_of_files += de.num_of_files;
-    }
+std::wstring app_data_file_name(const wchar_t *name)
+{
+    wchar_t local_app_data_dir[MAX_PATH];
+    if (FAILED(SHGetFolderPath(NULL, CSIDL_LOCAL_APPDATA|CSIDL_FLAG_CREATE, NULL, SHGFP_TYPE_CURRENT, local_app_data_dir))) // ‘<UserProfile>\AppData\Local’ is excluded from backup
+        return std::wstring();
+    std::wstring dir = std::wstring(local_app_data_dir) / L"Guard of Data";
+    CreateDirectory(dir.c_str(), NULL);
+    return dir / name;
+}
 
-    for (auto &&sd : de.subdirs) {
-        if (TabBackup::stop_scan)
-            return;
-        enum_files_recursively(dir_name / sd.first, sd.second, level + 1);
-        if ((uint64_t&)sd.second.max_last_write_time > (uint64_t&)de.max_last_write_time)
-            de.max_last_write_time = sd.second.max_last_write_time;
+// Must be called before `load_dir_tree_snapshot()`: user rules are in ‘rules.txt’ (see `DirRule`), built-in rules are used if there is no such file
+void load_dir_rules()
+{
+    dir_rules.define(L"<UserProfile>", root_dir_entries[1]->path);
+    std::wstring file_name = app_data_file_name(L"rules.txt");
+    std::string error;
+    if (!file_name.empty() && !dir_rules.load(file_name, error)) {
+        std::wstring message = L"Error in " + file_name + L", " + std::wstring(error.begin(), error.end()) + L".\nOnly built-in rules are used.";
+        MessageBox(NULL, message.c_str(), L"", MB_OK|MB_ICONWARNING);
     }
+}
 
-    if (ends_with(dir_name, L"/.git") && de.size > 100*1024*1024) {
-        de.exclude_auto();
+// Must be called before `initial_scan()` is started: the tree saved at the previous run is shown right away and `initial_scan()` rescans it in the background
+void load_dir_tree_snapshot()
+{
+    std::wstring file_name = app_data_file_name(L"dir_tree.snapshot");
+    if (file_name.empty())
         return;
-    }
-
-    if (level > DIR_MODE_LEVELS_AUTO) {
-        de.mode_auto = DirMode::INHERIT_FROM_PARENT;
-        //return; // no return to check if mode is mixed (e.g. if there is EXCLUDED .git subdirectory)
-    }
-    else {
-        size_t last_slash_pos = dir_name.rfind(L'/');
-        if (last_slash_pos != dir_name.npos) {
-            std::wstring base_name(dir_name.c_str() + last_slash_pos + 1);
-            fast_make_lowercase_en(&base_name[0]);
-            if (base_name.find(L"photo") != base_name.npos || base_name.find(L"backup") != base_name.npos) {
-                de.mode_auto = DirMode::APPEND_ONLY;
-                de.priority_auto = DIR_PRIORITY_LOW;
-                std::function<void(DirEntry&)> set_inherit_from_parent = [&set_inherit_from_parent](DirEntry &de) {
-                    for (auto &&sd : de.subdirs) {
-                        sd.second.mode_auto = DirMode::INHERIT_FROM_PARENT;
-                        sd.second.priority_auto = DIR_PRIORITY_NORMAL;
-                        set_inherit_from_parent(sd.second);
-                    }
-                };
-                set_inherit_from_parent(de);
-                return;
-            }
-        }
 
-        if ((uint64_t&)de.max_last_write_time == 0) {
-            de.mode_auto = DirMode::INHERIT_FROM_PARENT;
+    std::vector<DirEntry*> roots;
+    uint32_t flags = 0;
+    stop_filter_thread();
+    dir_tree.clear();
+    if (dir_tree.load_snapshot(file_name, roots, &flags) && roots.size() == root_dir_entries.size()) {
+        size_t i = 0;
+        while (i < roots.size() && wcscmp(roots[i]->name(), root_dir_entries[i]->path.c_str()) == 0)
+            i++;
+        if (i == roots.size()) {
+            for (i = 0; i < roots.size(); i++)
+                root_dir_entries[i]->de = roots[i];
+            guarded_folders_configured = (flags & SNAPSHOT_GUARDED_FOLDERS_CONFIGURED) != 0; // otherwise it is a checkpoint of an interrupted first scan
+            reset_dir_tree_view();
             return;
         }
-
-        std::function<void(DirEntry&)> set_priority_to_normal = [&set_priority_to_normal](DirEntry &de) {
-            for (auto &&sd : de.subdirs) {
-                sd.second.priority_auto = DIR_PRIORITY_NORMAL;
-                set_priority_to_normal(sd.second);
-            }
-        };
-        int64_t days_since_last_write = ((int64_t&)cur_ft - (int64_t&)de.max_last_write_time)/(10000000LL*3600*24);
-        if (days_since_last_write > 365/2) {
-            de.mode_auto = DirMode::FROZEN;
-            if (/*level == 1 && */de.size > 10*1024*1024) {
-                de.priority_auto = /*days_since_last_write < 365 ? */DIR_PRIORITY_LOW/* : DIR_PRIORITY_ULTRA_LOW*/; // there is very little data changed from six months to a year ago, and besides, it makes sense to reserve an ultra low priority for manual selection by the user
-                set_priority_to_normal(de);
-            }
-        }
-        else {
-            de.mode_auto = DirMode::NORMAL;
-            if (days_since_last_write <= 7 && de.size <= 1024*1024*1024) {
-                de.priority_auto = DIR_PRIORITY_HIGH;
-                set_priority_to_normal(de);
-            }
-        }
     }
 
-    // Check if mode is mixed
-    for (auto &&sd : de.subdirs)
-        if ((sd.second.mode_auto != de.mode_auto && sd.second.mode_auto != DirMode::INHERIT_FROM_PARENT) || sd.second.mode_mixed) {
-            de.mode_mixed = true;
-            break;
-        }
+    // Snapshot is missing or corrupted or it was made for other root directories
+    stop_filter_thread();
+    dir_tree.clear();
+    for (auto &root_dir_entry : root_dir_entries)
+        root_dir_entry = std::make_unique<RootDirEntry>(root_dir_entry->path, root_dir_entry->name);
+    root_dir_entries[0]->de->expanded = true;
+    reset_dir_tree_view();
 }
 
-HANDLE initial_scan_thread, scan_thread = NULL;
+// Scan must be completed, stopped or paused at a checkpoint (an incomplete tree is resumed by the next scan, see `DirScanner`), and no other thread may modify the tree
+void save_dir_tree_snapshot()
+{
+    std::wstring file_name = app_data_file_name(L"dir_tree.snapshot");
+    if (file_name.empty())
+        return;
+
+    std::vector<DirEntry*> roots;
+    for (auto &root_dir_entry : root_dir_entries)
+        roots.push_back(root_dir_entry->de);
+    if (!dir_tree.save_snapshot(file_name, roots, guarded_folders_configured ? SNAPSHOT_GUARDED_FOLDERS_CONFIGURED : 0))
+        ERROR;
+}
 
 void cancel_scan();
 
 DWORD WINAPI initial_scan(LPVOID)
 {
-    GetSystemTimeAsFileTime(&cur_ft);
+    std::vector<DirScanner::Root> roots;
     for (auto &root_dir_entry : root_dir_entries) {
-        enum_files_recursively(root_dir_entry->path, *root_dir_entry, 1);
-        if (TabBackup::stop_scan) {
-            if (TabBackup::cancel_scan)
-                cancel_scan();
-            return 1;
+        DirScanner::Root root = {root_dir_entry->path, root_dir_entry->de};
+        roots.push_back(root);
+    }
+    DirScanner scanner(TabBackup::stop_scan);
+    scanner.set_checkpoint(save_dir_tree_snapshot, SCAN_CHECKPOINT_INTERVAL); // an interrupted scan is resumed from the last checkpoint at the next run
+    scanner.scan(roots);
+    if (TabBackup::stop_scan) {
+        if (TabBackup::cancel_scan) {
+            save_dir_tree_snapshot(); // so that the scan is resumed by `restart_scan()` or at the next run (on exit the snapshot is saved by the main thread)
+            cancel_scan();
         }
+        return 1;
     }
 
-    // Exclude ‘<UserProfile>\AppData\Local’ and ‘<UserProfile>\AppData\LocalLow’
-    RootDirEntry &upde = *root_dir_entries[1];
-    ASSERT(upde.name == L"<UserProfile>");
-    auto it = upde.subdirs.find(L"AppData");
-    if (it != upde.subdirs.end()) { // for Windows XP
-        auto  lit = it->second.subdirs.find(L"Local");    if ( lit != it->second.subdirs.end())  lit->second.exclude_auto(true);
-        auto llit = it->second.subdirs.find(L"LocalLow"); if (llit != it->second.subdirs.end()) llit->second.exclude_auto(true);
-    }
+    for (auto &root_dir_entry : root_dir_entries) // needed after rescan of a snapshot with manual modes
+        root_dir_entry->de->recalc_excluded();
+
+    bool ask_to_configure = !guarded_folders_configured;
+    guarded_folders_configured = true;
+    save_dir_tree_snapshot();
 
     backup_state = BackupState::SCAN_COMPLETED;
     SendMessage(main_wnd, WM_COMMAND, IDB_TAB_BACKUP, 0); // needed to update backup tab if it is already active
 
-    MessageBox(main_wnd, L"Scan completed. Please configure guarded folders and/or exclude unnecessary ones, and then click ‘Start backup!’ button", L"", MB_OK|MB_ICONINFORMATION);
+    if (ask_to_configure)
+        MessageBox(main_wnd, L"Scan completed. Please configure guarded folders and/or exclude unnecessary ones, and then click ‘Start backup!’ button", L"", MB_OK|MB_ICONINFORMATION);
     return 0;
 }
 
-void scan_enum_files_recursively(DirEntry &de)
+struct SubtreeScan // the guard is pinned before the entry is handed over to the thread, so the entry can not be reused meanwhile
 {
-    de.scan_started = true;
-    de.not_traversed = false;
+    DirEntry *de;
+    DirTree::ReadGuard guard;
+};
 
-    WIN32_FIND_DATA fd;
-    HANDLE h = FindFirstFile((de.full_dir_name() / L"*.*").c_str(), &fd);
-    if (h == INVALID_HANDLE_VALUE) return;
+// Rescans subtree of a directory in place by `scanner`, and updates totals of its ancestors
+void scan_subtree(DirEntry &de, const std::wstring &dir_name, DirScanner &scanner)
+{
+    int level = 1;
+    for (DirEntry *pde = de.parent(); pde != nullptr; pde = pde->parent())
+        level++;
+
+    if (de.parent() != nullptr)
+        dir_tree.resolve_pending(*de.parent()); // so that the previous totals are exact and the deltas are right
+    int64_t prev_size          = de.size,          prev_size_excluded          = de.size_excluded;
+    int32_t prev_num_of_files  = de.num_of_files,  prev_num_of_files_excluded  = de.num_of_files_excluded;
+    bool was_counted_as_mixed = de.counted_as_mixed();
+    std::vector<DirScanner::Root> roots;
+    roots.push_back(DirScanner::Root(dir_name, &de, level));
+    scanner.scan(roots);
+    de.recalc_excluded();
+    de.update_mode_mixed(was_counted_as_mixed);
+
+    // Totals of the scanned subtree are added to its ancestors once (the scanner adds totals of subdirectories to their parents only within the subtree)
+    int64_t delta_size          = de.size          - prev_size,          delta_size_excluded          = de.size_excluded          - prev_size_excluded;
+    int32_t delta_num_of_files  = de.num_of_files  - prev_num_of_files,  delta_num_of_files_excluded  = de.num_of_files_excluded  - prev_num_of_files_excluded;
+    for (DirEntry *pde = de.parent(); pde != nullptr; pde = pde->parent()) {
+        pde->size += delta_size;
+        pde->size_excluded += delta_size_excluded;
+        pde->num_of_files += delta_num_of_files;
+        pde->num_of_files_excluded += delta_num_of_files_excluded;
+        dir_tree.totals_changed(*pde);
+    }
+}
 
-    DirEntry::SubDirs subdirs;
+DWORD WINAPI scan_thread_proc(LPVOID p) // scans subtree of a directory which was excluded before
+{
+    std::unique_ptr<SubtreeScan> subtree_scan((SubtreeScan*)p);
+    DirScanner scanner(TabBackup::stop_scan);
+    scan_subtree(*subtree_scan->de, subtree_scan->de->full_dir_name(), scanner);
+    return 0;
+}
 
-    do
-    {
-        if (TabBackup::stop_scan) {
-            FindClose(h);
-            return;
-        }
+struct DirItem
+{
+    const wchar_t *name;
+    DirEntry *d;
+    int level;
+};
 
-        if (fd.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM)
-            continue;
+DirTreeView dir_tree_view; // rows of the tree view, guarded by `backup_treeview_cs`
+DirTreeViewChanges dir_tree_view_changes; // since the last paint, guarded by `backup_treeview_cs`
 
-        if (fd.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN|FILE_ATTRIBUTE_REPARSE_POINT)) // skip hidden files and directories and symbolic links
-            if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && (wcscmp(fd.cFileName, L".git") == 0 || wcscmp(fd.cFileName, L"AppData") == 0))
-                ASSERT((fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0);
-            else
-                continue;
-
-        std::wstring file_name(fd.cFileName);
-        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            if (file_name == L"." || file_name == L"..")
-                continue;
-            if (!de.parent && always_excluded_directories.find(file_name) != always_excluded_directories.end())
-                continue;
-
-            if (de.subdirs.empty()) { // acquiring of `subdirs_lock` is not necessary here because `treeview_paint()` in other thread just read (i.e. does not write) `subdirs`
-                auto it = subdirs.emplace(file_name, DirEntry());
-                it.first->second.parent = &de;
-                it.first->second.dir_name = &it.first->first;
-            }
-        }
-        else {
-            de.dir_files_size += (uint64_t(fd.nFileSizeHigh) << 32) | fd.nFileSizeLow;
-            de.dir_num_of_files++;
-        }
-    } while (FindNextFile(h, &fd));
+struct DirTotalsText // totals of a row as they are shown
+{
+    uint32_t version; // of the entry when the totals were formatted (see `DirTree::entry_version()`)
+    bool scan_started, known; // `?` is shown if totals are not known yet
+    int32_t num_of_files_excluded, total_num_of_files;
+    char size[NUMBER_BUFFER_SIZE], num_of_files[NUMBER_BUFFER_SIZE];
+};
+std::unordered_map<uint32_t, DirTotalsText> dir_totals_texts; // by entry index, guarded by `backup_treeview_cs`
+const size_t MAX_DIR_TOTALS_TEXTS = 4096; // rows scrolled out of view are forgotten by clearing of the whole cache
 
-    FindClose(h);
+const DirTotalsText &dir_totals_text(const DirEntry &de)
+{
+    uint32_t version = dir_tree.entry_version(de.index); // before totals are read
+    DirTotalsText &t = dir_totals_texts[de.index];
+    if (t.version == version && t.scan_started == de.scan_started && t.size[0] != 0)
+        return t;
+
+    t.version = version;
+    t.scan_started = de.scan_started;
+    t.total_num_of_files = de.num_of_files, t.num_of_files_excluded = de.num_of_files_excluded; // totals may change during a scan, so each of them is read once
+    t.known = t.scan_started || t.total_num_of_files != 0;
+    const int MB = 1024 * 1024;
+    int64_t size = de.size, size_excluded = de.size_excluded;
+    //sprintf_s(s, d.second->size >= 100*MB ? "%.0f" : d.second->size >= 10*MB ? "%.1f" : d.second->size >= MB ? "%.2f" : "%.3f", d.second->size / double(MB));
+    format_thousands((t.num_of_files_excluded == t.total_num_of_files ? size_excluded : size - size_excluded) / double(MB), t.size);
+    format_thousands(t.num_of_files_excluded == t.total_num_of_files ? t.num_of_files_excluded : t.total_num_of_files - t.num_of_files_excluded, t.num_of_files);
+    return t;
+}
 
-    de.size += de.dir_files_size;
-    de.num_of_files += de.dir_num_of_files;
+// Directories are sorted by totals without excluded files, and directories which are excluded completely follow them sorted by their whole totals
+int64_t dir_size_key(const DirEntry &de)
+{
+    if (de.num_of_files_excluded == de.num_of_files)
+        return de.size - INT64_MAX;
+    return de.size - de.size_excluded;
+}
 
-    if (de.subdirs.empty()) {
-        de.subdirs_lock.acquire();
-        de.subdirs = std::move(subdirs);
-        de.subdirs_lock.release();
-    }
+int64_t dir_num_of_files_key(const DirEntry &de)
+{
+    int32_t num_of_files = de.num_of_files, num_of_files_excluded = de.num_of_files_excluded;
+    if (num_of_files_excluded == num_of_files)
+        return num_of_files - INT64_MAX;
+    return num_of_files - num_of_files_excluded;
+}
 
-    for (DirEntry *pde = de.parent; pde != nullptr; pde = pde->parent) {
-        pde->size += de.size;
-        pde->num_of_files += de.num_of_files;
+DirTreeView::Key dir_tree_view_order()
+{
+    switch (TabBackup::sort_by)
+    {
+    case TabBackup::SortBy::SIZE:         return dir_size_key;
+    case TabBackup::SortBy::NUM_OF_FILES: return dir_num_of_files_key;
+    default:                              return nullptr;
     }
+}
 
-    for (auto &&sd : de.subdirs) {
-        if (TabBackup::stop_scan)
-            return;
-        if (!sd.second.scan_started)
-            scan_enum_files_recursively(sd.second);
+void reset_dir_tree_view() // after the tree was replaced
+{
+    std::vector<DirEntry*> roots;
+    for (auto &root_dir_entry : root_dir_entries)
+        roots.push_back(root_dir_entry->de);
+    dir_tree_view.set_order(dir_tree_view_order());
+    dir_tree_view.reset(roots);
+    dir_totals_texts.clear(); // indices of entries are reused by the new tree
+    if (dir_tree_view.filtered()) { // matches are entries of the old tree
+        dir_tree_view.set_filter(true);
+        start_filter_thread();
     }
 }
 
-DWORD WINAPI scan_thread_proc(LPVOID p)
+DirItem dir_item(const DirTreeView::Row &row)
+{
+    const wchar_t *name = row.de->name();
+    if (row.level == 0)
+        for (auto &root_dir_entry : root_dir_entries)
+            if (root_dir_entry->de == row.de)
+                name = root_dir_entry->name.c_str();
+    DirItem di = {name, row.de, row.level};
+    return di;
+}
+
+POINT pressed_cur_pos;
+bool operator==(const POINT &p1, const POINT &p2) {return memcmp(&p1, &p2, sizeof(POINT)) == 0;}
+DirItem treeview_hover_dir_item = {0};
+int treeview_hover_dir_item_index;
+CriticalSection backup_treeview_cs;
+
+// The tree view is filtered by a part of directory names: a thread finds directories in `dir_name_index`, and the timer adds them to the view.
+// As the query finds only directories which existed when it was started, it is repeated while the tree changes (e.g. during a scan), and
+// while the index of a loaded tree is being built (the view shows "Indexing…" meanwhile).
+std::wstring filter_pattern; // the tree view is filtered if it is not empty
+bool filter_edit_shown = false;
+HANDLE filter_thread = NULL;
+volatile bool stop_filter = false;
+uint32_t filter_tree_version; // when the query was started
+bool filter_index_ready; // when the query was started
+bool filter_indexing_shown = false;
+DWORD filter_tick_count;
+const DWORD FILTER_REPEAT_INTERVAL = 1000; // ms
+CriticalSection filter_matches_cs;
+std::vector<DirEntry*> filter_matches; // found and not added to the view yet, guarded by `filter_matches_cs`
+std::unique_ptr<DirTree::ReadGuard> filter_guard; // pinned from the start of a query until its matches are dropped, so that they are not reused meanwhile
+
+DWORD WINAPI filter_thread_proc(LPVOID)
 {
-    scan_enum_files_recursively(*(DirEntry*)p);
+    const size_t BATCH_SIZE = 1024;
+    std::vector<DirEntry*> batch;
+    auto flush = [&batch]() {
+        AutoCriticalSection filter_matches_acs(filter_matches_cs);
+        filter_matches.insert(filter_matches.end(), batch.begin(), batch.end());
+        batch.clear();
+    };
+    dir_name_index.find(filter_pattern, stop_filter, [&](DirEntry &de) {
+        batch.push_back(&de);
+        if (batch.size() == BATCH_SIZE)
+            flush();
+    });
+    flush();
     return 0;
 }
 
-struct DirItem
+void stop_filter_thread() // must be called before the tree is cleared
 {
-    const std::wstring *name;
-    DirEntry *d;
-    int level;
-};
+    if (filter_thread == NULL)
+        return;
+    stop_filter = true;
+    WaitForSingleObject(filter_thread, INFINITE);
+    CloseHandle(filter_thread);
+    filter_thread = NULL;
+    AutoCriticalSection filter_matches_acs(filter_matches_cs);
+    filter_matches.clear();
+    filter_guard.reset();
+}
+
+void start_filter_thread()
+{
+    stop_filter_thread();
+    stop_filter = false;
+    filter_tree_version = dir_tree.version();
+    filter_index_ready = dir_name_index.ready();
+    filter_tick_count = GetTickCount();
+    filter_guard = std::make_unique<DirTree::ReadGuard>();
+    filter_thread = CreateThread(NULL, 0, filter_thread_proc, NULL, 0, NULL);
+}
 
-void fill_dirs(std::vector<DirItem> &all_dirs, DirEntry &d, int level)
+void set_filter_pattern(const std::wstring &pattern)
 {
-    std::vector<DirItem> dirs;
-    d.subdirs_lock.acquire();
-    dirs.reserve(d.subdirs.size());
-    for (auto &&dir : d.subdirs) {
-        DirItem di = {&dir.first, &dir.second, level};
-        dirs.push_back(di);
+    stop_filter_thread();
+    filter_pattern = pattern;
+    {
+        AutoCriticalSection backup_treeview_acs(backup_treeview_cs);
+        dir_tree_view.set_filter(!filter_pattern.empty());
+        treeview_hover_dir_item.d = nullptr;
     }
-    d.subdirs_lock.release();
-
-    if (TabBackup::sort_by == TabBackup::SortBy::SIZE)
-        std::sort(dirs.begin(), dirs.end(), [](const DirItem &a, const DirItem &b) {
-            if (a.d->num_of_files_excluded == a.d->num_of_files
-             && b.d->num_of_files_excluded == b.d->num_of_files)
-                return a.d->size > b.d->size;
-            return a.d->size - a.d->size_excluded > b.d->size - b.d->size_excluded;
-        });
-
-    for (auto &&di : dirs) {
-        all_dirs.push_back(di);
-        if (di.d->expanded)
-            fill_dirs(all_dirs, *di.d, level + 1);
+    if (!filter_pattern.empty())
+        start_filter_thread();
+    ScrollBar_SetPos(scrollbar_wnd, 0, TRUE);
+    InvalidateRect(treeview_wnd, NULL, FALSE);
+}
+
+void add_filter_matches() // must be called under `backup_treeview_cs`
+{
+    if (!dir_tree_view.filtered())
+        return;
+    static std::vector<DirEntry*> matches;
+    {
+        AutoCriticalSection filter_matches_acs(filter_matches_cs);
+        matches.swap(filter_matches);
     }
+    matches.erase(std::remove_if(matches.begin(), matches.end(), [](DirEntry *de) {return !dir_tree.is_alive(*de);}), matches.end()); // abandoned by a scan after they were found
+    if (!matches.empty())
+        dir_tree_view.add_filter_matches(matches);
+    matches.clear();
+
+    if (WaitForSingleObject(filter_thread, 0) == WAIT_OBJECT_0 && (dir_tree.version() != filter_tree_version || !filter_index_ready) && GetTickCount() - filter_tick_count >= FILTER_REPEAT_INTERVAL)
+        start_filter_thread(); // directories which are already shown are skipped by the view
 }
 
-POINT pressed_cur_pos;
-bool operator==(const POINT &p1, const POINT &p2) {return memcmp(&p1, &p2, sizeof(POINT)) == 0;}
-DirItem treeview_hover_dir_item = {0};
-int treeview_hover_dir_item_index;
-CriticalSection backup_treeview_cs;
+void TabBackup::create_filter_edit()
+{
+    filter.select(filter_edit_shown);
+    if (!filter_edit_shown)
+        return;
+    filter_edit = CreateWindow(L"EDIT", filter_pattern.c_str(), WS_VISIBLE|WS_CHILD|WS_BORDER|ES_AUTOHSCROLL,
+                               mul_by_system_scaling_factor(10), mul_by_system_scaling_factor(100), mul_by_system_scaling_factor(300), mul_by_system_scaling_factor(30),
+                               main_wnd, (HMENU)IDC_FILTER, h_instance, NULL);
+    SetWindowFont(filter_edit, treeview_font, FALSE);
+}
 
-void TabBackup::treeview_paint(HDC hdc, int width, int height)
+void TabBackup::toggle_filter()
+{
+    filter_edit_shown = filter_edit == NULL;
+    if (filter_edit_shown) {
+        create_filter_edit();
+        SetFocus(filter_edit);
+    }
+    else {
+        DestroyWindow(filter_edit);
+        filter_edit = NULL;
+        filter.select(false);
+        if (!filter_pattern.empty())
+            set_filter_pattern(std::wstring());
+    }
+    PostMessage(main_wnd, WM_SIZE, 0, 0);
+}
+
+void TabBackup::filter_changed()
+{
+    std::wstring pattern(GetWindowTextLength(filter_edit), L'\0');
+    GetWindowText(filter_edit, &pattern[0], int(pattern.size()) + 1);
+    set_filter_pattern(pattern);
+}
+
+int treeview_row_under_cursor() // -1 if the cursor is outside of the tree view
+{
+    RECT wnd_rect;
+    GetWindowRect(treeview_wnd, &wnd_rect);
+    POINT cur_pos;
+    GetCursorPos(&cur_pos);
+    if (cur_pos.x >= wnd_rect.left
+     && cur_pos.y >= wnd_rect.top
+     && cur_pos.x < wnd_rect.right
+     && cur_pos.y < wnd_rect.bottom
+     && (GetAsyncKeyState(VK_LBUTTON) >= 0 || cur_pos == pressed_cur_pos)) // do not show hover rect when left mouse button is pressed (during scrolling or pressing some button)
+        return (cur_pos.y - wnd_rect.top - TREEVIEW_PADDING + ScrollBar_GetPos(scrollbar_wnd)) / LINE_HEIGHT;
+    return -1;
+}
+
+void invalidate_treeview_rows(size_t first, size_t count)
+{
+    RECT r;
+    GetClientRect(treeview_wnd, &r);
+    int scrollpos = ScrollBar_GetPos(scrollbar_wnd);
+    r.top = std::max<int>(r.top, TREEVIEW_PADDING - scrollpos + int(first) * LINE_HEIGHT);
+    r.bottom = std::min<int>(r.bottom, TREEVIEW_PADDING - scrollpos + int(first + count) * LINE_HEIGHT);
+    if (r.top < r.bottom)
+        InvalidateRect(treeview_wnd, &r, FALSE);
+}
+
+void invalidate_treeview_hover_rows() // if the row under the cursor has changed since the last paint
+{
+    if (popup_menu_is_open)
+        return;
+    int row = treeview_row_under_cursor();
+    if (row >= 0 && size_t(row) >= dir_tree_view.num_of_rows())
+        row = -1;
+    int hover_row = treeview_hover_dir_item.d != nullptr ? treeview_hover_dir_item_index : -1;
+    if (row == hover_row)
+        return;
+    // Excluded totals of the hover item are shown below or above it
+    if (hover_row >= 0)
+        invalidate_treeview_rows(std::max(hover_row - 1, 0), 3);
+    if (row >= 0)
+        invalidate_treeview_rows(std::max(row - 1, 0), 3);
+}
+
+void TabBackup::treeview_mousemove()
 {
     AutoCriticalSection backup_treeview_acs(backup_treeview_cs);
+    invalidate_treeview_hover_rows();
+}
 
-    std::vector<DirItem> dirs;
-    for (auto &root_dir_entry : root_dir_entries) {
-        DirItem di = {&root_dir_entry->name, &*root_dir_entry, 0};
-        dirs.push_back(di);
-        if (root_dir_entry->expanded)
-            fill_dirs(dirs, *root_dir_entry, 1);
+void TabBackup::treeview_timer()
+{
+    AutoCriticalSection backup_treeview_acs(backup_treeview_cs);
+
+    dir_tree_view.update();
+    add_filter_matches();
+    if (filter_indexing_shown && dir_name_index.ready())
+        InvalidateRect(treeview_wnd, NULL, FALSE);
+    if (treeview_hover_dir_item.d != nullptr && !popup_menu_is_open) { // the hover item is taken again from the updated view, as its entry may have been abandoned
+        DirTreeView::Row row;
+        if (dir_tree_view.row(treeview_hover_dir_item_index, row))
+            treeview_hover_dir_item = dir_item(row);
+        else
+            treeview_hover_dir_item.d = nullptr;
     }
+    static std::vector<size_t> changed_rows;
+    if (!dir_tree_view_changes.find_changed_rows(dir_tree_view, changed_rows)) {
+        InvalidateRect(treeview_wnd, NULL, FALSE);
+        return;
+    }
+    for (auto &&row : changed_rows)
+        invalidate_treeview_rows(row, 1);
+    if (treeview_hover_dir_item.d != nullptr && !changed_rows.empty()) // excluded totals of the hover item may have changed
+        invalidate_treeview_rows(std::max(treeview_hover_dir_item_index - 1, 0), 3);
+    invalidate_treeview_hover_rows(); // the cursor may have left the window or the rows may have been scrolled under it
+}
 
-    int new_smax = dirs.size()*LINE_HEIGHT + TREEVIEW_PADDING*2 - 2; // without `- 2` there are artifacts at the bottom of tree view after scrolling to end and scrollbar up button pressed
+void TabBackup::treeview_paint(HDC hdc, int width, int height)
+{
+    AutoCriticalSection backup_treeview_acs(backup_treeview_cs);
+
+    dir_tree_view.update(); // also re-sorts directories whose totals have changed
+    add_filter_matches();
+    if (dir_totals_texts.size() > MAX_DIR_TOTALS_TEXTS)
+        dir_totals_texts.clear();
+    size_t num_of_rows = dir_tree_view.num_of_rows();
+    filter_indexing_shown = dir_tree_view.filtered() && !dir_name_index.ready(); // in a row after matches
+    if (filter_indexing_shown)
+        num_of_rows++;
+
+    int new_smax = num_of_rows*LINE_HEIGHT + TREEVIEW_PADDING*2 - 2; // without `- 2` there are artifacts at the bottom of tree view after scrolling to end and scrollbar up button pressed
     int smin, smax;
     ScrollBar_GetRange(scrollbar_wnd, &smin, &smax);
     if (smax != new_smax) {
@@ -530,19 +552,11 @@ void TabBackup::treeview_paint(HDC hdc, int width, int height)
     GetWindowRect(treeview_wnd, &wnd_rect);
     if (!popup_menu_is_open) {
         treeview_hover_dir_item.d = nullptr;
-        int item_under_mouse;
-        POINT cur_pos;
-        GetCursorPos(&cur_pos);
-        if (cur_pos.x >= wnd_rect.left
-         && cur_pos.y >= wnd_rect.top
-         && cur_pos.x < wnd_rect.right
-         && cur_pos.y < wnd_rect.bottom
-         && (GetAsyncKeyState(VK_LBUTTON) >= 0 || cur_pos == pressed_cur_pos)) { // do not show hover rect when left mouse button is pressed (during scrolling or pressing some button)
-            item_under_mouse = (cur_pos.y - wnd_rect.top - TREEVIEW_PADDING + scrollpos) / LINE_HEIGHT;
-            if (item_under_mouse < (int)dirs.size()) {
-                treeview_hover_dir_item_index = item_under_mouse;
-                treeview_hover_dir_item = dirs[item_under_mouse];
-            }
+        int item_under_mouse = treeview_row_under_cursor();
+        DirTreeView::Row row;
+        if (item_under_mouse >= 0 && dir_tree_view.row(item_under_mouse, row)) {
+            treeview_hover_dir_item_index = item_under_mouse;
+            treeview_hover_dir_item = dir_item(row);
         }
     }
     // Draw hover rect
@@ -557,33 +571,34 @@ void TabBackup::treeview_paint(HDC hdc, int width, int height)
     SelectFont(hdc, treeview_font);
     SetBkMode(hdc, TRANSPARENT);
 
+    int first_row = std::max(0, (scrollpos - TREEVIEW_PADDING) / LINE_HEIGHT - 1);
+    static std::vector<DirTreeView::Row> rows;
+    dir_tree_view_changes.get_rows(dir_tree_view, first_row, height / LINE_HEIGHT + 3, rows); // visible rows only
+
     RECT r;
-    r.top = TREEVIEW_PADDING + LINE_PADDING_TOP - scrollpos;
-    for (auto &&d : dirs) {
+    r.top = TREEVIEW_PADDING + LINE_PADDING_TOP - scrollpos + first_row * LINE_HEIGHT;
+    for (auto &&row : rows) {
         if (r.top >= height)
             break;
 
+        DirItem d = dir_item(row);
         r.bottom = r.top + FONT_HEIGHT;
 
         if (r.bottom >= TREEVIEW_PADDING) { // this check is not only for better performance, but is also to avoid artifacts at the top of tree view after scrollbar down button pressed
             r.right = width - TREEVIEW_PADDING - LINE_PADDING_RIGHT;
             r.left = r.right - DIR_SIZE_COLUMN_WIDTH;
-            if (d.d->scan_started || d.d->num_of_files != 0) {
-                const int MB = 1024 * 1024;
-                //char s[32];
-                //sprintf_s(s, d.second->size >= 100*MB ? "%.0f" : d.second->size >= 10*MB ? "%.1f" : d.second->size >= MB ? "%.2f" : "%.3f", d.second->size / double(MB));
-                double size_of_files_in_mb = (d.d->num_of_files_excluded == d.d->num_of_files ? d.d->size_excluded : d.d->size - d.d->size_excluded) / double(MB);
+            const DirTotalsText &t = dir_totals_text(*d.d);
+            if (t.known) {
                 //sprintf_s(s, "%.1f", ((int64_t&)cur_ft - (int64_t&)d.d->max_last_write_time)/(10000000.0*3600*24));
                 COLORREF prev_text_color;
-                if (d.d->num_of_files_excluded > 0)
-                    prev_text_color = SetTextColor(hdc, d.d->num_of_files_excluded == d.d->num_of_files ? RGB(192, 0, 0) : RGB(192, 192, 0));
-                DrawTextA(hdc, separate_thousands(size_of_files_in_mb).c_str(), -1, &r, DT_RIGHT);
+                if (t.num_of_files_excluded > 0)
+                    prev_text_color = SetTextColor(hdc, t.num_of_files_excluded == t.total_num_of_files ? RGB(192, 0, 0) : RGB(192, 192, 0));
+                DrawTextA(hdc, t.size, -1, &r, DT_RIGHT);
 
                 r.right = r.left;
                 r.left -= FILES_COUNT_COLUMN_WIDTH;
-                int num_of_files = d.d->num_of_files_excluded == d.d->num_of_files ? d.d->num_of_files_excluded : d.d->num_of_files - d.d->num_of_files_excluded;
-                DrawTextA(hdc, separate_thousands(num_of_files).c_str(), -1, &r, DT_RIGHT);
-                if (d.d->num_of_files_excluded > 0)
+                DrawTextA(hdc, t.num_of_files, -1, &r, DT_RIGHT);
+                if (t.num_of_files_excluded > 0)
                     SetTextColor(hdc, prev_text_color);
             }
             else
@@ -591,8 +606,8 @@ void TabBackup::treeview_paint(HDC hdc, int width, int height)
 
             r.right = r.left;
             r.left = TREEVIEW_PADDING + d.level * TREEVIEW_LEVEL_OFFSET;
-            if (!d.d->subdirs.empty() || d.d->not_traversed)
-                DrawIconEx(hdc, r.left, r.top, d.d->expanded ? icon_dir_exp : icon_dir_col, ICON_SIZE, ICON_SIZE, 0, NULL, DI_NORMAL);
+            if (!d.d->subdirs().empty() || d.d->not_traversed)
+                DrawIconEx(hdc, r.left, r.top, dir_tree_view.is_expanded(*d.d) ? icon_dir_exp : icon_dir_col, ICON_SIZE, ICON_SIZE, 0, NULL, DI_NORMAL);
 
             r.left += ICON_SIZE;
             if (d.d->mode_mixed) {
@@ -622,11 +637,20 @@ void TabBackup::treeview_paint(HDC hdc, int width, int height)
             }
 
             r.left += ICON_SIZE + LINE_PADDING_LEFT;
-            DrawText(hdc, d.name->c_str(), -1, &r, DT_END_ELLIPSIS);
+            DrawText(hdc, d.name, -1, &r, DT_END_ELLIPSIS);
         }
 
         r.top += LINE_HEIGHT;
     }
+    if (filter_indexing_shown) {
+        r.top = TREEVIEW_PADDING + LINE_PADDING_TOP - scrollpos + int(num_of_rows - 1) * LINE_HEIGHT;
+        r.bottom = r.top + FONT_HEIGHT;
+        r.left = TREEVIEW_PADDING + ICON_SIZE + LINE_PADDING_LEFT;
+        r.right = width - TREEVIEW_PADDING - LINE_PADDING_RIGHT;
+        COLORREF prev_text_color = SetTextColor(hdc, RGB(128, 128, 128));
+        DrawText(hdc, L"Indexing…", -1, &r, DT_END_ELLIPSIS);
+        SetTextColor(hdc, prev_text_color);
+    }
 
     if (treeview_hover_dir_item.d != nullptr
      && treeview_hover_dir_item.d->num_of_files_excluded > 0
@@ -647,11 +671,14 @@ void TabBackup::treeview_paint(HDC hdc, int width, int height)
         r.right = width - TREEVIEW_PADDING - LINE_PADDING_RIGHT;
         r.left = r.right - DIR_SIZE_COLUMN_WIDTH;
         SetTextColor(hdc, RGB(192, 0, 0));
-        DrawTextA(hdc, separate_thousands(treeview_hover_dir_item.d->size_excluded / double(1024*1024)).c_str(), -1, &r, DT_RIGHT);
+        char s[NUMBER_BUFFER_SIZE];
+        format_thousands(treeview_hover_dir_item.d->size_excluded / double(1024*1024), s);
+        DrawTextA(hdc, s, -1, &r, DT_RIGHT);
 
         r.right = r.left;
         r.left -= FILES_COUNT_COLUMN_WIDTH;
-        DrawTextA(hdc, separate_thousands(treeview_hover_dir_item.d->num_of_files_excluded).c_str(), -1, &r, DT_RIGHT);
+        format_thousands(treeview_hover_dir_item.d->num_of_files_excluded.load(), s);
+        DrawTextA(hdc, s, -1, &r, DT_RIGHT);
     }
 }
 
@@ -661,46 +688,55 @@ void TabBackup::treeview_lbdown()
     if (treeview_hover_dir_item.d == nullptr)
         return;
 
-    treeview_hover_dir_item.d->expanded = !treeview_hover_dir_item.d->expanded;
+    AutoCriticalSection backup_treeview_acs(backup_treeview_cs);
+    DirTree::ReadGuard guard; // the hover item was taken from the view at the last update, so it is checked after pinning, before the view is updated again
+    if (!dir_tree.is_alive(*treeview_hover_dir_item.d))
+        return;
+    dir_tree_view.update();
+    if (dir_tree_view.filtered()) { // the filter is closed and the directory is shown in the whole tree
+        DirEntry *de = treeview_hover_dir_item.d;
+        for (DirEntry *pde = de->parent(); pde != nullptr; pde = pde->parent())
+            pde->expanded = true;
+        toggle_filter();
+        size_t row;
+        if (dir_tree_view.find_row(*de, row)) {
+            ScrollBar_SetRange(scrollbar_wnd, 0, int(dir_tree_view.num_of_rows())*LINE_HEIGHT + TREEVIEW_PADDING*2 - 2, FALSE); // as in `treeview_paint()`
+            ScrollBar_SetPos(scrollbar_wnd, int(row)*LINE_HEIGHT, TRUE);
+        }
+        return;
+    }
     if (treeview_hover_dir_item.d->not_traversed) {
         treeview_hover_dir_item.d->not_traversed = false;
 
-        WIN32_FIND_DATA fd;
-        HANDLE h = FindFirstFile((treeview_hover_dir_item.d->full_dir_name() / L"*.*").c_str(), &fd);
-        if (h == INVALID_HANDLE_VALUE) return;
-
-        do
-        {
-            if (fd.dwFileAttributes & FILE_ATTRIBUTE_SYSTEM)
-                continue;
-
-            if (fd.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN|FILE_ATTRIBUTE_REPARSE_POINT)) // skip hidden files and directories and symbolic links
-                if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && (wcscmp(fd.cFileName, L".git") == 0 || wcscmp(fd.cFileName, L"AppData") == 0))
-                    ASSERT((fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0);
-                else
-                    continue;
-
-            std::wstring file_name(fd.cFileName);
-            if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-                if (file_name == L"." || file_name == L"..")
-                    continue;
-                if (!treeview_hover_dir_item.d->parent && always_excluded_directories.find(file_name) != always_excluded_directories.end())
-                    continue;
-
-                auto it = treeview_hover_dir_item.d->subdirs.emplace(file_name, DirEntry());
-                it.first->second.parent = treeview_hover_dir_item.d;
-                it.first->second.dir_name = &it.first->first;
-                it.first->second.not_traversed = true;
-            }
-        } while (FindNextFile(h, &fd));
+        std::wstring dir_name = treeview_hover_dir_item.d->full_dir_name();
+        int level = 1;
+        for (DirEntry *pde = treeview_hover_dir_item.d->parent(); pde != nullptr; pde = pde->parent())
+            level++;
+        std::vector<uint32_t> subdir_names;
+        if (!enum_dir_entries(dir_name, [&](const DirEnumEntry &e) {
+            if (e.is_dir && !dir_rules.skip(dir_name.c_str(), dir_name.size(), e.name, level + 1))
+                subdir_names.push_back(dir_tree.intern_name(e.name));
+        })) {
+            dir_tree_view.set_expanded(*treeview_hover_dir_item.d, !treeview_hover_dir_item.d->expanded);
+            return;
+        }
 
-        FindClose(h);
+        dir_tree.set_subdirs(*treeview_hover_dir_item.d, subdir_names);
+        for (auto &&sd : treeview_hover_dir_item.d->subdirs())
+            sd.not_traversed = true;
     }
+    dir_tree_view.set_expanded(*treeview_hover_dir_item.d, !treeview_hover_dir_item.d->expanded);
     InvalidateRect(treeview_wnd, NULL, FALSE);
 }
 
 void TabBackup::treeview_rbdown()
 {
+    DirTree::ReadGuard guard; // the view may be updated while the menu is open, so the hover item is kept alive by the guard
+    {
+        AutoCriticalSection backup_treeview_acs(backup_treeview_cs);
+        if (treeview_hover_dir_item.d != nullptr && !dir_tree.is_alive(*treeview_hover_dir_item.d))
+            treeview_hover_dir_item.d = nullptr;
+    }
     HMENU menu = LoadMenu(h_instance, MAKEINTRESOURCE(IDR_BACKUP_TAB_CONTEXT_MENU));
     CheckMenuRadioItem(menu, ID_SORTBY_NAME, ID_SORTBY_NAME + (int)SortBy::COUNT - 1, ID_SORTBY_NAME + (int)sort_by, MF_BYCOMMAND);
 
@@ -725,8 +761,7 @@ void TabBackup::treeview_rbdown()
     }
 
     auto check_if_scan_is_running = []() {
-        if (WaitForSingleObject(initial_scan_thread, 0) == WAIT_TIMEOUT || (scan_thread != NULL &&
-            WaitForSingleObject(        scan_thread, 0) == WAIT_TIMEOUT)) {
+        if (scan_is_running()) {
             MessageBox(main_wnd, L"You can not set mode and priority during scan!", NULL, MB_OK|MB_ICONERROR);
             return false;
         }
@@ -737,33 +772,38 @@ void TabBackup::treeview_rbdown()
     POINT curpos;
     GetCursorPos(&curpos);
 
-    popup_menu_is_open = true;
+    {
+        AutoCriticalSection scan_start_acs(scan_start_cs); // no reconcile is started until the menu action is over
+        popup_menu_is_open = true;
+    }
     auto r = TrackPopupMenu(sub_menu, TPM_LEFTALIGN|TPM_TOPALIGN|TPM_RIGHTBUTTON|TPM_NONOTIFY|TPM_RETURNCMD, curpos.x, curpos.y, 0, treeview_wnd, NULL);
     if (r != 0)
-        if (r < ID_SORTBY_NAME + (int)SortBy::COUNT)
+        if (r < ID_SORTBY_NAME + (int)SortBy::COUNT) {
             sort_by = SortBy(r - ID_SORTBY_NAME);
+            AutoCriticalSection backup_treeview_acs(backup_treeview_cs);
+            dir_tree_view.set_order(dir_tree_view_order());
+        }
         else if (r < ID_MODE_EXCLUDED + (int)DirMode::COUNT) {
             if (check_if_scan_is_running() && treeview_hover_dir_item.d != nullptr) {
                 DirMode new_mode = DirMode(r - ID_MODE_EXCLUDED);
                 treeview_hover_dir_item.d->set_mode_manual(new_mode);
 
+                // Only sub-entries with modes or priorities of their own can be distinct, so just they are visited instead of the whole subtree
+                std::vector<DirEntry*> overrides;
+                dir_tree.find_overrides(*treeview_hover_dir_item.d, overrides);
+
                 if (new_mode != DirMode::AUTO) {
                     std::vector<DirEntry*> manual_distinct;
-                    std::function<void(DirEntry&)> find_manual_distinct = [&find_manual_distinct, new_mode, &manual_distinct](DirEntry &de) {
-                        for (auto &&sd : de.subdirs) {
-                            if (sd.second.mode_manual != DirMode::AUTO) {
-                                if (new_mode == DirMode::INHERIT_FROM_PARENT) {
-                                    if (sd.second.mode_manual != DirMode::INHERIT_FROM_PARENT)
-                                        manual_distinct.push_back(&sd.second);
-                                }
-                                else
-                                    if (sd.second.mode_manual != new_mode && sd.second.mode_manual != DirMode::INHERIT_FROM_PARENT)
-                                        manual_distinct.push_back(&sd.second);
+                    for (auto &&sd : overrides)
+                        if (sd->mode_manual != DirMode::AUTO) {
+                            if (new_mode == DirMode::INHERIT_FROM_PARENT) {
+                                if (sd->mode_manual != DirMode::INHERIT_FROM_PARENT)
+                                    manual_distinct.push_back(sd);
                             }
-                            find_manual_distinct(sd.second);
+                            else
+                                if (sd->mode_manual != new_mode && sd->mode_manual != DirMode::INHERIT_FROM_PARENT)
+                                    manual_distinct.push_back(sd);
                         }
-                    };
-                    find_manual_distinct(*treeview_hover_dir_item.d);
                     if (!manual_distinct.empty())
                         if (MessageBox(main_wnd, manual_distinct.size() > 1 ? (L"There are " + int_to_str(manual_distinct.size()) + L" sub-entries which manual mode doesn't match up with new mode.\nWould you like to switch their mode also?").c_str() :
                                                                                                                             L"There is 1 sub-entry which manual mode doesn't match up with new mode.\nWould you like to switch its mode also?", L"", MB_YESNO) == IDYES)
@@ -798,21 +838,16 @@ void TabBackup::treeview_rbdown()
                                 }
 
                     std::vector<DirEntry*> auto_distinct;
-                    std::function<void(DirEntry&)> find_auto_distinct = [&find_auto_distinct, new_mode, &auto_distinct](DirEntry &de) {
-                        for (auto &&sd : de.subdirs) {
-                            if (sd.second.mode_manual == DirMode::AUTO) {
-                                if (new_mode == DirMode::INHERIT_FROM_PARENT) {
-                                    if (sd.second.mode_auto != DirMode::INHERIT_FROM_PARENT)
-                                        auto_distinct.push_back(&sd.second);
-                                }
-                                else
-                                    if (sd.second.mode_auto != new_mode && sd.second.mode_auto != DirMode::INHERIT_FROM_PARENT)
-                                        auto_distinct.push_back(&sd.second);
+                    for (auto &&sd : overrides) // the modes switched above are of these entries, so the list is still complete
+                        if (sd->mode_manual == DirMode::AUTO) {
+                            if (new_mode == DirMode::INHERIT_FROM_PARENT) {
+                                if (sd->mode_auto != DirMode::INHERIT_FROM_PARENT)
+                                    auto_distinct.push_back(sd);
                             }
-                            find_auto_distinct(sd.second);
+                            else
+                                if (sd->mode_auto != new_mode && sd->mode_auto != DirMode::INHERIT_FROM_PARENT)
+                                    auto_distinct.push_back(sd);
                         }
-                    };
-                    find_auto_distinct(*treeview_hover_dir_item.d);
                     if (!auto_distinct.empty())
                         if (MessageBox(main_wnd, auto_distinct.size() > 1 ? (L"There are " + int_to_str(auto_distinct.size()) + L" sub-entries which automatic mode doesn't match up with new mode.\nWould you like to switch their mode also?").c_str() :
                                                                                                                         L"There is 1 sub-entry which automatic mode doesn't match up with new mode.\nWould you like to switch its mode also?", L"", MB_YESNO) == IDYES)
@@ -821,14 +856,9 @@ void TabBackup::treeview_rbdown()
                 }
                 else {
                     std::vector<DirEntry*> non_auto;
-                    std::function<void(DirEntry&)> find_non_auto = [&find_non_auto, new_mode, &non_auto](DirEntry &de) {
-                        for (auto &&sd : de.subdirs) {
-                            if (sd.second.mode_manual != DirMode::AUTO)
-                                non_auto.push_back(&sd.second);
-                            find_non_auto(sd.second);
-                        }
-                    };
-                    find_non_auto(*treeview_hover_dir_item.d);
+                    for (auto &&sd : overrides)
+                        if (sd->mode_manual != DirMode::AUTO)
+                            non_auto.push_back(sd);
                     if (!non_auto.empty())
                         if (MessageBox(main_wnd, non_auto.size() > 1 ? (L"There are " + int_to_str(non_auto.size()) + L" sub-entries which mode is not auto.\nWould you like to switch their mode also?").c_str() :
                                                                                                               L"There is 1 sub-entry which mode is not auto.\nWould you like to switch its mode also?", L"", MB_YESNO) == IDYES)
@@ -840,42 +870,43 @@ void TabBackup::treeview_rbdown()
                     if (scan_thread != NULL)
                         CloseHandle(scan_thread);
                     TabBackup::stop_scan = false;
-                    scan_thread = CreateThread(NULL, 0, scan_thread_proc, treeview_hover_dir_item.d, 0, NULL);
+                    SubtreeScan *subtree_scan = new SubtreeScan;
+                    subtree_scan->de = treeview_hover_dir_item.d;
+                    scan_thread = CreateThread(NULL, 0, scan_thread_proc, subtree_scan, 0, NULL);
                 }
             }
         }
         else if (r <= ID_PRIORITY_AUTO) {
             if (check_if_scan_is_running() && treeview_hover_dir_item.d != nullptr) {
-                float priorities[] = {DIR_PRIORITY_ULTRA_HIGH, DIR_PRIORITY_HIGH, DIR_PRIORITY_NORMAL, DIR_PRIORITY_LOW, DIR_PRIORITY_ULTRA_LOW, DIR_PRIORITY_AUTO};
-                float new_priority = priorities[r - ID_PRIORITY_ULTRAHIGH];
+                DirPriority priorities[] = {DIR_PRIORITY_ULTRA_HIGH, DIR_PRIORITY_HIGH, DIR_PRIORITY_NORMAL, DIR_PRIORITY_LOW, DIR_PRIORITY_ULTRA_LOW, DIR_PRIORITY_AUTO};
+                DirPriority new_priority = priorities[r - ID_PRIORITY_ULTRAHIGH];
                 treeview_hover_dir_item.d->priority_manual = new_priority;
+                dir_tree.changed(*treeview_hover_dir_item.d);
 
+                // Priorities of sub-entries without priorities of their own stay as they are, so just overrides are visited
+                std::vector<DirEntry*> overrides;
+                dir_tree.find_overrides(*treeview_hover_dir_item.d, overrides);
                 if (new_priority == DIR_PRIORITY_AUTO) {
-                    std::function<void(DirEntry&)> set_priority_to_auto = [&set_priority_to_auto](DirEntry &de) {
-                        for (auto &&sd : de.subdirs) {
-                            sd.second.priority_manual = DIR_PRIORITY_AUTO;
-                            set_priority_to_auto(sd.second);
+                    for (auto &&sd : overrides)
+                        if (sd->priority_manual != DIR_PRIORITY_AUTO) {
+                            sd->priority_manual = DIR_PRIORITY_AUTO;
+                            dir_tree.changed(*sd);
                         }
-                    };
-                    set_priority_to_auto(*treeview_hover_dir_item.d);
                 }
                 else {
-                    std::function<void(DirEntry&)> set_priority = [&set_priority, new_priority](DirEntry &de) {
-                        for (auto &&sd : de.subdirs) {
-                            if (sd.second.priority_manual == DIR_PRIORITY_AUTO) {
-                                if (sd.second.priority_auto != new_priority && sd.second.priority_auto != DIR_PRIORITY_NORMAL)
-                                    sd.second.priority_manual = new_priority;
-                            }
-                            else {
-                                if (sd.second.priority_auto == DIR_PRIORITY_NORMAL || sd.second.priority_auto == new_priority)
-                                    sd.second.priority_manual = DIR_PRIORITY_AUTO;
-                                else
-                                    sd.second.priority_manual = new_priority;
-                            }
-                            set_priority(sd.second);
+                    for (auto &&sd : overrides) {
+                        if (sd->priority_manual == DIR_PRIORITY_AUTO) {
+                            if (sd->priority_auto != new_priority && sd->priority_auto != DIR_PRIORITY_NORMAL)
+                                sd->priority_manual = new_priority;
+                        }
+                        else {
+                            if (sd->priority_auto == DIR_PRIORITY_NORMAL || sd->priority_auto == new_priority)
+                                sd->priority_manual = DIR_PRIORITY_AUTO;
+                            else
+                                sd->priority_manual = new_priority;
                         }
-                    };
-                    set_priority(*treeview_hover_dir_item.d);
+                        dir_tree.changed(*sd);
+                    }
                 }
             }
         }
@@ -889,12 +920,19 @@ void TabBackup::treeview_rbdown()
 
 void cancel_scan()
 {
+    stop_reconcile = true; // none is started while `initial_scan()` is running, but one may have been running before
+    WaitForSingleObject(reconcile_done_event, INFINITE);
+    stop_reconcile = false;
+    stop_filter_thread();
     backup_treeview_cs.enter();
+    dir_tree.clear();
+    guarded_folders_configured = false;
     for (auto &root_dir_entry : root_dir_entries) {
         root_dir_entry = std::make_unique<RootDirEntry>(root_dir_entry->path, root_dir_entry->name);
-        root_dir_entry->mode_auto = DirMode::EXCLUDED;
-        root_dir_entry->not_traversed = true;
+        root_dir_entry->de->mode_auto = DirMode::EXCLUDED;
+        root_dir_entry->de->not_traversed = true;
     }
+    reset_dir_tree_view();
     treeview_hover_dir_item.d = nullptr;
     backup_treeview_cs.leave();
 
@@ -904,17 +942,23 @@ void cancel_scan()
 
 void restart_scan()
 {
+    AutoCriticalSection scan_start_acs(scan_start_cs); // no reconcile is started until `initial_scan_thread` is running
+    stop_reconcile = true; // a running one is queued again
+    WaitForSingleObject(reconcile_done_event, INFINITE);
+    stop_reconcile = false;
     if (scan_thread != NULL) {
         TabBackup::stop_scan = true;
         WaitForSingleObject(scan_thread, INFINITE);
     }
 
-    //backup_treeview_cs.enter(); // this is not necessary because `restart_scan()` is called in the same thread as `treeview_paint()`
-    for (auto &root_dir_entry : root_dir_entries)
-        root_dir_entry = std::make_unique<RootDirEntry>(root_dir_entry->path, root_dir_entry->name);
-    root_dir_entries[0]->expanded = true;
+    // The tree is kept (with manual modes and priorities), so `initial_scan()` rescans it incrementally: only directories which were changed since they were scanned are enumerated.
+    // If the scan was cancelled and no root was expanded since then, the tree saved on cancel is loaded instead, so the scan is resumed.
+    if (backup_state == BackupState::SCAN_CANCELLED && std::all_of(root_dir_entries.begin(), root_dir_entries.end(), [](const std::unique_ptr<RootDirEntry> &r) {return r->de->not_traversed;}))
+        load_dir_tree_snapshot();
+    guarded_folders_configured = false;
+    root_dir_entries[0]->de->expanded = true;
+    reset_dir_tree_view();
     treeview_hover_dir_item.d = nullptr;
-    //backup_treeview_cs.leave();
 
     TabBackup::stop_scan = false;
     TabBackup::cancel_scan = false;
@@ -926,214 +970,222 @@ void restart_scan()
 
 char local_backup_drive;
 
-class MonitoredDir
+// Path from the root of a watched tree, compared case insensitively for English letters (as names in `dir_tree`)
+struct RelativePathLess
 {
-    HANDLE read_directory_changes_thread;
+    bool operator()(const std::wstring &l, const std::wstring &r) const {return DirEntry::Less()(l.c_str(), r.c_str());}
+};
 
-public:
+typedef std::set<std::wstring, RelativePathLess> RelativePathSet;
+
+static bool lies_within_any(const NameView<wchar_t> &fname, const RelativePathSet &dir_names, std::wstring &prefix) // `prefix` is a buffer of the caller
+{
+    if (dir_names.empty())
+        return false;
+    for (size_t p = 0; p <= fname.length; p++)
+        if (p == fname.length || fname.chars[p] == L'\\') {
+            prefix.assign(fname.chars, p);
+            if (dir_names.count(prefix) != 0)
+                return true;
+        }
+    return false;
+}
+
+// Tree watched for changes by `dir_watcher` (its number in the watcher is its index in `monitored_dirs`)
+struct MonitoredDir
+{
     int root_dir_entry_index;
     std::wstring dir_name;
-    bool stop = false;
+    DirEntry *de; // of the watched directory, null if a rescan has abandoned it (see `monitoring_guard`)
+    RelativePathSet excluded_subdirs; // if an excluded directory is watched as a whole (see `collect_monitored_dirs()`), notifications from them are dropped
+    NotifyDecoder<wchar_t> decoder;
+    std::wstring name; // a part of a notified name, reused
+    uint64_t notified_time; // when notifications were delivered last time (or the watch was started), if the next ones are lost, they are of changes since then
 
-    MonitoredDir(int root_dir_entry_index, const std::wstring &dir_name) : root_dir_entry_index(root_dir_entry_index), dir_name(dir_name)
-    {
-        DWORD WINAPI read_directory_changes_thread_proc(LPVOID md);
-        read_directory_changes_thread = CreateThread(NULL, 0, read_directory_changes_thread_proc, this, 0, NULL);
-    }
-    ~MonitoredDir()
+    MonitoredDir(int root_dir_entry_index, const std::wstring &dir_name, DirEntry *de) : root_dir_entry_index(root_dir_entry_index), dir_name(dir_name), de(de), notified_time(current_file_time()) {}
+
+    // Classifier of names for the decoder
+    bool excluded(const NameView<wchar_t> &fname) {return lies_within_any(fname, excluded_subdirs, name);}
+    bool is_dir(const NameView<wchar_t> &fname) // by the tree instead of the file system, so a directory which has not been scanned yet is seen as a file
     {
-        ASSERT(stop);
-        WaitForSingleObject(read_directory_changes_thread, INFINITE);
+        DirEntry *e = de;
+        for (size_t b = 0, p = 0; e != nullptr && p <= fname.length; p++)
+            if (p == fname.length || fname.chars[p] == L'\\') {
+                name.assign(fname.chars + b, p - b);
+                e = e->find_subdir(name.c_str());
+                b = p + 1;
+            }
+        return e != nullptr;
     }
 };
 std::vector<std::unique_ptr<MonitoredDir>> monitored_dirs;
+std::unique_ptr<DirWatcher> dir_watcher;
+std::unique_ptr<DirTree::ReadGuard> monitoring_guard; // keeps entries of `monitored_dirs` from reuse, it is repinned by the watcher thread when they are checked
+uint64_t monitoring_epoch;
+
+// Watched tree which notifications have been lost, it is reconciled with the file system by `apply_directory_changes_thread_proc()`.
+// While trees are queued, `monitoring_guard` is not repinned, so their entries are kept from reuse until the applier takes them under a guard of its own.
+struct SuspectTree
+{
+    int tree;
+    std::wstring dir_name;
+    DirEntry *de;
+    RelativePathSet excluded_subdirs;
+    uint64_t since; // files which may have been modified since then are reported as modified
+};
+CriticalSection suspect_trees_cs;
+std::vector<std::unique_ptr<SuspectTree>> suspect_trees; // guarded by `suspect_trees_cs`, a tree is queued once until its rescan is started
+const uint64_t LOST_CHANGES_TIME_MARGIN = 2*10000000; // in FILETIME units, as last write times on FAT are of 2 seconds granularity
+HANDLE apply_directory_changes_event = CreateEvent(NULL, FALSE, FALSE, NULL); // wakes up `apply_directory_changes_thread_proc()`
 
 void stop_monitoring()
 {
-    for (auto &md : monitored_dirs)
-        md->stop = true;
+    dir_watcher.reset();
     monitored_dirs.clear();
+    monitoring_guard.reset();
+    AutoCriticalSection suspect_trees_acs(suspect_trees_cs);
+    suspect_trees.clear();
 }
 
-struct DirChange
+// Called by the watcher thread
+void add_suspect_tree(int tree, MonitoredDir &md, uint64_t since)
 {
-    int root_dir_entry_index; // corresponding root_dir_entry can be found by `dir_name`, of course, but storing this index is simpler [and faster]
-    std::wstring dir_name;
-    enum class Operation
-    {
-        CREATE,
-        MODIFY, // MODIFY is better than CHANGE because ‘modified/modification time’
-        RENAME,
-        MOVE,
-#undef DELETE
-        DELETE
-    } operation;
-    std::wstring fname;
-    std::wstring new_fname;
-    int time;
-};
-std::list<DirChange> dir_changes;
-SpinLock dir_changes_lock;
-
-void add_dir_change(MonitoredDir *md, DirChange::Operation operation, const std::wstring &fname, const std::wstring &new_fname = std::wstring())
-{
-    if (operation == DirChange::Operation::MOVE && fname == new_fname)
+    AutoCriticalSection suspect_trees_acs(suspect_trees_cs);
+    for (auto &&st : suspect_trees)
+        if (st->tree == tree) {
+            st->since = std::min(st->since, since);
+            return;
+        }
+    if (!dir_tree.is_alive(*md.de)) // it has been abandoned since `monitoring_guard` was pinned, so the rescan which has abandoned it has reconciled it
         return;
+    std::unique_ptr<SuspectTree> st = std::make_unique<SuspectTree>();
+    st->tree = tree;
+    st->dir_name = md.dir_name;
+    st->de = md.de;
+    st->excluded_subdirs = md.excluded_subdirs;
+    st->since = since;
+    suspect_trees.push_back(std::move(st));
+    SetEvent(apply_directory_changes_event);
+}
 
-    DirChange dc;
-    dc.time = timeGetTime();
+DirChangeQueue dir_changes;
 
-    dir_changes_lock.acquire();
-    if (operation == DirChange::Operation::MODIFY) {
-        for (auto &&d : dir_changes)
-            if ((d.operation == DirChange::Operation::MODIFY || d.operation == DirChange::Operation::CREATE) && d.fname == fname && d.root_dir_entry_index == md->root_dir_entry_index && d.dir_name == md->dir_name) {
-                d.time = dc.time; // just update time
-                goto skip_add;
-            }
-    }
-    else if (operation == DirChange::Operation::DELETE) {
-        for (auto it = dir_changes.begin(); it != dir_changes.end(); it++)
-            if (it->operation == DirChange::Operation::CREATE && it->fname == fname && it->root_dir_entry_index == md->root_dir_entry_index && it->dir_name == md->dir_name) {
-                dir_changes.erase(it);
-                goto skip_add;
-            }
-    }
-    dc.root_dir_entry_index = md->root_dir_entry_index;
-    dc.dir_name = md->dir_name;
+void add_dir_change(int tree, DirChange::Operation operation, const NameView<wchar_t> &fname, const NameView<wchar_t> &new_fname)
+{
+    DirChange dc;
+    dc.tree = tree;
     dc.operation = operation;
-    dc.fname = fname;
-    dc.new_fname = new_fname;
-    dir_changes.push_back(std::move(dc));
-skip_add:
-    dir_changes_lock.release();
+    dc.fname.assign(fname.chars, fname.length);
+    if (!new_fname.is_null())
+        dc.new_fname.assign(new_fname.chars, new_fname.length);
+    dc.time = timeGetTime();
+    if (dir_changes.push(std::move(dc))) // the applier may be asleep until the next check of pending changes
+        SetEvent(apply_directory_changes_event);
 }
 
-DWORD WINAPI read_directory_changes_thread_proc(LPVOID md_)
+// Called by `dir_watcher` on its thread
+void handle_dir_notifications(int tree, const char *records, size_t size)
 {
-    MonitoredDir *md = (MonitoredDir*)md_;
-    HANDLE dir_handle = CreateFileW((md->dir_name + L'\\').c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED|FILE_FLAG_BACKUP_SEMANTICS, NULL);
-    ASSERT(dir_handle != INVALID_HANDLE_VALUE);
-
-    OVERLAPPED opd;
-    opd.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-
-    std::wstring just_removed_file_name;
-
-    for(;;)
-    {
-        char fni_buf[10000];
-        if (!ReadDirectoryChangesW(dir_handle, fni_buf, sizeof(fni_buf), TRUE, FILE_NOTIFY_CHANGE_FILE_NAME|FILE_NOTIFY_CHANGE_DIR_NAME|FILE_NOTIFY_CHANGE_LAST_WRITE, NULL, &opd, NULL))
-            ERROR;
-        DWORD dwNumberOfBytesTransfered;
-        for(;;)
-            if (GetOverlappedResult(dir_handle, &opd, &dwNumberOfBytesTransfered, FALSE))
-            {
-                FILE_NOTIFY_INFORMATION *fni = (FILE_NOTIFY_INFORMATION*)fni_buf, *next_fni;
-                if (!just_removed_file_name.empty()) {
-                    if (fni->Action == FILE_ACTION_ADDED && path_base_name(just_removed_file_name) == path_base_name(std::wstring(fni->FileName, fni->FileNameLength/sizeof(WCHAR)))) {
-                        add_dir_change(md, DirChange::Operation::MOVE, just_removed_file_name, std::wstring(fni->FileName, fni->FileNameLength/sizeof(WCHAR)));
-                        just_removed_file_name.clear();
-                        if (fni->NextEntryOffset == 0)
-                            break;
-                        fni = (FILE_NOTIFY_INFORMATION*)((char*)fni + fni->NextEntryOffset);
-                    }
-                    else {
-                        add_dir_change(md, DirChange::Operation::DELETE, just_removed_file_name);
-                        just_removed_file_name.clear();
-                    }
-                }
-
-                for (; ;fni = next_fni)
-                {
-                    next_fni = (FILE_NOTIFY_INFORMATION*)((char*)fni + fni->NextEntryOffset);
-                    std::wstring fname(fni->FileName, fni->FileNameLength/sizeof(WCHAR));
-                    DirChange::Operation operation;
-                    switch (fni->Action)
-                    {
-                    case FILE_ACTION_ADDED:
-                        if (!just_removed_file_name.empty() && path_base_name(just_removed_file_name) == path_base_name(fname)) {
-                            add_dir_change(md, DirChange::Operation::MOVE, just_removed_file_name, fname);
-                            just_removed_file_name.clear();
-                            goto continue_;
-                        }
-                        operation = DirChange::Operation::CREATE;
-                        break;
-                    case FILE_ACTION_REMOVED:
-                        if (next_fni->Action == FILE_ACTION_ADDED && path_base_name(fname) == path_base_name(std::wstring(next_fni->FileName, next_fni->FileNameLength/sizeof(WCHAR)))) {
-                            add_dir_change(md, DirChange::Operation::MOVE, fname, std::wstring(next_fni->FileName, next_fni->FileNameLength/sizeof(WCHAR)));
-                            fni = next_fni;
-                            next_fni = (FILE_NOTIFY_INFORMATION*)((char*)fni + fni->NextEntryOffset);
-                            goto continue_;
-                        }
-                        else {
-                            if (!just_removed_file_name.empty()) {
-                                add_dir_change(md, DirChange::Operation::DELETE, just_removed_file_name);
-                                //just_removed_file_name.clear();
-                            }
-                            just_removed_file_name = fname;
-                            goto continue_;
-                        }
-                        break;
-                    case FILE_ACTION_MODIFIED:
-                        if (GetFileAttributes((md->dir_name / fname).c_str()) & FILE_ATTRIBUTE_DIRECTORY) // skip this action because there are excess modify directory notifications
-                            goto continue_;
-                        operation = DirChange::Operation::MODIFY;
-                        break;
-                    case FILE_ACTION_RENAMED_OLD_NAME:
-                        if (next_fni->Action == FILE_ACTION_RENAMED_NEW_NAME) {
-                            add_dir_change(md, DirChange::Operation::RENAME, fname, std::wstring(next_fni->FileName, next_fni->FileNameLength/sizeof(WCHAR)));
-                            fni = next_fni;
-                            next_fni = (FILE_NOTIFY_INFORMATION*)((char*)fni + fni->NextEntryOffset);
-                            goto continue_;
-                        }
-                        else
-                            ERROR;
-                        break;
-                    case FILE_ACTION_RENAMED_NEW_NAME:
-                        ERROR;
-                        break;
-                    }
-                    add_dir_change(md, operation, fname);
-continue_:
-                    if (fni->NextEntryOffset == 0) break;
-                }
-                break;
-            } else {
-                if (!just_removed_file_name.empty()) {
-                    add_dir_change(md, DirChange::Operation::DELETE, just_removed_file_name);
-                    just_removed_file_name.clear();
-                }
-                if (md->stop)
-                    goto break_;
-                Sleep(100);
-            }
+    MonitoredDir *md = monitored_dirs[tree].get();
+    auto emit = [tree](DirChange::Operation operation, const NameView<wchar_t> &fname, const NameView<wchar_t> &new_fname) {add_dir_change(tree, operation, fname, new_fname);};
+    if (records != nullptr) {
+        md->decoder.decode(records, size, *md, emit);
+        md->notified_time = current_file_time();
+        return;
+    }
+    md->decoder.flush(emit);
+    if (size == DirWatcher::LOST) { // the subtree is rescanned instead of a rescan of the whole tree
+        if (md->de != nullptr)
+            add_suspect_tree(tree, *md, md->notified_time - LOST_CHANGES_TIME_MARGIN);
+        md->notified_time = current_file_time();
+        return;
     }
-break_:
 
-    CloseHandle(opd.hEvent);
-    CloseHandle(dir_handle);
-    return 0;
+    // Ranges of subdirectories have been abandoned since the guard was pinned, so entries which have been abandoned are forgotten before it is repinned
+    uint64_t epoch = dir_tree.epoch();
+    if (epoch != monitoring_epoch) {
+        AutoCriticalSection suspect_trees_acs(suspect_trees_cs);
+        if (!suspect_trees.empty()) // it keeps their entries from reuse
+            return;
+        for (auto &&m : monitored_dirs)
+            if (m->de != nullptr && !dir_tree.is_alive(*m->de))
+                m->de = nullptr;
+        monitoring_guard->repin(epoch);
+        monitoring_epoch = epoch;
+    }
 }
 
 HANDLE apply_directory_changes_thread;
 bool stop_apply_directory_changes_thread = false;
+const DWORD SUSPECT_TREES_RETRY_INTERVAL = 1000; // while a scan is running
+
+// Directories of the tree which entries have changed since they were scanned are enumerated (others are known by their last write times to be unchanged),
+// and their files, as well as files of other directories which were modified since notifications were lost, are reported as modified
+void reconcile_suspect_tree(const SuspectTree &st)
+{
+    DirScanner scanner(stop_reconcile);
+    scanner.set_modified_files(st.since, [&st](const PathString &dir_name, const DirEnumEntry &e) {
+        std::wstring fname = dir_name.size() > st.dir_name.size() ? dir_name.substr(st.dir_name.size() + (st.dir_name.back() == L'/' ? 0 : 1)) / e.name : std::wstring(e.name), prefix;
+        std::replace(fname.begin(), fname.end(), L'/', L'\\'); // as in notifications
+        NameView<wchar_t> name(fname.c_str(), fname.size());
+        if (!lies_within_any(name, st.excluded_subdirs, prefix))
+            add_dir_change(st.tree, DirChange::Operation::MODIFY, name, NameView<wchar_t>());
+    });
+    scan_subtree(*st.de, st.dir_name, scanner);
+}
+
+// A pending change of a file is checked by its size and last write time, so the file is not opened and a writer which has opened it exclusively is not disturbed
+// (`monitored_dirs` do not change while this thread is running)
+bool probe_changed_file(const DirChange &dc, FileState &state)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (!GetFileAttributesEx((monitored_dirs[dc.tree]->dir_name / dc.fname).c_str(), GetFileExInfoStandard, &fad))
+        return false;
+    state.size = (uint64_t(fad.nFileSizeHigh) << 32) | fad.nFileSizeLow;
+    state.last_write_time = (uint64_t(fad.ftLastWriteTime.dwHighDateTime) << 32) | fad.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+// The thread sleeps until a change is pushed into an empty intake or a pending one is to be checked, so a settled file is picked up when it has settled
+// rather than at the next poll, and nothing is done while no file changes (but for forgetting of large files which have settled)
 DWORD WINAPI apply_directory_changes_thread_proc(LPVOID md)
 {
     while (!stop_apply_directory_changes_thread) {
-        int time = timeGetTime();
-        std::list<DirChange> tdir_changes;
-
-        dir_changes_lock.acquire();
-        for (auto it = dir_changes.begin(); it != dir_changes.end();) {
-            if ((it->operation == DirChange::Operation::MODIFY || it->operation == DirChange::Operation::CREATE) && time - it->time < 500) {
-                ++it;
-                continue;
+        // Trees which notifications have been lost are rescanned one by one, while no other scan is running (it may be scanning the same directories)
+        // and no menu action is editing the tree, and meanwhile `scan_is_running()` reports the reconcile, so no other scan or edit is started
+        bool suspect_trees_left = false;
+        while (!stop_apply_directory_changes_thread) {
+            DirTree::ReadGuard guard; // pinned before the tree is taken, so its entry is kept from reuse by `monitoring_guard` until then and by this guard after
+            std::unique_ptr<SuspectTree> st;
+            {
+                AutoCriticalSection scan_start_acs(scan_start_cs);
+                AutoCriticalSection suspect_trees_acs(suspect_trees_cs);
+                if (suspect_trees.empty())
+                    break;
+                if (scan_is_running() || popup_menu_is_open) {
+                    suspect_trees_left = true;
+                    break;
+                }
+                st = std::move(suspect_trees.front());
+                suspect_trees.erase(suspect_trees.begin());
+                if (!dir_tree.is_alive(*st->de)) // it has been abandoned since it was queued, so the rescan which has abandoned it has reconciled it
+                    continue;
+                ResetEvent(reconcile_done_event);
+            }
+            reconcile_suspect_tree(*st);
+            if (stop_reconcile) { // it is queued again (before the guard is released), so that its modified files are reported after the scan which has stopped it
+                AutoCriticalSection suspect_trees_acs(suspect_trees_cs);
+                auto it = std::find_if(suspect_trees.begin(), suspect_trees.end(), [&st](const std::unique_ptr<SuspectTree> &t) {return t->tree == st->tree;});
+                if (it != suspect_trees.end())
+                    (*it)->since = std::min((*it)->since, st->since);
+                else
+                    suspect_trees.insert(suspect_trees.begin(), std::move(st));
             }
-            tdir_changes.push_back(DirChange());
-            std::swap(tdir_changes.back(), *it);
-            it = dir_changes.erase(it);
+            SetEvent(reconcile_done_event);
         }
-        dir_changes_lock.release();
+
+        std::vector<DirChange> tdir_changes;
+        dir_changes.take_settled(timeGetTime(), probe_changed_file, tdir_changes);
 
         for (auto &&dc : tdir_changes) {
             wchar_t s[30+MAX_PATH*2], *ops[] = {L"CREATE", L"MODIFY", L"RENAME", L"MOVE", L"DELETE"};
@@ -1145,24 +1197,92 @@ DWORD WINAPI apply_directory_changes_thread_proc(LPVOID md)
             OutputDebugString(s);
         }
 
-        Sleep(250);
+        uint32_t timeout = dir_changes.time_to_next_check(timeGetTime());
+        if (suspect_trees_left)
+            timeout = std::min(timeout, uint32_t(SUSPECT_TREES_RETRY_INTERVAL));
+        WaitForSingleObject(apply_directory_changes_event, timeout == UINT32_MAX ? INFINITE : timeout);
     }
 
     return 0;
 }
 
+// An excluded directory is watched as a whole instead of its subdirectories if they are many and most of them are watched (notifications from the rest are dropped),
+// so there are no hundreds of watches where excluded and included directories are mixed, and the excess notifications are at most as many as the needed ones
+const size_t MIN_MONITORED_SUBDIRS_TO_MERGE = 8;
+
 void collect_monitored_dirs(int rdei, const std::wstring &dir_name, DirEntry &de)
 {
     DirMode mode = de.mode_no_ifp();
     ASSERT(mode != DirMode::INHERIT_FROM_PARENT);
 
     if (mode == DirMode::EXCLUDED) {
-        if (de.mode_mixed) // may be there are some non-excluded subdirectories
-            for (auto &&sd : de.subdirs)
-                collect_monitored_dirs(rdei, dir_name / sd.first, sd.second);
+        if (de.mode_mixed) { // may be there are some non-excluded subdirectories
+            size_t first = monitored_dirs.size();
+            bool whole_subdirs = true; // every subdirectory is watched as a whole or not at all
+            std::vector<DirEntry*> unwatched;
+            for (auto &&sd : de.subdirs()) {
+                size_t n = monitored_dirs.size();
+                std::wstring sd_dir_name = dir_name / sd.name();
+                collect_monitored_dirs(rdei, sd_dir_name, sd);
+                if (monitored_dirs.size() == n)
+                    unwatched.push_back(&sd);
+                else if (monitored_dirs.size() > n + 1 || monitored_dirs.back()->dir_name != sd_dir_name)
+                    whole_subdirs = false;
+            }
+            size_t count = monitored_dirs.size() - first;
+            if (whole_subdirs && count >= MIN_MONITORED_SUBDIRS_TO_MERGE && count >= unwatched.size()) {
+                std::unique_ptr<MonitoredDir> md = std::make_unique<MonitoredDir>(rdei, dir_name, &de);
+                for (auto &&sd : unwatched)
+                    md->excluded_subdirs.insert(sd->name());
+                for (size_t i = first; i < monitored_dirs.size(); i++) { // they may be merged excluded directories themselves
+                    std::wstring prefix = monitored_dirs[i]->dir_name.substr(dir_name.size() + 1) + L'\\';
+                    for (auto &&e : monitored_dirs[i]->excluded_subdirs)
+                        md->excluded_subdirs.insert(prefix + e);
+                }
+                monitored_dirs.resize(first);
+                monitored_dirs.push_back(std::move(md));
+            }
+        }
     }
     else
-        monitored_dirs.push_back(std::make_unique<MonitoredDir>(rdei, dir_name));
+        monitored_dirs.push_back(std::make_unique<MonitoredDir>(rdei, dir_name, &de));
+}
+
+static bool path_lies_within(const std::wstring &path, const std::wstring &dir_name) // `path` is `dir_name` or lies within it
+{
+    if (path.size() < dir_name.size())
+        return false;
+    for (size_t i = 0; i < dir_name.size(); i++) {
+        wchar_t a = path[i] == L'/' ? L'\\' : DirEntry::Less::fast_get_lowercase_en(path[i]),
+                b = dir_name[i] == L'/' ? L'\\' : DirEntry::Less::fast_get_lowercase_en(dir_name[i]);
+        if (a != b)
+            return false;
+    }
+    return path.size() == dir_name.size() || path[dir_name.size()] == L'\\' || path[dir_name.size()] == L'/';
+}
+
+// Watches trees of all roots with a single watcher. Trees which lie within other trees (e.g. when a root lies within another root) are not watched separately,
+// unless notifications from their place may be dropped by the enclosing tree.
+void start_monitoring()
+{
+    monitoring_epoch = dir_tree.epoch();
+    monitoring_guard = std::make_unique<DirTree::ReadGuard>();
+    for (size_t i=0; i<root_dir_entries.size(); i++)
+        collect_monitored_dirs(i, root_dir_entries[i]->path, *root_dir_entries[i]->de);
+    std::vector<bool> covered(monitored_dirs.size(), false);
+    for (size_t i = 0; i < monitored_dirs.size(); i++)
+        for (size_t j = 0; j < monitored_dirs.size() && !covered[i]; j++)
+            if (j != i && !covered[j] && monitored_dirs[j]->excluded_subdirs.empty() && path_lies_within(monitored_dirs[i]->dir_name, monitored_dirs[j]->dir_name))
+                covered[i] = true;
+    size_t n = 0;
+    for (size_t i = 0; i < monitored_dirs.size(); i++)
+        if (!covered[i])
+            monitored_dirs[n++] = std::move(monitored_dirs[i]);
+    monitored_dirs.resize(n);
+
+    dir_watcher = std::make_unique<DirWatcher>(handle_dir_notifications);
+    for (auto &&md : monitored_dirs)
+        dir_watcher->add_tree(md->dir_name);
 }
 
 INT_PTR CALLBACK backup_drive_selection_dlg_proc(HWND dlg_wnd, UINT message, WPARAM wparam, LPARAM lparam)
@@ -1228,7 +1348,7 @@ INT_PTR CALLBACK backup_drive_selection_dlg_proc(HWND dlg_wnd, UINT message, WPA
             ASSERT(GetDiskFreeSpaceEx((std::wstring(1, L'A' + selected_drive) + L":\\").c_str(), &free_bytes_available_to_caller, NULL, NULL));
             uint64_t total_size = 0;
             for (const auto &root_dir_entry : root_dir_entries)
-                total_size += root_dir_entry->size - root_dir_entry->size_excluded;
+                total_size += root_dir_entry->de->size - root_dir_entry->de->size_excluded;
             if (total_size * 125 / 100 > free_bytes_available_to_caller.QuadPart) {
                 MessageBox(dlg_wnd, replace_all(L"There is not enough free space on drive <drive_letter>.\nPlease select another drive.", L"<drive_letter>", std::wstring(1, L'A' + selected_drive)).c_str(), NULL, MB_OK|MB_ICONSTOP);
                 break;
@@ -1236,8 +1356,7 @@ INT_PTR CALLBACK backup_drive_selection_dlg_proc(HWND dlg_wnd, UINT message, WPA
 
             local_backup_drive = 'A' + selected_drive;
             backup_state = BackupState::BACKUP_STARTED;
-            for (size_t i=0; i<root_dir_entries.size(); i++)
-                collect_monitored_dirs(i, root_dir_entries[i]->path, *root_dir_entries[i]);
+            start_monitoring();
             apply_directory_changes_thread = CreateThread(NULL, 0, apply_directory_changes_thread_proc, NULL, 0, NULL);
             SendMessage(main_wnd, WM_COMMAND, IDB_TAB_PROGRESS, 0); }
         case IDCANCEL:
@@ -3,6 +3,8 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <windowsx.h>
+#include "path_string.h"
+#include "spin_lock.h"
 
 
 #undef ERROR
@@ -96,26 +98,6 @@ public:
     }
 };
 
-inline std::wstring operator/(const std::wstring &d, const std::wstring &f) {return d.back() == L'/' ? d + f : d + L'/' + f;}
-inline std::wstring operator/(const std::wstring &d, const wchar_t      *f) {return d.back() == L'/' ? d + f : d + L'/' + f;}
-
-inline std::wstring path_base_name(const std::wstring &path)
-{
-    size_t p = path.find_last_of(L"\\/");
-    return p != std::wstring::npos ? path.substr(p + 1) : path;
-}
-
-inline void spin_lock_acquire(volatile long &lock) {if (_InterlockedExchange(&lock, 1)) while (lock || _InterlockedExchange(&lock, 1)) _mm_pause();}
-inline void spin_lock_release(volatile long &lock) {_InterlockedExchange(&lock, 0);}
-
-class SpinLock
-{
-    long lock = 0;
-public:
-    void acquire() {spin_lock_acquire(lock);}
-    void release() {spin_lock_release(lock);}
-};
-
 inline void fast_make_lowercase_en(wchar_t *s)
 {
     for (; *s; s++)
@@ -143,25 +125,6 @@ inline std::wstring int64_to_str(int64_t i)
     return std::wstring(s);
 }
 
-template <typename Ty> inline std::string separate_thousands(Ty value)
-{
-    static std::stringstream ss;
-    static bool initialized = false;
-    if (!initialized) {
-        struct Dotted : std::numpunct<char> // [https://stackoverflow.com/a/31656618/2692494 <- google:‘c++ separate thousands’]
-        {
-            char do_thousands_sep()   const {return ' ';}  // separate with spaces
-            std::string do_grouping() const {return "\3";} // groups of 3 digits
-        };
-        ss.imbue(std::locale(ss.getloc(), new Dotted));
-        ss << std::fixed << std::setprecision(1); // [https://stackoverflow.com/a/14432416/2692494 <- google:‘c++ cout format float digits’]
-        initialized = true;
-    }
-    ss.str(std::string()); // [https://stackoverflow.com/a/20792/2692494 <- google:‘stringstream clear’] (`clear()` just clears state of the stream)
-    ss << value;
-    return ss.str();
-}
-
 inline std::wstring replace_all(const std::wstring &str, const std::wstring &old, const std::wstring &n)
 {
     std::wstring s(str);
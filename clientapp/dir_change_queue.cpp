@@ -0,0 +1,312 @@
+﻿#include <assert.h>
+#include <algorithm>
+#include "dir_change_queue.h"
+
+const uint32_t DirChangeQueue::NONE, DirChangeQueue::TICK, DirChangeQueue::WHEEL_SIZE;
+const uint32_t DirChangeQueue::MIN_QUIET_TIME, DirChangeQueue::MAX_QUIET_TIME, DirChangeQueue::QUIET_INTERVALS;
+const uint32_t DirChangeQueue::MIN_STABLE_INTERVAL, DirChangeQueue::MAX_STABLE_INTERVAL, DirChangeQueue::MAX_SETTLE_TIME;
+const uint32_t DirChangeQueue::GAP_INTERVALS, DirChangeQueue::SETTLED_MEMORY_TIME;
+const uint64_t DirChangeQueue::SMALL_FILE_SIZE;
+
+static uint32_t hash_of(int tree, const PathString &fname) // FNV-1a
+{
+    uint32_t h = 2166136261u ^ uint32_t(tree);
+    for (auto &&c : fname)
+        h = (h ^ uint32_t(c)) * 16777619u;
+    return h;
+}
+
+DirChangeQueue::~DirChangeQueue()
+{
+    for (Intake *in = intake.load(std::memory_order_acquire); in != nullptr;) {
+        Intake *next = in->next;
+        delete in;
+        in = next;
+    }
+}
+
+bool DirChangeQueue::push(DirChange &&change)
+{
+    Intake *in = new Intake;
+    in->change = std::move(change);
+    Intake *first = intake.load(std::memory_order_relaxed);
+    do
+        in->next = first;
+    while (!intake.compare_exchange_weak(first, in, std::memory_order_release, std::memory_order_relaxed));
+    return first == nullptr; // `in` may be taken already
+}
+
+uint32_t DirChangeQueue::find(int tree, const PathString &fname, uint32_t hash) const
+{
+    if (slots.empty())
+        return NONE;
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask; slots[i] != NONE; i = (i + 1) & mask) {
+        const Node &node = nodes[slots[i]];
+        if (node.hash == hash && node.change.tree == tree && node.change.fname == fname)
+            return slots[i];
+    }
+    return NONE;
+}
+
+void DirChangeQueue::index(uint32_t n)
+{
+    if ((num_of_indexed + 1) * 2 > slots.size()) { // keep load factor below 1/2
+        std::vector<uint32_t> old_slots(slots.empty() ? 16 : slots.size() * 2, NONE);
+        old_slots.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (auto &&s : old_slots)
+            if (s != NONE) {
+                size_t i = nodes[s].hash & mask;
+                while (slots[i] != NONE)
+                    i = (i + 1) & mask;
+                slots[i] = s;
+            }
+    }
+    size_t mask = slots.size() - 1, i = nodes[n].hash & mask;
+    while (slots[i] != NONE)
+        i = (i + 1) & mask;
+    slots[i] = n;
+    nodes[n].indexed = true;
+    num_of_indexed++;
+}
+
+void DirChangeQueue::unindex(uint32_t n)
+{
+    size_t mask = slots.size() - 1, i = nodes[n].hash & mask;
+    while (slots[i] != n)
+        i = (i + 1) & mask;
+    slots[i] = NONE;
+    nodes[n].indexed = false;
+    num_of_indexed--;
+
+    // Following slots of the cluster are shifted back, so that no probe sequence is broken by the hole (there are no tombstones)
+    for (size_t j = (i + 1) & mask; slots[j] != NONE; j = (j + 1) & mask) {
+        size_t home = nodes[slots[j]].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) { // the hole lies between the home slot and the slot
+            slots[i] = slots[j];
+            slots[j] = NONE;
+            i = j;
+        }
+    }
+}
+
+void DirChangeQueue::schedule(uint32_t n, uint32_t deadline)
+{
+    Node &node = nodes[n];
+    node.deadline = deadline;
+    uint32_t tick = deadline / TICK;
+    if (int32_t(tick - next_tick) < 0) // it is due already, so it goes to the slot which is visited first
+        tick = next_tick;
+    node.slot = tick & (WHEEL_SIZE - 1);
+    uint32_t &first = wheel[node.slot];
+    node.prev = NONE;
+    node.next = first;
+    if (first != NONE)
+        nodes[first].prev = n;
+    first = n;
+}
+
+void DirChangeQueue::unschedule(uint32_t n)
+{
+    Node &node = nodes[n];
+    if (node.prev != NONE)
+        nodes[node.prev].next = node.next;
+    else
+        wheel[node.slot] = node.next;
+    if (node.next != NONE)
+        nodes[node.next].prev = node.prev;
+    node.slot = NONE;
+}
+
+void DirChangeQueue::remove(uint32_t n)
+{
+    Node &node = nodes[n];
+    if (node.indexed)
+        unindex(n);
+    if (node.slot != NONE) // it is not being checked
+        unschedule(n);
+    node.change.fname = PathString(); // memory of long names is freed
+    node.change.new_fname = PathString();
+    if (node.pending)
+        num_of_changes--;
+    node.pending = false;
+    node.settled = false;
+    node.next = free_nodes;
+    free_nodes = n;
+}
+
+void DirChangeQueue::settle(uint32_t n, uint32_t time, bool remember)
+{
+    Node &node = nodes[n];
+    if (!remember || !node.indexed) {
+        Settled s = {node.sequence, std::move(node.change)};
+        settled_changes.push_back(std::move(s));
+        remove(n);
+        return;
+    }
+    Settled s = {node.sequence, node.change}; // the name is kept in the index
+    settled_changes.push_back(std::move(s));
+    node.pending = false;
+    node.settled = true;
+    num_of_changes--;
+    schedule(n, time + SETTLED_MEMORY_TIME);
+}
+
+void DirChangeQueue::add(DirChange &change, uint32_t time)
+{
+    if (change.operation == DirChange::Operation::MOVE && change.fname == change.new_fname)
+        return;
+
+    uint32_t hash = hash_of(change.tree, change.fname);
+    uint32_t n = find(change.tree, change.fname, hash), gap = 0;
+    if (n != NONE && nodes[n].settled) { // the file has not been complete when it has settled, if it is written again (unless it was to be forgotten already)
+        if ((change.operation == DirChange::Operation::CREATE || change.operation == DirChange::Operation::MODIFY) && int32_t(change.time - nodes[n].deadline) < 0)
+            gap = change.time - nodes[n].change.time;
+        remove(n);
+        n = NONE;
+    }
+    if (n != NONE)
+        switch (change.operation)
+        {
+        case DirChange::Operation::MODIFY: // just the time is updated, the deadline is moved when it comes (so an event costs no work in the wheel)
+            nodes[n].max_gap = std::max(nodes[n].max_gap, change.time - nodes[n].change.time);
+            nodes[n].change.time = change.time;
+            nodes[n].num_of_events++;
+            return;
+        case DirChange::Operation::DELETE:
+            if (nodes[n].change.operation == DirChange::Operation::CREATE) {
+                remove(n);
+                return;
+            }
+            unindex(n);
+            break;
+        default: // the newest creation is the one later modifications are merged into
+            unindex(n);
+            break;
+        }
+
+    uint64_t sequence = num_of_pushes++;
+    if (change.operation != DirChange::Operation::CREATE && change.operation != DirChange::Operation::MODIFY) {
+        Settled s = {sequence, std::move(change)};
+        settled_changes.push_back(std::move(s));
+        return;
+    }
+
+    if (free_nodes != NONE) {
+        n = free_nodes;
+        free_nodes = nodes[n].next;
+    }
+    else {
+        n = uint32_t(nodes.size());
+        nodes.push_back(Node());
+    }
+    Node &node = nodes[n];
+    node.change = std::move(change);
+    node.sequence = sequence;
+    node.hash = hash;
+    node.first_time = node.change.time;
+    node.num_of_events = 1;
+    node.max_gap = gap;
+    node.pending = true;
+    node.settled = false;
+    node.indexed = false;
+    node.probed = false;
+    num_of_changes++;
+    index(n);
+    schedule(n, std::max(node.change.time + MIN_QUIET_TIME, time)); // the event may have waited in the intake
+}
+
+void DirChangeQueue::check(uint32_t n, uint32_t time, const Probe &probe)
+{
+    Node &node = nodes[n];
+    if (node.settled) { // it is forgotten
+        remove(n);
+        return;
+    }
+    uint32_t quiet_time = MIN_QUIET_TIME;
+    if (node.num_of_events > 1)
+        quiet_time = std::min(std::max((node.change.time - node.first_time) / (node.num_of_events - 1) * QUIET_INTERVALS, MIN_QUIET_TIME), MAX_QUIET_TIME);
+    bool overdue = int32_t(time - node.first_time) >= int32_t(MAX_SETTLE_TIME);
+    if (int32_t(time - node.change.time) < int32_t(quiet_time) && !overdue) { // events keep coming
+        schedule(n, node.change.time + quiet_time);
+        return;
+    }
+
+    FileState state;
+    if (!overdue && (!probe(node.change, state) || state.size < SMALL_FILE_SIZE)) { // a small file is cheap to copy again if it is written once more
+        settle(n, time, false);
+        return;
+    }
+    if (overdue || (node.probed && state == node.state)) {
+        settle(n, time, node.probed);
+        return;
+    }
+    node.state = state;
+    node.probed = true;
+    schedule(n, time + std::min(std::max(MIN_STABLE_INTERVAL, node.max_gap * GAP_INTERVALS), MAX_STABLE_INTERVAL));
+}
+
+void DirChangeQueue::take_settled(uint32_t time, const Probe &probe, std::vector<DirChange> &settled)
+{
+    if (!wheel_started) {
+        wheel.assign(WHEEL_SIZE, NONE);
+        next_tick = time / TICK;
+        wheel_started = true;
+    }
+
+    // The intake is taken at once and reversed into the order of pushes
+    Intake *in = intake.exchange(nullptr, std::memory_order_acquire), *reversed = nullptr;
+    while (in != nullptr) {
+        Intake *next = in->next;
+        in->next = reversed;
+        reversed = in;
+        in = next;
+    }
+    while (reversed != nullptr) {
+        Intake *next = reversed->next;
+        add(reversed->change, time);
+        delete reversed;
+        reversed = next;
+    }
+
+    // Slots of ticks which have come are visited (each slot once, if the consumer has slept for more than a revolution), and the current tick is visited
+    // again by the next call
+    uint32_t tick = time / TICK;
+    for (uint32_t t = next_tick, visited = 0; int32_t(tick - t) >= 0 && visited < WHEEL_SIZE; t++, visited++)
+        for (uint32_t n = wheel[t & (WHEEL_SIZE - 1)]; n != NONE;) {
+            uint32_t next = nodes[n].next; // rescheduled nodes are put in front of slots, so they are not visited again
+            if (int32_t(time - nodes[n].deadline) >= 0) {
+                unschedule(n);
+                check(n, time, probe);
+            }
+            n = next;
+        }
+    next_tick = tick;
+
+    std::sort(settled_changes.begin(), settled_changes.end(), [](const Settled &a, const Settled &b) {return a.sequence < b.sequence;});
+    for (auto &&s : settled_changes)
+        settled.push_back(std::move(s.change));
+    settled_changes.clear();
+}
+
+uint32_t DirChangeQueue::time_to_next_check(uint32_t time) const
+{
+    for (uint32_t t = next_tick, visited = 0; visited < WHEEL_SIZE; t++, visited++) // the end of the first tick which slot is not empty (it may hold nodes of later revolutions)
+        if (wheel[t & (WHEEL_SIZE - 1)] != NONE)
+            return std::max(int32_t((t + 1) * TICK - time), 0);
+    return UINT32_MAX;
+}
+
+size_t DirChangeQueue::memory_usage() const
+{
+    size_t short_capacity = PathString().capacity(); // of names which are stored within the string
+    size_t r = nodes.size() * sizeof(Node) + slots.capacity() * sizeof(uint32_t);
+    r += wheel.capacity() * sizeof(uint32_t);
+    for (auto &&node : nodes)
+        if (node.pending || node.settled)
+            for (auto s : {&node.change.fname, &node.change.new_fname})
+                if (s->capacity() > short_capacity)
+                    r += (s->capacity() + 1) * sizeof(PathChar);
+    return r;
+}
@@ -0,0 +1,129 @@
+﻿#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <vector>
+#include "path_string.h"
+
+// Change of a file or a directory in a monitored tree
+struct DirChange
+{
+    int tree; // number of the watched tree, which gives the root directory entry and the watched directory
+    enum class Operation
+    {
+        CREATE,
+        MODIFY, // MODIFY is better than CHANGE because ‘modified/modification time’
+        RENAME,
+        MOVE,
+#undef DELETE
+        DELETE
+    } operation;
+    PathString fname; // relative to the watched directory
+    PathString new_fname;
+    uint32_t time; // of the last event in milliseconds
+};
+
+// State of a file as seen by the consumer when it checks whether a change has settled
+struct FileState
+{
+    uint64_t size;
+    uint64_t last_write_time;
+
+    bool operator==(const FileState &s) const {return size == s.size && last_write_time == s.last_write_time;}
+};
+
+// Queue of changes between the watcher and the thread which applies them.
+// Producers push changes into a lock-free intake stack, so they never wait for each other or for the consumer, which moves them into the queue proper.
+// There changes are coalesced in O(1): pending creations and modifications are indexed by (tree, file name) in an open addressing hash table,
+// so a modification of a file which creation or modification is pending just updates its time, and a deletion of a file which creation is pending cancels it.
+// A deletion, rename or move of a file takes its pending change out of the index, so later changes of another file with the same name are not merged into it.
+// Deletions, renames and moves are taken at once, while creations and modifications wait until the file has settled (so a file is not copied in the middle
+// of a write): a pending change sits in a hashed timer wheel until it is checked, so the consumer visits just the changes which are due, and sleeps until then.
+// A change is checked when there has been no event for the file for a quiet time, which adapts to the rate of its events (a few mean intervals between them),
+// and then the file is probed: a small file is taken at once, a large one when its size and last write time have not changed between two probes
+// (the interval between them is at least a couple of the longest gaps between events of the file, so a writer which stalls now and then,
+// e.g. a download, is waited for). A large file which has settled is remembered for a while, so that if it is written again,
+// the gap is taken into account. A file which never settles (e.g. a database which is always open) is taken anyway after a while.
+// Changes which are taken at once are in the order they were pushed.
+class DirChangeQueue
+{
+public:
+    // Returns false if the file can not be probed (e.g. it has been deleted meanwhile), then its change is taken as it is
+    typedef std::function<bool(const DirChange &change, FileState &state)> Probe;
+
+    DirChangeQueue() : intake(nullptr) {}
+    ~DirChangeQueue();
+
+    bool push(DirChange &&change); // by any thread, returns true if the intake was empty (so the consumer may be asleep and has to be woken up)
+
+    // By the consumer only
+    void take_settled(uint32_t time, const Probe &probe, std::vector<DirChange> &settled); // appends changes which have settled by `time`
+    uint32_t time_to_next_check(uint32_t time) const; // in milliseconds, `UINT32_MAX` if no change is pending and no settled file is remembered
+    size_t size() const {return num_of_changes;} // pending, as of the last `take_settled()` (files which have settled and are remembered are not counted)
+    size_t memory_usage() const; // in bytes, of pending changes
+
+    static const uint32_t MIN_QUIET_TIME = 50, MAX_QUIET_TIME = 5000, QUIET_INTERVALS = 4; // milliseconds, and mean intervals between events of a file
+    static const uint32_t MIN_STABLE_INTERVAL = 1000, MAX_STABLE_INTERVAL = 60000; // between probes of a large file
+    static const uint32_t GAP_INTERVALS = 2; // the interval between probes is at least this number of the longest gaps between events of the file
+    static const uint32_t SETTLED_MEMORY_TIME = 60000; // how long a large file which has settled is remembered
+    static const uint32_t MAX_SETTLE_TIME = 15*60*1000; // since the first event of a file
+    static const uint64_t SMALL_FILE_SIZE = 1024*1024;
+
+private:
+    DirChangeQueue(const DirChangeQueue&);
+    void operator=(const DirChangeQueue&);
+
+    struct Intake
+    {
+        Intake *next;
+        DirChange change;
+    };
+    std::atomic<Intake*> intake; // changes in reverse order
+
+    static const uint32_t NONE = UINT32_MAX;
+    struct Node
+    {
+        DirChange change; // `time` is of the last event
+        uint64_t sequence; // in the order of pushes
+        uint32_t prev, next; // in the slot of the wheel, `next` also links free nodes
+        uint32_t hash; // of the tree and the file name
+        uint32_t first_time, num_of_events;
+        uint32_t max_gap; // between events of the file (including the one since it has settled last time)
+        uint32_t deadline; // when it is checked next
+        uint32_t slot; // of the wheel, `NONE` while the node is out of it
+        FileState state; // at the last probe
+        bool pending, indexed, probed;
+        bool settled; // the change has been taken, and the node remembers when the file was written last until `deadline`
+    };
+    std::deque<Node> nodes; // grows by blocks, so there is little slack at peaks
+    uint32_t free_nodes = NONE;
+    size_t num_of_changes = 0;
+    std::vector<uint32_t> slots; // of the index: numbers of nodes (`NONE` in empty slots), collisions are resolved by linear probing
+    size_t num_of_indexed = 0;
+    uint64_t num_of_pushes = 0;
+
+    // Wheel of `WHEEL_SIZE` slots of `TICK` milliseconds each, a slot holds nodes which deadlines fall into its ticks of every revolution
+    static const uint32_t TICK = 16, WHEEL_SIZE = 256;
+    std::vector<uint32_t> wheel; // first nodes of slots
+    uint32_t next_tick = 0; // the first tick which has not been visited completely
+    bool wheel_started = false;
+
+    struct Settled
+    {
+        uint64_t sequence;
+        DirChange change;
+    };
+    std::vector<Settled> settled_changes; // of the current `take_settled()`, reused
+
+    void add(DirChange &change, uint32_t time);
+    uint32_t find(int tree, const PathString &fname, uint32_t hash) const;
+    void index(uint32_t n);
+    void unindex(uint32_t n);
+    void schedule(uint32_t n, uint32_t deadline);
+    void unschedule(uint32_t n);
+    void check(uint32_t n, uint32_t time, const Probe &probe);
+    void settle(uint32_t n, uint32_t time, bool remember);
+    void remove(uint32_t n);
+};
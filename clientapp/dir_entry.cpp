@@ -0,0 +1,757 @@
+﻿#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <new>
+#include "dir_entry.h"
+#include "dir_name_index.h"
+
+DirTree dir_tree;
+
+struct DirTree::RetiredRanges
+{
+    struct Range
+    {
+        uint32_t first, count;
+        uint64_t epoch; // at which the range was retired
+    };
+    std::deque<Range> retired; // roughly by ascending epoch (retiring threads may append out of order, which only delays reuse)
+    std::multimap<uint32_t, uint32_t> free; // first indices of ranges which no reader can see, by numbers of entries in them
+};
+
+PathString DirEntry::full_dir_name() const
+{
+    PathString full_dir_name = name();
+    for (DirEntry *p = parent(); p; p = p->parent())
+        full_dir_name = p->name() / full_dir_name;
+    return full_dir_name;
+}
+
+DirEntry *DirEntry::find_subdir(const PathChar *name) const
+{
+    SubDirs sds = subdirs();
+    size_t lo = 0, hi = sds.size();
+    while (lo < hi) { // binary search as subdirectories are sorted by name
+        size_t mid = (lo + hi) / 2;
+        if (Less()(sds[mid].name(), name))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < sds.size() && !Less()(name, sds[lo].name()))
+        return &sds[lo];
+    return nullptr;
+}
+
+static bool counted_as_mixed(const DirEntry &de, DirMode parent_mode_no_ifp)
+{
+    return de.mode_mixed || (de.mode() != DirMode::INHERIT_FROM_PARENT && de.mode() != parent_mode_no_ifp);
+}
+
+void DirEntry::update_mode_mixed(bool was_counted_as_mixed)
+{
+    // Effective modes of ancestors are found once from the root, and the change is carried up while it changes `mode_mixed`
+    std::vector<DirEntry*> ancestors;
+    for (DirEntry *pd = parent(); pd; pd = pd->parent())
+        ancestors.push_back(pd);
+    std::vector<DirMode> modes(ancestors.size());
+    DirMode mode = DirMode::INHERIT_FROM_PARENT;
+    for (size_t i = ancestors.size(); i-- > 0; ) {
+        if (ancestors[i]->mode() != DirMode::INHERIT_FROM_PARENT)
+            mode = ancestors[i]->mode();
+        modes[i] = mode;
+    }
+
+    const DirEntry *de = this;
+    bool was_counted = was_counted_as_mixed;
+    for (size_t i = 0; i < ancestors.size(); i++) {
+        bool counted = ::counted_as_mixed(*de, modes[i]);
+        if (counted == was_counted)
+            break;
+        DirEntry &pd = *ancestors[i];
+        was_counted = i + 1 < ancestors.size() && ::counted_as_mixed(pd, modes[i + 1]);
+        dir_tree.set_num_of_mixed_subdirs(pd, dir_tree.num_of_mixed_subdirs(pd.index) + (counted ? 1 : -1));
+        de = &pd;
+    }
+}
+
+static void recount_mixed_subdirs(DirEntry &de, DirMode mode, bool mode_changed) // `mode` is the effective mode of `de`
+{
+    uint32_t n = 0;
+    for (auto &&sd : de.subdirs()) {
+        if (mode_changed && sd.mode() == DirMode::INHERIT_FROM_PARENT && dir_tree.num_of_overrides(sd.index) != 0) // subtrees without overrides have no mixed subdirectories whatever mode they inherit
+            recount_mixed_subdirs(sd, mode, true);
+        if (counted_as_mixed(sd, mode))
+            n++;
+    }
+    dir_tree.set_num_of_mixed_subdirs(de, n);
+}
+
+void DirEntry::recount_mixed_subdirs(bool mode_no_ifp_changed)
+{
+    if (mode_no_ifp_changed) {
+        ::recount_mixed_subdirs(*this, mode_no_ifp(), true);
+        dir_tree.set_pending(*this); // descendants show the new mode when they are visited
+        return;
+    }
+    // The effective mode is found only if some subdirectory has its own mode (it takes O(depth) for directories which inherit the mode)
+    uint32_t n = 0;
+    DirMode mode = DirMode::AUTO;
+    for (auto &&sd : subdirs())
+        if (sd.mode_mixed)
+            n++;
+        else if (sd.mode() != DirMode::INHERIT_FROM_PARENT) {
+            if (mode == DirMode::AUTO)
+                mode = mode_no_ifp();
+            if (sd.mode() != mode)
+                n++;
+        }
+    dir_tree.set_num_of_mixed_subdirs(*this, n);
+}
+
+static void recalc_mode_mixed(DirEntry &de, DirMode mode)
+{
+    uint32_t n = 0;
+    for (auto &&sd : de.subdirs()) {
+        if (sd.mode_mixed || dir_tree.num_of_overrides(sd.index) != 0) // otherwise the subtree has no modes of its own, so it has no mixed subdirectories
+            recalc_mode_mixed(sd, sd.mode() != DirMode::INHERIT_FROM_PARENT ? sd.mode() : mode);
+        if (counted_as_mixed(sd, mode))
+            n++;
+    }
+    dir_tree.set_num_of_mixed_subdirs(de, n);
+}
+
+void DirEntry::recalc_mode_mixed()
+{
+    ::recalc_mode_mixed(*this, mode_no_ifp());
+}
+
+// Totals of a subtree are sums over its directories whose effective mode is excluded, but a subtree without overrides has the mode of its top,
+// so totals are summed up only along paths to overrides (it takes O(1) for most subtrees)
+static void excluded_totals(const DirEntry &de, bool parent_excluded, int64_t &size_excluded, int32_t &num_of_files_excluded)
+{
+    bool excluded = de.mode() != DirMode::INHERIT_FROM_PARENT ? de.mode() == DirMode::EXCLUDED : parent_excluded;
+    if (dir_tree.num_of_overrides(de.index) <= (de.has_overrides() ? 1u : 0u)) {
+        if (excluded) {
+            size_excluded += de.size;
+            num_of_files_excluded += de.num_of_files;
+        }
+        return;
+    }
+    if (excluded) {
+        size_excluded += de.dir_files_size;
+        num_of_files_excluded += de.dir_num_of_files;
+    }
+    for (auto &&sd : de.subdirs())
+        excluded_totals(sd, excluded, size_excluded, num_of_files_excluded);
+}
+
+void DirEntry::recalc_excluded()
+{
+    int64_t new_size_excluded = 0;
+    int32_t new_num_of_files_excluded = 0;
+    DirEntry *pde = parent();
+    excluded_totals(*this, pde != nullptr && pde->mode_no_ifp() == DirMode::EXCLUDED, new_size_excluded, new_num_of_files_excluded);
+    size_excluded = new_size_excluded;
+    num_of_files_excluded = new_num_of_files_excluded;
+    dir_tree.totals_changed(*this);
+    dir_tree.set_pending(*this);
+}
+
+void DirEntry::reset_auto_modes_of_descendants(bool set_priority_to_normal)
+{
+    // Only descendants with overrides may have automatic modes or priorities, and counts of mixed subdirectories change only on paths to them
+    std::vector<DirEntry*> overrides;
+    dir_tree.find_overrides(*this, overrides);
+    for (auto &&sd : overrides)
+        if (sd->mode_auto != DirMode::INHERIT_FROM_PARENT || (set_priority_to_normal && sd->priority_auto != DIR_PRIORITY_NORMAL)) {
+            sd->mode_auto = DirMode::INHERIT_FROM_PARENT;
+            if (set_priority_to_normal)
+                sd->priority_auto = DIR_PRIORITY_NORMAL;
+            dir_tree.changed(*sd);
+        }
+    recalc_mode_mixed();
+    dir_tree.set_pending(*this); // descendants show the new mode when they are visited
+}
+
+void DirEntry::exclude_auto(bool set_priority_to_normal_and_update_mode_mixed, bool update_ancestors)
+{
+    bool was_counted_as_mixed = set_priority_to_normal_and_update_mode_mixed && counted_as_mixed();
+    if (update_ancestors && parent() != nullptr)
+        dir_tree.resolve_pending(*parent()); // so that the previous excluded totals are exact and the deltas are right
+    int64_t prev_size_excluded         = size_excluded;
+    int32_t prev_num_of_files_excluded = num_of_files_excluded;
+
+    mode_auto = DirMode::EXCLUDED;
+    if (set_priority_to_normal_and_update_mode_mixed)
+        priority_auto = DIR_PRIORITY_NORMAL;
+    dir_tree.changed(*this);
+    reset_auto_modes_of_descendants(set_priority_to_normal_and_update_mode_mixed);
+    recalc_excluded(); // excluded totals of descendants are recalculated when they are visited
+    if (update_ancestors) { // the parallel scanner sums up excluded totals of subdirectories itself when the parent's subtree is complete
+        int64_t delta_size_excluded         = size_excluded         - prev_size_excluded;
+        int32_t delta_num_of_files_excluded = num_of_files_excluded - prev_num_of_files_excluded;
+        for (DirEntry *pde = parent(); pde != nullptr; pde = pde->parent()) {
+            pde->size_excluded += delta_size_excluded;
+            pde->num_of_files_excluded += delta_num_of_files_excluded;
+            dir_tree.totals_changed(*pde);
+        }
+    }
+
+    if (set_priority_to_normal_and_update_mode_mixed)
+        update_mode_mixed(was_counted_as_mixed);
+}
+
+void DirEntry::set_mode_manual(DirMode new_mode_manual)
+{
+    bool was_counted_as_mixed = counted_as_mixed();
+    DirMode prev_mode_no_ifp = mode_no_ifp();
+    if (parent() != nullptr)
+        dir_tree.resolve_pending(*parent()); // so that the previous excluded totals are exact and the deltas are right
+    mode_manual = new_mode_manual;
+    dir_tree.changed(*this);
+
+    // Update `mode_mixed`: subdirectories which inherit the mode are recounted if it has changed (they are marked as changed too), and ancestors in O(depth)
+    if (mode_no_ifp() != prev_mode_no_ifp)
+        recount_mixed_subdirs(true);
+    update_mode_mixed(was_counted_as_mixed);
+
+    // Update `num_of_files_excluded` and `size_excluded` if necessary
+    if ((prev_mode_no_ifp == DirMode::EXCLUDED) != (mode_no_ifp() == DirMode::EXCLUDED)) {
+        int64_t prev_size_excluded         = size_excluded;
+        int32_t prev_num_of_files_excluded = num_of_files_excluded;
+        recalc_excluded();
+        int64_t delta_size_excluded         = size_excluded         - prev_size_excluded;
+        int32_t delta_num_of_files_excluded = num_of_files_excluded - prev_num_of_files_excluded;
+        for (DirEntry *pde = parent(); pde != nullptr; pde = pde->parent()) {
+            pde->size_excluded += delta_size_excluded;
+            pde->num_of_files_excluded += delta_num_of_files_excluded;
+            dir_tree.totals_changed(*pde);
+        }
+    }
+}
+
+DirTree::ReadGuard::ReadGuard()
+{
+    uint64_t epoch = dir_tree.current_epoch.load();
+    for (slot = 0; slot < MAX_READERS; slot++) {
+        uint64_t free = 0;
+        if (dir_tree.reader_epochs[slot].compare_exchange_strong(free, epoch + 1))
+            break;
+    }
+    if (slot == MAX_READERS) { // instead of waiting for a slot, which may never be freed if its owner waits for this reader
+        dir_tree.num_of_overflow_readers++;
+        return;
+    }
+
+    // A writer which has advanced the epoch meanwhile may have missed the slot, so it is pinned again until the epoch is stable
+    for (uint64_t e; (e = dir_tree.current_epoch.load()) != epoch; epoch = e)
+        dir_tree.reader_epochs[slot].store(e + 1);
+}
+
+DirTree::ReadGuard::~ReadGuard()
+{
+    if (slot == MAX_READERS)
+        dir_tree.num_of_overflow_readers--;
+    else
+        dir_tree.reader_epochs[slot].store(0);
+}
+
+void DirTree::ReadGuard::repin(uint64_t epoch)
+{
+    if (slot == MAX_READERS) // it stays at the earliest epoch
+        return;
+    assert(epoch + 1 >= dir_tree.reader_epochs[slot].load(std::memory_order_relaxed));
+    dir_tree.reader_epochs[slot].store(epoch + 1);
+}
+
+uint64_t DirTree::min_pinned_epoch() const
+{
+    if (num_of_overflow_readers.load() != 0)
+        return 0;
+    uint64_t r = UINT64_MAX;
+    for (auto &&e : reader_epochs) {
+        uint64_t v = e.load();
+        if (v != 0 && v - 1 < r)
+            r = v - 1;
+    }
+    return r;
+}
+
+bool DirTree::is_alive(const DirEntry &de) const
+{
+    for (const DirEntry *d = &de, *p = d->parent(); p != nullptr; d = p, p = p->parent()) {
+        DirEntry::SubDirs subdirs = p->subdirs();
+        if (subdirs.empty() || d->index - subdirs[0].index >= subdirs.size())
+            return false;
+    }
+    return true;
+}
+
+void DirTree::retire(const DirEntry::SubDirs &subdirs, const std::vector<bool> &kept)
+{
+    std::vector<RetiredRanges::Range> ranges;
+    RetiredRanges::Range range = {subdirs[0].index, uint32_t(subdirs.size()), 0};
+    ranges.push_back(range);
+    std::vector<const DirEntry*> removed;
+    for (size_t i = 0; i < subdirs.size(); i++)
+        if (!kept[i])
+            removed.push_back(&subdirs[i]);
+    while (!removed.empty()) {
+        DirEntry::SubDirs sds = removed.back()->subdirs();
+        removed.pop_back();
+        if (sds.empty())
+            continue;
+        range.first = sds[0].index;
+        range.count = uint32_t(sds.size());
+        ranges.push_back(range);
+        for (auto &&sd : sds)
+            removed.push_back(&sd);
+    }
+
+    // Readers which pin a later epoch do not see the ranges, not even through the name index
+    for (auto &&r : ranges)
+        dir_name_index.remove(r.first, r.count);
+    uint64_t epoch = current_epoch.fetch_add(1);
+
+    spin_lock_acquire(retired_lock);
+    if (retired_ranges == nullptr)
+        retired_ranges = new RetiredRanges;
+    for (auto &&r : ranges) {
+        r.epoch = epoch;
+        retired_ranges->retired.push_back(r);
+        num_of_retired += r.count;
+    }
+    spin_lock_release(retired_lock);
+}
+
+uint32_t DirTree::reuse(uint32_t n)
+{
+    if (num_of_retired.load(std::memory_order_relaxed) < n)
+        return DIR_ENTRY_NONE;
+
+    // Pinned epochs only grow (new guards pin the current epoch, which is later than epochs of all retired ranges), so the minimum may be read before the lock
+    uint64_t min_epoch = min_pinned_epoch();
+    uint32_t first = DIR_ENTRY_NONE;
+    spin_lock_acquire(retired_lock);
+    std::deque<RetiredRanges::Range> &retired = retired_ranges->retired;
+    std::multimap<uint32_t, uint32_t> &free = retired_ranges->free;
+    for (; !retired.empty() && retired.front().epoch < min_epoch; retired.pop_front())
+        free.insert(std::make_pair(retired.front().count, retired.front().first));
+    auto it = free.lower_bound(n); // the smallest range which is large enough, the one which has been freed last (it is likely to be in the cache still)
+    if (it != free.end()) {
+        it = --free.upper_bound(it->first);
+        first = it->second;
+        if (it->first > n)
+            free.insert(std::make_pair(it->first - n, first + n));
+        free.erase(it);
+        num_of_retired -= n;
+    }
+    spin_lock_release(retired_lock);
+    if (first == DIR_ENTRY_NONE)
+        return DIR_ENTRY_NONE;
+
+    // Entries are reset as if they were allocated anew, and their versions change, so that what views derived from the old entries is stale
+    for (uint32_t i = first; i < first + n; i++) {
+        new (&(*this)[i]) DirEntry;
+        if (uint32_t *chunk = mixed_subdirs_chunks[i >> CHUNK_SIZE_LOG2].load(std::memory_order_acquire))
+            chunk[i & (CHUNK_SIZE - 1)] = 0;
+        if (std::atomic<uint32_t> *chunk = overrides_chunks[i >> CHUNK_SIZE_LOG2].load(std::memory_order_acquire))
+            chunk[i & (CHUNK_SIZE - 1)].store(0, std::memory_order_relaxed);
+        versions(i).entry.fetch_add(1, std::memory_order_relaxed);
+    }
+    return first;
+}
+
+uint32_t DirTree::allocate(uint32_t n)
+{
+    uint32_t first = reuse(n);
+    if (first != DIR_ENTRY_NONE)
+        return first;
+    first = num_of_allocated_entries.fetch_add(n);
+    assert(uint64_t(first) + n < DIR_ENTRY_NONE);
+    for (uint32_t c = first >> CHUNK_SIZE_LOG2; n != 0 && c <= (first + n - 1) >> CHUNK_SIZE_LOG2; c++)
+        if (chunks[c].load(std::memory_order_acquire) == nullptr) {
+            spin_lock_acquire(chunks_lock);
+            if (chunks[c].load(std::memory_order_relaxed) == nullptr)
+                chunks[c].store(new DirEntry[CHUNK_SIZE], std::memory_order_release);
+            spin_lock_release(chunks_lock);
+        }
+    return first;
+}
+
+DirTree::Versions &DirTree::versions(uint32_t index)
+{
+    std::atomic<Versions*> &chunk = versions_chunks[index >> CHUNK_SIZE_LOG2];
+    if (chunk.load(std::memory_order_acquire) == nullptr) {
+        spin_lock_acquire(chunks_lock);
+        if (chunk.load(std::memory_order_relaxed) == nullptr) {
+            Versions *versions = new Versions[CHUNK_SIZE];
+            for (int i = 0; i < CHUNK_SIZE; i++) {
+                versions[i].entry.store(0, std::memory_order_relaxed);
+                versions[i].subdirs.store(0, std::memory_order_relaxed);
+            }
+            chunk.store(versions, std::memory_order_release);
+        }
+        spin_lock_release(chunks_lock);
+    }
+    return chunk.load(std::memory_order_relaxed)[index & (CHUNK_SIZE - 1)];
+}
+
+std::atomic<uint32_t> &DirTree::overrides(uint32_t index)
+{
+    std::atomic<std::atomic<uint32_t>*> &chunk = overrides_chunks[index >> CHUNK_SIZE_LOG2];
+    if (chunk.load(std::memory_order_acquire) == nullptr) {
+        spin_lock_acquire(chunks_lock);
+        if (chunk.load(std::memory_order_relaxed) == nullptr) {
+            std::atomic<uint32_t> *values = new std::atomic<uint32_t>[CHUNK_SIZE];
+            for (int i = 0; i < CHUNK_SIZE; i++)
+                values[i].store(0, std::memory_order_relaxed);
+            chunk.store(values, std::memory_order_release);
+        }
+        spin_lock_release(chunks_lock);
+    }
+    return chunk.load(std::memory_order_relaxed)[index & (CHUNK_SIZE - 1)];
+}
+
+void DirTree::add_overrides(const DirEntry &de, int32_t delta)
+{
+    for (const DirEntry *d = &de; d != nullptr; d = d->parent()) // ancestors are shared with other workers of a scan, hence atomic additions
+        overrides(d->index).fetch_add(uint32_t(delta) << OVERRIDES_SHIFT, std::memory_order_relaxed);
+}
+
+void DirTree::find_overrides(const DirEntry &de, std::vector<DirEntry*> &overrides) const
+{
+    for (auto &&sd : de.subdirs()) {
+        uint32_t v = overrides_value(sd.index);
+        if (v & OVERRIDE_SELF)
+            overrides.push_back(&sd);
+        if ((v >> OVERRIDES_SHIFT) > (v & OVERRIDE_SELF))
+            find_overrides(sd, overrides);
+    }
+}
+
+uint32_t DirTree::recalc_overrides(const DirEntry &de)
+{
+    uint32_t self = de.has_overrides() ? OVERRIDE_SELF : 0, n = self;
+    for (auto &&sd : de.subdirs())
+        n += recalc_overrides(sd);
+    uint32_t v = overrides_value(de.index);
+    if (n != 0 || v != 0)
+        overrides(de.index).store(n << OVERRIDES_SHIFT | (v & OVERRIDE_PENDING) | self, std::memory_order_relaxed);
+    return n;
+}
+
+void DirTree::set_pending(const DirEntry &de)
+{
+    if (!de.subdirs().empty() && !is_pending(de.index)) {
+        overrides(de.index).fetch_or(OVERRIDE_PENDING, std::memory_order_relaxed);
+        tree_version.fetch_add(1, std::memory_order_release);
+    }
+}
+
+void DirTree::push_pending(const DirEntry &de)
+{
+    overrides(de.index).fetch_and(~uint32_t(OVERRIDE_PENDING), std::memory_order_relaxed); // before the subdirectories are read, so a mark set again meanwhile is not lost
+    bool excluded = de.mode_no_ifp() == DirMode::EXCLUDED;
+    for (auto &&sd : de.subdirs()) {
+        int64_t size_excluded = 0;
+        int32_t num_of_files_excluded = 0;
+        excluded_totals(sd, excluded, size_excluded, num_of_files_excluded);
+        sd.size_excluded = size_excluded;
+        sd.num_of_files_excluded = num_of_files_excluded;
+        totals_changed(sd); // also for its shown mode
+        set_pending(sd);
+    }
+}
+
+void DirTree::resolve_pending(const DirEntry &de)
+{
+    if (DirEntry *pde = de.parent())
+        resolve_pending(*pde);
+    if (is_pending(de.index))
+        push_pending(de);
+}
+
+void DirTree::resolve_subtree_pending(const DirEntry &de) // ancestors of `de` are resolved already
+{
+    if (is_pending(de.index))
+        push_pending(de);
+    for (auto &&sd : de.subdirs())
+        resolve_subtree_pending(sd);
+}
+
+void DirTree::resolve_all_pending(const DirEntry &de)
+{
+    if (DirEntry *pde = de.parent())
+        resolve_pending(*pde);
+    resolve_subtree_pending(de);
+}
+
+void DirTree::changed(const DirEntry &de)
+{
+    uint32_t v = overrides_value(de.index);
+    if ((v & OVERRIDE_SELF) != (de.has_overrides() ? uint32_t(OVERRIDE_SELF) : 0)) {
+        overrides(de.index).fetch_xor(OVERRIDE_SELF, std::memory_order_relaxed);
+        add_overrides(de, (v & OVERRIDE_SELF) ? -1 : 1);
+    }
+    versions(de.index).entry.fetch_add(1, std::memory_order_relaxed);
+    tree_version.fetch_add(1, std::memory_order_release);
+}
+
+void DirTree::set_num_of_mixed_subdirs(DirEntry &de, uint32_t n)
+{
+    std::atomic<uint32_t*> &chunk = mixed_subdirs_chunks[de.index >> CHUNK_SIZE_LOG2];
+    if (chunk.load(std::memory_order_acquire) == nullptr && n != 0) {
+        spin_lock_acquire(chunks_lock);
+        if (chunk.load(std::memory_order_relaxed) == nullptr)
+            chunk.store(new uint32_t[CHUNK_SIZE](), std::memory_order_release);
+        spin_lock_release(chunks_lock);
+    }
+    if (uint32_t *c = chunk.load(std::memory_order_relaxed))
+        c[de.index & (CHUNK_SIZE - 1)] = n;
+    if (de.mode_mixed != (n != 0)) {
+        de.mode_mixed = n != 0;
+        changed(de);
+    }
+}
+
+void DirTree::totals_changed(const DirEntry &de)
+{
+    versions(de.index).entry.fetch_add(1, std::memory_order_relaxed);
+    if (de.parent_index != DIR_ENTRY_NONE)
+        versions(de.parent_index).subdirs.fetch_add(1, std::memory_order_relaxed);
+    tree_version.fetch_add(1, std::memory_order_release);
+}
+
+uint32_t DirTree::add_name(const PathChar *name, size_t len)
+{
+    spin_lock_acquire(names_lock);
+    if (names_size == 0)
+        names_size = 1; // offset 0 is reserved for empty slots of name shards
+    if ((names_size & (NAMES_CHUNK_SIZE - 1)) + len + 1 > NAMES_CHUNK_SIZE) // names do not cross chunk boundaries
+        names_size = (names_size | (NAMES_CHUNK_SIZE - 1)) + 1;
+    uint32_t offset = names_size;
+    std::atomic<PathChar*> &chunk = names_chunks[offset >> NAMES_CHUNK_SIZE_LOG2];
+    if (chunk.load(std::memory_order_relaxed) == nullptr)
+        chunk.store(new PathChar[NAMES_CHUNK_SIZE], std::memory_order_release);
+    names_size += uint32_t(len + 1);
+    spin_lock_release(names_lock);
+
+    memcpy(chunk.load(std::memory_order_relaxed) + (offset & (NAMES_CHUNK_SIZE - 1)), name, (len + 1) * sizeof(PathChar));
+    return offset;
+}
+
+static uint32_t name_hash(const PathChar *name, size_t len)
+{
+    uint32_t h = 2166136261U; // FNV-1a
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ uint32_t(name[i])) * 16777619U;
+    return h;
+}
+
+static size_t name_length(const PathChar *name)
+{
+    size_t len = 0;
+    while (name[len] != 0)
+        len++;
+    return len;
+}
+
+uint32_t DirTree::intern_name(const PathChar *name)
+{
+    size_t len = name_length(name);
+    uint32_t h = name_hash(name, len);
+    NameShard &shard = name_shards[h % NUM_OF_NAME_SHARDS];
+    h /= NUM_OF_NAME_SHARDS;
+
+    spin_lock_acquire(shard.lock);
+    if ((shard.count + 1) * 2 > shard.capacity) { // keep load factor of the hash table below 1/2
+        uint32_t new_capacity = shard.capacity != 0 ? shard.capacity * 2 : 64;
+        uint32_t *new_slots = (uint32_t*)calloc(new_capacity, sizeof(uint32_t));
+        for (uint32_t i = 0; i < shard.capacity; i++)
+            if (shard.slots[i] != 0) {
+                const PathChar *n = this->name(shard.slots[i]);
+                uint32_t j = (name_hash(n, name_length(n)) / NUM_OF_NAME_SHARDS) & (new_capacity - 1);
+                while (new_slots[j] != 0)
+                    j = (j + 1) & (new_capacity - 1);
+                new_slots[j] = shard.slots[i];
+            }
+        free(shard.slots);
+        shard.slots = new_slots;
+        shard.capacity = new_capacity;
+    }
+
+    uint32_t i = h & (shard.capacity - 1);
+    for (; shard.slots[i] != 0; i = (i + 1) & (shard.capacity - 1)) {
+        const PathChar *n = this->name(shard.slots[i]), *m = name;
+        while (*n == *m && *m != 0)
+            n++, m++;
+        if (*n == *m) {
+            spin_lock_release(shard.lock);
+            return shard.slots[i];
+        }
+    }
+    uint32_t offset = add_name(name, len);
+    shard.slots[i] = offset;
+    shard.count++;
+    spin_lock_release(shard.lock);
+    return offset;
+}
+
+DirEntry *DirTree::add_root(const PathString &path)
+{
+    uint32_t index = allocate(1);
+    DirEntry &de = (*this)[index];
+    de.index = index;
+    de.name_offset = intern_name(path.c_str());
+    return &de;
+}
+
+void DirTree::set_subdirs(DirEntry &de, std::vector<uint32_t> &name_offsets)
+{
+    assert(is_alive(de)); // subdirectories of an abandoned entry are shared with its copy
+    std::sort(name_offsets.begin(), name_offsets.end(), [this](uint32_t a, uint32_t b) {return DirEntry::Less()(name(a), name(b));});
+
+    DirEntry::SubDirs old_subdirs = de.subdirs();
+    if (old_subdirs.size() == name_offsets.size()) { // names are interned, so equal names have equal offsets
+        size_t i = 0;
+        while (i < name_offsets.size() && old_subdirs[i].name_offset == name_offsets[i])
+            i++;
+        if (i == name_offsets.size())
+            return;
+    }
+
+    // Overrides in subtrees of old subdirectories which are not kept are subtracted from `de` and its ancestors
+    uint32_t removed_overrides = 0;
+    for (auto &&sd : old_subdirs)
+        removed_overrides += num_of_overrides(sd.index);
+    std::vector<bool> kept(old_subdirs.size());
+
+    if (name_offsets.empty()) {
+        de.subdirs_range.store(0, std::memory_order_release);
+        if (removed_overrides != 0)
+            add_overrides(de, -int32_t(removed_overrides));
+        retire(old_subdirs, kept);
+        changed(de);
+        return;
+    }
+
+    // Subdirectories are never changed in place because other threads may iterate over them, so a new range is allocated and the old one is retired
+    uint32_t first = allocate(uint32_t(name_offsets.size()));
+    size_t j = 0;
+    for (size_t i = 0; i < name_offsets.size(); i++) {
+        DirEntry &sd = (*this)[first + uint32_t(i)];
+        const PathChar *sd_name = name(name_offsets[i]);
+        uint32_t old_index = DIR_ENTRY_NONE;
+        while (j < old_subdirs.size() && DirEntry::Less()(old_subdirs[j].name(), sd_name)) // old subdirectories are sorted in the same order, so they are matched by merging
+            j++;
+        for (size_t k = j; k < old_subdirs.size() && !DirEntry::Less()(sd_name, old_subdirs[k].name()); k++)
+            if (old_subdirs[k].name_offset == name_offsets[i]) {
+                memcpy((void*)&sd, &old_subdirs[k], sizeof(DirEntry));
+                old_index = old_subdirs[k].index;
+                kept[k] = true;
+                for (auto &&ssd : sd.subdirs())
+                    ssd.parent_index = first + uint32_t(i);
+                break;
+            }
+        sd.index = first + uint32_t(i);
+        sd.parent_index = de.index;
+        sd.name_offset = name_offsets[i];
+        if (old_index != DIR_ENTRY_NONE) {
+            set_num_of_mixed_subdirs(sd, num_of_mixed_subdirs(old_index));
+            if (uint32_t v = overrides_value(old_index)) {
+                overrides(sd.index).store(v, std::memory_order_relaxed);
+                removed_overrides -= v >> OVERRIDES_SHIFT;
+            }
+        }
+    }
+    de.subdirs_range.store(first | (uint64_t(name_offsets.size()) << 32), std::memory_order_release);
+    if (removed_overrides != 0)
+        add_overrides(de, -int32_t(removed_overrides));
+    dir_name_index.add(first, uint32_t(name_offsets.size()));
+    if (!old_subdirs.empty())
+        retire(old_subdirs, kept);
+    changed(de);
+}
+
+void DirTree::clear()
+{
+    dir_name_index.clear(); // before entries are freed, as it may be being rebuilt from them
+    for (int c = 0; c < MAX_CHUNKS && chunks[c].load(std::memory_order_relaxed) != nullptr; c++) {
+        if (!is_in_mapped_snapshot(chunks[c].load(std::memory_order_relaxed)))
+            delete [] chunks[c].load(std::memory_order_relaxed);
+        chunks[c].store(nullptr, std::memory_order_relaxed);
+    }
+    num_of_allocated_entries = 0;
+    delete retired_ranges; // the epoch goes on, as guards may outlive the tree (e.g. the guard of a view)
+    retired_ranges = nullptr;
+    num_of_retired = 0;
+
+    for (int c = 0; c < MAX_CHUNKS; c++) {
+        delete [] versions_chunks[c].exchange(nullptr, std::memory_order_relaxed);
+        uint32_t *mixed_subdirs_chunk = mixed_subdirs_chunks[c].exchange(nullptr, std::memory_order_relaxed);
+        if (!is_in_mapped_snapshot(mixed_subdirs_chunk))
+            delete [] mixed_subdirs_chunk;
+        std::atomic<uint32_t> *overrides_chunk = overrides_chunks[c].exchange(nullptr, std::memory_order_relaxed);
+        if (!is_in_mapped_snapshot(overrides_chunk))
+            delete [] overrides_chunk;
+    }
+    tree_version++; // views see that the tree has changed even if they happen to have seen the same version of the previous tree
+
+    for (int c = 0; c < MAX_NAMES_CHUNKS && names_chunks[c].load(std::memory_order_relaxed) != nullptr; c++) {
+        if (!is_in_mapped_snapshot(names_chunks[c].load(std::memory_order_relaxed)))
+            delete [] names_chunks[c].load(std::memory_order_relaxed);
+        names_chunks[c].store(nullptr, std::memory_order_relaxed);
+    }
+    names_size = 0;
+
+    unmap_snapshot();
+
+    for (auto &&shard : name_shards) {
+        free(shard.slots);
+        shard.slots = nullptr;
+        shard.capacity = shard.count = 0;
+    }
+}
+
+size_t DirTree::memory_used() const
+{
+    size_t n = num_of_allocated_entries, r = n * sizeof(DirEntry);
+    for (size_t c = 0; c < MAX_CHUNKS && (c << CHUNK_SIZE_LOG2) < n; c++) {
+        size_t used = std::min(n - (c << CHUNK_SIZE_LOG2), size_t(CHUNK_SIZE)); // entries of the chunk which are allocated
+        if (versions_chunks[c].load(std::memory_order_relaxed) != nullptr)
+            r += used * sizeof(Versions);
+        if (mixed_subdirs_chunks[c].load(std::memory_order_relaxed) != nullptr)
+            r += used * sizeof(uint32_t);
+        if (overrides_chunks[c].load(std::memory_order_relaxed) != nullptr)
+            r += used * sizeof(uint32_t);
+    }
+    r += names_size * sizeof(PathChar);
+    for (auto &&shard : name_shards)
+        r += shard.count * sizeof(uint32_t);
+    return r;
+}
+
+size_t DirTree::memory_reserved() const
+{
+    size_t r = 0;
+    for (int c = 0; c < MAX_CHUNKS && chunks[c].load(std::memory_order_relaxed) != nullptr; c++)
+        r += CHUNK_SIZE * sizeof(DirEntry);
+    for (int c = 0; c < MAX_CHUNKS; c++)
+        if (versions_chunks[c].load(std::memory_order_relaxed) != nullptr)
+            r += CHUNK_SIZE * sizeof(Versions);
+    for (int c = 0; c < MAX_CHUNKS; c++)
+        if (mixed_subdirs_chunks[c].load(std::memory_order_relaxed) != nullptr)
+            r += CHUNK_SIZE * sizeof(uint32_t);
+    for (int c = 0; c < MAX_CHUNKS; c++)
+        if (overrides_chunks[c].load(std::memory_order_relaxed) != nullptr)
+            r += CHUNK_SIZE * sizeof(uint32_t);
+    for (int c = 0; c < MAX_NAMES_CHUNKS && names_chunks[c].load(std::memory_order_relaxed) != nullptr; c++)
+        r += NAMES_CHUNK_SIZE * sizeof(PathChar);
+    for (auto &&shard : name_shards)
+        r += shard.capacity * sizeof(uint32_t);
+    return r;
+}
@@ -0,0 +1,279 @@
+﻿#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "path_string.h"
+#include "spin_lock.h"
+
+enum class DirMode : uint8_t
+{
+    EXCLUDED,
+    NORMAL,
+    FROZEN,
+    APPEND_ONLY,
+    INHERIT_FROM_PARENT,
+    AUTO,
+    COUNT
+};
+typedef int8_t DirPriority;
+const DirPriority DIR_PRIORITY_ULTRA_HIGH =  2;
+const DirPriority DIR_PRIORITY_HIGH       =  1;
+const DirPriority DIR_PRIORITY_NORMAL     =  0;
+const DirPriority DIR_PRIORITY_LOW        = -1;
+const DirPriority DIR_PRIORITY_ULTRA_LOW  = -2;
+const DirPriority DIR_PRIORITY_AUTO       = -128;
+
+const uint32_t DIR_ENTRY_NONE = 0xFFFFFFFF;
+
+// Directory entries are allocated in `dir_tree` and are never moved, so pointers to them stay valid until `dir_tree.clear()` (but an entry abandoned by
+// a scan may be reused for another directory once no reader can see it, see `DirTree::ReadGuard`).
+// Links between entries are 32-bit indices into `dir_tree`, and subdirectories of an entry occupy a contiguous range of indices sorted by name.
+class DirEntry
+{
+    std::atomic<uint64_t> subdirs_range; // index of the first subdirectory in the low 32 bits and the number of subdirectories in the high 32 bits (so readers always see a consistent range)
+    friend class DirTree;
+
+public:
+    // Totals of the subtree are atomic because subdirectories add their totals to them concurrently during a scan, and the UI thread reads them at any time
+    // (plain 64-bit reads and writes are not atomic in 32-bit builds, so the UI could see a torn value)
+    int64_t dir_files_size = 0; // size of files just in this directory
+    std::atomic<int64_t> size; // total size of files including subdirectories
+    std::atomic<int64_t> size_excluded;
+    uint64_t max_last_write_time = 0; // in FILETIME units (100-nanosecond intervals since January 1, 1601 UTC) on all platforms
+    uint64_t dir_last_write_time = 0; // of the directory itself when its subtree was completely scanned (it changes when entries of the directory are added, removed or renamed), 0 if the subtree must be rescanned (in particular while it is being scanned)
+    uint32_t index = DIR_ENTRY_NONE; // index of this entry in `dir_tree`
+    uint32_t parent_index = DIR_ENTRY_NONE;
+    uint32_t name_offset = 0; // offset of the name in `dir_tree` name pool
+    int32_t dir_num_of_files : 31; // number of files just in this directory (a file with several hard links is counted in one of them only)
+    uint32_t dir_has_multiply_linked_files : 1; // so the directory is enumerated by every rescan: which of the links of a file is counted is decided anew by each scan
+    std::atomic<int32_t> num_of_files; // total number of files including subdirectories
+    std::atomic<int32_t> num_of_files_excluded;
+    DirMode mode_auto = DirMode::INHERIT_FROM_PARENT;
+    DirMode mode_manual = DirMode::AUTO;
+    DirPriority priority_auto = DIR_PRIORITY_NORMAL;
+    DirPriority priority_manual = DIR_PRIORITY_AUTO;
+    bool mode_mixed = false; // some subdirectory or its descendant has a mode which differs from the effective mode of its parent (see `DirTree::num_of_mixed_subdirs()`)
+    bool scan_started = false;
+    bool expanded = false;
+    bool not_traversed = false; // directory entry was not scanned
+
+    DirEntry() : subdirs_range(0), size(0), size_excluded(0), dir_num_of_files(0), dir_has_multiply_linked_files(0), num_of_files(0), num_of_files_excluded(0) {}
+
+    DirEntry *parent() const;
+    const PathChar *name() const;
+    PathString full_dir_name() const;
+
+    class SubDirs
+    {
+        uint32_t first, count;
+    public:
+        class iterator
+        {
+            uint32_t i;
+        public:
+            iterator(uint32_t i) : i(i) {}
+            DirEntry &operator*() const;
+            iterator &operator++() {i++; return *this;}
+            bool operator!=(const iterator &it) const {return i != it.i;}
+        };
+
+        SubDirs(uint64_t range) : first(uint32_t(range)), count(uint32_t(range >> 32)) {}
+        iterator begin() const {return iterator(first);}
+        iterator end()   const {return iterator(first + count);}
+        size_t size() const {return count;}
+        bool empty() const {return count == 0;}
+        DirEntry &operator[](size_t i) const;
+    };
+    SubDirs subdirs() const {return SubDirs(subdirs_range.load(std::memory_order_acquire));}
+    DirEntry *find_subdir(const PathChar *name) const;
+
+    struct Less // case insensitive for English letters
+    {
+        static PathChar fast_get_lowercase_en(PathChar c)
+        {
+            if (unsigned(int(c) - int('A')) <= unsigned('Z' - 'A'))
+                return c + ('a' - 'A');
+            return c;
+        }
+
+        bool operator()(const PathChar *l, const PathChar *r) const
+        {
+            for (; ; l++, r++) {
+                PathChar lower_l = fast_get_lowercase_en(*l),
+                         lower_r = fast_get_lowercase_en(*r);
+                if (lower_l != lower_r)
+                    return lower_l < lower_r;
+                if (lower_l == 0)
+                    return false;
+            }
+        }
+    };
+
+    DirMode mode() const {return mode_manual != DirMode::AUTO ? mode_manual : mode_auto;}
+    DirMode mode_no_ifp() const
+    {
+        if (mode() != DirMode::INHERIT_FROM_PARENT)
+            return mode();
+        for (DirEntry *pd = parent(); pd; pd = pd->parent())
+            if (pd->mode() != DirMode::INHERIT_FROM_PARENT)
+                return pd->mode();
+        return DirMode::INHERIT_FROM_PARENT;
+    }
+    DirPriority priority() const {return priority_manual == DIR_PRIORITY_AUTO ? priority_auto : priority_manual;}
+    bool has_overrides() const {return mode_manual != DirMode::AUTO || mode_auto != DirMode::INHERIT_FROM_PARENT || priority_manual != DIR_PRIORITY_AUTO || priority_auto != DIR_PRIORITY_NORMAL;} // mode or priority of its own (see `DirTree::num_of_overrides()`)
+
+    bool mode_differs_from_parent() const {return mode() != DirMode::INHERIT_FROM_PARENT && parent() != nullptr && mode() != parent()->mode_no_ifp();}
+    bool counted_as_mixed() const {return mode_mixed || mode_differs_from_parent();} // by the parent in its number of mixed subdirectories
+    void update_mode_mixed(bool was_counted_as_mixed); // carries a change of `counted_as_mixed()` to ancestors in O(depth)
+    void recount_mixed_subdirs(bool mode_no_ifp_changed = false); // after modes of subdirectories have changed, also of subdirectories which inherit the mode if it has changed (then the entry is marked as pending, see `DirTree::is_pending()`)
+    void recalc_mode_mixed(); // of the whole subtree (e.g. after modes were set without updating counts), but not of ancestors
+    void recalc_excluded(); // recalculates `size_excluded` and `num_of_files_excluded` by modes (but not of ancestors), of the subtree lazily (see `DirTree::is_pending()`)
+    void reset_auto_modes_of_descendants(bool set_priority_to_normal); // to inherit from parent in O(overrides in the subtree)
+    void exclude_auto(bool set_priority_to_normal_and_update_mode_mixed = false, bool update_ancestors = true);
+    void set_mode_manual(DirMode new_mode_manual);
+};
+
+// Slab allocator for directory entries plus a pool of interned names (every distinct name is stored once, null-terminated).
+// `dir_tree` is used during static initialization of other translation units (see `InitRootDirEntries`), so `DirTree` has no constructor and relies on zero initialization.
+class DirTree
+{
+public:
+    enum {CHUNK_SIZE_LOG2 = 16, CHUNK_SIZE = 1 << CHUNK_SIZE_LOG2, MAX_CHUNKS = 1 << (32 - CHUNK_SIZE_LOG2)};
+    enum {NAMES_CHUNK_SIZE_LOG2 = 20, NAMES_CHUNK_SIZE = 1 << NAMES_CHUNK_SIZE_LOG2, MAX_NAMES_CHUNKS = 1 << (32 - NAMES_CHUNK_SIZE_LOG2)};
+    enum {NUM_OF_NAME_SHARDS = 256};
+
+    DirEntry &operator[](uint32_t index) const {return chunks[index >> CHUNK_SIZE_LOG2].load(std::memory_order_relaxed)[index & (CHUNK_SIZE - 1)];}
+    const PathChar *name(uint32_t offset) const {return names_chunks[offset >> NAMES_CHUNK_SIZE_LOG2].load(std::memory_order_relaxed) + (offset & (NAMES_CHUNK_SIZE - 1));}
+
+    DirEntry *add_root(const PathString &path);
+    uint32_t intern_name(const PathChar *name);
+    void set_subdirs(DirEntry &de, std::vector<uint32_t> &name_offsets); // sorts `name_offsets` and publishes them as subdirectories of `de` (subdirectories which `de` already has keep their data and subtrees)
+    void clear(); // all scans must be stopped and no other thread may access the tree
+
+    // Subdirectories are never changed in place, so `set_subdirs()` abandons the old range of subdirectories (and ranges in subtrees of removed ones).
+    // Abandoned ranges are retired at the current epoch and reused by later allocations when no reader can see them: readers which keep pointers to
+    // entries or their indices pin an epoch by a guard (a scan for its whole duration, a view between its updates), and a range is reused only after
+    // every pinned epoch is later than the one it was retired at. Thus readers never block writers, and memory of rescanned directories is reused.
+    // An entry which a reader has kept from an earlier pin must be checked by `is_alive()` after the guard is pinned. Guards are not limited in number:
+    // a guard which finds all `MAX_READERS` slots taken is counted as an overflow reader instead, and no range is reused while there are any of them.
+    class ReadGuard
+    {
+        uint32_t slot; // `MAX_READERS` for an overflow reader
+        ReadGuard(const ReadGuard&);
+        ReadGuard &operator=(const ReadGuard&);
+    public:
+        ReadGuard(); // pins the current epoch
+        ~ReadGuard();
+        void repin(uint64_t epoch); // to a later epoch, which must have been read by `epoch()` before the reader read what it keeps from the tree
+    };
+    uint64_t epoch() const {return current_epoch.load();}
+    bool is_alive(const DirEntry &de) const; // entry was not abandoned by `set_subdirs()`
+    uint32_t num_of_retired_entries() const {return num_of_retired;} // waiting for readers or free for reuse
+
+    // Snapshot is a file with entries and names of the tree, which is memory-mapped on load (copy-on-write) and used in place (see dir_snapshot.cpp)
+    bool save_snapshot(const PathString &file_name, const std::vector<DirEntry*> &roots, uint32_t user_flags = 0); // no other thread may modify the tree
+    bool load_snapshot(const PathString &file_name, std::vector<DirEntry*> &roots, uint32_t *user_flags = nullptr); // the tree must be empty; `user_flags` are stored as is
+
+    // Versions let views keep what they have derived from the tree (painted rows, orders of subdirectories) until it is stale.
+    // They only grow (wrapping around) and are not saved in snapshots. Versions of entries are changed before the version of the tree,
+    // so a reader which reads the version of the tree first and then versions of entries does not miss a change.
+    uint32_t version() const {return tree_version.load(std::memory_order_acquire);} // changes whenever anything in the tree changes
+    uint32_t entry_version(uint32_t index) const {const Versions *v = versions(index); return v != nullptr ? v->entry.load(std::memory_order_relaxed) : 0;} // changes whenever anything shown about the entry changes
+    uint32_t subdirs_version(uint32_t index) const {const Versions *v = versions(index); return v != nullptr ? v->subdirs.load(std::memory_order_relaxed) : 0;} // changes whenever totals of any subdirectory of the entry change
+    void changed(const DirEntry &de); // must be called after anything shown about `de` (mode, priority, subdirectories) except its totals has changed (it also updates counts of overrides)
+    void totals_changed(const DirEntry &de); // must be called after the totals of `de` have changed
+
+    // Number of subdirectories of an entry which are mode mixed or whose mode differs from the effective mode of the entry, so `mode_mixed` is
+    // kept up to date in O(depth) after a change of mode (see `DirEntry::update_mode_mixed()`). Counts are saved in snapshots.
+    uint32_t num_of_mixed_subdirs(uint32_t index) const {const uint32_t *chunk = mixed_subdirs_chunks[index >> CHUNK_SIZE_LOG2].load(std::memory_order_acquire); return chunk != nullptr ? chunk[index & (CHUNK_SIZE - 1)] : 0;}
+    void set_num_of_mixed_subdirs(DirEntry &de, uint32_t n); // also sets `de.mode_mixed`
+
+    // Number of entries with modes or priorities of their own (see `DirEntry::has_overrides()`) in the subtree of an entry including itself, so bulk edits
+    // of modes and priorities visit only subtrees which have such entries instead of whole subtrees. Counts are updated in O(depth) by `changed()` and are saved in snapshots.
+    uint32_t num_of_overrides(uint32_t index) const {return overrides_value(index) >> OVERRIDES_SHIFT;}
+    void find_overrides(const DirEntry &de, std::vector<DirEntry*> &overrides) const; // appends descendants of `de` which have overrides, parents before their subdirectories
+    uint32_t recalc_overrides(const DirEntry &de); // counts of the whole subtree (e.g. after modes were set without `changed()`) but not of ancestors, returns the number of overrides in it
+
+    // A change of mode reaches descendants lazily, so it costs O(depth) plus O(overrides in the subtree) instead of O(subtree): the changed entry gets exact
+    // excluded totals and a pending mark, and the mark is pushed down a level at a time when subdirectories are visited. A push recalculates excluded totals
+    // of the subdirectories by modes (see `DirEntry::recalc_excluded()`), marks them as changed (so rows repaint shown modes) and marks them as pending.
+    // Thus `resolve_pending()` must be called before totals of subdirectories are read (the tree view does so for expanded directories). Marks are not
+    // saved in snapshots: they are resolved before saving.
+    bool is_pending(uint32_t index) const {return (overrides_value(index) & OVERRIDE_PENDING) != 0;}
+    void set_pending(const DirEntry &de); // excluded totals of `de` itself must be exact
+    void resolve_pending(const DirEntry &de); // pushes down marks of ancestors of `de` and of `de` itself, so totals of its subdirectories are exact
+    void resolve_all_pending(const DirEntry &de); // of the whole subtree and of ancestors (e.g. before a scan), costs O(subtree)
+
+    uint32_t num_of_entries() const {return num_of_allocated_entries;}
+    size_t memory_used() const; // in bytes, of allocated entries (including retired ones), their counts and names
+    size_t memory_reserved() const; // in bytes, including allocated but not yet used parts of chunks and name shards
+    double bytes_per_entry() const {return num_of_entries() != 0 ? double(memory_used()) / num_of_entries() : 0;}
+
+private:
+    struct NameShard
+    {
+        long lock;
+        uint32_t *slots; // open addressing hash table of name offsets (0 means empty slot)
+        uint32_t capacity, count;
+    };
+
+    std::atomic<DirEntry*> chunks[MAX_CHUNKS];
+    std::atomic<uint32_t> num_of_allocated_entries;
+    long chunks_lock;
+    enum {MAX_READERS = 64};
+    std::atomic<uint64_t> current_epoch;
+    std::atomic<uint64_t> reader_epochs[MAX_READERS]; // pinned epoch plus 1 by slot of a guard, 0 for a free slot
+    std::atomic<uint32_t> num_of_overflow_readers; // guards without a slot, they pin the earliest epoch
+    struct RetiredRanges;
+    RetiredRanges *retired_ranges; // allocated on the first retirement, guarded by `retired_lock`
+    long retired_lock;
+    std::atomic<uint32_t> num_of_retired;
+    struct Versions
+    {
+        std::atomic<uint32_t> entry, subdirs;
+    };
+    std::atomic<Versions*> versions_chunks[MAX_CHUNKS]; // parallel to `chunks`, allocated on the first change of a version within the chunk
+    std::atomic<uint32_t> tree_version;
+    std::atomic<uint32_t*> mixed_subdirs_chunks[MAX_CHUNKS]; // parallel to `chunks`, allocated on the first nonzero count within the chunk
+    enum {OVERRIDE_SELF = 1, OVERRIDE_PENDING = 2, OVERRIDES_SHIFT = 2};
+    std::atomic<std::atomic<uint32_t>*> overrides_chunks[MAX_CHUNKS]; // parallel to `chunks`: the number of overrides in the subtree shifted by `OVERRIDES_SHIFT` with flags `OVERRIDE_*`
+    std::atomic<PathChar*> names_chunks[MAX_NAMES_CHUNKS];
+    uint32_t names_size;
+    long names_lock;
+    NameShard name_shards[NUM_OF_NAME_SHARDS];
+    void *mapped_snapshot; // chunks (of entries, names and counts) which lie inside of the mapped snapshot must not be deleted
+    size_t mapped_snapshot_size;
+    int mapped_snapshot_slot;
+    uint64_t snapshot_generation; // generation of the last loaded or saved snapshot
+    int snapshot_slot; // file of the last loaded or saved snapshot
+
+    uint32_t allocate(uint32_t n); // returns index of the first of `n` consecutive entries
+    uint32_t reuse(uint32_t n); // returns index of the first of `n` retired entries which no reader can see, or `DIR_ENTRY_NONE`
+    void retire(const DirEntry::SubDirs &subdirs, const std::vector<bool> &kept); // range of subdirectories with subtrees of those which are not kept
+    uint64_t min_pinned_epoch() const;
+    uint32_t add_name(const PathChar *name, size_t len);
+    const Versions *versions(uint32_t index) const
+    {
+        const Versions *chunk = versions_chunks[index >> CHUNK_SIZE_LOG2].load(std::memory_order_acquire);
+        return chunk != nullptr ? chunk + (index & (CHUNK_SIZE - 1)) : nullptr;
+    }
+    Versions &versions(uint32_t index); // allocates the chunk if necessary
+    uint32_t overrides_value(uint32_t index) const
+    {
+        const std::atomic<uint32_t> *chunk = overrides_chunks[index >> CHUNK_SIZE_LOG2].load(std::memory_order_acquire);
+        return chunk != nullptr ? chunk[index & (CHUNK_SIZE - 1)].load(std::memory_order_relaxed) : 0;
+    }
+    std::atomic<uint32_t> &overrides(uint32_t index); // allocates the chunk if necessary
+    void add_overrides(const DirEntry &de, int32_t delta); // to the counts of `de` and its ancestors
+    void push_pending(const DirEntry &de);
+    void resolve_subtree_pending(const DirEntry &de);
+    bool is_in_mapped_snapshot(const void *p) const {return (const char*)p >= (const char*)mapped_snapshot && (const char*)p < (const char*)mapped_snapshot + mapped_snapshot_size;}
+    void unmap_snapshot();
+};
+extern DirTree dir_tree;
+
+inline DirEntry *DirEntry::parent() const {return parent_index != DIR_ENTRY_NONE ? &dir_tree[parent_index] : nullptr;}
+inline const PathChar *DirEntry::name() const {return dir_tree.name(name_offset);}
+inline DirEntry &DirEntry::SubDirs::iterator::operator*() const {return dir_tree[i];}
+inline DirEntry &DirEntry::SubDirs::operator[](size_t i) const {return dir_tree[first + uint32_t(i)];}
@@ -0,0 +1,285 @@
+﻿#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+#include <assert.h>
+#include "dir_enumerator.h"
+
+const size_t ENUM_BUFFER_SIZE = 64*1024;
+
+#ifdef _WIN32
+
+// `GetFileInformationByHandleEx` is not available on Windows XP, so it is obtained at run time
+typedef BOOL (WINAPI *GetFileInformationByHandleExFunc)(HANDLE, FILE_INFO_BY_HANDLE_CLASS, LPVOID, DWORD);
+static GetFileInformationByHandleExFunc get_file_information_by_handle_ex()
+{
+    static GetFileInformationByHandleExFunc func = (GetFileInformationByHandleExFunc)GetProcAddress(GetModuleHandle(L"kernel32.dll"), "GetFileInformationByHandleEx");
+    return func;
+}
+
+typedef HANDLE (WINAPI *OpenFileByIdFunc)(HANDLE, LPFILE_ID_DESCRIPTOR, DWORD, DWORD, LPSECURITY_ATTRIBUTES, DWORD);
+static OpenFileByIdFunc open_file_by_id()
+{
+    static OpenFileByIdFunc func = (OpenFileByIdFunc)GetProcAddress(GetModuleHandle(L"kernel32.dll"), "OpenFileById");
+    return func;
+}
+
+static bool skip_entry(DWORD attributes, const wchar_t *name)
+{
+    if ((attributes & FILE_ATTRIBUTE_SYSTEM) && !(!(attributes & FILE_ATTRIBUTE_DIRECTORY) && wcscmp(name, L"desktop.ini") == 0))
+        return true;
+
+    if (attributes & (FILE_ATTRIBUTE_HIDDEN|FILE_ATTRIBUTE_REPARSE_POINT)) // skip hidden files and directories and symbolic links
+        if ((attributes & FILE_ATTRIBUTE_DIRECTORY) && (wcscmp(name, L".git") == 0 || wcscmp(name, L"AppData") == 0))
+            assert((attributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0);
+        else
+            return true;
+
+    return (attributes & FILE_ATTRIBUTE_DIRECTORY) && name[0] == L'.' && (name[1] == 0 || (name[1] == L'.' && name[2] == 0)); // `.` and `..`
+}
+
+static uint64_t to_uint64(const LARGE_INTEGER &li) {return uint64_t(li.QuadPart);}
+static uint64_t to_uint64(const FILETIME &ft) {return (uint64_t(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;}
+
+DirEnumerator::DirEnumerator(const PathString &dir_name, bool fallback)
+{
+    if (!fallback && get_file_information_by_handle_ex() != nullptr) {
+        handle = CreateFile((dir_name.back() == L':' ? dir_name + L'\\' : dir_name).c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL); // ‘C:’ means current directory on drive C
+        if (handle == INVALID_HANDLE_VALUE) return;
+        buffer.resize(ENUM_BUFFER_SIZE);
+        names.reserve(ENUM_BUFFER_SIZE / sizeof(wchar_t)); // every FILE_ID_BOTH_DIR_INFO record is longer than its name with a terminating null
+    }
+    else {
+        find_api = true;
+        buffer.resize(sizeof(WIN32_FIND_DATA));
+        handle = FindFirstFile((dir_name / L"*.*").c_str(), (WIN32_FIND_DATA*)buffer.data());
+        if (handle == INVALID_HANDLE_VALUE) return;
+        find_data_pending = true;
+        names.reserve(ENUM_BUFFER_SIZE / sizeof(WIN32_FIND_DATA) * MAX_PATH);
+    }
+    opened = true;
+}
+
+DirEnumerator::~DirEnumerator()
+{
+    if (!opened) return;
+    if (find_api)
+        FindClose(handle);
+    else
+        CloseHandle(handle);
+}
+
+bool DirEnumerator::next_batch()
+{
+    entries.clear();
+    names.clear();
+    if (!opened) return false;
+
+    if (find_api) {
+        WIN32_FIND_DATA &fd = *(WIN32_FIND_DATA*)buffer.data();
+        bool end = true;
+        for (size_t n = names.capacity() / MAX_PATH; n != 0; n--) {
+            if (!find_data_pending && !FindNextFile(handle, &fd))
+                break;
+            find_data_pending = false;
+            end = false;
+            if (skip_entry(fd.dwFileAttributes, fd.cFileName))
+                continue;
+
+            DirEnumEntry e;
+            e.name = names.data() + names.size();
+            names.insert(names.end(), fd.cFileName, fd.cFileName + wcslen(fd.cFileName) + 1);
+            e.is_dir = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+            e.size = (uint64_t(fd.nFileSizeHigh) << 32) | fd.nFileSizeLow;
+            e.last_write_time = to_uint64(fd.ftLastWriteTime);
+            e.num_of_links = 1;
+            entries.push_back(e);
+        }
+        return !end;
+    }
+
+    if (!get_file_information_by_handle_ex()(handle, FileIdBothDirectoryInfo, buffer.data(), (DWORD)buffer.size())) // fails with ERROR_NO_MORE_FILES at the end
+        return false;
+
+    for (const char *p = buffer.data(); ; ) {
+        const FILE_ID_BOTH_DIR_INFO &info = *(const FILE_ID_BOTH_DIR_INFO*)p;
+        const wchar_t *name = names.data() + names.size();
+        names.insert(names.end(), info.FileName, info.FileName + info.FileNameLength / sizeof(WCHAR));
+        names.push_back(L'\0');
+
+        if (skip_entry(info.FileAttributes, name))
+            names.resize(name - names.data());
+        else {
+            DirEnumEntry e;
+            e.name = name;
+            e.is_dir = (info.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+            e.size = to_uint64(info.EndOfFile);
+            e.last_write_time = to_uint64(info.LastWriteTime);
+            e.num_of_links = 1;
+            if (!e.is_dir && e.size >= HARD_LINK_CHECK_MIN_SIZE) {
+                FILE_ID_DESCRIPTOR fid = {sizeof(FILE_ID_DESCRIPTOR), FileIdType};
+                fid.FileId = info.FileId;
+                HANDLE h = open_file_by_id()(handle, &fid, 0, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, NULL, 0); // no access rights are needed to query information, so this does not fail on locked files
+                if (h != INVALID_HANDLE_VALUE) {
+                    BY_HANDLE_FILE_INFORMATION fi;
+                    if (GetFileInformationByHandle(h, &fi) && fi.nNumberOfLinks > 1) {
+                        e.num_of_links = fi.nNumberOfLinks;
+                        e.volume_id = fi.dwVolumeSerialNumber;
+                        e.file_id = (uint64_t(fi.nFileIndexHigh) << 32) | fi.nFileIndexLow;
+                    }
+                    CloseHandle(h);
+                }
+            }
+            entries.push_back(e);
+        }
+
+        if (info.NextEntryOffset == 0)
+            break;
+        p += info.NextEntryOffset;
+    }
+    assert(names.size() <= names.capacity());
+    return true;
+}
+
+uint64_t get_dir_last_write_time(const PathString &dir_name)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (!GetFileAttributesEx((dir_name.back() == L':' ? dir_name + L'\\' : dir_name).c_str(), GetFileExInfoStandard, &fad)) // ‘C:’ means current directory on drive C
+        return 0;
+    return to_uint64(fad.ftLastWriteTime);
+}
+
+#else
+
+static uint64_t file_time(const timespec &ts)
+{
+    return FILETIME_UNIX_EPOCH + uint64_t(ts.tv_sec) * 10000000 + ts.tv_nsec / 100;
+}
+
+// Returns false if the entry must be skipped. `d_type` is DT_UNKNOWN if the file system does not report types of entries.
+static bool stat_entry(int dfd, const char *name, unsigned char d_type, DirEnumEntry &e)
+{
+    if (name[0] == '.' && strcmp(name, ".git") != 0) // skip `.`, `..` and hidden files and directories
+        return false;
+    if (d_type != DT_UNKNOWN && d_type != DT_DIR && d_type != DT_REG) // symbolic links, devices, sockets and FIFOs are skipped without `stat`
+        return false;
+
+    struct stat st;
+    if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return false;
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) // skip symbolic links (like reparse points on Windows) and devices, sockets and FIFOs (like system files)
+        return false;
+
+    e.name = name;
+    e.is_dir = S_ISDIR(st.st_mode);
+    if (!e.is_dir && name[0] == '.')
+        return false;
+    e.size = st.st_size;
+    e.last_write_time = file_time(st.st_mtim);
+    e.num_of_links = 1;
+    if (!e.is_dir && st.st_nlink > 1) {
+        e.num_of_links = uint32_t(st.st_nlink);
+        e.volume_id = st.st_dev;
+        e.file_id = st.st_ino;
+    }
+    return true;
+}
+
+#ifdef __linux__
+
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1]; // null-terminated
+};
+
+static bool next_getdents64_batch(int fd, std::vector<char> &buffer, std::vector<DirEnumEntry> &entries)
+{
+    long n = syscall(SYS_getdents64, fd, buffer.data(), buffer.size()); // names are null-terminated in the buffer, so they are not copied
+    if (n <= 0)
+        return false;
+
+    for (long pos = 0; pos < n; ) {
+        const linux_dirent64 &d = *(const linux_dirent64*)(buffer.data() + pos);
+        pos += d.d_reclen;
+        DirEnumEntry e;
+        if (stat_entry(fd, d.d_name, d.d_type, e))
+            entries.push_back(e);
+    }
+    return true;
+}
+
+#endif
+
+DirEnumerator::DirEnumerator(const PathString &dir_name, bool fallback)
+{
+#ifdef __linux__
+    if (!fallback) {
+        fd = open(dir_name.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (fd < 0) return;
+        buffer.resize(ENUM_BUFFER_SIZE);
+        opened = true;
+        return;
+    }
+#endif
+    dir = opendir(dir_name.c_str());
+    if (dir == nullptr) return;
+    fd = dirfd((DIR*)dir);
+    names.reserve(ENUM_BUFFER_SIZE);
+    opened = true;
+}
+
+DirEnumerator::~DirEnumerator()
+{
+    if (dir != nullptr)
+        closedir((DIR*)dir);
+    else if (fd >= 0)
+        close(fd);
+}
+
+bool DirEnumerator::next_batch()
+{
+    entries.clear();
+    names.clear();
+    if (!opened) return false;
+#ifdef __linux__
+    if (dir == nullptr)
+        return next_getdents64_batch(fd, buffer, entries);
+#endif
+
+    bool end = true;
+    while (names.capacity() - names.size() > 256) { // NAME_MAX + 1
+        dirent *d = readdir((DIR*)dir);
+        if (d == nullptr)
+            break;
+        end = false;
+        const char *name = names.data() + names.size();
+        names.insert(names.end(), d->d_name, d->d_name + strlen(d->d_name) + 1); // `d_name` is overwritten by the next `readdir`
+        DirEnumEntry e;
+        if (stat_entry(fd, name, d->d_type, e))
+            entries.push_back(e);
+    }
+    return !end;
+}
+
+uint64_t get_dir_last_write_time(const PathString &dir_name)
+{
+    struct stat st;
+    if (stat(dir_name.c_str(), &st) != 0)
+        return 0;
+    return file_time(st.st_mtim);
+}
+
+#endif
@@ -0,0 +1,72 @@
+﻿#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "path_string.h"
+
+const uint64_t FILETIME_UNIX_EPOCH = 116444736000000000ULL; // January 1, 1970 in FILETIME units
+
+// File or directory which should be taken into account by a scan (`.`, `..`, symbolic links, system and hidden entries except `.git` and `AppData` directories are filtered out)
+struct DirEnumEntry
+{
+    const PathChar *name; // valid until the next batch
+    bool is_dir;
+    uint64_t size;
+    uint64_t last_write_time; // in FILETIME units
+    uint32_t num_of_links; // hard links to the file, 1 if it is not known
+    uint64_t volume_id, file_id; // identity of the file (volume serial number and file index on Windows, `st_dev` and `st_ino` on POSIX), set only if `num_of_links` > 1
+};
+
+// Hard links of smaller files are not looked for on Windows: the number of links is not returned by directory enumeration, so a file has to be opened
+// to get it, which is worthwhile only for files which take a noticeable share of the total size
+const uint64_t HARD_LINK_CHECK_MIN_SIZE = 1024*1024;
+
+// Enumerates a directory in batches: every system call fills a large buffer with many entries at once
+// (`GetFileInformationByHandleEx(FileIdBothDirectoryInfo)` on Windows Vista and later, `getdents64` on Linux),
+// and names are decoded into a buffer which is reused for all batches, so there are no allocations per entry.
+// On Windows XP it falls back to `FindFirstFile`/`FindNextFile` (hard links are not detected then), and on other POSIX systems to `readdir`.
+class DirEnumerator
+{
+public:
+    DirEnumerator(const PathString &dir_name, bool fallback = false); // `fallback` forces the fallback API (e.g. to compare it with the batched one)
+    ~DirEnumerator();
+
+    bool is_open() const {return opened;}
+    bool next_batch(); // returns false when there are no more entries or on error
+    const std::vector<DirEnumEntry> &batch() const {return entries;}
+
+private:
+    DirEnumerator(const DirEnumerator&);
+    void operator=(const DirEnumerator&);
+
+    bool opened = false;
+    std::vector<DirEnumEntry> entries;
+    std::vector<char> buffer; // for raw output of the system call
+    std::vector<PathChar> names; // for null-terminated copies of names (capacity is reserved up front, so names are never moved while a batch is filled)
+#ifdef _WIN32
+    void *handle; // directory handle or find handle
+    bool find_api = false; // `handle` is a find handle of `FindFirstFile`
+    bool find_data_pending = false; // find data in `buffer` is not yet returned
+#else
+    void *dir = nullptr; // DIR* of `readdir`, null if `getdents64` is used
+    int fd = -1;
+#endif
+};
+
+// Calls `f` for every entry of `dir_name` (see `DirEnumEntry`).
+// Returns false if the directory can not be enumerated or `*stop` was set (it is checked between batches).
+template <class Func> bool enum_dir_entries(const PathString &dir_name, Func f, const volatile bool *stop = nullptr)
+{
+    DirEnumerator de(dir_name);
+    if (!de.is_open())
+        return false;
+    while (de.next_batch()) {
+        if (stop != nullptr && *stop)
+            return false;
+        for (auto &&e : de.batch())
+            f(e);
+    }
+    return true;
+}
+
+uint64_t get_dir_last_write_time(const PathString &dir_name); // returns 0 if the directory is not accessible
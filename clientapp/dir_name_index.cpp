@@ -0,0 +1,217 @@
+﻿#include <assert.h>
+#include <algorithm>
+#include <type_traits>
+#include "dir_name_index.h"
+
+DirNameIndex dir_name_index;
+const uint32_t DirNameIndex::UNLINKED;
+const uint32_t DirNameIndex::ALL_ENTRIES;
+
+static void lowercase(const PathChar *s, PathString &r)
+{
+    r.clear();
+    for (; *s != 0; s++)
+        r += DirEntry::Less::fast_get_lowercase_en(*s);
+}
+
+static uint64_t trigram(const PathChar *s) // of lowercase characters
+{
+    typedef std::make_unsigned<PathChar>::type UPathChar;
+    return uint64_t(UPathChar(s[0])) | uint64_t(UPathChar(s[1])) << 21 | uint64_t(UPathChar(s[2])) << 42;
+}
+
+static bool contains(const PathChar *name, const PathString &pattern) // `pattern` is lowercase
+{
+    for (; *name != 0; name++) {
+        size_t i = 0;
+        while (i < pattern.size() && DirEntry::Less::fast_get_lowercase_en(name[i]) == pattern[i])
+            i++;
+        if (i == pattern.size())
+            return true;
+    }
+    return pattern.empty();
+}
+
+void DirNameIndex::add_name(uint32_t id, const PathChar *name)
+{
+    // Buffers are reused as they are guarded by the lock
+    PathString &s = lowercase_name;
+    std::vector<uint64_t> &keys = name_trigrams;
+    lowercase(name, s);
+    keys.clear();
+    for (size_t i = 0; i + 3 <= s.size(); i++)
+        keys.push_back(trigram(s.c_str() + i));
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    for (auto &&key : keys)
+        trigrams[key].push_back(id);
+}
+
+void DirNameIndex::add_entry(DirEntry &de)
+{
+    auto r = name_ids.insert(std::make_pair(de.name_offset, uint32_t(names.size())));
+    if (r.second) {
+        Name n = {de.name_offset, DIR_ENTRY_NONE};
+        names.push_back(n);
+        add_name(r.first->second, de.name());
+    }
+    Name &n = names[r.first->second];
+
+    std::atomic<uint32_t*> &chunk = next_entry_chunks[de.index >> DirTree::CHUNK_SIZE_LOG2];
+    if (chunk.load(std::memory_order_relaxed) == nullptr) {
+        chunk.store(new uint32_t[DirTree::CHUNK_SIZE], std::memory_order_relaxed);
+        uint32_t *prev = new uint32_t[DirTree::CHUNK_SIZE];
+        std::fill(prev, prev + DirTree::CHUNK_SIZE, UNLINKED);
+        prev_entry_chunks[de.index >> DirTree::CHUNK_SIZE_LOG2].store(prev, std::memory_order_relaxed);
+    }
+    next_entry(de.index) = n.last_entry;
+    prev_entry(de.index) = DIR_ENTRY_NONE;
+    if (n.last_entry != DIR_ENTRY_NONE)
+        prev_entry(n.last_entry) = de.index;
+    n.last_entry = de.index;
+}
+
+void DirNameIndex::remove_entry(const DirEntry &de)
+{
+    if (prev_entry_chunks[de.index >> DirTree::CHUNK_SIZE_LOG2].load(std::memory_order_relaxed) == nullptr)
+        return;
+    uint32_t prev = prev_entry(de.index), next = next_entry(de.index);
+    if (prev == UNLINKED)
+        return;
+    if (prev != DIR_ENTRY_NONE)
+        next_entry(prev) = next;
+    else {
+        auto it = name_ids.find(de.name_offset);
+        assert(it != name_ids.end() && names[it->second].last_entry == de.index);
+        names[it->second].last_entry = next;
+    }
+    if (next != DIR_ENTRY_NONE)
+        prev_entry(next) = prev;
+    prev_entry(de.index) = UNLINKED; // `next_entry` is kept for queries which are walking the list, the entry is not reused until they are over
+}
+
+void DirNameIndex::add(uint32_t first, uint32_t count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t end = std::min(first + count, indexed_entries.load(std::memory_order_relaxed)); // the rebuild adds the rest when it reaches them
+    for (uint32_t i = first; i < end; i++)
+        if (prev_entry_chunks[i >> DirTree::CHUNK_SIZE_LOG2].load(std::memory_order_relaxed) == nullptr || prev_entry(i) == UNLINKED) // unless the rebuild has just added it
+            add_entry(dir_tree[i]);
+}
+
+void DirNameIndex::remove(uint32_t first, uint32_t count)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (uint32_t i = 0; i < count; i++)
+        remove_entry(dir_tree[first + i]);
+}
+
+void DirNameIndex::start_rebuild()
+{
+    clear();
+    indexed_entries = 0;
+    stop_rebuild_thread = false;
+    rebuild_thread = std::thread(&DirNameIndex::rebuild_thread_proc, this);
+}
+
+void DirNameIndex::rebuild_thread_proc()
+{
+    // Entries are added in batches, so that scans which add and remove entries meanwhile wait for the lock only shortly. An entry which is not alive
+    // yet (its parent is not linked to its range) or not anymore is skipped: it is added or has been removed by the scan when it is linked or retired.
+    const uint32_t BATCH_SIZE = 4096;
+    while (!stop_rebuild_thread) {
+        DirTree::ReadGuard read_guard; // ancestors of entries are not reused while they are checked
+        std::lock_guard<std::mutex> guard(lock);
+        uint32_t first = indexed_entries.load(std::memory_order_relaxed), n = dir_tree.num_of_entries();
+        if (first >= n) {
+            indexed_entries.store(ALL_ENTRIES, std::memory_order_release);
+            break;
+        }
+        uint32_t end = std::min(first + BATCH_SIZE, n);
+        for (uint32_t i = first; i < end; i++) {
+            DirEntry &de = dir_tree[i];
+            if (de.parent_index != DIR_ENTRY_NONE && dir_tree.is_alive(de)) // roots are shown by their paths, not names
+                add_entry(de);
+        }
+        indexed_entries.store(end, std::memory_order_release);
+    }
+}
+
+void DirNameIndex::stop_rebuild()
+{
+    if (!rebuild_thread.joinable())
+        return;
+    stop_rebuild_thread = true;
+    rebuild_thread.join();
+}
+
+void DirNameIndex::clear()
+{
+    stop_rebuild();
+    std::lock_guard<std::mutex> guard(lock);
+    indexed_entries.store(ALL_ENTRIES, std::memory_order_relaxed);
+    names.clear();
+    name_ids.clear();
+    trigrams.clear();
+    for (auto &&chunk : next_entry_chunks)
+        delete [] chunk.exchange(nullptr, std::memory_order_relaxed);
+    for (auto &&chunk : prev_entry_chunks)
+        delete [] chunk.exchange(nullptr, std::memory_order_relaxed);
+}
+
+bool DirNameIndex::find(const PathString &pattern, const volatile bool &stop, const std::function<void(DirEntry&)> &found)
+{
+    PathString p;
+    lowercase(pattern.c_str(), p);
+
+    // Names which contain all trigrams of the pattern are candidates (lists of the least frequent trigrams are intersected first)
+    std::vector<Name> candidates;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (p.size() < 3)
+            candidates = names;
+        else {
+            std::vector<const std::vector<uint32_t>*> lists;
+            for (size_t i = 0; i + 3 <= p.size(); i++) {
+                auto it = trigrams.find(trigram(p.c_str() + i));
+                if (it == trigrams.end())
+                    return true;
+                lists.push_back(&it->second);
+            }
+            std::sort(lists.begin(), lists.end(), [](const std::vector<uint32_t> *a, const std::vector<uint32_t> *b) {return a->size() < b->size();});
+            std::vector<uint32_t> ids(*lists[0]), common;
+            for (size_t i = 1; i < lists.size() && !ids.empty(); i++) {
+                if (stop)
+                    return false;
+                common.clear();
+                std::set_intersection(ids.begin(), ids.end(), lists[i]->begin(), lists[i]->end(), std::back_inserter(common));
+                ids.swap(common);
+            }
+            for (auto &&id : ids)
+                candidates.push_back(names[id]);
+        }
+    }
+
+    // Lists of entries are only prepended to, so they are walked without the lock from the heads taken under it
+    for (auto &&n : candidates) {
+        if (stop)
+            return false;
+        if (!contains(dir_tree.name(n.offset), p)) // trigrams may be in another order
+            continue;
+        for (uint32_t i = n.last_entry; i != DIR_ENTRY_NONE; i = next_entry_chunks[i >> DirTree::CHUNK_SIZE_LOG2].load(std::memory_order_relaxed)[i & (DirTree::CHUNK_SIZE - 1)])
+            if (dir_tree.is_alive(dir_tree[i])) // a scan may have abandoned it after the head of the list was taken
+                found(dir_tree[i]);
+    }
+    return true;
+}
+
+size_t DirNameIndex::memory_usage() const
+{
+    size_t r = names.capacity() * sizeof(Name) + name_ids.size() * (sizeof(uint32_t) * 2 + sizeof(void*) * 2);
+    for (auto &&t : trigrams)
+        r += sizeof(t) + sizeof(void*) * 2 + t.second.capacity() * sizeof(uint32_t);
+    for (auto &&chunk : next_entry_chunks)
+        if (chunk.load(std::memory_order_relaxed) != nullptr)
+            r += DirTree::CHUNK_SIZE * sizeof(uint32_t) * 2; // with `prev_entry_chunks`
+    return r;
+}
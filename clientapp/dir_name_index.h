@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "dir_entry.h"
+
+// Index of names of directories in `dir_tree` for finding directories by a part of their name (case insensitive for English letters as `DirEntry::Less`).
+// Every distinct name is indexed once by trigrams (substrings of 3 characters) of its lowercase form, and entries with the same name are linked into a list.
+// The tree adds entries to the index as soon as they get their names during a scan, so queries find new directories immediately. A loaded snapshot is indexed
+// by a background thread, so the tree is shown right away: queries find only directories which it has reached until `ready()`, and entries which get their
+// names meanwhile are added by it (as entries from `indexed_entries` on are left to it).
+// Entries abandoned by a scan are unlinked from the lists before they are retired, so they may be reused for other directories (see `DirTree::ReadGuard`).
+// Queries, additions and removals may run concurrently, a query must be run under a guard.
+class DirNameIndex
+{
+public:
+    ~DirNameIndex() {stop_rebuild();}
+
+    void add(uint32_t first, uint32_t count); // entries which have just got their names
+    void remove(uint32_t first, uint32_t count); // entries which are being retired
+    void start_rebuild(); // from all entries of the tree in a background thread (e.g. after a snapshot was loaded)
+    bool ready() const {return indexed_entries.load(std::memory_order_acquire) == ALL_ENTRIES;} // all entries of the tree are indexed
+    void clear(); // also stops the rebuild, must be called before entries of the tree are freed
+
+    // Calls `found` for every directory of the tree whose name contains `pattern` (abandoned entries are skipped), returns false if `stop` was set
+    bool find(const PathString &pattern, const volatile bool &stop, const std::function<void(DirEntry&)> &found);
+
+    size_t num_of_names() const {return names.size();}
+    size_t memory_usage() const; // in bytes
+
+private:
+    struct Name
+    {
+        uint32_t offset; // in the name pool of `dir_tree`
+        uint32_t last_entry; // the list of entries with this name starts here and continues through `next_entry`
+    };
+
+    std::mutex lock;
+    std::vector<Name> names; // by name id
+    std::unordered_map<uint32_t, uint32_t> name_ids; // by name offset
+    std::unordered_map<uint64_t, std::vector<uint32_t>> trigrams; // ascending ids of names which contain the trigram
+    std::atomic<uint32_t*> next_entry_chunks[DirTree::MAX_CHUNKS]; // parallel to chunks of the tree, `DIR_ENTRY_NONE` ends a list
+    std::atomic<uint32_t*> prev_entry_chunks[DirTree::MAX_CHUNKS]; // `DIR_ENTRY_NONE` starts a list, `UNLINKED` for entries which are in no list
+    static const uint32_t UNLINKED = DIR_ENTRY_NONE - 1;
+    static const uint32_t ALL_ENTRIES = 0xFFFFFFFF;
+    std::atomic<uint32_t> indexed_entries{ALL_ENTRIES}; // entries below it have been reached by the rebuild, changed under the lock
+    std::thread rebuild_thread;
+    volatile bool stop_rebuild_thread = false;
+    PathString lowercase_name;
+    std::vector<uint64_t> name_trigrams;
+
+    void add_entry(DirEntry &de);
+    void remove_entry(const DirEntry &de);
+    uint32_t &next_entry(uint32_t index) {return next_entry_chunks[index >> DirTree::CHUNK_SIZE_LOG2].load(std::memory_order_relaxed)[index & (DirTree::CHUNK_SIZE - 1)];}
+    uint32_t &prev_entry(uint32_t index) {return prev_entry_chunks[index >> DirTree::CHUNK_SIZE_LOG2].load(std::memory_order_relaxed)[index & (DirTree::CHUNK_SIZE - 1)];}
+    void add_name(uint32_t id, const PathChar *name);
+    void rebuild_thread_proc();
+    void stop_rebuild();
+};
+extern DirNameIndex dir_name_index;
@@ -0,0 +1,128 @@
+﻿#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include "dir_change_queue.h"
+
+// Actions of notification records, the values of `FILE_ACTION_*`
+enum NotifyAction {NOTIFY_ADDED = 1, NOTIFY_REMOVED, NOTIFY_MODIFIED, NOTIFY_RENAMED_OLD_NAME, NOTIFY_RENAMED_NEW_NAME};
+
+// Notification record with the layout of `FILE_NOTIFY_INFORMATION`: `ReadDirectoryChangesW` fills buffers with them (of `wchar_t` names), and the Linux watcher
+// produces the same (of native names). Records are aligned on 4-byte boundaries, `next_entry_offset` is 0 in the last one.
+template <class Char> struct NotifyRecord
+{
+    uint32_t next_entry_offset;
+    uint32_t action;
+    uint32_t name_length; // in bytes, the name is not null-terminated
+    Char name[1]; // relative to the root of the watched tree
+};
+
+// Name which is not owned: it points into a buffer of records (or into a copy of a name kept by the decoder)
+template <class Char> struct NameView
+{
+    const Char *chars;
+    size_t length;
+
+    NameView() : chars(nullptr), length(0) {}
+    NameView(const Char *chars, size_t length) : chars(chars), length(length) {}
+
+    bool is_null() const {return chars == nullptr;}
+    bool operator==(const NameView &n) const {return length == n.length && memcmp(chars, n.chars, length * sizeof(Char)) == 0;}
+    NameView base_name() const
+    {
+        size_t i = length;
+        while (i > 0 && chars[i - 1] != Char('\\') && chars[i - 1] != Char('/'))
+            i--;
+        return NameView(chars + i, length - i);
+    }
+};
+
+// Decodes buffers of notification records of a watched tree into changes. It is pure (it depends on nothing but the records and the classifier it is given,
+// so it can be run on captured buffers anywhere) and does not allocate: names are views of the records, a removal followed by an addition of the same
+// base name is paired into a move, and a rename of the old and the new name, in place. Only a half of a pair which ends a buffer is copied (into a string
+// which keeps its capacity), as the buffer is reused by the next read.
+// `Classifier` has `bool excluded(const NameView<Char>&)` (records of excluded names are dropped, so a move from an excluded subdirectory is seen as a creation,
+// and a move into it as a deletion) and `bool is_dir(const NameView<Char>&)` (modifications of directories are dropped, as there are excess modify directory
+// notifications). `Emit` is called as `emit(DirChange::Operation, const NameView<Char> &name, const NameView<Char> &new_name)`, `new_name` is null but for
+// renames and moves.
+template <class Char> class NotifyDecoder
+{
+public:
+    typedef NameView<Char> Name;
+
+    template <class Classifier, class Emit> void decode(const char *records, size_t size, Classifier &classifier, Emit emit)
+    {
+        for (size_t offset = 0; offset + offsetof(NotifyRecord<Char>, name) <= size;) {
+            const NotifyRecord<Char> *r = (const NotifyRecord<Char>*)(records + offset);
+            if (offset + offsetof(NotifyRecord<Char>, name) + r->name_length > size) // truncated
+                break;
+            Name name(r->name, r->name_length / sizeof(Char));
+            bool excluded = classifier.excluded(name);
+            switch (r->action)
+            {
+            case NOTIFY_ADDED:
+                if (excluded)
+                    break;
+                if (!removed.is_null() && removed.base_name() == name.base_name()) {
+                    emit(DirChange::Operation::MOVE, removed, name);
+                    removed = Name();
+                }
+                else
+                    emit(DirChange::Operation::CREATE, name, Name());
+                break;
+            case NOTIFY_REMOVED:
+                if (excluded)
+                    break;
+                if (!removed.is_null())
+                    emit(DirChange::Operation::DELETE, removed, Name());
+                removed = name;
+                break;
+            case NOTIFY_MODIFIED:
+                if (excluded || classifier.is_dir(name))
+                    break;
+                emit(DirChange::Operation::MODIFY, name, Name());
+                break;
+            case NOTIFY_RENAMED_OLD_NAME:
+                old_name = excluded ? Name() : name;
+                break;
+            case NOTIFY_RENAMED_NEW_NAME:
+                if (old_name.is_null()) {
+                    if (!excluded) // the old name was excluded
+                        emit(DirChange::Operation::CREATE, name, Name());
+                }
+                else if (excluded)
+                    emit(DirChange::Operation::DELETE, old_name, Name());
+                else
+                    emit(DirChange::Operation::RENAME, old_name, name);
+                old_name = Name();
+                break;
+            }
+            if (r->next_entry_offset == 0)
+                break;
+            offset += r->next_entry_offset;
+        }
+        keep(removed, kept_removed);
+        keep(old_name, kept_old_name);
+    }
+
+    template <class Emit> void flush(Emit emit) // there are no more notifications queued, so the removal is not a half of a move
+    {
+        if (!removed.is_null())
+            emit(DirChange::Operation::DELETE, removed, Name());
+        removed = Name();
+    }
+
+private:
+    Name removed, old_name; // halves of pairs which wait for the other half
+    std::basic_string<Char> kept_removed, kept_old_name;
+
+    static void keep(Name &n, std::basic_string<Char> &s)
+    {
+        if (n.is_null() || n.chars == s.data())
+            return;
+        s.assign(n.chars, n.length);
+        n.chars = s.data();
+    }
+};
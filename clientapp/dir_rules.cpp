@@ -0,0 +1,519 @@
+﻿#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <algorithm>
+#include <deque>
+#include <type_traits>
+#include "dir_rules.h"
+
+// Built-in rules are checked after user rules, so they can be overridden (`level<=3` in them is `DIR_MODE_LEVELS_AUTO`)
+static const char BUILTIN_RULES[] =
+    "skip level=2 name=$Recycle.Bin\n"
+    "skip level=2 \"name=Program Files\"\n"
+    "skip level=2 \"name=Program Files (x86)\"\n"
+    "skip level=2 name=Users\n"
+    "skip level=2 name=Windows\n" // also ‘WINDOWS’ on Windows XP
+    "skip level=2 \"name=Documents and Settings\"\n" // for Windows XP
+    "exclude level>=2 name=.git size>100MB\n"
+    "exclude path=<UserProfile>/AppData/Local\n"
+    "exclude path=<UserProfile>/AppData/LocalLow\n"
+    "mode=append_only priority=low level>=2 level<=3 contains=photo\n"
+    "mode=append_only priority=low level>=2 level<=3 contains=backup\n";
+
+DirRules dir_rules;
+
+typedef std::make_unsigned<PathChar>::type UPathChar;
+
+static PathChar fold(PathChar c)
+{
+    return c == PathChar('\\') ? PathChar('/') : DirEntry::Less::fast_get_lowercase_en(c);
+}
+
+static PathString fold(const PathString &s)
+{
+    PathString r(s);
+    for (auto &&c : r)
+        c = fold(c);
+    return r;
+}
+
+static uint32_t hash_path(const PathChar *s, size_t len, uint32_t h = 2166136261U) // FNV-1a of folded characters
+{
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ uint32_t(UPathChar(fold(s[i])))) * 16777619U;
+    return h;
+}
+
+static size_t length(const PathChar *s)
+{
+    size_t len = 0;
+    while (s[len] != 0)
+        len++;
+    return len;
+}
+
+static bool glob_match(const PathChar *p, const PathChar *s) // `p` is folded
+{
+    const PathChar *star_p = nullptr, *star_s = nullptr;
+    while (*s != 0) {
+        if (*p == PathChar('*')) {
+            star_p = ++p;
+            star_s = s;
+        }
+        else if (*p != 0 && (*p == PathChar('?') || *p == fold(*s))) {
+            p++;
+            s++;
+        }
+        else if (star_p != nullptr) { // let the last `*` match one more character
+            p = star_p;
+            s = ++star_s;
+        }
+        else
+            return false;
+    }
+    while (*p == PathChar('*'))
+        p++;
+    return *p == 0;
+}
+
+static bool contains(const PathChar *s, const PathString &substring) // `substring` is folded
+{
+    for (; *s != 0; s++) {
+        size_t i = 0;
+        while (i < substring.size() && s[i] != 0 && fold(s[i]) == substring[i])
+            i++;
+        if (i == substring.size())
+            return true;
+    }
+    return substring.empty();
+}
+
+static bool path_equals(const PathString &path, const PathChar *parent_path, size_t parent_path_len, const PathChar *name) // `path` is folded
+{
+    size_t i = 0;
+    if (parent_path_len != 0) {
+        if (path.size() <= parent_path_len)
+            return false;
+        for (; i < parent_path_len; i++)
+            if (fold(parent_path[i]) != path[i])
+                return false;
+        if (path[i++] != PathChar('/'))
+            return false;
+    }
+    for (; *name != 0; name++, i++)
+        if (i == path.size() || fold(*name) != path[i])
+            return false;
+    return i == path.size();
+}
+
+static PathString name_key(const DirRule &rule) // key which must be found in the name of a directory for the rule to be triggered
+{
+    PathString key, fragment;
+    for (auto &&c : rule.name_glob + PathChar('*')) // the longest literal part of the glob
+        if (c == PathChar('*') || c == PathChar('?')) {
+            if (fragment.size() > key.size())
+                key = fragment;
+            fragment.clear();
+        }
+        else
+            fragment += c;
+    return rule.substring.size() > key.size() ? rule.substring : key;
+}
+
+void DirRules::RuleSet::compile(std::vector<DirRule> &&rules)
+{
+    this->rules = std::move(rules);
+    std::vector<PathString> keys(this->rules.size());
+    for (size_t i = 0; i < this->rules.size(); i++)
+        if (this->rules[i].path.empty())
+            keys[i] = name_key(this->rules[i]);
+
+    // Characters which occur in keys get their own classes, so the table of transitions is small
+    char_classes.assign(size_t(1) << (8 * sizeof(PathChar)), 0);
+    num_of_char_classes = 1;
+    for (auto &&key : keys)
+        for (auto &&c : key)
+            if (char_classes[UPathChar(c)] == 0)
+                char_classes[UPathChar(c)] = uint16_t(num_of_char_classes++);
+
+    // Trie of keys
+    const uint32_t NONE = 0xFFFFFFFF;
+    transitions.assign(num_of_char_classes, NONE);
+    std::vector<std::vector<uint32_t>> state_outputs(1);
+    path_index.clear();
+    generic_rules.clear();
+    for (uint32_t i = 0; i < this->rules.size(); i++) {
+        if (!this->rules[i].path.empty()) {
+            path_index.insert(std::make_pair(hash_path(this->rules[i].path.c_str(), this->rules[i].path.size()), i));
+            continue;
+        }
+        if (keys[i].empty()) {
+            generic_rules.push_back(i);
+            continue;
+        }
+        uint32_t s = 0;
+        for (auto &&c : keys[i]) {
+            uint32_t &t = transitions[s * num_of_char_classes + char_classes[UPathChar(c)]];
+            if (t == NONE) {
+                t = uint32_t(state_outputs.size());
+                state_outputs.push_back(std::vector<uint32_t>());
+                transitions.resize(transitions.size() + num_of_char_classes, NONE);
+            }
+            s = transitions[s * num_of_char_classes + char_classes[UPathChar(c)]];
+        }
+        state_outputs[s].push_back(i);
+    }
+
+    // Failure links are resolved in breadth-first order, turning the trie into a complete automaton (every state has a transition for every class)
+    uint32_t num_of_states = uint32_t(state_outputs.size());
+    std::vector<uint32_t> fail(num_of_states, 0);
+    std::deque<uint32_t> queue;
+    for (uint32_t cc = 0; cc < num_of_char_classes; cc++) {
+        uint32_t &t = transitions[cc];
+        if (t == NONE)
+            t = 0;
+        else
+            queue.push_back(t);
+    }
+    while (!queue.empty()) {
+        uint32_t s = queue.front();
+        queue.pop_front();
+        state_outputs[s].insert(state_outputs[s].end(), state_outputs[fail[s]].begin(), state_outputs[fail[s]].end());
+        for (uint32_t cc = 0; cc < num_of_char_classes; cc++) {
+            uint32_t &t = transitions[s * num_of_char_classes + cc];
+            if (t == NONE)
+                t = transitions[fail[s] * num_of_char_classes + cc];
+            else {
+                fail[t] = transitions[fail[s] * num_of_char_classes + cc];
+                queue.push_back(t);
+            }
+        }
+    }
+
+    outputs_begin.resize(num_of_states + 1);
+    outputs.clear();
+    for (uint32_t s = 0; s < num_of_states; s++) {
+        outputs_begin[s] = uint32_t(outputs.size());
+        outputs.insert(outputs.end(), state_outputs[s].begin(), state_outputs[s].end());
+    }
+    outputs_begin[num_of_states] = uint32_t(outputs.size());
+}
+
+const DirRule *DirRules::RuleSet::match(const PathChar *parent_path, size_t parent_path_len, const PathChar *name, int level, int64_t size, int64_t age) const
+{
+    auto matches = [&](const DirRule &rule) {
+        if (level < rule.level_min || level > rule.level_max)
+            return false;
+        if (rule.has_size_or_age()) {
+            if (size < 0 || size < rule.size_min || size > rule.size_max)
+                return false;
+            if ((rule.age_min != INT64_MIN || rule.age_max != INT64_MAX) && (age < 0 || age < rule.age_min || age > rule.age_max))
+                return false;
+        }
+        if (!rule.name_glob.empty() && !glob_match(rule.name_glob.c_str(), name))
+            return false;
+        if (!rule.substring.empty() && !contains(name, rule.substring))
+            return false;
+        return rule.path.empty() || path_equals(rule.path, parent_path, parent_path_len, name);
+    };
+
+    uint32_t best = uint32_t(rules.size()); // the first matching rule wins
+
+    if (!path_index.empty()) {
+        uint32_t h = parent_path_len != 0 ? hash_path(PATH_LITERAL("/"), 1, hash_path(parent_path, parent_path_len)) : 2166136261U;
+        auto range = path_index.equal_range(hash_path(name, length(name), h));
+        for (auto it = range.first; it != range.second; ++it)
+            if (it->second < best && matches(rules[it->second]))
+                best = it->second;
+    }
+
+    uint32_t s = 0;
+    for (const PathChar *p = name; *p != 0; p++) {
+        s = transitions[s * num_of_char_classes + char_classes[UPathChar(fold(*p))]];
+        for (uint32_t o = outputs_begin[s]; o < outputs_begin[s + 1]; o++)
+            if (outputs[o] < best && matches(rules[outputs[o]]))
+                best = outputs[o];
+    }
+
+    for (auto &&r : generic_rules) {
+        if (r >= best)
+            break;
+        if (matches(rules[r])) {
+            best = r;
+            break;
+        }
+    }
+
+    return best < rules.size() ? &rules[best] : nullptr;
+}
+
+static PathString from_utf8(const std::string &s)
+{
+#ifdef _WIN32
+    PathString r;
+    for (size_t i = 0; i < s.size(); ) {
+        unsigned char c = s[i++];
+        uint32_t cp = c;
+        int n = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+        if (n != 0)
+            cp &= 0x3F >> n;
+        for (; n != 0 && i < s.size(); n--)
+            cp = (cp << 6) | (s[i++] & 0x3F);
+        if (cp >= 0x10000) { // surrogate pair
+            r += wchar_t(0xD800 + ((cp - 0x10000) >> 10));
+            r += wchar_t(0xDC00 + ((cp - 0x10000) & 0x3FF));
+        }
+        else
+            r += wchar_t(cp);
+    }
+    return r;
+#else
+    return s;
+#endif
+}
+
+static bool equal_ignoring_case(const char *a, const char *b)
+{
+    for (; tolower((unsigned char)*a) == tolower((unsigned char)*b); a++, b++)
+        if (*a == 0)
+            return true;
+    return false;
+}
+
+static bool parse_number(const std::string &value, const char *const suffixes[], const int64_t multipliers[], int64_t &r)
+{
+    char *end;
+    r = strtoll(value.c_str(), &end, 10);
+    if (end == value.c_str())
+        return false;
+    if (*end == 0)
+        return true;
+    for (int i = 0; suffixes[i] != nullptr; i++)
+        if (equal_ignoring_case(end, suffixes[i])) {
+            r *= multipliers[i];
+            return true;
+        }
+    return false;
+}
+
+static bool parse_rule(const std::string &line, const std::vector<std::pair<PathString, PathString>> &variables, DirRule &rule, std::string &error)
+{
+    static const char *const SIZE_SUFFIXES[] = {"KB", "MB", "GB", "TB", nullptr};
+    static const int64_t SIZE_MULTIPLIERS[] = {1LL << 10, 1LL << 20, 1LL << 30, 1LL << 40};
+    static const char *const AGE_SUFFIXES[] = {"d", nullptr};
+    static const int64_t AGE_MULTIPLIERS[] = {1};
+    static const char *const MODES[] = {"excluded", "normal", "frozen", "append_only"}; // in order of `DirMode`
+    static const char *const PRIORITIES[] = {"ultra_high", "high", "normal", "low", "ultra_low"};
+    const int NUM_OF_MODES = sizeof(MODES)/sizeof(MODES[0]), NUM_OF_PRIORITIES = sizeof(PRIORITIES)/sizeof(PRIORITIES[0]);
+    static const DirPriority PRIORITY_VALUES[] = {DIR_PRIORITY_ULTRA_HIGH, DIR_PRIORITY_HIGH, DIR_PRIORITY_NORMAL, DIR_PRIORITY_LOW, DIR_PRIORITY_ULTRA_LOW};
+
+    bool has_condition = false;
+    for (size_t i = 0; i < line.size(); ) {
+        // Read a token (double quotes group characters with spaces)
+        std::string token;
+        bool quoted = false;
+        for (; i < line.size() && (quoted || (line[i] != ' ' && line[i] != '\t')); i++)
+            if (line[i] == '"')
+                quoted = !quoted;
+            else
+                token += line[i];
+        for (; i < line.size() && (line[i] == ' ' || line[i] == '\t'); i++);
+        if (quoted) {
+            error = "unterminated quotes";
+            return false;
+        }
+        if (token.empty())
+            continue;
+
+        if (token == "skip") {
+            rule.skip = true;
+            continue;
+        }
+        if (token == "exclude" || token == "include") {
+            rule.mode = token == "exclude" ? DirMode::EXCLUDED : DirMode::NORMAL;
+            continue;
+        }
+
+        size_t op_pos = token.find_first_of("=<>");
+        if (op_pos == std::string::npos || op_pos == 0) {
+            error = "unknown action `" + token + '`';
+            return false;
+        }
+        std::string key = token.substr(0, op_pos), op = token.substr(op_pos, token[op_pos + 1] == '=' ? 2 : 1), value = token.substr(op_pos + op.size());
+        if (value.empty()) {
+            error = "no value of `" + key + '`';
+            return false;
+        }
+
+        if (key == "mode" || key == "priority" || key == "name" || key == "contains" || key == "path") {
+            if (op != "=") {
+                error = '`' + key + "` can be compared only by `=`";
+                return false;
+            }
+            if (key == "mode") {
+                int m = 0;
+                while (m < NUM_OF_MODES && value != MODES[m])
+                    m++;
+                if (m == NUM_OF_MODES) {
+                    error = "unknown mode `" + value + '`';
+                    return false;
+                }
+                rule.mode = DirMode(m);
+            }
+            else if (key == "priority") {
+                int p = 0;
+                while (p < NUM_OF_PRIORITIES && value != PRIORITIES[p])
+                    p++;
+                if (p == NUM_OF_PRIORITIES) {
+                    error = "unknown priority `" + value + '`';
+                    return false;
+                }
+                rule.priority = PRIORITY_VALUES[p];
+            }
+            else {
+                PathString v = from_utf8(value);
+                if (key == "name")
+                    rule.name_glob = fold(v);
+                else if (key == "contains")
+                    rule.substring = fold(v);
+                else {
+                    for (auto &&var : variables)
+                        for (size_t p; (p = v.find(var.first)) != PathString::npos; )
+                            v.replace(p, var.first.size(), var.second);
+                    rule.path = fold(v); // `<` is left if a variable is not defined
+                    while (rule.path.size() > 1 && rule.path.back() == PathChar('/'))
+                        rule.path.pop_back();
+                }
+                has_condition = true;
+            }
+            continue;
+        }
+
+        int64_t n, *min, *max;
+        if (key == "level" || key == "age") {
+            if (!parse_number(value, AGE_SUFFIXES, AGE_MULTIPLIERS, n) || (key == "level" && value.back() == 'd')) {
+                error = "bad value of `" + key + '`';
+                return false;
+            }
+            min = key == "level" ? &rule.level_min : &rule.age_min;
+            max = key == "level" ? &rule.level_max : &rule.age_max;
+        }
+        else if (key == "size") {
+            if (!parse_number(value, SIZE_SUFFIXES, SIZE_MULTIPLIERS, n)) {
+                error = "bad value of `size`";
+                return false;
+            }
+            min = &rule.size_min;
+            max = &rule.size_max;
+        }
+        else {
+            error = "unknown condition `" + key + '`';
+            return false;
+        }
+        if (op == "=" || op == ">=") *min = std::max(*min, n);
+        if (op == "=" || op == "<=") *max = std::min(*max, n);
+        if (op == ">")  *min = std::max(*min, n + 1);
+        if (op == "<")  *max = std::min(*max, n - 1);
+        has_condition = true;
+    }
+
+    if (!rule.skip && rule.mode == DirMode::AUTO && rule.priority == DIR_PRIORITY_AUTO) {
+        error = "no action";
+        return false;
+    }
+    if (rule.skip && (rule.mode != DirMode::AUTO || rule.priority != DIR_PRIORITY_AUTO)) {
+        error = "skipped directory can not have mode or priority";
+        return false;
+    }
+    if (rule.skip && rule.has_size_or_age()) {
+        error = "size and age are not known when directory is skipped";
+        return false;
+    }
+    if (!has_condition) { // most likely a mistake, which would apply the rule to every directory
+        error = "no conditions";
+        return false;
+    }
+    return true;
+}
+
+static bool parse_rules(const std::string &text, const std::vector<std::pair<PathString, PathString>> &variables, bool builtin, std::vector<DirRule> &skip_rules, std::vector<DirRule> &classify_rules, std::string &error)
+{
+    int line_number = 0;
+    for (size_t pos = 0; pos < text.size(); ) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string line = text.substr(pos, end - pos);
+        pos = end + 1;
+        line_number++;
+
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+
+        DirRule rule;
+        rule.line = builtin ? 0 : line_number;
+        if (!parse_rule(line, variables, rule, error)) {
+            error = "line " + std::to_string(line_number) + ": " + error;
+            return false;
+        }
+        if (rule.path.find(PathChar('<')) != PathString::npos) { // `<` is not allowed in file names
+            if (builtin) // e.g. there is no user profile in tests
+                continue;
+            error = "line " + std::to_string(line_number) + ": undefined variable in path";
+            return false;
+        }
+        (rule.skip ? skip_rules : classify_rules).push_back(rule);
+    }
+    return true;
+}
+
+DirRules::DirRules()
+{
+    std::string error;
+    bool r = parse(std::string(), error);
+    assert(r);
+}
+
+void DirRules::define(const PathString &variable, const PathString &value)
+{
+    variables.push_back(std::make_pair(variable, value));
+}
+
+bool DirRules::parse(const std::string &text, std::string &error)
+{
+    std::vector<DirRule> new_skip_rules, new_classify_rules;
+    if (!parse_rules(text, variables, false, new_skip_rules, new_classify_rules, error))
+        return false;
+    bool r = parse_rules(BUILTIN_RULES, variables, true, new_skip_rules, new_classify_rules, error);
+    assert(r);
+    skip_rules.compile(std::move(new_skip_rules));
+    classify_rules.compile(std::move(new_classify_rules));
+    return true;
+}
+
+bool DirRules::load(const PathString &file_name, std::string &error)
+{
+#ifdef _WIN32
+    FILE *f;
+    if (_wfopen_s(&f, file_name.c_str(), L"rb") != 0)
+        f = NULL;
+#else
+    FILE *f = fopen(file_name.c_str(), "rb");
+#endif
+    if (f == NULL)
+        return parse(std::string(), error);
+
+    std::string text;
+    char buffer[4096];
+    for (size_t n; (n = fread(buffer, 1, sizeof(buffer), f)) != 0; )
+        text.append(buffer, n);
+    fclose(f);
+
+    if (text.compare(0, 3, "\xEF\xBB\xBF") == 0) // UTF-8 BOM
+        text.erase(0, 3);
+    return parse(text, error);
+}
@@ -0,0 +1,74 @@
+﻿#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "dir_entry.h"
+
+// Rule which decides how a directory is treated by a scan. Rules are written one per line, e.g.:
+//   skip level=2 name=Windows
+//   exclude name=.git size>100MB
+//   mode=append_only priority=low level<=3 contains=photo
+// Action is `skip` (the directory is not scanned and not shown at all), `exclude`, `include` (same as `mode=normal`),
+// `mode=<excluded|normal|frozen|append_only>` and/or `priority=<ultra_high|high|normal|low|ultra_low>`.
+// Conditions (all of them must hold) are `name=<glob with * and ?>`, `contains=<substring of the name>`, `path=<full path>` (`<UserProfile>` is expanded)
+// and comparisons (`=`, `<`, `<=`, `>`, `>=`) of `level` (1 for roots), `size` (with KB/MB/GB/TB suffix) and `age` (days since the last write of any file in the subtree).
+// Values with spaces are put in double quotes. Names and paths are compared case insensitively for English letters, `\` and `/` are equivalent.
+struct DirRule
+{
+    bool skip = false;
+    DirMode mode = DirMode::AUTO; // AUTO means that the mode is not set by this rule
+    DirPriority priority = DIR_PRIORITY_AUTO;
+    PathString name_glob, substring, path; // case folded, empty means any
+    int64_t level_min = INT64_MIN, level_max = INT64_MAX;
+    int64_t size_min  = INT64_MIN, size_max  = INT64_MAX;
+    int64_t age_min   = INT64_MIN, age_max   = INT64_MAX;
+    int line = 0; // in the rules file (0 for built-in rules)
+
+    bool has_size_or_age() const {return size_min != INT64_MIN || size_max != INT64_MAX || age_min != INT64_MIN || age_max != INT64_MAX;}
+};
+
+// User rules followed by built-in ones (which replace the hard-coded exclusions and classification), compiled into a single matcher, so that
+// the cost of matching of an entry is O(length of its name) plus the number of rules which are triggered by it, however many rules there are.
+// The first matching rule wins.
+class DirRules
+{
+public:
+    DirRules(); // built-in rules only
+
+    void define(const PathString &variable, const PathString &value); // e.g. `<UserProfile>`, takes effect at the next `load()`/`parse()`
+    bool load(const PathString &file_name, std::string &error); // missing file means no user rules; on error current rules are kept
+    bool parse(const std::string &text, std::string &error); // text is in UTF-8
+
+    // Path of the directory is `parent_path` + '/' + `name` (just `name` for roots, when `parent_path_len` is 0)
+    bool skip(const PathChar *parent_path, size_t parent_path_len, const PathChar *name, int level) const {return skip_rules.match(parent_path, parent_path_len, name, level, -1, -1) != nullptr;}
+    const DirRule *classify(const PathChar *parent_path, size_t parent_path_len, const PathChar *name, int level, int64_t size, int64_t age) const // `age` is -1 if it is not known
+    {
+        return classify_rules.match(parent_path, parent_path_len, name, level, size, age);
+    }
+
+    size_t num_of_rules() const {return skip_rules.rules.size() + classify_rules.rules.size();}
+
+private:
+    // Rules are triggered by the key of their name condition (the longest literal part of the glob or the substring) found by an Aho-Corasick automaton,
+    // by their path found in a hash table, or they are checked for every entry if they have neither name nor path conditions.
+    struct RuleSet
+    {
+        std::vector<DirRule> rules;
+        std::vector<uint16_t> char_classes; // for every PathChar (characters which do not occur in keys are in class 0)
+        uint32_t num_of_char_classes;
+        std::vector<uint32_t> transitions; // of the automaton: [state * num_of_char_classes + char class]
+        std::vector<uint32_t> outputs_begin; // rules triggered in state `s` are `outputs[outputs_begin[s] .. outputs_begin[s+1]-1]`
+        std::vector<uint32_t> outputs;
+        std::unordered_multimap<uint32_t, uint32_t> path_index; // hash of path -> rule index
+        std::vector<uint32_t> generic_rules;
+
+        void compile(std::vector<DirRule> &&rules);
+        const DirRule *match(const PathChar *parent_path, size_t parent_path_len, const PathChar *name, int level, int64_t size, int64_t age) const;
+    };
+
+    std::vector<std::pair<PathString, PathString>> variables;
+    RuleSet skip_rules, classify_rules;
+};
+extern DirRules dir_rules;
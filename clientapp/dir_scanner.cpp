@@ -0,0 +1,437 @@
+﻿#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include "dir_scanner.h"
+#include "dir_enumerator.h"
+#include "dir_rules.h"
+
+uint64_t current_file_time()
+{
+#ifdef _WIN32
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    return (uint64_t(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return FILETIME_UNIX_EPOCH + uint64_t(ts.tv_sec) * 10000000 + ts.tv_nsec / 100;
+#endif
+}
+
+FileIdentitySet::FileIdentitySet()
+{
+    memset(shards, 0, sizeof(shards));
+}
+
+FileIdentitySet::~FileIdentitySet()
+{
+    for (auto &&shard : shards)
+        free(shard.slots);
+}
+
+bool FileIdentitySet::insert(uint64_t volume_id, uint64_t file_id)
+{
+    uint64_t h = file_id ^ (volume_id * 0x9E3779B97F4A7C15ULL); // splitmix64 finalizer
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    if (h == 0)
+        h = 1;
+    Shard &shard = shards[(h >> 32) % NUM_OF_SHARDS]; // high bits select the shard, low bits select the slot
+
+    spin_lock_acquire(shard.lock);
+    if ((shard.count + 1) * 2 > shard.capacity) { // keep load factor of the hash table below 1/2
+        uint32_t new_capacity = shard.capacity != 0 ? shard.capacity * 2 : 16;
+        uint64_t *new_slots = (uint64_t*)calloc(new_capacity, sizeof(uint64_t));
+        for (uint32_t i = 0; i < shard.capacity; i++)
+            if (shard.slots[i] != 0) {
+                uint32_t j = uint32_t(shard.slots[i]) & (new_capacity - 1);
+                while (new_slots[j] != 0)
+                    j = (j + 1) & (new_capacity - 1);
+                new_slots[j] = shard.slots[i];
+            }
+        free(shard.slots);
+        shard.slots = new_slots;
+        shard.capacity = new_capacity;
+    }
+
+    uint32_t i = uint32_t(h) & (shard.capacity - 1);
+    for (; shard.slots[i] != 0; i = (i + 1) & (shard.capacity - 1))
+        if (shard.slots[i] == h) {
+            spin_lock_release(shard.lock);
+            return false;
+        }
+    shard.slots[i] = h;
+    shard.count++;
+    spin_lock_release(shard.lock);
+    return true;
+}
+
+struct DirScanner::Frame
+{
+    DirEntry *de;
+    Frame *parent;
+    PathString dir_name;
+    int level;
+    uint64_t last_write_time; // of the directory itself before its enumeration (0 if it is not known yet)
+    bool first_scan = false; // totals of the directory start from its own files and grow as subtrees of its subdirectories are completed
+    std::atomic<int> pending; // 1 for enumeration of this directory itself plus 1 for each subdirectory which subtree is not scanned yet
+    std::atomic<bool> changed; // totals of the subtree may have changed, so they must be summed up again
+
+    Frame(DirEntry *de, Frame *parent, const PathString &dir_name, int level, uint64_t last_write_time = 0) : de(de), parent(parent), dir_name(dir_name), level(level), last_write_time(last_write_time), pending(1), changed(false) {}
+};
+
+DirScanner::DirScanner(volatile bool &stop, int num_of_threads) : stop(stop), num_of_threads(num_of_threads), dirs_scanned(0), dirs_unchanged(0), files_scanned(0), ancestor_writes(0), checkpoint_interval(0), checkpoint_requested(false)
+{
+}
+
+void DirScanner::scan(const std::vector<Root> &roots)
+{
+    cur_time = current_file_time();
+    next_checkpoint_time = (std::chrono::steady_clock::now() + checkpoint_interval).time_since_epoch().count();
+
+    // Group roots by device
+    devices.clear();
+    workers.clear();
+    std::vector<Device*> root_devices;
+    for (auto &&root : roots) {
+        StorageDevice sd = get_storage_device(root.path);
+        auto it = std::find_if(devices.begin(), devices.end(), [&sd](const std::unique_ptr<Device> &d) {return !sd.id.empty() && d->device.id == sd.id;});
+        if (it == devices.end()) {
+            devices.push_back(std::unique_ptr<Device>(new Device(sd)));
+            it = devices.end() - 1;
+        }
+        root_devices.push_back(it->get());
+    }
+    for (auto &&d : devices) {
+        d->first_worker = (int)workers.size();
+        d->num_of_workers = num_of_threads > 0 ? num_of_threads : d->device.scan_concurrency();
+        for (int i=0; i<d->num_of_workers; i++)
+            workers.push_back(std::unique_ptr<Worker>(new Worker(d.get())));
+    }
+    num_of_running_workers = (int)workers.size();
+    num_of_paused_workers = 0;
+
+    DirTree::ReadGuard guard; // frames keep entries until their subtrees are complete, so entries which the scan abandons are reused only after it
+    for (auto &&root : roots) // rescans sum up excluded totals of subdirectories, so changes of modes must reach them first
+        dir_tree.resolve_all_pending(*root.de);
+    for (size_t i=0; i<roots.size(); i++) {
+        Device *d = root_devices[i];
+        push(d->first_worker + int(i % d->num_of_workers), new Frame(roots[i].de, nullptr, roots[i].path, roots[i].level));
+    }
+
+    std::vector<std::thread> threads;
+    for (int i=1; i<(int)workers.size(); i++)
+        threads.push_back(std::thread(&DirScanner::worker_proc, this, i));
+    if (!workers.empty())
+        worker_proc(0);
+    for (auto &&t : threads)
+        t.join();
+}
+
+void DirScanner::push(int wi, Frame *f)
+{
+    Worker &w = *workers[wi];
+    w.device->num_of_pending_frames++;
+    std::lock_guard<std::mutex> lock(w.lock);
+    w.frames.push_back(f);
+}
+
+DirScanner::Frame *DirScanner::pop(int wi)
+{
+    {Worker &w = *workers[wi];
+    std::lock_guard<std::mutex> lock(w.lock);
+    if (!w.frames.empty()) {
+        Frame *f = w.frames.back();
+        w.frames.pop_back();
+        return f;
+    }}
+
+    const Device &d = *workers[wi]->device;
+    for (int i=1; i<d.num_of_workers; i++) {
+        Worker &victim = *workers[d.first_worker + (wi - d.first_worker + i) % d.num_of_workers];
+        std::lock_guard<std::mutex> lock(victim.lock);
+        if (!victim.frames.empty()) {
+            Frame *f = victim.frames.front();
+            victim.frames.pop_front();
+            return f;
+        }
+    }
+    return nullptr;
+}
+
+void DirScanner::worker_proc(int wi)
+{
+    Device &d = *workers[wi]->device;
+    int idle_iterations = 0;
+    for (;;) {
+        if (checkpoint_requested)
+            pause();
+        else if (checkpoint && !stop && std::chrono::steady_clock::now().time_since_epoch().count() >= next_checkpoint_time && !checkpoint_requested.exchange(true))
+            make_checkpoint();
+
+        Frame *f = pop(wi);
+        if (f == nullptr) {
+            if (d.num_of_pending_frames == 0) // nothing of this device is queued and nothing is being enumerated (so nothing can be queued anymore)
+                break;
+            if (++idle_iterations < 64)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        idle_iterations = 0;
+
+        if (!stop) // after stop frames are still popped in order to free them
+            enum_dir(wi, f);
+        complete(f);
+        d.num_of_pending_frames--; // must be after pushing of subdirectories
+    }
+
+    std::lock_guard<std::mutex> lock(checkpoint_lock);
+    num_of_running_workers--;
+    checkpoint_cv.notify_all();
+}
+
+void DirScanner::make_checkpoint()
+{
+    std::unique_lock<std::mutex> lock(checkpoint_lock);
+    checkpoint_cv.wait(lock, [this]{return num_of_paused_workers == num_of_running_workers - 1;}); // other workers finish their current directories
+    lock.unlock();
+
+    auto start = std::chrono::steady_clock::now();
+    checkpoint();
+    auto end = std::chrono::steady_clock::now();
+    next_checkpoint_time = (end + std::max(checkpoint_interval, (end - start) * 10)).time_since_epoch().count(); // scan is paused for at most 10% of the time
+
+    lock.lock();
+    checkpoint_requested = false;
+    checkpoint_cv.notify_all();
+}
+
+void DirScanner::pause()
+{
+    std::unique_lock<std::mutex> lock(checkpoint_lock);
+    num_of_paused_workers++;
+    checkpoint_cv.notify_all();
+    checkpoint_cv.wait(lock, [this]{return !checkpoint_requested;});
+    num_of_paused_workers--;
+}
+
+void DirScanner::enum_dir(int wi, Frame *f)
+{
+    DirEntry &de = *f->de;
+    bool rescan = de.scan_started; // directory is already in the tree (e.g. loaded from a snapshot), so its previous totals are shown until its subtree is rescanned
+    f->first_scan = !rescan;
+    de.scan_started = true;
+    de.not_traversed = false;
+    uint64_t scanned_last_write_time = de.dir_last_write_time;
+    de.dir_last_write_time = 0; // until the whole subtree is scanned (see `finalize()`), so if the scan is stopped or a checkpoint is made meanwhile, this directory is enumerated again by the next scan
+
+    if (f->last_write_time == 0)
+        f->last_write_time = get_dir_last_write_time(f->dir_name);
+    if (rescan && f->last_write_time == scanned_last_write_time && f->last_write_time != 0 && !de.dir_has_multiply_linked_files) {
+        // Entries of this directory were not added, removed or renamed since it was scanned, so it is not enumerated (but its subdirectories are checked separately)
+        dirs_unchanged++;
+        if (modified_file)
+            if (!enum_dir_entries(f->dir_name, [&](const DirEnumEntry &e) {
+                if (!e.is_dir && e.last_write_time >= modified_since)
+                    modified_file(f->dir_name, e);
+            }, &stop))
+                return;
+        DirEntry::SubDirs subdirs = de.subdirs();
+        f->pending += (int)subdirs.size();
+        for (size_t i = subdirs.size(); i-- > 0; )
+            push(wi, new Frame(&subdirs[i], f, f->dir_name / subdirs[i].name(), f->level + 1));
+        return;
+    }
+    f->changed = true;
+
+    std::vector<uint32_t> subdir_names;
+    std::vector<std::pair<uint32_t, uint64_t>> subdir_last_write_times; // last write times of subdirectories are obtained for free here
+    int64_t dir_files_size = 0;
+    int32_t dir_num_of_files = 0;
+    uint64_t max_last_write_time = 0;
+    bool has_multiply_linked_files = false;
+    if (!enum_dir_entries(f->dir_name, [&](const DirEnumEntry &e) {
+        if (e.is_dir) {
+            if (dir_rules.skip(f->dir_name.c_str(), f->dir_name.size(), e.name, f->level + 1))
+                return;
+            subdir_names.push_back(dir_tree.intern_name(e.name));
+            subdir_last_write_times.push_back(std::make_pair(subdir_names.back(), e.last_write_time));
+        }
+        else {
+            if (modified_file)
+                modified_file(f->dir_name, e);
+            if (e.last_write_time > max_last_write_time
+                    && int64_t(cur_time - e.last_write_time) >= 0) // ignore time in future
+                max_last_write_time = e.last_write_time;
+            if (e.num_of_links > 1) {
+                has_multiply_linked_files = true;
+                if (!file_identities.insert(e.volume_id, e.file_id)) // another link to this file is already counted
+                    return;
+            }
+            dir_files_size += e.size;
+            dir_num_of_files++;
+        }
+    }, &stop))
+        return;
+
+    dirs_scanned++;
+    files_scanned += dir_num_of_files;
+
+    de.dir_files_size = dir_files_size;
+    de.dir_num_of_files = dir_num_of_files;
+    de.dir_has_multiply_linked_files = has_multiply_linked_files;
+    de.max_last_write_time = max_last_write_time;
+    if (!rescan) {
+        de.size = dir_files_size;
+        de.num_of_files = dir_num_of_files;
+        de.size_excluded = 0;
+        de.num_of_files_excluded = 0;
+        dir_tree.totals_changed(de);
+    }
+
+    dir_tree.set_subdirs(de, subdir_names);
+
+    std::sort(subdir_last_write_times.begin(), subdir_last_write_times.end());
+    DirEntry::SubDirs subdirs = de.subdirs();
+    f->pending += (int)subdirs.size();
+    for (size_t i = subdirs.size(); i-- > 0; ) { // in reverse order, so that subdirectories are popped in alphabetical order
+        auto it = std::lower_bound(subdir_last_write_times.begin(), subdir_last_write_times.end(), std::make_pair(subdirs[i].name_offset, uint64_t(0)));
+        push(wi, new Frame(&subdirs[i], f, f->dir_name / subdirs[i].name(), f->level + 1, it != subdir_last_write_times.end() && it->first == subdirs[i].name_offset ? it->second : 0));
+    }
+}
+
+void DirScanner::complete(Frame *f)
+{
+    while (--f->pending == 0) { // the last one who completes the subtree finalizes it
+        if (!stop) // otherwise totals of the subtree are incomplete and `dir_last_write_time` is left 0, so the directory is enumerated and its totals are summed up at the next scan
+            finalize(f);
+        Frame *parent = f->parent;
+        delete f;
+        if (parent == nullptr)
+            break;
+        f = parent;
+    }
+}
+
+void DirScanner::finalize(Frame *f)
+{
+    DirEntry &de = *f->de;
+
+    // All subdirectories are finalized at this point, so their totals are final
+    if (f->changed) { // totals of unchanged subtrees are kept
+        for (auto &&sd : de.subdirs())
+            if (sd.max_last_write_time > de.max_last_write_time) // if this directory was not enumerated, its maximum can only grow here (deleted files are not taken into account until the directory is enumerated)
+                de.max_last_write_time = sd.max_last_write_time;
+        if (!f->first_scan) { // previous totals were shown during the rescan, so they are summed up again (totals of a directory scanned for the first time are already summed up in `publish()`)
+            int64_t size = de.dir_files_size, size_excluded = 0;
+            int32_t num_of_files = de.dir_num_of_files, num_of_files_excluded = 0;
+            for (auto &&sd : de.subdirs()) {
+                size += sd.size;
+                size_excluded += sd.size_excluded;
+                num_of_files += sd.num_of_files;
+                num_of_files_excluded += sd.num_of_files_excluded;
+            }
+            de.size = size;
+            de.num_of_files = num_of_files;
+            de.size_excluded = size_excluded;
+            de.num_of_files_excluded = num_of_files_excluded;
+            dir_tree.totals_changed(de);
+        }
+        if (f->parent != nullptr)
+            f->parent->changed = true;
+    }
+    de.dir_last_write_time = f->last_write_time; // only now, when the whole subtree is scanned
+
+    classify(f);
+    dir_tree.changed(de);
+    publish(f);
+}
+
+void DirScanner::publish(Frame *f)
+{
+    // Totals of the completed subtree are added to the parent only (not to all ancestors), so there is one write per directory whatever the depth of the tree.
+    // Siblings are completed concurrently by different workers, hence atomic additions.
+    if (f->parent == nullptr || !f->parent->first_scan)
+        return;
+    DirEntry &de = *f->de, &pde = *f->parent->de;
+    pde.size += de.size;
+    pde.num_of_files += de.num_of_files;
+    pde.size_excluded += de.size_excluded;
+    pde.num_of_files_excluded += de.num_of_files_excluded;
+    dir_tree.totals_changed(pde);
+    ancestor_writes++;
+}
+
+void DirScanner::classify(Frame *f)
+{
+    DirEntry &de = *f->de;
+    const PathString &dir_name = f->dir_name;
+    DirMode prev_mode = de.mode();
+    de.priority_auto = DIR_PRIORITY_NORMAL;
+
+    size_t last_slash_pos = dir_name.rfind(PathChar('/'));
+    size_t parent_path_len = last_slash_pos != dir_name.npos ? last_slash_pos : 0;
+    int64_t days_since_last_write = de.max_last_write_time != 0 ? int64_t(cur_time - de.max_last_write_time)/(10000000LL*3600*24) : -1;
+    const DirRule *rule = dir_rules.classify(dir_name.c_str(), parent_path_len, dir_name.c_str() + (parent_path_len != 0 ? parent_path_len + 1 : 0), f->level, de.size, days_since_last_write);
+
+    if (rule != nullptr && rule->mode == DirMode::EXCLUDED) {
+        de.exclude_auto(false, false);
+        return;
+    }
+
+    if (rule != nullptr && rule->mode != DirMode::AUTO) {
+        de.mode_auto = rule->mode;
+        de.priority_auto = rule->priority != DIR_PRIORITY_AUTO ? rule->priority : DIR_PRIORITY_NORMAL;
+        de.reset_auto_modes_of_descendants(true); // also recalculates `mode_mixed` of the subtree
+        return;
+    }
+
+    auto set_priority_to_normal = [](DirEntry &de) { // descendants with automatic priorities are among overrides of the subtree
+        std::vector<DirEntry*> overrides;
+        dir_tree.find_overrides(de, overrides);
+        for (auto &&sd : overrides)
+            if (sd->priority_auto != DIR_PRIORITY_NORMAL) {
+                sd->priority_auto = DIR_PRIORITY_NORMAL;
+                dir_tree.changed(*sd);
+            }
+    };
+    if (f->level > DIR_MODE_LEVELS_AUTO || de.max_last_write_time == 0) {
+        de.mode_auto = DirMode::INHERIT_FROM_PARENT;
+        //return; // no return to check if mode is mixed (e.g. if there is EXCLUDED .git subdirectory)
+    }
+    else if (days_since_last_write > 365/2) {
+        de.mode_auto = DirMode::FROZEN;
+        if (/*level == 1 && */de.size > 10*1024*1024) {
+            de.priority_auto = /*days_since_last_write < 365 ? */DIR_PRIORITY_LOW/* : DIR_PRIORITY_ULTRA_LOW*/; // there is very little data changed from six months to a year ago, and besides, it makes sense to reserve an ultra low priority for manual selection by the user
+            set_priority_to_normal(de);
+        }
+    }
+    else {
+        de.mode_auto = DirMode::NORMAL;
+        if (days_since_last_write <= 7 && de.size <= 1024*1024*1024) {
+            de.priority_auto = DIR_PRIORITY_HIGH;
+            set_priority_to_normal(de);
+        }
+    }
+
+    if (rule != nullptr) { // rule sets just priority
+        de.priority_auto = rule->priority;
+        set_priority_to_normal(de);
+    }
+
+    // Subdirectories are classified already, so they are counted once here (manual modes are taken into account because of rescan).
+    // If the mode has changed, subdirectories which inherit it are recounted too, which happens once per directory whose mode is set as a scan goes up the tree.
+    de.recount_mixed_subdirs(de.mode() != prev_mode);
+}
@@ -0,0 +1,137 @@
+﻿#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include "dir_entry.h"
+#include "storage_device.h"
+
+struct DirEnumEntry;
+
+const int DIR_MODE_LEVELS_AUTO = 3;
+
+uint64_t current_file_time(); // in FILETIME units
+
+// Identities of multiply-linked files met by a scan, so that every physical file is counted once (in the directory where it is met first).
+// Identities are hashed into 64 bits (collisions are negligible for any realistic number of hard links) and kept in sharded open addressing hash tables,
+// so the set takes at most 32 bytes per multiply-linked file and nothing for ordinary files.
+class FileIdentitySet
+{
+public:
+    FileIdentitySet();
+    ~FileIdentitySet();
+    bool insert(uint64_t volume_id, uint64_t file_id); // returns false if the file is already in the set
+
+private:
+    FileIdentitySet(const FileIdentitySet&);
+    void operator=(const FileIdentitySet&);
+
+    enum {NUM_OF_SHARDS = 64};
+    struct Shard
+    {
+        long lock;
+        uint64_t *slots; // 0 means empty slot
+        uint32_t capacity, count;
+    };
+    Shard shards[NUM_OF_SHARDS];
+};
+
+// Parallel directory tree scanner.
+// Roots are grouped by the storage device they lie on, and each device gets its own workers (see `StorageDevice::scan_concurrency()`): many for an SSD,
+// a single one for a rotational disk, so that its heads do not seek between walkers. Devices are scanned in parallel, so the time of a scan is
+// the time of the slowest device rather than the sum of times of all devices. Workers of a device never take directories of another one.
+// Each worker owns a deque of directories to enumerate: it pushes and pops subdirectories at the back (so the walk is depth-first and the frontier stays small),
+// and an idle worker steals from the front of deques of other workers of the same device (the oldest entries there are usually the roots of the largest remaining subtrees).
+// When the whole subtree of a directory is scanned, its auto mode/priority are determined and its totals are added to its parent (once, so the cost does not
+// depend on depth), thus totals of directories being scanned grow as their subtrees complete and can be read by the UI thread at any time.
+// Directories which are already scanned (e.g. loaded from a snapshot) are rescanned in place: their manual modes/priorities and
+// the data of their subdirectories which still exist are kept, and excluded totals have to be recalculated after the scan (see `DirEntry::recalc_excluded()`).
+// Such a rescan is incremental: a directory which last write time has not changed since it was scanned is not enumerated (just its subdirectories
+// are checked), and totals are summed up again only along the paths from changed directories to the roots.
+// A directory is marked as completely scanned (by its `dir_last_write_time`) only when its whole subtree is scanned, so the tree is a valid checkpoint
+// at any moment between enumerations: queued directories are those which scan is not started yet, and directories which subtrees are incomplete are enumerated
+// again by the next scan, which thus resumes from where the previous one stopped (see `set_checkpoint()`).
+class DirScanner
+{
+public:
+    struct Root
+    {
+        PathString path;
+        DirEntry *de;
+        int level; // 1 for root directories of the tree, or the level of a subdirectory which subtree is scanned separately
+
+        Root(const PathString &path, DirEntry *de, int level = 1) : path(path), de(de), level(level) {}
+    };
+
+    DirScanner(volatile bool &stop, int num_of_threads = 0); // per device, 0 means that it is chosen by the kind of the device
+    void scan(const std::vector<Root> &roots); // returns when all roots are scanned or `stop` is set
+
+    // `checkpoint` (e.g. saving of a snapshot) is called by the scan every `interval` (or less often if `checkpoint` itself is slow) while all workers are paused,
+    // so it can read the whole tree
+    void set_checkpoint(const std::function<void()> &checkpoint, std::chrono::seconds interval) {this->checkpoint = checkpoint; checkpoint_interval = interval;}
+
+    // `modified` is called by workers for every file which may have been modified since `since` (e.g. to find files which changes were missed): for every file
+    // of a directory which entries have been added, removed or renamed since it was scanned (a file may be moved in or extracted with an earlier last write time),
+    // and for files of other directories which last write time is `since` or later. A file may be modified in place without a change of the last write time
+    // of its directory, so unchanged directories are enumerated then too, but just for their files (the tree is updated as without it).
+    void set_modified_files(uint64_t since, const std::function<void(const PathString &dir_name, const DirEnumEntry&)> &modified) {modified_since = since; modified_file = modified;}
+
+    uint64_t num_of_dirs_scanned()  const {return dirs_scanned;}
+    uint64_t num_of_dirs_unchanged() const {return dirs_unchanged;} // not enumerated during rescan
+    uint64_t num_of_files_scanned() const {return files_scanned;}
+    uint64_t num_of_ancestor_writes() const {return ancestor_writes;} // additions of totals of completed subtrees to directories above them (see `publish()`)
+    int num_of_workers() const {return (int)workers.size();} // of the last scan, for all devices
+
+private:
+    struct Frame;
+    struct Device
+    {
+        StorageDevice device;
+        int first_worker, num_of_workers;
+        std::atomic<int64_t> num_of_pending_frames;
+
+        Device(const StorageDevice &device) : device(device), first_worker(0), num_of_workers(0), num_of_pending_frames(0) {}
+    };
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<Frame*> frames;
+        Device *device;
+
+        Worker(Device *device) : device(device) {}
+    };
+
+    volatile bool &stop;
+    int num_of_threads;
+    uint64_t cur_time;
+    std::vector<std::unique_ptr<Device>> devices;
+    std::vector<std::unique_ptr<Worker>> workers; // workers of each device are contiguous
+    std::atomic<uint64_t> dirs_scanned, dirs_unchanged, files_scanned, ancestor_writes;
+    FileIdentitySet file_identities;
+    uint64_t modified_since = 0;
+    std::function<void(const PathString&, const DirEnumEntry&)> modified_file;
+
+    std::function<void()> checkpoint;
+    std::chrono::steady_clock::duration checkpoint_interval;
+    std::atomic<std::chrono::steady_clock::rep> next_checkpoint_time;
+    std::mutex checkpoint_lock;
+    std::condition_variable checkpoint_cv;
+    std::atomic<bool> checkpoint_requested;
+    int num_of_running_workers, num_of_paused_workers; // guarded by `checkpoint_lock`
+
+    void worker_proc(int wi);
+    void make_checkpoint(); // called by the worker which has set `checkpoint_requested`
+    void pause();
+    void push(int wi, Frame *f);
+    Frame *pop(int wi);
+    void enum_dir(int wi, Frame *f);
+    void complete(Frame *f);
+    void finalize(Frame *f);
+    void publish(Frame *f);
+    void classify(Frame *f);
+};
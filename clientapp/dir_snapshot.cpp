@@ -0,0 +1,483 @@
+﻿#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <atomic>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "dir_entry.h"
+#include "dir_name_index.h"
+
+// Layout of a snapshot file (all parts are aligned to 64 bytes):
+//   SnapshotHeader
+//   indices of root entries [num_of_roots]
+//   entries [num_of_entries] at `entries_offset`: raw `DirEntry` objects, links between them are indices, so they are used in place
+//   counts [num_of_counts_blocks] at `counts_offset`: for a chunk of entries which has nonzero counts, counts of overrides [CHUNK_SIZE]
+//     and of mixed subdirectories [CHUNK_SIZE] laid out exactly as in `DirTree::overrides_chunks` and `DirTree::mixed_subdirs_chunks`, so they are used in place too
+//   name pool [names_size] at `names_offset`: `PathChar`s laid out exactly as in `DirTree::names_chunks`
+//   name index at `names_index_offset`: for each name shard its capacity, count and slots[capacity]
+//   checksums of entry chunks [number of chunks of `DirTree::CHUNK_SIZE` entries] (of entries of the chunk followed by its counts block, if any)
+//   numbers of counts blocks of entry chunks [number of chunks] (`NO_COUNTS` if all counts of the chunk are 0)
+// Entries and counts make up the bulk of the file, so they are excluded from the header checksum and their chunks are verified in parallel.
+// Snapshot is written alternately into two files (`file_name`.0 and `file_name`.1) and the valid one with the greater generation is loaded,
+// because a memory-mapped file can not be replaced on Windows.
+
+const char SNAPSHOT_MAGIC[8] = {'G', 'o', 'D', 'T', 'r', 'e', 'e', '\0'};
+const uint32_t SNAPSHOT_VERSION = 3; // must be incremented on every change of `DirEntry` layout or of the file layout
+const uint32_t NO_COUNTS = 0xFFFFFFFF;
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t path_char_size;
+    uint32_t checksum; // of everything after the header except of entries and counts
+    uint64_t generation;
+    uint64_t file_size;
+    uint64_t entries_offset, counts_offset, names_offset, names_index_offset;
+    uint32_t num_of_roots, num_of_entries, names_size, user_flags;
+    uint32_t num_of_counts_blocks, reserved;
+};
+
+// xxHash32 [https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md]: 4 independent lanes make checksumming of a snapshot run at memory bandwidth
+class SnapshotChecksum
+{
+    enum : uint32_t {PRIME1 = 2654435761U, PRIME2 = 2246822519U, PRIME3 = 3266489917U, PRIME4 = 668265263U, PRIME5 = 374761393U};
+    uint32_t lanes[4];
+    uint8_t stripe[16];
+    size_t stripe_size;
+    uint64_t total_size;
+
+    static uint32_t rotl(uint32_t x, int r) {return (x << r) | (x >> (32 - r));}
+    static uint32_t read32(const uint8_t *p) {uint32_t w; memcpy(&w, p, 4); return w;}
+    void process_stripe(const uint8_t *p)
+    {
+        for (int i = 0; i < 4; i++)
+            lanes[i] = rotl(lanes[i] + read32(p + i*4) * PRIME2, 13) * PRIME1;
+    }
+
+public:
+    SnapshotChecksum() : stripe_size(0), total_size(0)
+    {
+        lanes[0] = PRIME1 + PRIME2;
+        lanes[1] = PRIME2;
+        lanes[2] = 0;
+        lanes[3] = 0 - PRIME1;
+    }
+
+    void update(const void *data, size_t size)
+    {
+        const uint8_t *p = (const uint8_t*)data, *end = p + size;
+        total_size += size;
+        if (stripe_size != 0) {
+            size_t n = std::min(size_t(16) - stripe_size, size);
+            memcpy(stripe + stripe_size, p, n);
+            stripe_size += n;
+            p += n;
+            if (stripe_size < 16)
+                return;
+            process_stripe(stripe);
+            stripe_size = 0;
+        }
+        for (; end - p >= 16; p += 16)
+            process_stripe(p);
+        memcpy(stripe, p, end - p);
+        stripe_size = end - p;
+    }
+
+    uint32_t result() const
+    {
+        uint32_t h = total_size >= 16 ? rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18) : PRIME5;
+        h += uint32_t(total_size);
+        size_t i = 0;
+        for (; i + 4 <= stripe_size; i += 4)
+            h = rotl(h + read32(stripe + i) * PRIME3, 17) * PRIME4;
+        for (; i < stripe_size; i++)
+            h = rotl(h + stripe[i] * PRIME5, 11) * PRIME1;
+        h ^= h >> 15;
+        h *= PRIME2;
+        h ^= h >> 13;
+        h *= PRIME3;
+        h ^= h >> 16;
+        return h;
+    }
+};
+
+static uint64_t align64(uint64_t offset) {return (offset + 63) & ~uint64_t(63);}
+
+static FILE *open_file(const PathString &file_name, const PathChar *mode)
+{
+#ifdef _WIN32
+    FILE *f;
+    return _wfopen_s(&f, file_name.c_str(), mode) == 0 ? f : NULL;
+#else
+    return fopen(file_name.c_str(), mode);
+#endif
+}
+
+// Maps the whole file copy-on-write, so that the loaded tree can be modified without touching the file
+static void *map_file(const PathString &file_name, size_t &size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFile(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+    LARGE_INTEGER file_size;
+    void *view = nullptr;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 && uint64_t(file_size.QuadPart) <= SIZE_MAX) {
+        HANDLE mapping = CreateFileMapping(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if (mapping != NULL) {
+            view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            CloseHandle(mapping); // the view keeps the mapping alive
+        }
+        size = size_t(file_size.QuadPart);
+    }
+    CloseHandle(file);
+    return view;
+#else
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd == -1)
+        return nullptr;
+    struct stat st;
+    void *view = nullptr;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        view = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (view == MAP_FAILED)
+            view = nullptr;
+        size = st.st_size;
+    }
+    close(fd);
+    return view;
+#endif
+}
+
+static void unmap_file(void *view, size_t size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(view);
+#else
+    munmap(view, size);
+#endif
+}
+
+class SnapshotWriter
+{
+    FILE *f;
+    SnapshotChecksum checksum;
+    uint64_t offset;
+    bool failed;
+
+public:
+    SnapshotWriter(FILE *f) : f(f), offset(sizeof(SnapshotHeader)), failed(false)
+    {
+        SnapshotHeader h = {0}; // placeholder until everything else is written
+        failed = fwrite(&h, sizeof(h), 1, f) != 1;
+    }
+
+    void write(const void *data, size_t size, SnapshotChecksum *other_checksum = nullptr)
+    {
+        if (failed || size == 0)
+            return;
+        (other_checksum != nullptr ? other_checksum : &checksum)->update(data, size);
+        offset += size;
+        failed = fwrite(data, size, 1, f) != 1;
+    }
+    void align(SnapshotChecksum *other_checksum = nullptr)
+    {
+        static const char zeros[64] = {0};
+        write(zeros, size_t(align64(offset) - offset), other_checksum);
+    }
+
+    uint64_t get_offset() const {return offset;}
+    bool ok() const {return !failed;}
+
+    bool finish(SnapshotHeader &h)
+    {
+        h.checksum = checksum.result();
+        h.file_size = offset;
+        return !failed && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+    }
+};
+
+static PathString slot_file_name(const PathString &file_name, int slot)
+{
+    return file_name + (slot == 0 ? PATH_LITERAL(".0") : PATH_LITERAL(".1"));
+}
+
+bool DirTree::save_snapshot(const PathString &file_name, const std::vector<DirEntry*> &roots, uint32_t user_flags)
+{
+    for (auto &&root : roots) // pending marks are not saved, so excluded totals of all entries are made exact
+        resolve_all_pending(*root);
+
+    int slot = 1 - (mapped_snapshot != nullptr ? mapped_snapshot_slot : snapshot_slot); // the mapped snapshot (or else the last saved one) is kept as a fallback in case this write fails
+    PathString slot_name = slot_file_name(file_name, slot);
+    FILE *f = open_file(slot_name, PATH_LITERAL("wb"));
+    if (f == NULL)
+        return false;
+
+    SnapshotHeader h = {{0}};
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.version = SNAPSHOT_VERSION;
+    h.entry_size = sizeof(DirEntry);
+    h.path_char_size = sizeof(PathChar);
+    h.generation = snapshot_generation + 1;
+    h.num_of_roots = uint32_t(roots.size());
+    h.user_flags = user_flags;
+
+    SnapshotWriter w(f);
+    for (uint32_t i = 0; i < h.num_of_roots; i++) // roots come first in the saved tree
+        w.write(&i, sizeof(i));
+    w.align();
+
+    // Entries are written in breadth-first order, which drops abandoned entries and keeps subdirectories of every entry contiguous
+    h.entries_offset = w.get_offset();
+    std::vector<uint32_t> order, new_parent_index;
+    order.reserve(num_of_entries());
+    new_parent_index.reserve(num_of_entries());
+    for (auto &&root : roots) {
+        order.push_back(root->index);
+        new_parent_index.push_back(DIR_ENTRY_NONE);
+    }
+    const size_t BUFFER_SIZE = 4096; // must divide CHUNK_SIZE
+    std::unique_ptr<DirEntry[]> buffer(new DirEntry[BUFFER_SIZE]);
+    SnapshotChecksum chunk_checksum;
+    std::vector<uint32_t> chunk_checksums, counts_blocks_of_chunks, counts(2 * CHUNK_SIZE); // counts of the current chunk of entries
+    std::vector<uint32_t> counts_blocks; // written after entries
+    bool nonzero_counts = false;
+    for (size_t i = 0; i < order.size() && w.ok(); i++) {
+        const DirEntry &de = (*this)[order[i]];
+        DirEntry &e = buffer[i % BUFFER_SIZE];
+        memcpy((void*)&e, &de, sizeof(DirEntry));
+        e.index = uint32_t(i);
+        e.parent_index = new_parent_index[i];
+        DirEntry::SubDirs subdirs = de.subdirs();
+        e.subdirs_range.store(subdirs.empty() ? 0 : order.size() | (uint64_t(subdirs.size()) << 32), std::memory_order_relaxed);
+        for (auto &&sd : subdirs) {
+            order.push_back(sd.index);
+            new_parent_index.push_back(uint32_t(i));
+        }
+        uint32_t &overrides_count = counts[i % CHUNK_SIZE], &mixed_subdirs_count = counts[CHUNK_SIZE + i % CHUNK_SIZE];
+        overrides_count = overrides_value(de.index) & ~uint32_t(OVERRIDE_PENDING);
+        mixed_subdirs_count = num_of_mixed_subdirs(de.index);
+        nonzero_counts |= overrides_count != 0 || mixed_subdirs_count != 0;
+        if (i % BUFFER_SIZE == BUFFER_SIZE - 1 || i == order.size() - 1)
+            w.write(&buffer[0], (i % BUFFER_SIZE + 1) * sizeof(DirEntry), &chunk_checksum);
+        if (i % CHUNK_SIZE == CHUNK_SIZE - 1 || i == order.size() - 1) {
+            if (nonzero_counts) {
+                chunk_checksum.update(counts.data(), counts.size() * sizeof(uint32_t));
+                counts_blocks_of_chunks.push_back(uint32_t(counts_blocks.size() / counts.size()));
+                counts_blocks.insert(counts_blocks.end(), counts.begin(), counts.end());
+            }
+            else
+                counts_blocks_of_chunks.push_back(NO_COUNTS);
+            chunk_checksums.push_back(chunk_checksum.result());
+            chunk_checksum = SnapshotChecksum();
+            std::fill(counts.begin(), counts.end(), 0);
+            nonzero_counts = false;
+        }
+    }
+    h.num_of_entries = uint32_t(order.size());
+    SnapshotChecksum unused_checksum; // entries and counts are covered by checksums of chunks
+    w.align(&unused_checksum);
+
+    h.counts_offset = w.get_offset();
+    h.num_of_counts_blocks = uint32_t(counts_blocks.size() / counts.size());
+    w.write(counts_blocks.data(), counts_blocks.size() * sizeof(uint32_t), &unused_checksum);
+    w.align(&unused_checksum);
+
+    h.names_offset = w.get_offset();
+    h.names_size = names_size;
+    for (uint32_t c = 0; c * uint32_t(NAMES_CHUNK_SIZE) < names_size; c++)
+        w.write(names_chunks[c].load(std::memory_order_relaxed), std::min(uint32_t(NAMES_CHUNK_SIZE), names_size - c * uint32_t(NAMES_CHUNK_SIZE)) * sizeof(PathChar));
+    w.align();
+
+    h.names_index_offset = w.get_offset();
+    for (auto &&shard : name_shards) {
+        w.write(&shard.capacity, sizeof(shard.capacity));
+        w.write(&shard.count, sizeof(shard.count));
+        w.write(shard.slots, shard.capacity * sizeof(uint32_t));
+    }
+    w.write(chunk_checksums.data(), chunk_checksums.size() * sizeof(uint32_t));
+    w.write(counts_blocks_of_chunks.data(), counts_blocks_of_chunks.size() * sizeof(uint32_t));
+
+    bool ok = w.finish(h);
+    ok = fclose(f) == 0 && ok;
+    if (ok) {
+        snapshot_generation = h.generation;
+        snapshot_slot = slot;
+    }
+    return ok;
+}
+
+// Checks everything which is needed to use the snapshot in place safely
+static bool validate_snapshot(const char *view, size_t size)
+{
+    if (size < sizeof(SnapshotHeader))
+        return false;
+    const SnapshotHeader &h = *(const SnapshotHeader*)view;
+    if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0
+     || h.version != SNAPSHOT_VERSION
+     || h.entry_size != sizeof(DirEntry)
+     || h.path_char_size != sizeof(PathChar)
+     || h.file_size != size
+     || h.entries_offset != align64(sizeof(SnapshotHeader) + uint64_t(h.num_of_roots) * sizeof(uint32_t))
+     || h.counts_offset != align64(h.entries_offset + uint64_t(h.num_of_entries) * sizeof(DirEntry))
+     || h.names_offset != align64(h.counts_offset + uint64_t(h.num_of_counts_blocks) * 2 * DirTree::CHUNK_SIZE * sizeof(uint32_t))
+     || h.names_index_offset != align64(h.names_offset + uint64_t(h.names_size) * sizeof(PathChar))
+     || h.names_index_offset > size
+     || h.num_of_roots > h.num_of_entries)
+        return false;
+
+    uint64_t offset = h.names_index_offset;
+    for (int i = 0; i < DirTree::NUM_OF_NAME_SHARDS; i++) {
+        if (offset + 2 * sizeof(uint32_t) > size)
+            return false;
+        uint32_t capacity = *(const uint32_t*)(view + offset);
+        if ((capacity & (capacity - 1)) != 0) // must be a power of 2
+            return false;
+        offset += (2 + uint64_t(capacity)) * sizeof(uint32_t);
+    }
+    uint32_t num_of_chunks = (h.num_of_entries + DirTree::CHUNK_SIZE - 1) / DirTree::CHUNK_SIZE;
+    if (offset + 2 * uint64_t(num_of_chunks) * sizeof(uint32_t) != size)
+        return false;
+
+    SnapshotChecksum checksum;
+    checksum.update(view + sizeof(SnapshotHeader), size_t(h.entries_offset - sizeof(SnapshotHeader)));
+    checksum.update(view + h.names_offset, size_t(size - h.names_offset));
+    if (checksum.result() != h.checksum)
+        return false;
+
+    const char *entries = view + h.entries_offset;
+    const uint32_t *chunk_checksums = (const uint32_t*)(view + offset), *counts_blocks_of_chunks = chunk_checksums + num_of_chunks;
+    for (uint32_t c = 0; c < num_of_chunks; c++)
+        if (counts_blocks_of_chunks[c] != NO_COUNTS && counts_blocks_of_chunks[c] >= h.num_of_counts_blocks)
+            return false;
+    std::atomic<uint32_t> next_chunk(0);
+    std::atomic<bool> mismatch(false);
+    auto verify_chunks = [&]() {
+        for (uint32_t c; (c = next_chunk++) < num_of_chunks && !mismatch; ) {
+            SnapshotChecksum chunk_checksum;
+            chunk_checksum.update(entries + size_t(c) * DirTree::CHUNK_SIZE * sizeof(DirEntry), std::min(uint32_t(DirTree::CHUNK_SIZE), h.num_of_entries - c * uint32_t(DirTree::CHUNK_SIZE)) * sizeof(DirEntry));
+            if (counts_blocks_of_chunks[c] != NO_COUNTS)
+                chunk_checksum.update(view + h.counts_offset + size_t(counts_blocks_of_chunks[c]) * 2 * DirTree::CHUNK_SIZE * sizeof(uint32_t), 2 * DirTree::CHUNK_SIZE * sizeof(uint32_t));
+            if (chunk_checksum.result() != chunk_checksums[c])
+                mismatch = true;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < std::min(num_of_chunks, std::thread::hardware_concurrency()); i++)
+        threads.push_back(std::thread(verify_chunks));
+    verify_chunks();
+    for (auto &&t : threads)
+        t.join();
+    return !mismatch;
+}
+
+bool DirTree::load_snapshot(const PathString &file_name, std::vector<DirEntry*> &roots, uint32_t *user_flags)
+{
+    assert(num_of_entries() == 0 && mapped_snapshot == nullptr);
+
+    // Try snapshots starting from the newest one
+    uint64_t generations[2] = {0, 0};
+    for (int slot = 0; slot < 2; slot++)
+        if (FILE *f = open_file(slot_file_name(file_name, slot), PATH_LITERAL("rb"))) {
+            SnapshotHeader h;
+            if (fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) == 0)
+                generations[slot] = h.generation;
+            fclose(f);
+        }
+    snapshot_generation = std::max(generations[0], generations[1]); // a new snapshot must be newer than any existing one even if they are invalid
+
+    int slots[2] = {0, 1};
+    if (generations[1] > generations[0])
+        std::swap(slots[0], slots[1]);
+    for (int slot : slots) {
+        if (generations[slot] == 0)
+            continue;
+        size_t size = 0;
+        char *view = (char*)map_file(slot_file_name(file_name, slot), size);
+        if (view == nullptr)
+            continue;
+        if (!validate_snapshot(view, size)) {
+            unmap_file(view, size);
+            continue;
+        }
+        const SnapshotHeader &h = *(const SnapshotHeader*)view;
+
+        // Full chunks are used in place and the last partial chunks are copied, because new entries and names are appended to them
+        DirEntry *entries = (DirEntry*)(view + h.entries_offset);
+        for (uint32_t c = 0; c * uint32_t(CHUNK_SIZE) < h.num_of_entries; c++)
+            if (h.num_of_entries - c * uint32_t(CHUNK_SIZE) >= uint32_t(CHUNK_SIZE))
+                chunks[c].store(entries + c * CHUNK_SIZE, std::memory_order_relaxed);
+            else {
+                DirEntry *chunk = new DirEntry[CHUNK_SIZE];
+                memcpy((void*)chunk, entries + c * CHUNK_SIZE, (h.num_of_entries - c * uint32_t(CHUNK_SIZE)) * sizeof(DirEntry));
+                chunks[c].store(chunk, std::memory_order_relaxed);
+            }
+        num_of_allocated_entries = h.num_of_entries;
+
+        // Counts are used in place, including those of the last chunk (its blocks are full)
+        uint32_t num_of_chunks = (h.num_of_entries + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        const uint32_t *counts_blocks_of_chunks = (const uint32_t*)(view + size) - num_of_chunks;
+        for (uint32_t c = 0; c < num_of_chunks; c++)
+            if (counts_blocks_of_chunks[c] != NO_COUNTS) {
+                uint32_t *counts = (uint32_t*)(view + h.counts_offset) + size_t(counts_blocks_of_chunks[c]) * 2 * CHUNK_SIZE;
+                overrides_chunks[c].store((std::atomic<uint32_t>*)counts, std::memory_order_relaxed);
+                mixed_subdirs_chunks[c].store(counts + CHUNK_SIZE, std::memory_order_relaxed);
+            }
+
+        PathChar *names = (PathChar*)(view + h.names_offset);
+        for (uint32_t c = 0; c * uint32_t(NAMES_CHUNK_SIZE) < h.names_size; c++)
+            if (h.names_size - c * uint32_t(NAMES_CHUNK_SIZE) >= uint32_t(NAMES_CHUNK_SIZE))
+                names_chunks[c].store(names + c * NAMES_CHUNK_SIZE, std::memory_order_relaxed);
+            else {
+                PathChar *chunk = new PathChar[NAMES_CHUNK_SIZE];
+                memcpy(chunk, names + c * NAMES_CHUNK_SIZE, (h.names_size - c * uint32_t(NAMES_CHUNK_SIZE)) * sizeof(PathChar));
+                names_chunks[c].store(chunk, std::memory_order_relaxed);
+            }
+        names_size = h.names_size;
+
+        const uint32_t *index = (const uint32_t*)(view + h.names_index_offset);
+        for (auto &&shard : name_shards) {
+            shard.capacity = *index++;
+            shard.count = *index++;
+            shard.slots = (uint32_t*)calloc(std::max(shard.capacity, 1U), sizeof(uint32_t)); // the index is rehashed on growth, so it is copied
+            memcpy(shard.slots, index, shard.capacity * sizeof(uint32_t));
+            index += shard.capacity;
+        }
+
+        mapped_snapshot = view;
+        mapped_snapshot_size = size;
+        mapped_snapshot_slot = snapshot_slot = slot;
+
+        roots.clear();
+        const uint32_t *root_indices = (const uint32_t*)(view + sizeof(SnapshotHeader));
+        for (uint32_t i = 0; i < h.num_of_roots; i++)
+            roots.push_back(&(*this)[root_indices[i]]);
+        if (user_flags != nullptr)
+            *user_flags = h.user_flags;
+        dir_name_index.start_rebuild(); // in the background, so loading is not O(entries)
+        return true;
+    }
+    return false;
+}
+
+void DirTree::unmap_snapshot()
+{
+    if (mapped_snapshot != nullptr) {
+        unmap_file(mapped_snapshot, mapped_snapshot_size);
+        mapped_snapshot = nullptr;
+        mapped_snapshot_size = 0;
+    }
+}
@@ -0,0 +1,437 @@
+﻿#include <assert.h>
+#include <algorithm>
+#include "dir_tree_view.h"
+
+const uint32_t DirTreeView::NO_POSITION;
+
+uint32_t DirTreeView::Node::find(uint32_t &row) const
+{
+    uint32_t size = uint32_t(order.size());
+    uint32_t pos = 0;
+    uint32_t step = 1;
+    while (step * 2 <= size)
+        step *= 2;
+    for (; step != 0; step /= 2)
+        if (pos + step <= size && fenwick[pos + step] <= row) {
+            pos += step;
+            row -= fenwick[pos];
+        }
+    assert(pos < size);
+    return pos;
+}
+
+uint32_t DirTreeView::Node::rows_before(uint32_t pos) const
+{
+    uint32_t r = 0;
+    for (uint32_t i = pos; i != 0; i -= i & (0 - i))
+        r += fenwick[i];
+    return r;
+}
+
+void DirTreeView::Node::add(uint32_t pos, int64_t delta)
+{
+    for (uint32_t i = pos + 1; i <= order.size(); i += i & (0 - i))
+        fenwick[i] = uint32_t(fenwick[i] + delta);
+    num_of_rows = uint32_t(num_of_rows + delta);
+}
+
+uint32_t DirTreeView::rows_of(const DirEntry &de) const
+{
+    auto it = nodes.find(de.index);
+    return it != nodes.end() ? 1 + it->second.num_of_rows : 1;
+}
+
+void DirTreeView::set_positions(Node &n)
+{
+    uint32_t size = uint32_t(n.order.size());
+    n.position.assign(n.count, NO_POSITION);
+    n.fenwick.assign(size + 1, 0);
+    n.num_of_rows = 0;
+    for (uint32_t pos = 0; pos < size; pos++) {
+        n.position[n.order[pos]] = pos;
+        uint32_t rows = rows_of(dir_tree[n.first + n.order[pos]]);
+        n.num_of_rows += rows;
+        n.fenwick[pos + 1] += rows; // linear construction of the Fenwick tree
+        uint32_t parent = (pos + 1) + ((pos + 1) & (0 - (pos + 1)));
+        if (parent <= size)
+            n.fenwick[parent] += n.fenwick[pos + 1];
+    }
+}
+
+void DirTreeView::sort(uint32_t index, Node &n)
+{
+    dir_tree.resolve_pending(dir_tree[index]); // totals of subdirectories are read
+    n.version = dir_tree.subdirs_version(index); // before keys are read, so that changes made meanwhile are picked up by the next `update()`
+    n.order.clear();
+    for (uint32_t i = 0; i < n.count; i++)
+        if (shown(dir_tree[n.first + i]))
+            n.order.push_back(i);
+    if (key != nullptr) {
+        // Keys are copied, because totals change during a scan and `std::sort` requires a consistent order
+        n.keys.resize(n.count);
+        for (uint32_t i = 0; i < n.count; i++)
+            n.keys[i] = key(dir_tree[n.first + i]);
+        std::sort(n.order.begin(), n.order.end(), [this, &n](uint32_t a, uint32_t b) {return before(n, a, b);});
+    }
+    else
+        n.keys.clear();
+    set_positions(n);
+}
+
+bool DirTreeView::refresh(uint32_t index, Node &n)
+{
+    n.version = dir_tree.subdirs_version(index);
+    uint32_t num_of_changed = 0, changed = 0;
+    for (uint32_t i = 0; i < n.count; i++) {
+        int64_t k = key(dir_tree[n.first + i]);
+        if (k != n.keys[i]) {
+            n.keys[i] = k;
+            num_of_changed++;
+            changed = i;
+        }
+    }
+    if (num_of_changed == 0)
+        return false;
+
+    if (num_of_changed == 1) { // move the changed subdirectory to its new place
+        uint32_t pos = n.position[changed];
+        if (pos == NO_POSITION) // hidden by the filter
+            return false;
+        n.order.erase(n.order.begin() + pos);
+        n.order.insert(std::lower_bound(n.order.begin(), n.order.end(), changed, [this, &n](uint32_t a, uint32_t b) {return before(n, a, b);}), changed);
+        if (n.order[pos] == changed)
+            return false;
+        set_positions(n);
+        return true;
+    }
+
+    for (uint32_t pos = 1; pos < n.order.size(); pos++)
+        if (before(n, n.order[pos], n.order[pos - 1])) {
+            std::sort(n.order.begin(), n.order.end(), [this, &n](uint32_t a, uint32_t b) {return before(n, a, b);});
+            set_positions(n);
+            return true;
+        }
+    return false;
+}
+
+uint32_t DirTreeView::build(DirEntry &de)
+{
+    DirEntry::SubDirs subdirs = de.subdirs();
+    for (auto &&sd : subdirs)
+        if (has_node(sd))
+            build(sd);
+
+    Node &n = nodes[de.index];
+    n.first = subdirs.empty() ? 0 : subdirs[0].index;
+    n.count = uint32_t(subdirs.size());
+    sort(de.index, n);
+    return n.num_of_rows;
+}
+
+void DirTreeView::erase(uint32_t index)
+{
+    auto it = nodes.find(index);
+    if (it == nodes.end())
+        return;
+    uint32_t first = it->second.first, count = it->second.count;
+    nodes.erase(it);
+    for (uint32_t i = 0; i < count; i++) {
+        erase(first + i);
+        if (filter) { // subdirectories may have been abandoned, so their indices may be reused
+            filter_shown.erase(first + i);
+            filter_expanded.erase(first + i);
+        }
+    }
+}
+
+void DirTreeView::add_rows(DirEntry &de, int64_t delta)
+{
+    for (DirEntry *d = &de, *p = d->parent(); p != nullptr; d = p, p = p->parent()) {
+        auto it = nodes.find(p->index);
+        if (it == nodes.end())
+            return;
+        Node &n = it->second;
+        if (d->index - n.first >= n.count) // `d` was replaced by a scan and its parent is not updated yet (see `update()`)
+            return;
+        uint32_t pos = n.position[d->index - n.first];
+        if (pos == NO_POSITION) // hidden by the filter
+            return;
+        n.add(pos, delta);
+    }
+}
+
+void DirTreeView::reset(const std::vector<DirEntry*> &roots)
+{
+    this->roots = roots;
+    rebuild();
+}
+
+void DirTreeView::rebuild()
+{
+    nodes.clear();
+    rows_version++;
+    up_to_date = false;
+    for (auto &&root : roots)
+        if (has_node(*root))
+            build(*root);
+}
+
+void DirTreeView::set_filter(bool filtered)
+{
+    filter = filtered;
+    filter_shown.clear();
+    filter_expanded.clear();
+    rebuild();
+}
+
+void DirTreeView::add_filter_matches(const std::vector<DirEntry*> &matches)
+{
+    assert(filter);
+
+    // Directories which get new shown subdirectories: new nodes of ancestors of new matches, and the nodes where their paths join the shown tree
+    std::vector<std::pair<int, uint32_t>> changed; // by depth
+    std::unordered_set<uint32_t> changed_set;
+    for (auto &&m : matches) {
+        if (!filter_shown.insert(m->index).second)
+            continue;
+        for (DirEntry *p = m->parent(); p != nullptr; p = p->parent()) {
+            bool new_node = filter_expanded.insert(p->index).second;
+            if (changed_set.insert(p->index).second)
+                changed.push_back(std::make_pair(0, p->index));
+            if (!new_node || !filter_shown.insert(p->index).second)
+                break;
+        }
+    }
+    if (changed.empty())
+        return;
+    rows_version++;
+
+    // Nodes are rebuilt from the deepest ones, so that rows of subdirectories are known, and rows are added to ancestors for the nodes which were shown before
+    for (auto &&c : changed)
+        for (DirEntry *p = dir_tree[c.second].parent(); p != nullptr; p = p->parent())
+            c.first++;
+    std::sort(changed.begin(), changed.end(), [](const std::pair<int, uint32_t> &a, const std::pair<int, uint32_t> &b) {return a.first > b.first;});
+    for (auto &&c : changed) {
+        DirEntry &de = dir_tree[c.second];
+        uint32_t old_rows = rows_of(de);
+        DirEntry::SubDirs subdirs = de.subdirs();
+        auto it = nodes.find(de.index);
+        if (it == nodes.end()) {
+            Node &n = nodes[de.index];
+            n.first = subdirs.empty() ? 0 : subdirs[0].index;
+            n.count = uint32_t(subdirs.size());
+            sort(de.index, n);
+        }
+        else
+            sort(de.index, it->second);
+        DirEntry *p = de.parent();
+        if (p != nullptr && changed_set.count(p->index) == 0)
+            add_rows(de, int64_t(rows_of(de)) - int64_t(old_rows));
+    }
+}
+
+void DirTreeView::set_order(Key key)
+{
+    this->key = key;
+    rows_version++;
+    // Counts of rows collected from subdirectories do not depend on their order, so nodes are sorted in any order
+    for (auto &&n : nodes)
+        sort(n.first, n.second);
+}
+
+void DirTreeView::update()
+{
+    uint32_t version = dir_tree.version(); // before anything is read from the tree
+    if (up_to_date && version == tree_version)
+        return;
+    tree_version = version;
+    up_to_date = true;
+    uint64_t epoch = dir_tree.epoch(); // entries abandoned before it are forgotten below
+
+    for (auto &&kv : nodes) // subdirectories of expanded directories are shown, so changes of modes are carried to them (see `DirTree::is_pending()`)
+        dir_tree.resolve_pending(dir_tree[kv.first]);
+
+    std::vector<uint32_t> changed;
+    for (auto &&kv : nodes) {
+        DirEntry::SubDirs subdirs = dir_tree[kv.first].subdirs();
+        if (subdirs.size() != kv.second.count || (!subdirs.empty() && subdirs[0].index != kv.second.first))
+            changed.push_back(kv.first);
+    }
+
+    for (auto &&index : changed) {
+        auto it = nodes.find(index);
+        if (it == nodes.end()) // was erased with its changed ancestor
+            continue;
+        DirEntry &de = dir_tree[index];
+        if (DirEntry *p = de.parent()) {
+            DirEntry::SubDirs siblings = p->subdirs();
+            if (siblings.empty() || de.index - siblings[0].index >= siblings.size()) // abandoned entry (its parent got a new range of subdirectories, which is picked up with the parent)
+                continue;
+        }
+        uint32_t old_rows = it->second.num_of_rows;
+        erase(index);
+        uint32_t new_rows = build(de);
+        add_rows(de, int64_t(new_rows) - int64_t(old_rows));
+        rows_version++;
+    }
+
+    if (key != nullptr)
+        for (auto &&kv : nodes)
+            if (kv.second.version != dir_tree.subdirs_version(kv.first) && refresh(kv.first, kv.second))
+                rows_version++;
+    guard.repin(epoch);
+}
+
+void DirTreeView::set_expanded(DirEntry &de, bool expanded)
+{
+    if (de.expanded == expanded || filter)
+        return;
+    de.expanded = expanded;
+    rows_version++;
+    if (expanded)
+        add_rows(de, build(de));
+    else {
+        auto it = nodes.find(de.index);
+        if (it == nodes.end())
+            return;
+        int64_t rows = it->second.num_of_rows;
+        erase(de.index);
+        add_rows(de, -rows);
+    }
+}
+
+size_t DirTreeView::num_of_rows() const
+{
+    size_t r = 0;
+    for (auto &&root : roots)
+        r += rows_of_root(*root);
+    return r;
+}
+
+bool DirTreeView::row(size_t index, Row &r) const
+{
+    std::vector<Row> rows;
+    get_rows(index, 1, rows);
+    if (rows.empty())
+        return false;
+    r = rows[0];
+    return true;
+}
+
+bool DirTreeView::find_row(const DirEntry &de, size_t &index) const
+{
+    if (!shown(de))
+        return false;
+    index = 0;
+    const DirEntry *d = &de;
+    for (const DirEntry *p = d->parent(); p != nullptr; d = p, p = p->parent()) {
+        auto it = nodes.find(p->index);
+        if (it == nodes.end())
+            return false;
+        const Node &n = it->second;
+        if (d->index - n.first >= n.count || n.position[d->index - n.first] == NO_POSITION)
+            return false;
+        index += 1 + n.rows_before(n.position[d->index - n.first]); // `p` itself and rows before `d`
+    }
+    for (auto &&root : roots) {
+        if (root == d)
+            return true;
+        index += rows_of_root(*root);
+    }
+    return false;
+}
+
+void DirTreeView::get_rows(size_t first, size_t count, std::vector<Row> &rows) const
+{
+    rows.clear();
+    if (count == 0)
+        return;
+
+    size_t root_index = 0;
+    for (; root_index < roots.size(); root_index++) {
+        uint32_t r = rows_of_root(*roots[root_index]);
+        if (first < r)
+            break;
+        first -= r;
+    }
+    if (root_index == roots.size())
+        return;
+
+    // Descend to the first row remembering the path
+    struct Frame
+    {
+        const Node *node;
+        uint32_t pos;
+    };
+    std::vector<Frame> path;
+    DirEntry *de = roots[root_index];
+    uint32_t row = uint32_t(first);
+    while (row != 0) {
+        const Node &n = nodes.find(de->index)->second;
+        row--; // `de` itself
+        Frame f = {&n, n.find(row)};
+        path.push_back(f);
+        de = &dir_tree[n.first + n.order[f.pos]];
+    }
+
+    // Iterate in depth-first order
+    for (;;) {
+        Row r = {de, int(path.size())};
+        rows.push_back(r);
+        if (rows.size() == count)
+            return;
+
+        auto it = nodes.find(de->index);
+        if (it != nodes.end() && !it->second.order.empty()) {
+            Frame f = {&it->second, 0};
+            path.push_back(f);
+        }
+        else {
+            while (!path.empty() && ++path.back().pos == path.back().node->order.size())
+                path.pop_back();
+            if (path.empty()) {
+                do
+                    if (++root_index == roots.size())
+                        return;
+                while (!shown(*roots[root_index]));
+                de = roots[root_index];
+                continue;
+            }
+        }
+        de = &dir_tree[path.back().node->first + path.back().node->order[path.back().pos]];
+    }
+}
+
+void DirTreeViewChanges::get_rows(const DirTreeView &view, size_t first, size_t count, std::vector<DirTreeView::Row> &rows)
+{
+    painted = true;
+    view_version = view.version();
+    tree_version = dir_tree.version(); // before versions of entries are read
+    this->first = first;
+    view.get_rows(first, count, rows);
+    indices.resize(rows.size());
+    versions.resize(rows.size());
+    for (size_t i = 0; i < rows.size(); i++) {
+        indices[i] = rows[i].de->index;
+        versions[i] = dir_tree.entry_version(indices[i]);
+    }
+}
+
+bool DirTreeViewChanges::find_changed_rows(const DirTreeView &view, std::vector<size_t> &changed_rows)
+{
+    changed_rows.clear();
+    if (!painted)
+        return true;
+    if (view.version() != view_version)
+        return false;
+
+    uint32_t version = dir_tree.version();
+    if (version == tree_version)
+        return true;
+    for (size_t i = 0; i < indices.size(); i++)
+        if (dir_tree.entry_version(indices[i]) != versions[i])
+            changed_rows.push_back(first + i);
+    if (changed_rows.empty()) // changed rows are reported until they are painted
+        tree_version = version;
+    return true;
+}
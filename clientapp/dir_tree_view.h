@@ -0,0 +1,105 @@
+﻿#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include "dir_entry.h"
+
+// Flattened view of the tree: its rows are the roots and subdirectories of expanded directories in depth-first order.
+// Every expanded directory keeps the display order of its subdirectories and a Fenwick tree of the numbers of rows they take (1 plus the rows of
+// an expanded subdirectory), so a row is found by its index in O(depth * log(number of subdirectories)), following rows are iterated in O(1) each,
+// and expanding or collapsing a directory updates counts along the path to its root only. Thus painting costs O(visible rows) however many rows there are.
+// Subdirectories are ordered by name or by a key (e.g. size) which changes during a scan. Keys are cached with the order and are read again only
+// when the version of the directory changes (see `DirTree::subdirs_version()`), and if one subdirectory has moved, it is just reinserted.
+// Pending changes of modes are pushed down to subdirectories of expanded directories before their totals are read (see `DirTree::resolve_pending()`).
+// In the filtered mode the view shows given directories (e.g. found by `DirNameIndex`) with their ancestors, which are expanded regardless of their
+// `expanded` flags, and other directories are hidden. Directories are added to the filter incrementally, so results are shown as they are found.
+// The view keeps entries and their indices between updates, so it pins the epoch of its last update (see `DirTree::ReadGuard`): entries which a scan
+// abandons are not reused until the view has picked up the change and forgotten them.
+// The view does not depend on the UI, it is used by the backup tab under `backup_treeview_cs`.
+class DirTreeView
+{
+public:
+    typedef int64_t (*Key)(const DirEntry &de);
+    struct Row
+    {
+        DirEntry *de;
+        int level; // 0 for roots
+    };
+
+    void reset(const std::vector<DirEntry*> &roots); // rebuilds the view from `expanded` flags of entries (e.g. after the tree was loaded or cleared)
+    void set_order(Key key); // subdirectories by descending key and then by name, nullptr means by name only
+    void update(); // picks up subdirectories added or removed by a scan and changed keys, costs O(1) if the tree has not changed (see `DirTree::version()`);
+                   // entries got from rows before it may have been abandoned (see `DirTree::is_alive()`)
+    void set_expanded(DirEntry &de, bool expanded); // `de` must be a row of the view, does nothing in the filtered mode
+    void set_filter(bool filtered); // enters the filtered mode with no directories shown, or leaves it
+    void add_filter_matches(const std::vector<DirEntry*> &matches); // shows `matches` with their ancestors in the filtered mode
+    bool filtered() const {return filter;}
+    bool is_expanded(const DirEntry &de) const {return nodes.find(de.index) != nodes.end();} // as it is shown (see the filtered mode)
+
+    size_t num_of_rows() const;
+    bool row(size_t index, Row &r) const;
+    bool find_row(const DirEntry &de, size_t &index) const; // returns false if `de` is not a row of the view
+    void get_rows(size_t first, size_t count, std::vector<Row> &rows) const; // rows [first, first + count) which exist
+    size_t num_of_expanded_dirs() const {return nodes.size();}
+    uint32_t version() const {return rows_version;} // changes whenever rows of the view or their order change
+
+private:
+    struct Node // expanded directory
+    {
+        uint32_t first, count; // range of subdirectories for which the node was built
+        uint32_t num_of_rows; // taken by all subdirectories
+        uint32_t version; // of the directory when `keys` were read
+        std::vector<int64_t> keys; // of subdirectories (by offset from `first`), empty if they are ordered by name
+        std::vector<uint32_t> order; // offsets of shown subdirectories (from `first`) in the display order
+        std::vector<uint32_t> position; // of each subdirectory in `order`, `NO_POSITION` for hidden ones
+        std::vector<uint32_t> fenwick; // [1..order.size()] over rows taken by subdirectories in the display order
+
+        uint32_t find(uint32_t &row) const; // returns the position of the subdirectory which takes `row`, and `row` becomes the index of the row within it
+        uint32_t rows_before(uint32_t pos) const; // taken by subdirectories at positions [0, pos)
+        void add(uint32_t pos, int64_t delta);
+    };
+
+    static const uint32_t NO_POSITION = UINT32_MAX;
+
+    std::vector<DirEntry*> roots;
+    std::unordered_map<uint32_t, Node> nodes; // by entry index
+    bool filter = false;
+    std::unordered_set<uint32_t> filter_shown; // indices of matches and their ancestors in the filtered mode
+    std::unordered_set<uint32_t> filter_expanded; // indices of ancestors of matches
+    Key key = nullptr;
+    uint32_t rows_version = 0;
+    uint32_t tree_version; // at the last `update()`
+    bool up_to_date = false; // nothing has changed in the tree since `tree_version`, except of what the view has already picked up
+    DirTree::ReadGuard guard;
+
+    bool shown(const DirEntry &de) const {return !filter || filter_shown.count(de.index) != 0;}
+    bool has_node(const DirEntry &de) const {return filter ? filter_expanded.count(de.index) != 0 : de.expanded;}
+    uint32_t rows_of(const DirEntry &de) const; // of `de` itself plus its expanded subtree
+    uint32_t rows_of_root(const DirEntry &root) const {return shown(root) ? rows_of(root) : 0;}
+    void rebuild();
+    uint32_t build(DirEntry &de); // builds nodes of `de` and of its expanded subdirectories, returns rows taken by subdirectories of `de`
+    bool before(const Node &n, uint32_t a, uint32_t b) const {return n.keys[a] > n.keys[b] || (n.keys[a] == n.keys[b] && a < b);} // in the display order
+    void sort(uint32_t index, Node &n); // reads keys and sorts subdirectories of `dir_tree[index]`
+    bool refresh(uint32_t index, Node &n); // reads keys and restores the order if necessary, returns true if the order has changed
+    void set_positions(Node &n); // after `order` has changed
+    void erase(uint32_t index); // node with its descendants (and its subdirectories are forgotten by the filter)
+    void add_rows(DirEntry &de, int64_t delta); // to ancestors of `de`
+};
+
+// Rows painted last time together with versions of their entries, so that a window repaints only the rows whose entries have changed since.
+// Checking it (e.g. by a timer) costs O(1) while nothing changes in the tree, and O(painted rows) after a change anywhere in the tree.
+// It does not depend on the UI either.
+class DirTreeViewChanges
+{
+public:
+    void get_rows(const DirTreeView &view, size_t first, size_t count, std::vector<DirTreeView::Row> &rows); // rows which are going to be painted
+    bool find_changed_rows(const DirTreeView &view, std::vector<size_t> &changed_rows); // returns false if rows of the view have changed (so all of them must be repainted),
+                                                                                         // otherwise indices of painted rows whose entries have changed (`view.update()` must be called before)
+private:
+    bool painted = false;
+    uint32_t view_version, tree_version;
+    size_t first;
+    std::vector<uint32_t> indices, versions; // of painted entries
+};
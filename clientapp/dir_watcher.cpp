@@ -0,0 +1,403 @@
+﻿#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#endif
+#include <stddef.h>
+#include <string.h>
+#include "dir_enumerator.h"
+#include "dir_watcher.h"
+
+const size_t NOTIFY_BUFFER_SIZE = 256*1024;
+const size_t NETWORK_NOTIFY_BUFFER_SIZE = 64*1024; // `ReadDirectoryChangesW` fails with larger buffers on network shares
+const size_t DirWatcher::LOST;
+
+void DirWatcher::delivered(int tree)
+{
+    if (size_t(tree) >= tree_notified.size())
+        tree_notified.resize(tree + 1);
+    if (!tree_notified[tree]) {
+        tree_notified[tree] = true;
+        notified_trees.push_back(tree);
+    }
+}
+
+void DirWatcher::notify_idle()
+{
+    for (auto &&tree : notified_trees) {
+        tree_notified[tree] = false;
+        handler(tree, nullptr, 0);
+    }
+    notified_trees.clear();
+}
+
+void DirWatcher::notify_lost(int tree)
+{
+    handler(tree, nullptr, LOST);
+    delivered(tree); // the handler is called when the queue is empty, as after records
+}
+
+#ifdef _WIN32
+
+struct DirWatcher::Tree
+{
+    int index;
+    HANDLE handle;
+    OVERLAPPED overlapped;
+    bool reading = false;
+    void *buffer;
+    DWORD buffer_size;
+};
+
+DirWatcher::DirWatcher(const Handler &handler) : handler(handler)
+{
+    port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    thread = std::thread(&DirWatcher::thread_proc, this);
+}
+
+DirWatcher::~DirWatcher()
+{
+    PostQueuedCompletionStatus(port, 0, 0, NULL); // completion key 0 stops the thread
+    thread.join();
+    for (auto &&t : trees) {
+        CloseHandle(t->handle);
+        VirtualFree(t->buffer, 0, MEM_RELEASE);
+    }
+    CloseHandle(port);
+}
+
+int DirWatcher::add_tree(const PathString &dir_name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int index = num_of_trees++;
+    HANDLE handle = CreateFile((dir_name.back() == L':' ? dir_name + L'\\' : dir_name).c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED|FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (handle != INVALID_HANDLE_VALUE) {
+        std::unique_ptr<Tree> t(new Tree);
+        t->index = index;
+        t->handle = handle;
+        t->buffer_size = DWORD(dir_name.compare(0, 2, L"\\\\") == 0 || GetDriveType((dir_name.substr(0, 2) + L'\\').c_str()) == DRIVE_REMOTE ? NETWORK_NOTIFY_BUFFER_SIZE : NOTIFY_BUFFER_SIZE);
+        t->buffer = VirtualAlloc(NULL, t->buffer_size, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+        CreateIoCompletionPort(handle, port, ULONG_PTR(t.get()), 0);
+        PostQueuedCompletionStatus(port, 0, ULONG_PTR(t.get()), NULL); // a packet without OVERLAPPED asks the thread to start reading
+        trees.push_back(std::move(t));
+    }
+    return index;
+}
+
+bool DirWatcher::start_read(Tree &t)
+{
+    memset(&t.overlapped, 0, sizeof(t.overlapped));
+    t.reading = ReadDirectoryChangesW(t.handle, t.buffer, t.buffer_size, TRUE, FILE_NOTIFY_CHANGE_FILE_NAME|FILE_NOTIFY_CHANGE_DIR_NAME|FILE_NOTIFY_CHANGE_LAST_WRITE, NULL, &t.overlapped, NULL) != FALSE;
+    return t.reading;
+}
+
+void DirWatcher::thread_proc()
+{
+    int num_of_reads = 0; // which are not completed yet
+    for (;;) {
+        DWORD size;
+        ULONG_PTR key;
+        OVERLAPPED *overlapped;
+        BOOL ok = GetQueuedCompletionStatus(port, &size, &key, &overlapped, notified_trees.empty() ? INFINITE : 0);
+        if (!ok && overlapped == NULL) { // the queue is empty
+            notify_idle();
+            continue;
+        }
+        if (key == 0)
+            break;
+        Tree &t = *(Tree*)key;
+        if (overlapped != NULL) {
+            num_of_reads--;
+            t.reading = false;
+            if (!ok && GetLastError() != ERROR_NOTIFY_ENUM_DIR) // e.g. the root has been deleted, so the tree is not watched anymore
+                continue;
+            if (ok && size != 0) {
+                handler(t.index, (const char*)t.buffer, size);
+                delivered(t.index);
+            }
+            else // notifications did not fit into the buffer before it was read, so they have been discarded
+                notify_lost(t.index);
+        }
+        if (start_read(t))
+            num_of_reads++;
+    }
+
+    // Reads are cancelled (by the thread which has issued them) and their completions are awaited, so buffers are not written after they are freed
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto &&t : trees)
+            if (t->reading)
+                CancelIo(t->handle);
+    }
+    while (num_of_reads > 0) {
+        DWORD size;
+        ULONG_PTR key;
+        OVERLAPPED *overlapped;
+        GetQueuedCompletionStatus(port, &size, &key, &overlapped, INFINITE);
+        if (overlapped != NULL)
+            num_of_reads--;
+    }
+}
+
+#else
+
+DirWatcher::DirWatcher(const Handler &handler) : handler(handler)
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    for (int fd : {inotify_fd, event_fd}) {
+        epoll_event e = {};
+        e.events = EPOLLIN;
+        e.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &e);
+    }
+    buffer.resize(NOTIFY_BUFFER_SIZE);
+    thread = std::thread(&DirWatcher::thread_proc, this);
+}
+
+DirWatcher::~DirWatcher()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0) {}
+    thread.join();
+    close(epoll_fd);
+    close(event_fd);
+    close(inotify_fd);
+}
+
+int DirWatcher::add_tree(const PathString &dir_name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int index = num_of_trees++;
+    new_trees.push_back(std::make_pair(index, dir_name));
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0) {}
+    return index;
+}
+
+void DirWatcher::deliver()
+{
+    if (records.empty())
+        return;
+    handler(records_tree, records.data(), records.size());
+    delivered(records_tree);
+    records.clear();
+}
+
+void DirWatcher::notify(int tree, uint32_t action, const PathString &dir_name, const char *name)
+{
+    if (tree != records_tree) {
+        deliver();
+        records_tree = tree;
+    }
+    if (!records.empty()) {
+        NotifyRecord<char> *last = (NotifyRecord<char>*)(records.data() + last_record);
+        last->next_entry_offset = uint32_t(records.size() - last_record);
+    }
+    last_record = records.size();
+    size_t name_length = dir_name.size() + (name != nullptr ? (dir_name.empty() ? 0 : 1) + strlen(name) : 0);
+    records.resize(last_record + ((offsetof(NotifyRecord<char>, name) + name_length + 3) & ~size_t(3)));
+    NotifyRecord<char> *r = (NotifyRecord<char>*)(records.data() + last_record);
+    r->next_entry_offset = 0;
+    r->action = action;
+    r->name_length = uint32_t(name_length);
+    char *p = r->name;
+    memcpy(p, dir_name.data(), dir_name.size());
+    p += dir_name.size();
+    if (name != nullptr) {
+        if (!dir_name.empty())
+            *p++ = '/';
+        memcpy(p, name, strlen(name));
+    }
+}
+
+void DirWatcher::watch_dir(int tree, const PathString &name, bool report_entries)
+{
+    PathString path = name.empty() ? root_names[tree] : root_names[tree] / name;
+    int wd = inotify_add_watch(inotify_fd, path.c_str(), IN_CREATE|IN_DELETE|IN_MODIFY|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR|IN_DONT_FOLLOW|IN_EXCL_UNLINK);
+    if (wd < 0)
+        return;
+    Dir &d = dirs[wd];
+    d.tree = tree;
+    d.name = name;
+
+    std::vector<PathString> subdirs;
+    enum_dir_entries(path, [&](const DirEnumEntry &e) {
+        if (report_entries)
+            notify(tree, NOTIFY_ADDED, name, e.name);
+        if (e.is_dir)
+            subdirs.push_back(name.empty() ? PathString(e.name) : name / e.name);
+    });
+    for (auto &&sd : subdirs)
+        watch_dir(tree, sd, report_entries);
+}
+
+static bool is_within(const PathString &name, const PathString &dir_name) // `name` is `dir_name` or lies within it
+{
+    return name.compare(0, dir_name.size(), dir_name) == 0 && (name.size() == dir_name.size() || name[dir_name.size()] == '/');
+}
+
+void DirWatcher::unwatch_dir(int tree, const PathString &name)
+{
+    for (auto it = dirs.begin(); it != dirs.end();)
+        if (it->second.tree == tree && is_within(it->second.name, name)) {
+            inotify_rm_watch(inotify_fd, it->first);
+            it = dirs.erase(it);
+        }
+        else
+            ++it;
+}
+
+void DirWatcher::move_dir(int from_tree, const PathString &from_name, int to_tree, const PathString &to_name)
+{
+    // Watches follow directories, so just their names are changed
+    for (auto &&d : dirs)
+        if (d.second.tree == from_tree && is_within(d.second.name, from_name)) {
+            d.second.tree = to_tree;
+            d.second.name = to_name + d.second.name.substr(from_name.size());
+        }
+}
+
+void DirWatcher::flush_pending_move()
+{
+    if (!pending_move.pending)
+        return;
+    pending_move.pending = false;
+    notify(pending_move.from.tree, NOTIFY_REMOVED, pending_move.from.name); // moved out of all trees
+    if (pending_move.is_dir)
+        unwatch_dir(pending_move.from.tree, pending_move.from.name);
+}
+
+// The queue of events of the inotify instance has overflowed, so events of all trees have been lost: directories which have appeared meanwhile
+// are watched now (a directory which is already watched keeps its watch, and gets its current name if its move has been lost), and every tree is reported
+void DirWatcher::overflowed()
+{
+    deliver();
+    for (int tree = 0; tree < int(root_names.size()); tree++)
+        if (!root_names[tree].empty()) {
+            watch_dir(tree, PathString(), false);
+            notify_lost(tree);
+        }
+}
+
+void DirWatcher::read_events()
+{
+    for (;;) {
+        ssize_t size = read(inotify_fd, buffer.data(), buffer.size());
+        if (size <= 0)
+            break;
+        for (const char *p = buffer.data(), *end = p + size; p < end;) {
+            const inotify_event *ie = (const inotify_event*)p;
+            p += sizeof(inotify_event) + ie->len;
+            if (pending_move.pending && !((ie->mask & IN_MOVED_TO) && ie->cookie == pending_move.cookie))
+                flush_pending_move();
+
+            if (ie->mask & IN_Q_OVERFLOW) {
+                overflowed();
+                continue;
+            }
+            auto it = dirs.find(ie->wd);
+            if (it == dirs.end())
+                continue;
+            if (ie->mask & IN_IGNORED) {
+                dirs.erase(it);
+                continue;
+            }
+            if (ie->len == 0) // an event of the watched directory itself, its parent reports it
+                continue;
+            int tree = it->second.tree;
+            const PathString &dir_name = it->second.name;
+            bool is_dir = (ie->mask & IN_ISDIR) != 0;
+
+            if (ie->mask & IN_CREATE) {
+                notify(tree, NOTIFY_ADDED, dir_name, ie->name);
+                if (is_dir)
+                    watch_dir(tree, dir_name.empty() ? PathString(ie->name) : dir_name / ie->name, true);
+            }
+            else if (ie->mask & IN_DELETE)
+                notify(tree, NOTIFY_REMOVED, dir_name, ie->name);
+            else if (ie->mask & IN_MODIFY)
+                notify(tree, NOTIFY_MODIFIED, dir_name, ie->name);
+            else if (ie->mask & IN_MOVED_FROM) {
+                pending_move.pending = true;
+                pending_move.cookie = ie->cookie;
+                pending_move.wd = ie->wd;
+                pending_move.from.tree = tree;
+                pending_move.from.name = dir_name.empty() ? PathString(ie->name) : dir_name / ie->name;
+                pending_move.is_dir = is_dir;
+            }
+            else if (ie->mask & IN_MOVED_TO) {
+                if (pending_move.pending) {
+                    pending_move.pending = false;
+                    if (pending_move.wd == ie->wd) {
+                        notify(tree, NOTIFY_RENAMED_OLD_NAME, pending_move.from.name);
+                        notify(tree, NOTIFY_RENAMED_NEW_NAME, dir_name, ie->name);
+                    }
+                    else {
+                        notify(pending_move.from.tree, NOTIFY_REMOVED, pending_move.from.name);
+                        notify(tree, NOTIFY_ADDED, dir_name, ie->name);
+                    }
+                    if (is_dir)
+                        move_dir(pending_move.from.tree, pending_move.from.name, tree, dir_name.empty() ? PathString(ie->name) : dir_name / ie->name);
+                }
+                else { // moved in from outside of the trees
+                    notify(tree, NOTIFY_ADDED, dir_name, ie->name);
+                    if (is_dir)
+                        watch_dir(tree, dir_name.empty() ? PathString(ie->name) : dir_name / ie->name, true);
+                }
+            }
+        }
+    }
+    deliver();
+}
+
+void DirWatcher::thread_proc()
+{
+    for (;;) {
+        epoll_event events[2];
+        int n = epoll_wait(epoll_fd, events, 2, notified_trees.empty() && !pending_move.pending ? -1 : 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (n == 0) { // the queue is empty
+            flush_pending_move();
+            deliver();
+            notify_idle();
+            continue;
+        }
+        for (int i = 0; i < n; i++)
+            if (events[i].data.fd == event_fd) {
+                uint64_t count;
+                if (read(event_fd, &count, sizeof(count)) < 0) {}
+                std::vector<std::pair<int, PathString>> trees;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (stop)
+                        return;
+                    trees.swap(new_trees);
+                }
+                for (auto &&t : trees) {
+                    if (size_t(t.first) >= root_names.size())
+                        root_names.resize(t.first + 1);
+                    root_names[t.first] = t.second;
+                    watch_dir(t.first, PathString(), false);
+                }
+            }
+            else
+                read_events();
+    }
+}
+
+#endif
@@ -0,0 +1,91 @@
+﻿#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "path_string.h"
+#include "dir_notify_decoder.h"
+
+// Watches any number of directory trees with a single thread, which sleeps until there are notifications.
+// Windows: every tree has an overlapped recursive `ReadDirectoryChangesW` on the handle of its root, and all handles are associated with one I/O completion port
+// which the thread waits on (reads are issued by the thread itself, as Windows XP cancels I/O of a thread when it exits).
+// Linux: inotify is not recursive, so every directory of a tree gets a watch of its own (directories which appear later get them when they are created or moved in,
+// and entries which were created in them before are reported as added), and the thread waits on the inotify descriptor and on an eventfd for requests by epoll.
+// A move within a tree is reported as a removal and an addition (or as a rename if it is within a directory), as on Windows.
+// Notifications are delivered as buffers of records of the layout of `FILE_NOTIFY_INFORMATION` on both systems (see `NotifyRecord`), which are read on Windows
+// into page-aligned buffers (a buffer of a tree is allocated once and reused by every read, 256 KB for local volumes, 64 KB for network shares).
+class DirWatcher
+{
+public:
+    // Called on the watcher thread with records of notifications of a tree in the order they occurred (valid until it returns), and with null `records`
+    // when there are no more notifications queued at the moment (e.g. so that a removal which has not been followed by an addition of the same name
+    // is known not to be a half of a move), or with null `records` and `size` of `LOST` when notifications of the tree have been lost since the previous call
+    // (the system has overflowed its buffer of them), so the tree has to be reconciled with the file system
+    typedef std::function<void(int tree, const char *records, size_t size)> Handler;
+    static const size_t LOST = ~size_t(0);
+
+    DirWatcher(const Handler &handler);
+    ~DirWatcher(); // the handler is not called after it returns
+
+    int add_tree(const PathString &dir_name); // returns the number of the tree (trees are numbered from 0 in the order they are added)
+
+private:
+    DirWatcher(const DirWatcher&);
+    void operator=(const DirWatcher&);
+
+    Handler handler;
+    std::mutex lock; // guards what is shared with `add_tree()`
+    int num_of_trees = 0;
+    std::vector<int> notified_trees; // since the queue was empty last time
+    std::vector<bool> tree_notified; // by tree
+    std::thread thread;
+
+    void thread_proc();
+    void delivered(int tree);
+    void notify_idle();
+    void notify_lost(int tree);
+#ifdef _WIN32
+    struct Tree;
+    std::vector<std::unique_ptr<Tree>> trees;
+    void *port; // I/O completion port
+
+    bool start_read(Tree &t);
+#else
+    int inotify_fd = -1, epoll_fd = -1, event_fd = -1;
+    bool stop = false;
+    std::vector<std::pair<int, PathString>> new_trees; // added, but not watched by the thread yet
+    std::vector<PathString> root_names; // of trees which are watched by the thread
+    struct Dir
+    {
+        int tree;
+        PathString name; // relative to the root of the tree
+    };
+    std::unordered_map<int, Dir> dirs; // by watch descriptor
+    struct PendingMove // `IN_MOVED_FROM` which may be followed by `IN_MOVED_TO` with the same cookie
+    {
+        bool pending = false;
+        uint32_t cookie;
+        int wd;
+        Dir from;
+        bool is_dir;
+    } pending_move;
+    std::vector<char> buffer; // for events
+    std::vector<char> records; // of `records_tree`, which have not been delivered yet
+    int records_tree = -1;
+    size_t last_record; // offset
+
+    void watch_dir(int tree, const PathString &name, bool report_entries);
+    void unwatch_dir(int tree, const PathString &name); // with its subdirectories
+    void move_dir(int from_tree, const PathString &from_name, int to_tree, const PathString &to_name);
+    void notify(int tree, uint32_t action, const PathString &dir_name, const char *name = nullptr); // of `dir_name/name` (or of `dir_name`)
+    void deliver();
+    void flush_pending_move();
+    void overflowed();
+    void read_events();
+#endif
+};
@@ -146,6 +146,15 @@ LRESULT CALLBACK main_wnd_proc(HWND hwnd, UINT message, WPARAM wparam, LPARAM lp
             PostMessage(hwnd, WM_SIZE, 0, 0);
             break;
 
+        case IDB_FILTER:
+            static_cast<TabBackup*>(current_tab.get())->toggle_filter();
+            break;
+
+        case IDC_FILTER:
+            if (HIWORD(wparam) == EN_CHANGE)
+                static_cast<TabBackup*>(current_tab.get())->filter_changed();
+            break;
+
         case IDB_CANCEL_SCAN:
             TabBackup::cancel_scan = true; // must be before `stop_scan = true` because `cancel_scan` is checked after `stop_scan` inside `initial_scan()`
             TabBackup::stop_scan = true;
@@ -293,8 +302,12 @@ LRESULT CALLBACK treeview_wnd_proc(HWND hwnd, UINT message, WPARAM wparam, LPARA
         return 0;
 
     case WM_MOUSEMOVE:
+        current_tab->treeview_mousemove();
+        break;
+
     case WM_TIMER:
-        InvalidateRect(hwnd, NULL, FALSE);
+        if (IsWindowVisible(main_wnd) && !IsIconic(main_wnd)) // nothing is painted while the window is hidden in the tray, it is repainted when shown
+            current_tab->treeview_timer();
         break;
 
     case WM_LBUTTONDOWN:
@@ -450,6 +463,11 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
         if (i != 2)
             create_menu_item_bitmaps_from_icon((HICON)LoadImage(hInstance, MAKEINTRESOURCE(IDI_UP_DOUBLE_ARROW_GREEN + (i < 2 ? i : i - 1)), IMAGE_ICON, ICO_RES_SIZE, ICO_RES_SIZE, 0), menu_item_selection_icon, &priority_bitmaps[i], &priority_bitmaps_selected[i]);
 
+    void load_dir_rules();
+    load_dir_rules();
+    void load_dir_tree_snapshot();
+    load_dir_tree_snapshot();
+
     if (wcsstr(GetCommandLine(), L" --show-window"))
         ShowWindow(main_wnd, SW_NORMAL);
 
@@ -477,11 +495,19 @@ int APIENTRY _tWinMain(HINSTANCE hInstance,
     if (scan_thread != NULL)
         WaitForSingleObject(scan_thread, INFINITE);
     extern bool stop_apply_directory_changes_thread;
-    extern HANDLE apply_directory_changes_thread;
+    extern volatile bool stop_reconcile;
+    extern HANDLE apply_directory_changes_thread, apply_directory_changes_event;
     stop_apply_directory_changes_thread = true;
+    stop_reconcile = true;
+    SetEvent(apply_directory_changes_event);
+    WaitForSingleObject(apply_directory_changes_thread, INFINITE); // before monitored directories are gone, as it probes files in them
     void stop_monitoring();
     stop_monitoring();
-    WaitForSingleObject(apply_directory_changes_thread, INFINITE);
+
+    if (backup_state == BackupState::SCAN_STARTED || backup_state == BackupState::SCAN_COMPLETED || backup_state == BackupState::BACKUP_STARTED) { // save changes of modes and priorities (or the tree of the stopped scan, which is resumed at the next run)
+        void save_dir_tree_snapshot();
+        save_dir_tree_snapshot();
+    }
 
     tab_buttons.clear(); // may be unnecessary
     current_tab.reset(); // may be unnecessary
@@ -0,0 +1,49 @@
+﻿#pragma once
+
+#include <stdint.h>
+#include <math.h>
+
+// Formatting of numbers with groups of 3 digits separated by spaces (e.g. `12 345 678`) into buffers of the caller, without allocations and locales
+const int NUMBER_BUFFER_SIZE = 32; // enough for any `int64_t` with separators, sign, one decimal digit and terminating zero
+
+inline int format_thousands(uint64_t value, char *buf, int decimal_digit = -1, bool negative = false) // returns the length, `decimal_digit` < 0 means no decimal digit
+{
+    char tmp[NUMBER_BUFFER_SIZE];
+    char *p = tmp + NUMBER_BUFFER_SIZE;
+    if (decimal_digit >= 0) {
+        *--p = char('0' + decimal_digit);
+        *--p = '.';
+    }
+    for (int n = 0; ; n++) { // digits from the lowest one
+        if (n != 0 && n % 3 == 0)
+            *--p = ' ';
+        *--p = char('0' + value % 10);
+        value /= 10;
+        if (value == 0)
+            break;
+    }
+    if (negative)
+        *--p = '-';
+
+    int len = int(tmp + NUMBER_BUFFER_SIZE - p);
+    for (int i = 0; i < len; i++)
+        buf[i] = p[i];
+    buf[len] = 0;
+    return len;
+}
+
+inline int format_thousands(int64_t value, char *buf)
+{
+    return format_thousands(value < 0 ? 0 - uint64_t(value) : uint64_t(value), buf, -1, value < 0);
+}
+
+inline int format_thousands(int32_t value, char *buf) {return format_thousands(int64_t(value), buf);}
+
+inline int format_thousands(double value, char *buf) // with one decimal digit rounded half to even, as `printf("%.1f")` does
+{
+    double tenths = nearbyint(fabs(value) * 10); // exact for sizes in megabytes (they are integers divided by a power of 2)
+    if (!(tenths < 1.8e19)) // also NaN
+        tenths = 0;
+    uint64_t t = uint64_t(tenths);
+    return format_thousands(t / 10, buf, int(t % 10), value < 0 && t != 0);
+}
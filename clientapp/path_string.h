@@ -0,0 +1,22 @@
+﻿#pragma once
+
+#include <string>
+
+// Native path characters: UTF-16 on Windows, bytes (usually UTF-8) on POSIX systems
+#ifdef _WIN32
+typedef wchar_t PathChar;
+#define PATH_LITERAL(s) L##s
+#else
+typedef char PathChar;
+#define PATH_LITERAL(s) s
+#endif
+typedef std::basic_string<PathChar> PathString;
+
+inline PathString operator/(const PathString &d, const PathString &f) {return d.back() == PathChar('/') ? d + f : d + PathChar('/') + f;}
+inline PathString operator/(const PathString &d, const PathChar   *f) {return d.back() == PathChar('/') ? d + f : d + PathChar('/') + f;}
+
+inline PathString path_base_name(const PathString &path)
+{
+    size_t p = path.find_last_of(PATH_LITERAL("\\/"));
+    return p != PathString::npos ? path.substr(p + 1) : path;
+}
@@ -12,6 +12,7 @@
 #include <windows.h>
 #include <windowsx.h>
 #include <shellapi.h>
+#include <shlobj.h>
 #include <mmsystem.h>
 
 // C RunTime Header Files
@@ -26,6 +27,7 @@
 #include <memory>
 #include <unordered_set>
 #include <map>
+#include <set>
 #include <functional>
 #include <algorithm>
 #include <sstream>
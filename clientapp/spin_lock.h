@@ -0,0 +1,26 @@
+﻿#pragma once
+
+#ifdef _MSC_VER
+#include <intrin.h>
+inline long interlocked_exchange(volatile long &target, long value) {return _InterlockedExchange(&target, value);}
+inline void cpu_pause() {_mm_pause();}
+#else
+inline long interlocked_exchange(volatile long &target, long value) {return __atomic_exchange_n(&target, value, __ATOMIC_SEQ_CST);}
+inline void cpu_pause()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+#endif
+
+inline void spin_lock_acquire(volatile long &lock) {if (interlocked_exchange(lock, 1)) while (lock || interlocked_exchange(lock, 1)) cpu_pause();}
+inline void spin_lock_release(volatile long &lock) {interlocked_exchange(lock, 0);}
+
+class SpinLock
+{
+    long lock = 0;
+public:
+    void acquire() {spin_lock_acquire(lock);}
+    void release() {spin_lock_release(lock);}
+};
@@ -0,0 +1,139 @@
+﻿#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#endif
+#endif
+#include <algorithm>
+#include <thread>
+#include "storage_device.h"
+
+int StorageDevice::scan_concurrency() const
+{
+    int num_of_processors = std::max(1, (int)std::thread::hardware_concurrency());
+    switch (kind) {
+    case Kind::SOLID_STATE: return std::min(32, std::max(8, num_of_processors * 2)); // SSD serves many requests at once, so deep queue keeps it busy
+    case Kind::ROTATIONAL:  return 1; // concurrent walkers just make the heads seek between them
+    case Kind::NETWORK:     return 8; // requests are latency bound, so several of them are kept in flight
+    default:                return num_of_processors;
+    }
+}
+
+#ifdef _WIN32
+
+// Declared here because `winioctl.h` of the XP toolset lacks it
+const int STORAGE_DEVICE_SEEK_PENALTY_PROPERTY = 7; // `StorageDeviceSeekPenaltyProperty`
+struct DeviceSeekPenaltyDescriptor
+{
+    DWORD Version;
+    DWORD Size;
+    BOOLEAN IncursSeekPenalty;
+};
+
+static bool query_seek_penalty(const wchar_t *device_name, bool &seek_penalty)
+{
+    HANDLE h = CreateFile(device_name, 0, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL); // no access rights are needed for queries, so this works without elevation
+    if (h == INVALID_HANDLE_VALUE)
+        return false;
+    STORAGE_PROPERTY_QUERY query = {};
+    query.PropertyId = (STORAGE_PROPERTY_ID)STORAGE_DEVICE_SEEK_PENALTY_PROPERTY;
+    query.QueryType = PropertyStandardQuery;
+    DeviceSeekPenaltyDescriptor descriptor = {};
+    DWORD size;
+    bool r = DeviceIoControl(h, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &descriptor, sizeof(descriptor), &size, NULL) && size >= sizeof(descriptor);
+    CloseHandle(h);
+    if (r)
+        seek_penalty = descriptor.IncursSeekPenalty != FALSE;
+    return r;
+}
+
+StorageDevice get_storage_device(const PathString &path)
+{
+    StorageDevice d;
+    wchar_t volume_path[MAX_PATH], volume_name[MAX_PATH];
+    if (!GetVolumePathName((path.back() == L':' ? path + L'\\' : path).c_str(), volume_path, MAX_PATH)) // ‘C:’ means current directory on drive C
+        return d;
+
+    if (GetDriveType(volume_path) == DRIVE_REMOTE) {
+        d.id = volume_path;
+        std::transform(d.id.begin(), d.id.end(), d.id.begin(), towlower);
+        d.kind = StorageDevice::Kind::NETWORK;
+        return d;
+    }
+
+    if (!GetVolumeNameForVolumeMountPoint(volume_path, volume_name, MAX_PATH)) // ‘\\?\Volume{GUID}\’
+        return d;
+    std::wstring volume_device = volume_name;
+    volume_device.pop_back(); // without the trailing backslash it is the volume device rather than its root directory
+    d.id = volume_device;
+
+    HANDLE h = CreateFile(volume_device.c_str(), 0, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (h != INVALID_HANDLE_VALUE) {
+        VOLUME_DISK_EXTENTS extents; // the first extent is enough to identify the disk (volumes spanning several disks are rare)
+        DWORD size;
+        if (DeviceIoControl(h, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, NULL, 0, &extents, sizeof(extents), &size, NULL) || GetLastError() == ERROR_MORE_DATA)
+            d.id = L"\\\\.\\PhysicalDrive" + std::to_wstring(extents.Extents[0].DiskNumber);
+        CloseHandle(h);
+    }
+
+    bool seek_penalty;
+    if (query_seek_penalty(d.id.c_str(), seek_penalty))
+        d.kind = seek_penalty ? StorageDevice::Kind::ROTATIONAL : StorageDevice::Kind::SOLID_STATE;
+    return d;
+}
+
+#else
+
+StorageDevice get_storage_device(const PathString &path)
+{
+    StorageDevice d;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return d;
+#ifdef __linux__
+    unsigned maj = major(st.st_dev), min = minor(st.st_dev);
+    PathString dev = "/sys/dev/block/" + std::to_string(maj) + ':' + std::to_string(min);
+    d.id = std::to_string(maj) + ':' + std::to_string(min);
+    struct statfs sfs;
+    if (statfs(path.c_str(), &sfs) == 0 && (sfs.f_type == 0x6969 || sfs.f_type == 0xFF534D42 || sfs.f_type == 0xFE534D42 || sfs.f_type == 0x517B)) { // NFS, CIFS, SMB2, SMB
+        d.kind = StorageDevice::Kind::NETWORK;
+        return d;
+    }
+    if (maj == 0) // not backed by a block device (tmpfs, overlay, btrfs subvolume, etc.)
+        return d;
+
+    // Partitions have no queue of their own, it is in the directory of the whole disk, which is the parent one in sysfs
+    FILE *f = fopen((dev + "/queue/rotational").c_str(), "r");
+    if (f == NULL) {
+        f = fopen((dev + "/../queue/rotational").c_str(), "r");
+        if (f != NULL) {
+            char link[256];
+            ssize_t n = readlink(dev.c_str(), link, sizeof(link) - 1); // ‘../../devices/.../block/sda/sda1’
+            if (n > 0) {
+                link[n] = 0;
+                PathString disk_path(link);
+                disk_path.erase(disk_path.rfind('/'));
+                d.id = path_base_name(disk_path); // all partitions of a disk are the same device
+            }
+        }
+    }
+    if (f != NULL) {
+        int rotational;
+        if (fscanf(f, "%d", &rotational) == 1)
+            d.kind = rotational ? StorageDevice::Kind::ROTATIONAL : StorageDevice::Kind::SOLID_STATE;
+        fclose(f);
+    }
+#else
+    d.id = std::to_string((unsigned long long)st.st_dev);
+#endif
+    return d;
+}
+
+#endif
@@ -0,0 +1,18 @@
+﻿#pragma once
+
+#include "path_string.h"
+
+// Storage device on which a directory lies, so that scans of different devices run in parallel and each device is walked with a concurrency it handles well
+struct StorageDevice
+{
+    enum class Kind {UNKNOWN, SOLID_STATE, ROTATIONAL, NETWORK};
+
+    PathString id; // equal for all volumes of the same physical disk (or of the same network share), empty if it can not be determined
+    Kind kind = Kind::UNKNOWN;
+
+    int scan_concurrency() const; // number of directories which are worth enumerating at once
+};
+
+// Windows: disk number from `IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS` and seek penalty from `IOCTL_STORAGE_QUERY_PROPERTY` (Windows 7 and later, otherwise the kind is unknown).
+// Linux: block device from `stat()` and `/sys/dev/block/<major>:<minor>/queue/rotational` (of the whole disk if the device is a partition).
+StorageDevice get_storage_device(const PathString &path);
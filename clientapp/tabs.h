@@ -18,6 +18,8 @@ public:
     virtual void treeview_paint(HDC hdc, int width, int height) = 0;
     virtual void treeview_lbdown() = 0;
     virtual void treeview_rbdown() = 0;
+    virtual void treeview_mousemove() = 0;
+    virtual void treeview_timer() = 0; // repaints what has changed
 };
 
 extern std::unique_ptr<Tab> current_tab;
@@ -28,10 +30,13 @@ extern std::unique_ptr<Tab> current_tab;
 class TabBackup : public Tab
 {
     Button filter;
+    HWND filter_edit = NULL; // pattern of directory names, shown by the `filter` button
     std::unique_ptr<Button> cancel_scan_button, restart_scan, start_backup;
 
+    void create_filter_edit();
+
 public:
-    static enum class SortBy {NAME, SIZE, COUNT} sort_by;
+    static enum class SortBy {NAME, SIZE, NUM_OF_FILES, COUNT} sort_by;
     static volatile bool stop_scan, cancel_scan;
 
     TabBackup() :
@@ -43,12 +48,19 @@ public:
             start_backup = std::make_unique<Button>(IDB_START_BACKUP, L"Start backup!", 120, 60, 100, 30);
         if (backup_state == BackupState::SCAN_CANCELLED)
             restart_scan = std::make_unique<Button>(IDB_RESTART_SCAN, L"Restart scan", 230, 60, 100, 30);
+        create_filter_edit(); // if it was shown before the tab was recreated
     }
+    ~TabBackup() {if (filter_edit) DestroyWindow(filter_edit);}
+
+    void toggle_filter(); // by the `filter` button
+    void filter_changed(); // text of `filter_edit` has changed
 
-    virtual int treeview_offsety() const override {return 40;}
+    virtual int treeview_offsety() const override {return filter_edit != NULL ? 80 : 40;}
     virtual void treeview_paint(HDC hdc, int width, int height) override;
     virtual void treeview_lbdown() override;
     virtual void treeview_rbdown() override;
+    virtual void treeview_mousemove() override;
+    virtual void treeview_timer() override;
 };
 INT_PTR CALLBACK backup_drive_selection_dlg_proc(HWND dlg_wnd, UINT message, WPARAM wparam, LPARAM lparam);
 
@@ -58,6 +70,8 @@ class TabProgress : public Tab
     virtual void treeview_paint(HDC hdc, int width, int height) override {}
     virtual void treeview_lbdown() override {}
     virtual void treeview_rbdown() override {}
+    virtual void treeview_mousemove() override {}
+    virtual void treeview_timer() override {}
 };
 
 class TabLog : public Tab
@@ -65,6 +79,8 @@ class TabLog : public Tab
     virtual void treeview_paint(HDC hdc, int width, int height) override {}
     virtual void treeview_lbdown() override {}
     virtual void treeview_rbdown() override {}
+    virtual void treeview_mousemove() override {}
+    virtual void treeview_timer() override {}
 };
 
 inline void switch_tab(std::unique_ptr<Tab> &&t)
@@ -0,0 +1,261 @@
+﻿// Multi-threaded stress test and benchmark of reuse of abandoned entries of the tree with epochs (see `DirTree::ReadGuard`). It runs anywhere.
+// Build:
+//   g++ -O2 -std=c++14 -pthread -I../clientapp epochbench.cpp ../clientapp/dir_entry.cpp ../clientapp/dir_snapshot.cpp ../clientapp/dir_name_index.cpp -o epochbench
+// Usage:
+//   epochbench [--readers N] [--writers N] [--seconds N] [--no-guards] [--rebuild] [--seed N]
+// First 100 guards (more than `DirTree::MAX_READERS` slots) are held at once while a root is rescanned, and then the root is rescanned again after
+// they are released: guards beyond the slots must not wait, and no entries may be reused while they are held. It prints one JSON object with the numbers
+// of entries reused in both phases.
+// Every writer owns a root and replaces subdirectories of random directories of its subtree again and again, as rescans do, so ranges of
+// subdirectories are abandoned and reused. Readers walk random paths from the roots under a guard, remember every entry they have read and check
+// at the end of the walk that none of them has been reused meanwhile (its index or name has changed); another reader queries the name index and
+// checks names of found directories. With `--no-guards` readers do not pin epochs, so they are expected to see reused entries. With `--rebuild` the name
+// index is rebuilt in the background while writers start, as it is after a snapshot was loaded (a static tree of 1M entries is added before the
+// subtrees of writers, so that the rebuild reaches them while they are being changed).
+// At last the name index is compared with the tree, and it prints one JSON object with the numbers of reads, violations and entries allocated
+// against entries requested by `set_subdirs()` (what the tree took before abandoned entries were reused), and the time of pinning of a guard.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dir_entry.h"
+#include "dir_name_index.h"
+
+static const int NUM_OF_NAMES = 16, MAX_SUBDIRS = 8, MAX_DEPTH = 6, WRITES_PER_SCAN = 10;
+
+struct Options
+{
+    int readers = 4;
+    int writers = 2;
+    double seconds = 3;
+    bool guards = true;
+    bool rebuild = false;
+    uint64_t seed = 1;
+};
+
+static std::vector<uint32_t> names; // interned names of directories
+static std::vector<DirEntry*> roots;
+static std::atomic<bool> stop(false);
+static std::atomic<uint64_t> reads(0), violations(0), writes(0), requested_entries(0);
+
+static void set_random_subdirs(DirEntry &de, std::mt19937_64 &rng, int depth)
+{
+    std::vector<uint32_t> subdir_names;
+    for (int i = 0; i < NUM_OF_NAMES && int(subdir_names.size()) < MAX_SUBDIRS; i++)
+        if (rng() % 3 == 0)
+            subdir_names.push_back(names[i]);
+    dir_tree.set_subdirs(de, subdir_names);
+    requested_entries += subdir_names.size();
+    if (depth + 1 < MAX_DEPTH) // new directories get subdirectories too, so that whole subtrees are removed later
+        for (auto &&sd : de.subdirs())
+            if (sd.subdirs().empty() && rng() % 4 == 0)
+                set_random_subdirs(sd, rng, depth + 1);
+}
+
+static void writer_proc(DirEntry &root, uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    while (!stop) {
+        DirTree::ReadGuard guard; // as a scan pins an epoch for its whole duration
+        for (int i = 0; i < WRITES_PER_SCAN && !stop; i++) {
+            DirEntry *de = &root;
+            int depth = 0;
+            for (; depth + 1 < MAX_DEPTH && rng() % 4 != 0; depth++) {
+                DirEntry::SubDirs subdirs = de->subdirs();
+                if (subdirs.empty())
+                    break;
+                de = &subdirs[rng() % subdirs.size()];
+            }
+            set_random_subdirs(*de, rng, depth);
+            writes++;
+        }
+    }
+}
+
+struct Seen
+{
+    const DirEntry *de;
+    uint32_t index, name_offset;
+    bool first_in_range;
+};
+
+static void reader_proc(uint64_t seed, bool guards)
+{
+    std::mt19937_64 rng(seed);
+    std::vector<Seen> seen;
+    while (!stop) {
+        std::unique_ptr<DirTree::ReadGuard> guard;
+        if (guards)
+            guard.reset(new DirTree::ReadGuard);
+        seen.clear();
+        const DirEntry *de = roots[rng() % roots.size()];
+        for (int depth = 0; depth < MAX_DEPTH; depth++) {
+            DirEntry::SubDirs subdirs = de->subdirs();
+            if (subdirs.empty())
+                break;
+            for (size_t i = 0; i < subdirs.size(); i++) {
+                const DirEntry &sd = subdirs[i];
+                Seen s = {&sd, sd.index, sd.name_offset, i == 0};
+                seen.push_back(s);
+            }
+            de = &subdirs[rng() % subdirs.size()];
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1)); // as a view keeps rows between updates, writers get a chance to reuse what has been read
+
+        // Entries were read in ranges of subdirectories, so their indices are consecutive and names ascending within a range, and they do not change
+        // until the guard is released
+        for (size_t i = 0; i < seen.size(); i++) {
+            const Seen &s = seen[i];
+            if (s.de->index != s.index || s.de->name_offset != s.name_offset || s.index >= dir_tree.num_of_entries() || &dir_tree[s.index] != s.de)
+                violations++;
+            else if (!s.first_in_range && (seen[i - 1].index + 1 != s.index || !DirEntry::Less()(dir_tree.name(seen[i - 1].name_offset), dir_tree.name(s.name_offset))))
+                violations++;
+        }
+        reads += seen.size();
+    }
+}
+
+static void query_proc(uint64_t seed, bool guards)
+{
+    std::mt19937_64 rng(seed);
+    while (!stop) {
+        std::unique_ptr<DirTree::ReadGuard> guard;
+        if (guards)
+            guard.reset(new DirTree::ReadGuard);
+        uint32_t name_offset = names[rng() % names.size()];
+        PathString pattern = dir_tree.name(name_offset);
+        uint64_t n = 0;
+        volatile bool never = false;
+        dir_name_index.find(pattern, never, [&](DirEntry &de) {
+            if (de.name_offset != name_offset) // names of the pool do not contain each other except of `dir1` in `dir1N`
+                if (PathString(dir_tree.name(de.name_offset)).compare(0, pattern.size(), pattern) != 0)
+                    violations++;
+            n++;
+        });
+        reads += n;
+    }
+}
+
+static void collect_alive(const DirEntry &de, std::vector<uint32_t> &alive)
+{
+    for (auto &&sd : de.subdirs()) {
+        alive.push_back(sd.index);
+        collect_alive(sd, alive);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Options o;
+    for (int i = 1; i < argc; i++) {
+        if      (strcmp(argv[i], "--readers") == 0 && i + 1 < argc) o.readers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--writers") == 0 && i + 1 < argc) o.writers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) o.seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)    o.seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--no-guards") == 0)               o.guards = false;
+        else if (strcmp(argv[i], "--rebuild") == 0)                 o.rebuild = true;
+        else {
+            fprintf(stderr, "Unknown option `%s`\n", argv[i]);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < NUM_OF_NAMES; i++)
+        names.push_back(dir_tree.intern_name(("dir" + std::to_string(i)).c_str()));
+    std::mt19937_64 rng(o.seed);
+    DirEntry *static_root = nullptr;
+    if (o.rebuild) {
+        static_root = dir_tree.add_root("static");
+        std::vector<uint32_t> subdir_names(names.begin(), names.begin() + MAX_SUBDIRS);
+        std::vector<DirEntry*> level(1, static_root);
+        for (size_t i = 0; i < level.size() && dir_tree.num_of_entries() < 1000000; i++) {
+            dir_tree.set_subdirs(*level[i], subdir_names);
+            for (auto &&sd : level[i]->subdirs())
+                level.push_back(&sd);
+        }
+    }
+    for (int i = 0; i < std::max(o.writers, 1); i++) {
+        roots.push_back(dir_tree.add_root("root" + std::to_string(i)));
+        set_random_subdirs(*roots.back(), rng, 0);
+    }
+    if (static_root != nullptr) // after roots of writers
+        roots.push_back(static_root);
+
+    // Pinning of a guard by the only reader
+    const int PINS = 1000000;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < PINS; i++)
+        DirTree::ReadGuard guard;
+    double pin_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / PINS;
+
+    // More guards than slots
+    const int OVERFLOW_GUARDS = 100, RESCANS = 100;
+    auto rescan = [&rng]() { // returns the number of reused entries
+        uint64_t requested = requested_entries;
+        uint32_t allocated = dir_tree.num_of_entries();
+        DirTree::ReadGuard guard;
+        for (int i = 0; i < RESCANS; i++)
+            set_random_subdirs(*roots[0], rng, 0);
+        return (requested_entries - requested) - (dir_tree.num_of_entries() - allocated);
+    };
+    std::vector<std::unique_ptr<DirTree::ReadGuard>> guards;
+    for (int i = 0; i < OVERFLOW_GUARDS; i++)
+        guards.push_back(std::make_unique<DirTree::ReadGuard>());
+    uint64_t reused_with_overflow = rescan();
+    guards.clear();
+    uint64_t reused_after_overflow = rescan();
+    printf("{\"test\": \"overflow\", \"guards\": %d, \"rescans\": %d, \"reused_with_overflow\": %llu, \"reused_after_overflow\": %llu}\n",
+           OVERFLOW_GUARDS, RESCANS, (unsigned long long)reused_with_overflow, (unsigned long long)reused_after_overflow);
+    fflush(stdout);
+    if (reused_with_overflow != 0 || reused_after_overflow == 0)
+        return 1;
+
+    if (o.rebuild)
+        dir_name_index.start_rebuild();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < o.writers; i++)
+        threads.push_back(std::thread(writer_proc, std::ref(*roots[i]), o.seed * 1000 + i));
+    for (int i = 0; i < o.readers; i++)
+        threads.push_back(std::thread(reader_proc, o.seed * 2000 + i, o.guards));
+    threads.push_back(std::thread(query_proc, o.seed * 3000, o.guards));
+    std::this_thread::sleep_for(std::chrono::duration<double>(o.seconds));
+    stop = true;
+    for (auto &&t : threads)
+        t.join();
+    if (!dir_name_index.ready()) {
+        fprintf(stderr, "Name index is not rebuilt\n");
+        return 1;
+    }
+
+    // Every alive directory is found by its name exactly once, and nothing else is found
+    uint64_t index_mismatches = 0;
+    for (auto &&name_offset : names) {
+        std::vector<uint32_t> alive, found;
+        for (auto &&root : roots)
+            collect_alive(*root, alive);
+        alive.erase(std::remove_if(alive.begin(), alive.end(), [name_offset](uint32_t i) {return dir_tree[i].name_offset != name_offset;}), alive.end());
+        volatile bool never = false;
+        dir_name_index.find(dir_tree.name(name_offset), never, [&](DirEntry &de) {
+            if (de.name_offset == name_offset)
+                found.push_back(de.index);
+        });
+        std::sort(alive.begin(), alive.end());
+        std::sort(found.begin(), found.end());
+        if (alive != found)
+            index_mismatches++;
+    }
+
+    printf("{\"test\": \"stress\", \"guards\": %s, \"rebuild\": %s, \"readers\": %d, \"writers\": %d, \"seconds\": %.1f, \"reads\": %llu, \"violations\": %llu, \"index_mismatches\": %llu, "
+           "\"set_subdirs\": %llu, \"requested_entries\": %llu, \"allocated_entries\": %u, \"retired_entries\": %u, \"pin_seconds\": %.9f}\n",
+           o.guards ? "true" : "false", o.rebuild ? "true" : "false", o.readers, o.writers, o.seconds, (unsigned long long)reads, (unsigned long long)violations, (unsigned long long)index_mismatches,
+           (unsigned long long)writes, (unsigned long long)requested_entries, dir_tree.num_of_entries(), dir_tree.num_of_retired_entries(), pin_seconds);
+    return (o.guards && violations != 0) || index_mismatches != 0 ? 1 : 0;
+}
@@ -0,0 +1,450 @@
+﻿// Stress test and benchmark of maintenance of `DirEntry::mode_mixed` by counts of mixed subdirectories (see `DirTree::num_of_mixed_subdirs()`),
+// of counts of overrides (see `DirTree::num_of_overrides()`) and of excluded totals with pending marks (see `DirTree::is_pending()`). It runs anywhere.
+// Build:
+//   g++ -O2 -std=c++14 -pthread -I../clientapp modebench.cpp ../clientapp/dir_entry.cpp ../clientapp/dir_snapshot.cpp ../clientapp/dir_name_index.cpp -o modebench
+// Usage:
+//   modebench [--entries N] [--ops N] [--width N] [--bulk-entries N] [--seed N]
+// A random tree with random automatic and manual modes is changed by random operations (`set_mode_manual()`, `exclude_auto()`, a new mode of
+// a rescanned directory as `DirScanner::classify()` sets it, a new manual priority and new subdirectories), and after each of them `mode_mixed`
+// and counts of every entry are compared with a full recomputation, as well as overrides found in the subtree of a random entry and excluded totals of
+// subdirectories of a random entry after `resolve_pending()` (and of every entry after `resolve_all_pending()` every 10 operations).
+// Then a mode of the last subdirectory of a directory with `--width` subdirectories is toggled, with `update_mode_mixed()` as it was before
+// (it rescanned subdirectories of every ancestor) against the counts. At last sub-entries with manual modes are found in a tree of `--bulk-entries`
+// entries with 100 of them, by a walk over the whole subtree as the mode menu did before against `find_overrides()`, and the root of this tree is
+// excluded and included, with excluded totals of the whole subtree recalculated as before against `set_mode_manual()`. Finally the tree is saved
+// into a snapshot and loaded back, and counts of every entry are compared again (they are saved, so they are not recalculated on load), also after
+// a change of mode of a random entry of the loaded tree, and the name index which is built in the background after loading must find every entry
+// but roots. It prints one JSON object per line.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dir_entry.h"
+#include "dir_name_index.h"
+
+static const DirMode MODES[] = {DirMode::EXCLUDED, DirMode::NORMAL, DirMode::FROZEN, DirMode::APPEND_ONLY, DirMode::INHERIT_FROM_PARENT};
+
+static void set_subdirs(DirEntry &de, int n, std::vector<DirEntry*> &entries)
+{
+    std::vector<uint32_t> names;
+    for (int i = 0; i < n; i++)
+        names.push_back(dir_tree.intern_name(("d" + std::to_string(i)).c_str()));
+    dir_tree.set_subdirs(de, names);
+    for (auto &&sd : de.subdirs()) {
+        if (sd.dir_num_of_files == 0) { // a new directory
+            sd.dir_files_size = 1000 * (sd.index % 7);
+            sd.dir_num_of_files = sd.index % 5;
+        }
+        entries.push_back(&sd);
+    }
+}
+
+static void recalc_sizes(DirEntry &de) // as a scan sums them up
+{
+    de.size = de.dir_files_size;
+    de.num_of_files = de.dir_num_of_files;
+    for (auto &&sd : de.subdirs()) {
+        recalc_sizes(sd);
+        de.size += sd.size;
+        de.num_of_files += sd.num_of_files;
+    }
+}
+
+static bool full_recomputation(const DirEntry &de, DirMode mode, std::vector<uint32_t> &counts) // as `update_mode_mixed()` defined it for every directory
+{
+    uint32_t n = 0;
+    for (auto &&sd : de.subdirs())
+        if (full_recomputation(sd, sd.mode() != DirMode::INHERIT_FROM_PARENT ? sd.mode() : mode, counts) || (sd.mode() != mode && sd.mode() != DirMode::INHERIT_FROM_PARENT))
+            n++;
+    counts[de.index] = n;
+    return n != 0;
+}
+
+static uint32_t count_overrides(const DirEntry &de, std::vector<uint32_t> &counts)
+{
+    uint32_t n = de.has_overrides() ? 1 : 0;
+    for (auto &&sd : de.subdirs())
+        n += count_overrides(sd, counts);
+    return counts[de.index] = n;
+}
+
+static void find_overrides(const DirEntry &de, std::vector<DirEntry*> &overrides) // by a walk over the whole subtree
+{
+    for (auto &&sd : de.subdirs()) {
+        if (sd.has_overrides())
+            overrides.push_back(&sd);
+        find_overrides(sd, overrides);
+    }
+}
+
+static void check(const std::vector<DirEntry*> &roots, int op)
+{
+    std::vector<uint32_t> counts(dir_tree.num_of_entries()), overrides(dir_tree.num_of_entries());
+    std::vector<const DirEntry*> stack;
+    for (auto &&root : roots) {
+        full_recomputation(*root, root->mode(), counts);
+        count_overrides(*root, overrides);
+        stack.push_back(root);
+    }
+    while (!stack.empty()) {
+        const DirEntry &de = *stack.back();
+        stack.pop_back();
+        if (de.mode_mixed != (counts[de.index] != 0) || dir_tree.num_of_mixed_subdirs(de.index) != counts[de.index]) {
+            fprintf(stderr, "Mismatch after operation %d: entry %u has `mode_mixed` %d and count %u, expected %u\n", op, de.index, de.mode_mixed, dir_tree.num_of_mixed_subdirs(de.index), counts[de.index]);
+            exit(1);
+        }
+        if (dir_tree.num_of_overrides(de.index) != overrides[de.index]) {
+            fprintf(stderr, "Mismatch after operation %d: entry %u has %u overrides, expected %u\n", op, de.index, dir_tree.num_of_overrides(de.index), overrides[de.index]);
+            exit(1);
+        }
+        for (auto &&sd : de.subdirs())
+            stack.push_back(&sd);
+    }
+}
+
+static void expected_excluded(const DirEntry &de, bool parent_excluded, std::vector<int64_t> &sizes, std::vector<int32_t> &nums) // by the definition
+{
+    bool excluded = de.mode() != DirMode::INHERIT_FROM_PARENT ? de.mode() == DirMode::EXCLUDED : parent_excluded;
+    sizes[de.index] = excluded ? de.dir_files_size : 0;
+    nums[de.index] = excluded ? de.dir_num_of_files : 0;
+    for (auto &&sd : de.subdirs()) {
+        expected_excluded(sd, excluded, sizes, nums);
+        sizes[de.index] += sizes[sd.index];
+        nums[de.index] += nums[sd.index];
+    }
+}
+
+static void check_excluded(const std::vector<DirEntry*> &roots, const DirEntry &visited, bool all, int op)
+{
+    std::vector<int64_t> sizes(dir_tree.num_of_entries());
+    std::vector<int32_t> nums(dir_tree.num_of_entries());
+    for (auto &&root : roots)
+        expected_excluded(*root, false, sizes, nums);
+    auto check_entry = [&](const DirEntry &de) {
+        if (de.size_excluded != sizes[de.index] || de.num_of_files_excluded != nums[de.index]) {
+            fprintf(stderr, "Mismatch after operation %d: entry %u has excluded totals %lld and %d, expected %lld and %d\n", op, de.index,
+                    (long long)de.size_excluded, de.num_of_files_excluded.load(), (long long)sizes[de.index], nums[de.index]);
+            exit(1);
+        }
+    };
+    for (auto &&root : roots)
+        check_entry(*root);
+
+    dir_tree.resolve_pending(visited);
+    check_entry(visited);
+    for (auto &&sd : visited.subdirs())
+        check_entry(sd);
+    if (!all)
+        return;
+
+    std::vector<const DirEntry*> stack;
+    for (auto &&root : roots) {
+        dir_tree.resolve_all_pending(*root);
+        stack.push_back(root);
+    }
+    while (!stack.empty()) {
+        const DirEntry &de = *stack.back();
+        stack.pop_back();
+        check_entry(de);
+        if (dir_tree.is_pending(de.index)) {
+            fprintf(stderr, "Mismatch after operation %d: entry %u is still pending\n", op, de.index);
+            exit(1);
+        }
+        for (auto &&sd : de.subdirs())
+            stack.push_back(&sd);
+    }
+}
+
+static void check_found_overrides(const DirEntry &de, int op)
+{
+    std::vector<DirEntry*> expected, found;
+    find_overrides(de, expected);
+    dir_tree.find_overrides(de, found);
+    if (found != expected) {
+        fprintf(stderr, "Mismatch after operation %d: %u overrides are found under entry %u, expected %u\n", op, uint32_t(found.size()), de.index, uint32_t(expected.size()));
+        exit(1);
+    }
+}
+
+static void collect_entries(const std::vector<DirEntry*> &roots, std::vector<DirEntry*> &entries) // after a rescan has abandoned some entries
+{
+    entries.clear();
+    for (auto &&root : roots)
+        entries.push_back(root);
+    for (size_t i = 0; i < entries.size(); i++)
+        for (auto &&sd : entries[i]->subdirs())
+            entries.push_back(&sd);
+}
+
+static void old_update_mode_mixed(DirEntry &de) // as it was before the counts
+{
+    for (DirEntry *pd = de.parent(); pd; pd = pd->parent()) {
+        bool prev_mode_mixed = pd->mode_mixed;
+        pd->mode_mixed = false;
+        DirMode pd_mode_no_ifp = pd->mode_no_ifp();
+        for (auto &&sd : pd->subdirs())
+            if ((sd.mode() != pd_mode_no_ifp && sd.mode() != DirMode::INHERIT_FROM_PARENT) || sd.mode_mixed) {
+                pd->mode_mixed = true;
+                break;
+            }
+        if (pd->mode_mixed != prev_mode_mixed)
+            dir_tree.changed(*pd);
+    }
+}
+
+static void old_recalc_excluded(DirEntry &de, bool excluded) // as `DirEntry::recalc_excluded()` was before pending marks
+{
+    if (de.mode() != DirMode::INHERIT_FROM_PARENT)
+        excluded = de.mode() == DirMode::EXCLUDED;
+    if (excluded) {
+        de.size_excluded = de.dir_files_size;
+        de.num_of_files_excluded = de.dir_num_of_files;
+    }
+    else {
+        de.size_excluded = 0;
+        de.num_of_files_excluded = 0;
+    }
+    for (auto &&sd : de.subdirs()) {
+        old_recalc_excluded(sd, excluded);
+        de.size_excluded += sd.size_excluded;
+        de.num_of_files_excluded += sd.num_of_files_excluded;
+    }
+    dir_tree.totals_changed(de);
+}
+
+static void old_mark_inheriting(DirEntry &de) // descendants which show the inherited mode were marked as changed by `recount_mixed_subdirs()`
+{
+    for (auto &&sd : de.subdirs())
+        if (sd.mode() == DirMode::INHERIT_FROM_PARENT) {
+            dir_tree.changed(sd);
+            old_mark_inheriting(sd);
+        }
+}
+
+static void rescanned(const std::vector<DirEntry*> &roots) // totals are summed up and excluded totals are recalculated as at the end of a scan
+{
+    for (auto &&root : roots) {
+        recalc_sizes(*root);
+        root->recalc_excluded();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_of_entries = 20000;
+    int num_of_ops = 2000, width = 50000;
+    uint32_t bulk_entries = 1000000;
+    uint64_t seed = 1;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if      (strcmp(argv[i], "--entries") == 0) num_of_entries = uint32_t(strtoul(argv[i + 1], NULL, 10));
+        else if (strcmp(argv[i], "--ops") == 0)     num_of_ops = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--width") == 0)   width = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--bulk-entries") == 0) bulk_entries = uint32_t(strtoul(argv[i + 1], NULL, 10));
+        else if (strcmp(argv[i], "--seed") == 0)    seed = strtoull(argv[i + 1], NULL, 10);
+        else {
+            fprintf(stderr, "Unknown option `%s`\n", argv[i]);
+            return 1;
+        }
+    }
+    std::mt19937_64 rng(seed);
+    auto random_mode = [&rng]() {return rng() % 2 == 0 ? DirMode::INHERIT_FROM_PARENT : MODES[rng() % 5];};
+
+    // Random tree (most directories inherit their modes as after a scan)
+    std::vector<DirEntry*> roots, entries;
+    for (int i = 0; i < 2; i++) {
+        roots.push_back(dir_tree.add_root("root" + std::to_string(i)));
+        roots.back()->mode_auto = DirMode::NORMAL;
+        entries.push_back(roots.back());
+    }
+    for (size_t i = 0; i < entries.size() && entries.size() < num_of_entries; i++)
+        set_subdirs(*entries[i], rng() % 4 == 0 ? 0 : int(rng() % 8) + 1, entries);
+    for (auto &&de : entries)
+        if (de->parent() != nullptr) {
+            de->mode_auto = rng() % 4 == 0 ? random_mode() : DirMode::INHERIT_FROM_PARENT;
+            de->mode_manual = rng() % 8 == 0 ? random_mode() : DirMode::AUTO;
+            de->priority_auto = rng() % 8 == 0 ? DIR_PRIORITY_LOW : DIR_PRIORITY_NORMAL;
+        }
+    for (auto &&root : roots) {
+        dir_tree.recalc_overrides(*root);
+        root->recalc_mode_mixed();
+    }
+    rescanned(roots);
+    check(roots, 0);
+    check_excluded(roots, *entries[0], true, 0);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int op = 1; op <= num_of_ops; op++) {
+        DirEntry &de = *entries[rng() % entries.size()];
+        switch (rng() % 6) {
+        case 0:
+            de.exclude_auto(true);
+            break;
+        case 2:
+            de.priority_manual = rng() % 2 == 0 ? DIR_PRIORITY_HIGH : DIR_PRIORITY_AUTO;
+            dir_tree.changed(de);
+            break;
+        case 3: { // a rescan finds other subdirectories (some of them are kept with their subtrees)
+            bool was_counted_as_mixed = de.counted_as_mixed();
+            std::vector<DirEntry*> added;
+            set_subdirs(de, int(rng() % 8), added);
+            de.recount_mixed_subdirs();
+            de.update_mode_mixed(was_counted_as_mixed);
+            collect_entries(roots, entries);
+            rescanned(roots);
+            break; }
+        case 1: { // a rescanned directory gets a new automatic mode
+            bool was_counted_as_mixed = de.counted_as_mixed();
+            DirMode prev_mode = de.mode();
+            if (de.parent() != nullptr)
+                de.mode_auto = random_mode();
+            de.recount_mixed_subdirs(de.mode() != prev_mode);
+            de.update_mode_mixed(was_counted_as_mixed);
+            dir_tree.changed(de);
+            rescanned(roots);
+            break; }
+        default:
+            de.set_mode_manual(rng() % 3 == 0 ? DirMode::AUTO : random_mode());
+        }
+        check(roots, op);
+        check_found_overrides(*entries[rng() % entries.size()], op);
+        check_excluded(roots, *entries[rng() % entries.size()], op % 10 == 0, op);
+    }
+    printf("{\"test\": \"equivalence\", \"entries\": %u, \"ops\": %d, \"seconds\": %.3f, \"result\": \"ok\"}\n",
+           dir_tree.num_of_entries(), num_of_ops, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    fflush(stdout);
+
+    // Toggling of modes of subdirectories of a wide directory 4 levels deep
+    std::vector<DirEntry*> chain, wide;
+    roots.push_back(dir_tree.add_root("wide"));
+    roots.back()->mode_auto = DirMode::NORMAL;
+    DirEntry *de = roots.back();
+    for (int level = 0; level < 4; level++) {
+        chain.clear();
+        set_subdirs(*de, 1, chain);
+        de = chain[0];
+    }
+    set_subdirs(*de, width, wide);
+    roots.back()->recalc_mode_mixed();
+    rescanned(roots);
+    const int TOGGLES = 200;
+    DirEntry &sd = *wide.back(); // the only mixed subdirectory when it is excluded, so the previous algorithm rescans all of them when it is not
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < TOGGLES; i++) {
+        sd.mode_manual = sd.mode_manual == DirMode::EXCLUDED ? DirMode::AUTO : DirMode::EXCLUDED;
+        old_update_mode_mixed(sd);
+    }
+    double old_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / TOGGLES;
+
+    roots.back()->recalc_mode_mixed();
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < TOGGLES; i++)
+        sd.set_mode_manual(sd.mode_manual == DirMode::EXCLUDED ? DirMode::AUTO : DirMode::EXCLUDED);
+    double new_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / TOGGLES;
+    check(roots, num_of_ops + 1);
+
+    printf("{\"test\": \"toggle\", \"width\": %d, \"old_seconds\": %.9f, \"new_seconds\": %.9f, \"speedup\": %.0f}\n", width, old_seconds, new_seconds, old_seconds / new_seconds);
+    fflush(stdout);
+
+    // Sub-entries with manual modes in a large tree (as the mode menu finds them to offer switching of their modes)
+    std::vector<DirEntry*> bulk;
+    roots.push_back(dir_tree.add_root("bulk"));
+    roots.back()->mode_auto = DirMode::NORMAL;
+    bulk.push_back(roots.back());
+    for (size_t i = 0; i < bulk.size() && bulk.size() < bulk_entries; i++)
+        set_subdirs(*bulk[i], 10, bulk);
+    rescanned(roots);
+    for (int i = 0; i < 100; i++)
+        bulk[1 + rng() % (bulk.size() - 1)]->set_mode_manual(DirMode::EXCLUDED);
+    const int QUERIES = 10;
+    size_t found = 0;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < QUERIES; i++) {
+        std::vector<DirEntry*> overrides;
+        find_overrides(*roots.back(), overrides);
+        found += overrides.size();
+    }
+    old_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / QUERIES;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < QUERIES; i++) {
+        std::vector<DirEntry*> overrides;
+        dir_tree.find_overrides(*roots.back(), overrides);
+        found -= overrides.size();
+    }
+    new_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / QUERIES;
+    check_found_overrides(*roots.back(), num_of_ops + 2);
+
+    printf("{\"test\": \"bulk\", \"entries\": %u, \"overrides\": %u, \"old_seconds\": %.9f, \"new_seconds\": %.9f, \"speedup\": %.0f}\n",
+           uint32_t(bulk.size()), dir_tree.num_of_overrides(roots.back()->index) - 1, old_seconds, new_seconds, old_seconds / new_seconds);
+    fflush(stdout);
+
+    // Exclusion of the whole large tree and back
+    DirEntry &top = *roots.back();
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < QUERIES; i++) {
+        top.mode_manual = top.mode_manual == DirMode::EXCLUDED ? DirMode::AUTO : DirMode::EXCLUDED;
+        dir_tree.changed(top);
+        old_mark_inheriting(top);
+        old_recalc_excluded(top, false);
+    }
+    old_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / QUERIES;
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < QUERIES; i++)
+        top.set_mode_manual(top.mode_manual == DirMode::EXCLUDED ? DirMode::AUTO : DirMode::EXCLUDED);
+    new_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / QUERIES;
+    check_excluded(roots, top, false, num_of_ops + 3);
+
+    start = std::chrono::steady_clock::now();
+    dir_tree.resolve_all_pending(top);
+    double resolve_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    check_excluded(roots, top, true, num_of_ops + 3);
+
+    printf("{\"test\": \"exclude\", \"entries\": %u, \"old_seconds\": %.9f, \"new_seconds\": %.9f, \"speedup\": %.0f, \"resolve_all_seconds\": %.6f}\n",
+           uint32_t(bulk.size()), old_seconds, new_seconds, old_seconds / new_seconds, resolve_seconds);
+    fflush(stdout);
+
+    // Round trip through a snapshot
+    const PathString SNAPSHOT_NAME = "modebench.snapshot";
+    start = std::chrono::steady_clock::now();
+    if (!dir_tree.save_snapshot(SNAPSHOT_NAME, roots)) {
+        fprintf(stderr, "Can not save a snapshot\n");
+        return 1;
+    }
+    double save_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    dir_tree.clear();
+    start = std::chrono::steady_clock::now();
+    if (!dir_tree.load_snapshot(SNAPSHOT_NAME, roots)) {
+        fprintf(stderr, "Can not load the snapshot\n");
+        return 1;
+    }
+    double load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    while (!dir_name_index.ready())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    double index_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() - load_seconds;
+    check(roots, num_of_ops + 4);
+    collect_entries(roots, entries);
+    size_t indexed = 0;
+    const volatile bool never = false;
+    dir_name_index.find(PathString(), never, [&](DirEntry &) {indexed++;});
+    if (indexed != entries.size() - roots.size()) {
+        fprintf(stderr, "Name index of the loaded tree has %u entries, expected %u\n", uint32_t(indexed), uint32_t(entries.size() - roots.size()));
+        return 1;
+    }
+    entries[1 + rng() % (entries.size() - 1)]->set_mode_manual(DirMode::EXCLUDED);
+    check(roots, num_of_ops + 5);
+    dir_tree.clear();
+    remove((SNAPSHOT_NAME + ".0").c_str());
+    remove((SNAPSHOT_NAME + ".1").c_str());
+
+    printf("{\"test\": \"snapshot\", \"entries\": %u, \"save_seconds\": %.6f, \"load_seconds\": %.6f, \"index_seconds\": %.6f, \"result\": \"ok\"}\n",
+           uint32_t(entries.size()), save_seconds, load_seconds, index_seconds);
+    return found == 0 ? 0 : 1;
+}
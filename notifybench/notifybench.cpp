@@ -0,0 +1,433 @@
+﻿// Benchmark of decoding of buffers of change notifications (`NotifyDecoder`) against the decoding which was done before, on buffers in the format
+// of `ReadDirectoryChangesW` (UTF-16 names), so it runs anywhere (POSIX only for the old decoding, which checked every modified name in the file system).
+// Build:
+//   g++ -O2 -std=c++14 -I../clientapp notifybench.cpp -o notifybench
+// Usage:
+//   notifybench [--records N] [--buffer-size N] [--seed N] [--dir PATH]
+//   notifybench --replay FILE [--dirs FILE]
+// The benchmark generates a stream of notifications of a tree of 1000 directories (files are created, written by several modifications, moved between
+// directories, renamed and deleted, and directories get excess modifications) and packs it into buffers of `--buffer-size` bytes. The old decoding built
+// a `std::wstring` per record and per pairing check and called `GetFileAttributes` on every modified name (`stat()` here, on a copy of the directory tree
+// which is made under `--dir`; a missing name is taken as a file, while the old code dropped it), the decoder takes names of directories from the tree
+// (a hash set here). It prints one JSON object with the time and the number of allocations per record of both, and checks that both give the same changes.
+// `--replay` decodes buffers captured on Windows: the file is a sequence of buffers, each is a 32-bit little-endian size followed by the bytes
+// returned by `ReadDirectoryChangesW` (a size of 0 marks a moment when no more notifications were queued). Changes are printed one per line,
+// `--dirs` gives relative names of directories of the tree (one per line, with `\` separators), so that their modifications are dropped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "dir_notify_decoder.h"
+
+static size_t num_of_allocations = 0;
+void *operator new(size_t size)
+{
+    num_of_allocations++;
+    void *p = malloc(size != 0 ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) noexcept {free(p);}
+void operator delete(void *p, size_t) noexcept {free(p);}
+
+typedef char16_t WChar;
+typedef std::u16string WString;
+
+static WString to_utf16(const std::string &s) // names are ASCII
+{
+    return WString(s.begin(), s.end());
+}
+
+static std::string to_utf8(const WChar *s, size_t length)
+{
+    std::string r;
+    for (size_t i = 0; i < length; i++) {
+        uint32_t c = s[i];
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < length && s[i + 1] >= 0xDC00 && s[i + 1] < 0xE000)
+            c = 0x10000 + ((c - 0xD800) << 10) + (s[++i] - 0xDC00);
+        if (c < 0x80)
+            r += char(c);
+        else if (c < 0x800) {
+            r += char(0xC0 | c >> 6);
+            r += char(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000) {
+            r += char(0xE0 | c >> 12);
+            r += char(0x80 | (c >> 6 & 0x3F));
+            r += char(0x80 | (c & 0x3F));
+        }
+        else {
+            r += char(0xF0 | c >> 18);
+            r += char(0x80 | (c >> 12 & 0x3F));
+            r += char(0x80 | (c >> 6 & 0x3F));
+            r += char(0x80 | (c & 0x3F));
+        }
+    }
+    return r;
+}
+
+static const char *OPERATIONS[] = {"CREATE", "MODIFY", "RENAME", "MOVE", "DELETE"};
+
+struct Change
+{
+    int operation;
+    WString fname, new_fname;
+    bool operator<(const Change &c) const {return operation != c.operation ? operation < c.operation : fname != c.fname ? fname < c.fname : new_fname < c.new_fname;}
+    bool operator==(const Change &c) const {return operation == c.operation && fname == c.fname && new_fname == c.new_fname;}
+};
+
+// Buffers of records as `ReadDirectoryChangesW` fills them
+class BufferWriter
+{
+public:
+    std::vector<std::vector<char>> buffers;
+    size_t buffer_size;
+
+    BufferWriter(size_t buffer_size) : buffer_size(buffer_size) {buffers.push_back(std::vector<char>());}
+
+    void add(uint32_t action, const WString &name, bool keep_with_next = false)
+    {
+        size_t size = (offsetof(NotifyRecord<WChar>, name) + name.size() * sizeof(WChar) + 3) & ~size_t(3);
+        std::vector<char> *b = &buffers.back();
+        if (!held && b->size() + size + (keep_with_next ? 4 + offsetof(NotifyRecord<WChar>, name) + MAX_NAME_BYTES : 0) > buffer_size) {
+            buffers.push_back(std::vector<char>());
+            b = &buffers.back();
+            last = 0;
+        }
+        held = keep_with_next; // renames are never split between buffers
+        if (!b->empty())
+            ((NotifyRecord<WChar>*)(b->data() + last))->next_entry_offset = uint32_t(b->size() - last);
+        last = b->size();
+        b->resize(last + size);
+        NotifyRecord<WChar> *r = (NotifyRecord<WChar>*)(b->data() + last);
+        r->next_entry_offset = 0;
+        r->action = action;
+        r->name_length = uint32_t(name.size() * sizeof(WChar));
+        memcpy(r->name, name.data(), name.size() * sizeof(WChar));
+    }
+
+    static const size_t MAX_NAME_BYTES = 512;
+
+private:
+    size_t last = 0;
+    bool held = false;
+};
+
+// What `read_directory_changes_thread_proc()` did before (with `GetFileAttributes` as `stat()`)
+class OldDecoder
+{
+public:
+    std::string root;
+    std::vector<Change> *changes;
+    WString just_removed_file_name;
+
+    static WString path_base_name(const WString &path)
+    {
+        size_t p = path.find_last_of(u"\\/");
+        return p != WString::npos ? path.substr(p + 1) : path;
+    }
+
+    void add_dir_change(int operation, const WString &fname, const WString &new_fname = WString())
+    {
+        if (operation == 3 && fname == new_fname)
+            return;
+        Change c = {operation, fname, new_fname};
+        changes->push_back(c);
+    }
+
+    bool is_dir(const WString &fname)
+    {
+        std::string path = root + '/' + to_utf8(fname.data(), fname.size());
+        std::replace(path.begin(), path.end(), '\\', '/');
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+
+    void decode(const char *fni_buf)
+    {
+        typedef NotifyRecord<WChar> FNI;
+        const FNI *fni = (const FNI*)fni_buf, *next_fni;
+        if (!just_removed_file_name.empty()) {
+            if (fni->action == NOTIFY_ADDED && path_base_name(just_removed_file_name) == path_base_name(WString(fni->name, fni->name_length/sizeof(WChar)))) {
+                add_dir_change(3, just_removed_file_name, WString(fni->name, fni->name_length/sizeof(WChar)));
+                just_removed_file_name.clear();
+                if (fni->next_entry_offset == 0)
+                    return;
+                fni = (const FNI*)((const char*)fni + fni->next_entry_offset);
+            }
+            else {
+                add_dir_change(4, just_removed_file_name);
+                just_removed_file_name.clear();
+            }
+        }
+
+        for (;; fni = next_fni) {
+            next_fni = (const FNI*)((const char*)fni + fni->next_entry_offset);
+            WString fname(fni->name, fni->name_length/sizeof(WChar));
+            int operation = -1;
+            switch (fni->action)
+            {
+            case NOTIFY_ADDED:
+                if (!just_removed_file_name.empty() && path_base_name(just_removed_file_name) == path_base_name(fname)) {
+                    add_dir_change(3, just_removed_file_name, fname);
+                    just_removed_file_name.clear();
+                    break;
+                }
+                operation = 0;
+                break;
+            case NOTIFY_REMOVED:
+                if (next_fni->action == NOTIFY_ADDED && path_base_name(fname) == path_base_name(WString(next_fni->name, next_fni->name_length/sizeof(WChar)))) {
+                    add_dir_change(3, fname, WString(next_fni->name, next_fni->name_length/sizeof(WChar)));
+                    fni = next_fni;
+                    next_fni = (const FNI*)((const char*)fni + fni->next_entry_offset);
+                    break;
+                }
+                if (!just_removed_file_name.empty())
+                    add_dir_change(4, just_removed_file_name);
+                just_removed_file_name = fname;
+                break;
+            case NOTIFY_MODIFIED:
+                if (is_dir(fname))
+                    break;
+                operation = 1;
+                break;
+            case NOTIFY_RENAMED_OLD_NAME:
+                add_dir_change(2, fname, WString(next_fni->name, next_fni->name_length/sizeof(WChar)));
+                fni = next_fni;
+                next_fni = (const FNI*)((const char*)fni + fni->next_entry_offset);
+                break;
+            }
+            if (operation >= 0)
+                add_dir_change(operation, fname);
+            if (fni->next_entry_offset == 0)
+                break;
+        }
+    }
+
+    void flush()
+    {
+        if (!just_removed_file_name.empty()) {
+            add_dir_change(4, just_removed_file_name);
+            just_removed_file_name.clear();
+        }
+    }
+};
+
+struct Classifier
+{
+    const std::unordered_set<WString> *dirs;
+    WString name;
+
+    bool excluded(const NameView<WChar>&) {return false;}
+    bool is_dir(const NameView<WChar> &fname) // a hash set stands for the tree (it allocates no more than lookups in the tree)
+    {
+        name.assign(fname.chars, fname.length);
+        return dirs->count(name) != 0;
+    }
+};
+
+static int replay(const char *file_name, const char *dirs_file_name)
+{
+    std::unordered_set<WString> dirs;
+    if (dirs_file_name != nullptr) {
+        FILE *f = fopen(dirs_file_name, "r");
+        if (f == nullptr) {
+            fprintf(stderr, "Can not open `%s`\n", dirs_file_name);
+            return 1;
+        }
+        char line[4096];
+        while (fgets(line, sizeof(line), f)) {
+            std::string s(line);
+            while (!s.empty() && (s.back() == '\n' || s.back() == '\r'))
+                s.pop_back();
+            dirs.insert(to_utf16(s)); // ASCII names only
+        }
+        fclose(f);
+    }
+    FILE *f = fopen(file_name, "rb");
+    if (f == nullptr) {
+        fprintf(stderr, "Can not open `%s`\n", file_name);
+        return 1;
+    }
+    NotifyDecoder<WChar> decoder;
+    Classifier classifier = {&dirs};
+    auto emit = [](DirChange::Operation operation, const NameView<WChar> &fname, const NameView<WChar> &new_fname) {
+        printf("%s %s", OPERATIONS[int(operation)], to_utf8(fname.chars, fname.length).c_str());
+        if (!new_fname.is_null())
+            printf(" -> %s", to_utf8(new_fname.chars, new_fname.length).c_str());
+        printf("\n");
+    };
+    std::vector<char> buffer;
+    for (;;) {
+        unsigned char size_bytes[4];
+        if (fread(size_bytes, 1, 4, f) != 4)
+            break;
+        uint32_t size = size_bytes[0] | size_bytes[1] << 8 | size_bytes[2] << 16 | uint32_t(size_bytes[3]) << 24;
+        if (size == 0) {
+            decoder.flush(emit);
+            continue;
+        }
+        buffer.resize(size);
+        if (fread(buffer.data(), 1, size, f) != size)
+            break;
+        decoder.decode(buffer.data(), size, classifier, emit);
+    }
+    decoder.flush(emit);
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_of_records = 1000000;
+    size_t buffer_size = 64*1024;
+    uint64_t seed = 1;
+    std::string dir = "/tmp/notifybench_tree";
+    const char *replay_file = nullptr, *dirs_file = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if      (strcmp(argv[i], "--records") == 0 && i + 1 < argc)     num_of_records = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--buffer-size") == 0 && i + 1 < argc) buffer_size = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)        seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)         dir = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)      replay_file = argv[++i];
+        else if (strcmp(argv[i], "--dirs") == 0 && i + 1 < argc)        dirs_file = argv[++i];
+        else {
+            fprintf(stderr, "Unknown option `%s`\n", argv[i]);
+            return 1;
+        }
+    }
+    if (replay_file != nullptr)
+        return replay(replay_file, dirs_file);
+
+    // The tree: 10 top directories with 100 subdirectories each
+    std::vector<WString> dir_names;
+    std::unordered_set<WString> dirs;
+    if (system(("rm -rf '" + dir + "' && mkdir -p '" + dir + "'").c_str()) != 0)
+        return 1;
+    for (int i = 0; i < 10; i++) {
+        std::string top = "project" + std::to_string(i);
+        mkdir((dir + '/' + top).c_str(), 0755);
+        dirs.insert(to_utf16(top));
+        for (int j = 0; j < 100; j++) {
+            std::string sub = top + "\\module" + std::to_string(j);
+            mkdir((dir + '/' + top + "/module" + std::to_string(j)).c_str(), 0755);
+            dir_names.push_back(to_utf16(sub));
+            dirs.insert(dir_names.back());
+        }
+    }
+
+    // The stream: files are created, written, and later moved, renamed or deleted
+    std::mt19937_64 rng(seed);
+    BufferWriter writer(buffer_size);
+    std::vector<WString> files;
+    int records = 0, file_number = 0;
+    while (records < num_of_records) {
+        unsigned r = rng() % 100;
+        if (r < 20 || files.empty()) {
+            WString name = dir_names[rng() % dir_names.size()] + u"\\source_file_" + to_utf16(std::to_string(file_number++)) + u".cpp";
+            writer.add(NOTIFY_ADDED, name);
+            files.push_back(name);
+            records++;
+        }
+        else if (r < 70) {
+            writer.add(NOTIFY_MODIFIED, files[rng() % files.size()]);
+            records++;
+        }
+        else if (r < 80) { // excess notification of a directory
+            writer.add(NOTIFY_MODIFIED, dir_names[rng() % dir_names.size()]);
+            records++;
+        }
+        else if (r < 87) { // moved to another directory
+            size_t i = rng() % files.size();
+            WString base = files[i].substr(files[i].find_last_of(u'\\'));
+            writer.add(NOTIFY_REMOVED, files[i], true);
+            files[i] = dir_names[rng() % dir_names.size()] + base;
+            writer.add(NOTIFY_ADDED, files[i]);
+            records += 2;
+        }
+        else if (r < 94) { // renamed in place
+            size_t i = rng() % files.size();
+            writer.add(NOTIFY_RENAMED_OLD_NAME, files[i], true);
+            files[i] += u"~";
+            writer.add(NOTIFY_RENAMED_NEW_NAME, files[i]);
+            records += 2;
+        }
+        else {
+            size_t i = rng() % files.size();
+            writer.add(NOTIFY_REMOVED, files[i]);
+            files[i] = files.back();
+            files.pop_back();
+            records++;
+        }
+    }
+
+    // Both decoders get the same buffers, and are told that no more notifications are queued after every buffer
+    std::vector<Change> old_changes, new_changes;
+    old_changes.reserve(records);
+    new_changes.reserve(records);
+    size_t allocations = num_of_allocations;
+    auto start = std::chrono::steady_clock::now();
+    OldDecoder old_decoder;
+    old_decoder.root = dir;
+    old_decoder.changes = &old_changes;
+    for (auto &&b : writer.buffers) {
+        old_decoder.decode(b.data());
+        old_decoder.flush();
+    }
+    double old_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t old_allocations = num_of_allocations - allocations;
+
+    NotifyDecoder<WChar> decoder;
+    Classifier classifier = {&dirs};
+    size_t num_of_changes = 0;
+    std::vector<int> operations;
+    std::vector<WChar> chars; // names are copied as `add_dir_change()` does, but into reserved memory so that allocations are of the decoder only
+    std::vector<size_t> offsets, lengths; // `SIZE_MAX` offsets for null names
+    chars.reserve(records * 100);
+    operations.reserve(records);
+    offsets.reserve(records * 2);
+    lengths.reserve(records * 2);
+    auto emit = [&](DirChange::Operation operation, const NameView<WChar> &fname, const NameView<WChar> &new_fname) {
+        if (operation == DirChange::Operation::MOVE && fname == new_fname) // as `DirChangeQueue::push()` drops it
+            return;
+        operations.push_back(int(operation));
+        for (auto name : {&fname, &new_fname}) {
+            offsets.push_back(name->is_null() ? SIZE_MAX : chars.size());
+            lengths.push_back(name->length);
+            chars.insert(chars.end(), name->chars, name->chars + name->length);
+        }
+        num_of_changes++;
+    };
+    allocations = num_of_allocations;
+    start = std::chrono::steady_clock::now();
+    for (auto &&b : writer.buffers) {
+        decoder.decode(b.data(), b.size(), classifier, emit);
+        decoder.flush(emit);
+    }
+    double new_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    size_t new_allocations = num_of_allocations - allocations;
+
+    for (size_t i = 0; i < num_of_changes; i++) {
+        Change c = {operations[i], WString(&chars[offsets[i*2]], lengths[i*2]), offsets[i*2 + 1] != SIZE_MAX ? WString(&chars[offsets[i*2 + 1]], lengths[i*2 + 1]) : WString()};
+        new_changes.push_back(c);
+    }
+    std::sort(old_changes.begin(), old_changes.end()); // a deletion which ends a buffer was reported by the old decoding when the next buffer came
+    std::sort(new_changes.begin(), new_changes.end());
+    bool same = old_changes == new_changes;
+
+    printf("{\"records\": %d, \"buffers\": %zu, \"buffer_size\": %zu, \"changes\": %zu, \"old_seconds_per_record\": %.9f, \"old_allocations_per_record\": %.2f, "
+           "\"seconds_per_record\": %.9f, \"allocations_per_record\": %.4f, \"same_changes\": %s}\n",
+           records, writer.buffers.size(), buffer_size, num_of_changes, old_seconds / records, double(old_allocations) / records,
+           new_seconds / records, double(new_allocations) / records, same ? "true" : "false");
+    if (system(("rm -rf '" + dir + "'").c_str()) != 0) {}
+    return same ? 0 : 1;
+}
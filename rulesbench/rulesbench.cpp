@@ -0,0 +1,141 @@
+﻿// Benchmark of matching of directory names against rules (`DirRules`): the compiled matcher against checking every rule in turn.
+// It runs anywhere.
+// Build:
+//   g++ -O2 -std=c++14 -I../clientapp rulesbench.cpp ../clientapp/dir_rules.cpp -o rulesbench
+// Usage:
+//   rulesbench [--patterns N[,N...]] [--names N] [--seed N]
+// For every number of `--patterns` (10,100,1000,10000 by default) random rules with name conditions are generated (`contains=<key>`, `name=*<key>*`,
+// `name=<key>*` and `name=*<key>?<key>*`, keys are of 3 to 6 letters), and `--names` random names of 6 to 24 letters (a tenth of them has a key of some rule
+// in it) are matched against them. It prints one JSON object per line with the time per name of the compiled matcher and of the naive matching (rules
+// are checked in order, globs by a backtracking matcher and substrings by `std::string::find`) and whether both have found the same first matching rules.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include "dir_rules.h"
+
+struct Options
+{
+    std::vector<int> patterns = {10, 100, 1000, 10000};
+    int names = 20000;
+    uint64_t seed = 1;
+};
+
+struct Pattern
+{
+    bool glob; // `name=` or `contains=`
+    std::string text;
+};
+
+static std::string random_letters(std::mt19937_64 &rng, int min_length, int max_length)
+{
+    std::string r(std::uniform_int_distribution<int>(min_length, max_length)(rng), ' ');
+    for (auto &&c : r)
+        c = char('a' + rng() % 26);
+    return r;
+}
+
+static bool naive_glob_match(const char *p, const char *s)
+{
+    if (*p == 0)
+        return *s == 0;
+    if (*p == '*')
+        return naive_glob_match(p + 1, s) || (*s != 0 && naive_glob_match(p, s + 1));
+    return *s != 0 && (*p == '?' || *p == *s) && naive_glob_match(p + 1, s + 1);
+}
+
+static int naive_match(const std::vector<Pattern> &patterns, const std::string &name) // returns the line of the first matching rule, or 0
+{
+    for (size_t i = 0; i < patterns.size(); i++)
+        if (patterns[i].glob ? naive_glob_match(patterns[i].text.c_str(), name.c_str()) : name.find(patterns[i].text) != std::string::npos)
+            return int(i + 1);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    Options o;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--patterns") == 0 && i + 1 < argc) {
+            o.patterns.clear();
+            for (const char *p = argv[++i]; *p != 0; p = strchr(p, ',') != NULL ? strchr(p, ',') + 1 : p + strlen(p))
+                o.patterns.push_back(atoi(p));
+        }
+        else if (strcmp(argv[i], "--names") == 0 && i + 1 < argc) o.names = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)  o.seed = strtoull(argv[++i], NULL, 10);
+        else {
+            fprintf(stderr, "Unknown option `%s`\n", argv[i]);
+            return 1;
+        }
+    }
+
+    int mismatches = 0;
+    for (int num_of_patterns : o.patterns) {
+        std::mt19937_64 rng(o.seed);
+        std::vector<Pattern> patterns;
+        std::vector<std::string> keys;
+        std::string text;
+        for (int i = 0; i < num_of_patterns; i++) {
+            std::string key = random_letters(rng, 3, 6);
+            keys.push_back(key);
+            Pattern p;
+            switch (rng() % 4)
+            {
+            case 0:  p.glob = false; p.text = key; break;
+            case 1:  p.glob = true;  p.text = '*' + key + '*'; break;
+            case 2:  p.glob = true;  p.text = key + '*'; break;
+            default: p.glob = true;  p.text = '*' + key + '?' + random_letters(rng, 3, 6) + '*'; break;
+            }
+            patterns.push_back(p);
+            text += std::string("exclude ") + (p.glob ? "name=" : "contains=") + p.text + '\n';
+        }
+
+        DirRules rules;
+        std::string error;
+        if (!rules.parse(text, error)) {
+            fprintf(stderr, "Rules are not parsed: %s\n", error.c_str());
+            return 1;
+        }
+
+        std::vector<std::string> names;
+        for (int i = 0; i < o.names; i++) {
+            std::string name = random_letters(rng, 6, 24);
+            if (rng() % 10 == 0) {
+                const std::string &key = keys[rng() % keys.size()];
+                name.replace(rng() % (name.size() - 3), std::min(key.size(), name.size()), key);
+            }
+            names.push_back(name);
+        }
+        std::vector<PathString> path_names(names.size()); // PathChar is wchar_t on Windows
+        for (size_t i = 0; i < names.size(); i++)
+            path_names[i].assign(names[i].begin(), names[i].end());
+
+        const int LEVEL = 4; // deeper than built-in rules of names
+        std::vector<int> compiled_lines(names.size()), naive_lines(names.size());
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < names.size(); i++) {
+            const DirRule *r = rules.classify(nullptr, 0, path_names[i].c_str(), LEVEL, -1, -1);
+            compiled_lines[i] = r != nullptr ? r->line : 0;
+        }
+        double compiled_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < names.size(); i++)
+            naive_lines[i] = naive_match(patterns, names[i]);
+        double naive_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        size_t matched = 0;
+        for (auto &&l : naive_lines)
+            matched += l != 0;
+        bool same = compiled_lines == naive_lines;
+        mismatches += !same;
+        printf("{\"patterns\": %d, \"names\": %d, \"matched_names\": %zu, \"compiled_ns_per_name\": %.1f, \"naive_ns_per_name\": %.1f, \"same_matches\": %s}\n",
+               num_of_patterns, o.names, matched, compiled_seconds * 1e9 / names.size(), naive_seconds * 1e9 / names.size(), same ? "true" : "false");
+        fflush(stdout);
+    }
+    return mismatches != 0 ? 1 : 0;
+}
@@ -0,0 +1,344 @@
+﻿// Benchmark of the directory scanner on reproducible synthetic trees (POSIX only, it is meant to be run on a Linux build host to track regressions between releases).
+// Build:
+//   g++ -O2 -std=c++14 -pthread -I../clientapp scanbench.cpp ../clientapp/dir_scanner.cpp ../clientapp/dir_entry.cpp ../clientapp/dir_snapshot.cpp ../clientapp/dir_enumerator.cpp ../clientapp/dir_rules.cpp ../clientapp/storage_device.cpp ../clientapp/dir_name_index.cpp -o scanbench
+// Usage:
+//   scanbench [--shape tree|wide|deep|all] [--depth N] [--fanout N] [--files N] [--name-length N] [--max-age-days N] [--max-file-size N]
+//             [--seed N] [--threads N] [--runs N] [--dir PATH] [--keep]
+// Shapes: `tree` is a balanced tree (depth 4, fan-out 8, 16 files per directory by default), `wide` is one directory with 1M files,
+// `deep` is a chain of 200 nested directories. Files are sparse (they take no disk space), their sizes and last write times are random but
+// determined by the seed. Every run prints one JSON object per line to stdout (progress goes to stderr).
+// After each run, totals of the scanned tree are propagated again in memory by the scheme used before the scanner published totals to parents only
+// (totals of each listed directory were added to every ancestor) and by the current one, to compare the number of writes and the time (they differ most
+// for `deep` shape).
+// Memory of `dir_tree` is reported as used bytes (of allocated entries and names) and as reserved bytes (of whole chunks). The scanned tree is also
+// copied into nested maps with the layout of directory entries used before `dir_tree` (`MapDirEntry`), and the heap taken by them is reported
+// (it is measured by `mallinfo2()`, so glibc 2.33 or later is required).
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "dir_scanner.h"
+
+struct Options
+{
+    std::string shape = "tree";
+    int depth = -1, fanout = -1, files = -1; // -1 means default for the shape
+    int name_length = 12;
+    int max_age_days = 730;
+    int64_t max_file_size = 1024*1024;
+    uint64_t seed = 1;
+    int threads = 0; // per device, 0 means that the scanner chooses it by the kind of the device
+    int runs = 3;
+    std::string dir;
+    bool keep = false;
+};
+
+struct Generator
+{
+    const Options &options;
+    std::mt19937_64 rng;
+    time_t now;
+    uint64_t num_of_dirs = 0, num_of_files = 0;
+
+    Generator(const Options &options) : options(options), rng(options.seed), now(time(NULL)) {}
+
+    std::string name(uint64_t index)
+    {
+        static const char CHARS[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+        std::string r;
+        for (int i = 0; i < options.name_length - 6; i++)
+            r += CHARS[rng() % 36];
+        for (int i = 0; i < 6; i++, index /= 36) // makes names unique within a directory
+            r += CHARS[index % 36];
+        return r;
+    }
+
+    void add_files(int dfd, int n)
+    {
+        for (int i = 0; i < n; i++) {
+            int fd = openat(dfd, ("f" + name(i)).c_str(), O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, 0644);
+            if (fd < 0) {
+                perror("openat");
+                exit(1);
+            }
+            double log_size = std::uniform_real_distribution<double>(0, log2(double(options.max_file_size) + 1))(rng); // sizes are spread evenly over orders of magnitude
+            if (ftruncate(fd, off_t(exp2(log_size)) - 1) != 0) {
+                perror("ftruncate");
+                exit(1);
+            }
+            timespec times[2];
+            times[0].tv_sec = times[1].tv_sec = now - time_t(rng() % (uint64_t(options.max_age_days) * 24 * 3600 + 1));
+            times[0].tv_nsec = times[1].tv_nsec = 0;
+            futimens(fd, times);
+            close(fd);
+            num_of_files++;
+        }
+    }
+
+    int make_dir(int parent_dfd, const std::string &dir_name)
+    {
+        if (mkdirat(parent_dfd, dir_name.c_str(), 0755) != 0) {
+            perror("mkdirat");
+            exit(1);
+        }
+        int dfd = openat(parent_dfd, dir_name.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (dfd < 0) {
+            perror("openat");
+            exit(1);
+        }
+        num_of_dirs++;
+        return dfd;
+    }
+
+    void tree(int dfd, int depth, int fanout, int files)
+    {
+        add_files(dfd, files);
+        if (depth == 0)
+            return;
+        for (int i = 0; i < fanout; i++) {
+            int sdfd = make_dir(dfd, "d" + name(i));
+            tree(sdfd, depth - 1, fanout, files);
+            close(sdfd);
+        }
+    }
+
+    void generate(int root_dfd)
+    {
+        if (options.shape == "tree")
+            tree(root_dfd, options.depth >= 0 ? options.depth : 4, options.fanout >= 0 ? options.fanout : 8, options.files >= 0 ? options.files : 16);
+        else if (options.shape == "wide")
+            add_files(root_dfd, options.files >= 0 ? options.files : 1000000);
+        else if (options.shape == "deep")
+            tree(root_dfd, options.depth >= 0 ? options.depth : 200, 1, options.files >= 0 ? options.files : 4); // directories are created relative to their parents, so path length is not limited here
+        else {
+            fprintf(stderr, "Unknown shape `%s`\n", options.shape.c_str());
+            exit(1);
+        }
+    }
+};
+
+static int remove_entry(const char *path, const struct stat *, int, FTW *)
+{
+    return remove(path);
+}
+
+static int64_t peak_rss() // in bytes
+{
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return int64_t(ru.ru_maxrss) * 1024;
+}
+
+// Layout of a directory entry before `dir_tree`: a node of the map of subdirectories of its parent keyed by its name
+struct MapDirEntry
+{
+    MapDirEntry *parent = nullptr;
+    const PathString *dir_name = nullptr; // key of the node
+    std::map<PathString, MapDirEntry> subdirs; // names were compared case-insensitively by a stateless comparator
+    SpinLock subdirs_lock;
+    int32_t dir_num_of_files = 0, num_of_files = 0, num_of_files_excluded = 0;
+    int64_t dir_files_size = 0, size = 0, size_excluded = 0;
+    uint64_t max_last_write_time = 0;
+    int mode_auto = 0, mode_manual = 0; // underlying type of DirMode was int
+    float priority_auto = 0, priority_manual = 0; // priorities were floats
+    bool mode_mixed = false, scan_started = false, expanded = false, not_traversed = false;
+};
+
+static void copy_to_map(const DirEntry &de, MapDirEntry &mde)
+{
+    mde.dir_num_of_files = de.dir_num_of_files;
+    mde.num_of_files = de.num_of_files;
+    mde.dir_files_size = de.dir_files_size;
+    mde.size = de.size;
+    mde.max_last_write_time = de.max_last_write_time;
+    mde.scan_started = de.scan_started;
+    for (auto &&sd : de.subdirs()) {
+        auto it = mde.subdirs.insert(mde.subdirs.end(), std::make_pair(PathString(sd.name()), MapDirEntry()));
+        it->second.parent = &mde;
+        it->second.dir_name = &it->first;
+        copy_to_map(sd, it->second);
+    }
+}
+
+struct Propagation
+{
+    uint64_t ancestor_writes = 0;
+    double seconds = 0;
+};
+
+// Sets totals of `dirs` (a whole subtree, parents before their subdirectories) from the files of the directories, in the order in which they were listed
+static Propagation propagate_totals(const std::vector<DirEntry*> &dirs, bool to_every_ancestor)
+{
+    Propagation p;
+    auto start = std::chrono::steady_clock::now();
+    if (to_every_ancestor) // as directories were listed, their files were added to all their ancestors
+        for (auto &&de : dirs) {
+            de->size = de->dir_files_size;
+            de->num_of_files = de->dir_num_of_files;
+            for (DirEntry *pde = de->parent(); pde != nullptr; pde = pde->parent()) {
+                pde->size += de->dir_files_size;
+                pde->num_of_files += de->dir_num_of_files;
+                p.ancestor_writes++;
+            }
+        }
+    else { // as in `DirScanner::publish()`: totals of a completed subtree are added to its parent once
+        for (auto &&de : dirs) {
+            de->size = de->dir_files_size;
+            de->num_of_files = de->dir_num_of_files;
+        }
+        for (size_t i = dirs.size(); i-- > 1; ) { // subtrees are completed in the reverse order of listing (the root has no parent)
+            DirEntry &pde = *dirs[i]->parent();
+            pde.size += dirs[i]->size;
+            pde.num_of_files += dirs[i]->num_of_files;
+            p.ancestor_writes++;
+        }
+    }
+    p.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return p;
+}
+
+static void bench(const Options &options)
+{
+    std::string root_dir = options.dir;
+    if (root_dir.empty()) {
+        char tmpl[] = "/tmp/scanbench.XXXXXX";
+        if (mkdtemp(tmpl) == NULL) {
+            perror("mkdtemp");
+            exit(1);
+        }
+        root_dir = tmpl;
+    }
+    else if (mkdir(root_dir.c_str(), 0755) != 0) {
+        perror("mkdir");
+        exit(1);
+    }
+
+    fprintf(stderr, "Generating `%s` tree in %s...\n", options.shape.c_str(), root_dir.c_str());
+    Generator g(options);
+    auto start = std::chrono::steady_clock::now();
+    int root_dfd = open(root_dir.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    g.generate(root_dfd);
+    close(root_dfd);
+    double generation_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (int run = 1; run <= options.runs; run++) {
+        volatile bool stop = false;
+        dir_tree.clear();
+        DirEntry *root = dir_tree.add_root(root_dir);
+        std::vector<DirScanner::Root> roots;
+        roots.push_back(DirScanner::Root(root_dir, root));
+
+        DirScanner scanner(stop, options.threads);
+        start = std::chrono::steady_clock::now();
+        scanner.scan(roots);
+        double scan_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        DirScanner rescanner(stop, options.threads); // nothing has changed, so the rescan is incremental
+        start = std::chrono::steady_clock::now();
+        rescanner.scan(roots);
+        double rescan_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (uint64_t(root->num_of_files) != g.num_of_files || scanner.num_of_dirs_scanned() != g.num_of_dirs + 1)
+            fprintf(stderr, "Warning: scanned %d files and %llu directories, but %llu files and %llu directories were generated\n",
+                    (int)root->num_of_files, (unsigned long long)scanner.num_of_dirs_scanned(), (unsigned long long)g.num_of_files, (unsigned long long)g.num_of_dirs + 1);
+
+        std::vector<DirEntry*> dirs, stack(1, root); // in pre-order, as they are listed by a single worker
+        while (!stack.empty()) {
+            DirEntry *de = stack.back();
+            stack.pop_back();
+            dirs.push_back(de);
+            for (auto &&sd : de->subdirs())
+                stack.push_back(&sd);
+        }
+        int64_t size = root->size;
+        int32_t num_of_files = root->num_of_files;
+        Propagation per_ancestor = propagate_totals(dirs, true);
+        if (root->size != size || root->num_of_files != num_of_files)
+            fprintf(stderr, "Warning: totals propagated to every ancestor differ from totals of the scan\n");
+        Propagation bottom_up = propagate_totals(dirs, false);
+        if (root->size != size || root->num_of_files != num_of_files)
+            fprintf(stderr, "Warning: totals propagated to parents differ from totals of the scan\n");
+
+        size_t heap_before = mallinfo2().uordblks;
+        MapDirEntry *map_root = new MapDirEntry;
+        copy_to_map(*root, *map_root);
+        size_t map_memory = mallinfo2().uordblks - heap_before;
+        delete map_root;
+
+        uint64_t entries = scanner.num_of_dirs_scanned() + scanner.num_of_files_scanned();
+        printf("{\"shape\": \"%s\", \"seed\": %llu, \"run\": %d, \"threads\": %d, \"workers\": %d, \"dirs\": %llu, \"files\": %llu, \"generation_seconds\": %.3f, "
+               "\"scan_seconds\": %.6f, \"entries_per_second\": %.0f, \"rescan_seconds\": %.6f, \"dirs_unchanged\": %llu, "
+               "\"ancestor_writes\": %llu, \"replayed_ancestor_writes\": %llu, \"replayed_seconds\": %.6f, \"per_ancestor_writes\": %llu, \"per_ancestor_seconds\": %.6f, "
+               "\"peak_rss_bytes\": %lld, \"sizeof_dir_entry\": %d, \"bytes_per_dir_entry\": %.1f, \"dir_tree_used_bytes\": %llu, \"dir_tree_reserved_bytes\": %llu, "
+               "\"sizeof_map_dir_entry\": %d, \"bytes_per_map_dir_entry\": %.1f, \"map_tree_bytes\": %llu, \"map_to_dir_tree_ratio\": %.2f}\n",
+               options.shape.c_str(), (unsigned long long)options.seed, run, options.threads, scanner.num_of_workers(), (unsigned long long)scanner.num_of_dirs_scanned(), (unsigned long long)scanner.num_of_files_scanned(), generation_seconds,
+               scan_seconds, entries / scan_seconds, rescan_seconds, (unsigned long long)rescanner.num_of_dirs_unchanged(),
+               (unsigned long long)scanner.num_of_ancestor_writes(), (unsigned long long)bottom_up.ancestor_writes, bottom_up.seconds, (unsigned long long)per_ancestor.ancestor_writes, per_ancestor.seconds,
+               (long long)peak_rss(), (int)sizeof(DirEntry), dir_tree.bytes_per_entry(), (unsigned long long)dir_tree.memory_used(), (unsigned long long)dir_tree.memory_reserved(),
+               (int)sizeof(MapDirEntry), double(map_memory) / dirs.size(), (unsigned long long)map_memory, double(map_memory) / dir_tree.memory_used());
+        fflush(stdout);
+    }
+
+    if (!options.keep)
+        nftw(root_dir.c_str(), remove_entry, 64, FTW_DEPTH|FTW_PHYS);
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--keep") {
+            options.keep = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            fprintf(stderr, "Value of `%s` is missing\n", arg.c_str());
+            return 1;
+        }
+        const char *value = argv[++i];
+        if      (arg == "--shape")         options.shape = value;
+        else if (arg == "--depth")         options.depth = atoi(value);
+        else if (arg == "--fanout")        options.fanout = atoi(value);
+        else if (arg == "--files")         options.files = atoi(value);
+        else if (arg == "--name-length")   options.name_length = atoi(value);
+        else if (arg == "--max-age-days")  options.max_age_days = atoi(value);
+        else if (arg == "--max-file-size") options.max_file_size = atoll(value);
+        else if (arg == "--seed")          options.seed = strtoull(value, NULL, 10);
+        else if (arg == "--threads")       options.threads = atoi(value);
+        else if (arg == "--runs")          options.runs = atoi(value);
+        else if (arg == "--dir")           options.dir = value;
+        else {
+            fprintf(stderr, "Unknown option `%s`\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    if (options.shape == "all") {
+        const char *shapes[] = {"tree", "wide", "deep"};
+        for (auto &&shape : shapes) {
+            Options o = options;
+            o.shape = shape;
+            if (!o.dir.empty())
+                o.dir += std::string(".") + shape;
+            bench(o);
+        }
+    }
+    else
+        bench(options);
+    return 0;
+}
@@ -0,0 +1,345 @@
+﻿// Benchmark of the settle detection of the change queue (`DirChangeQueue`) against the fixed settle time which was used before, on replayed traces of writes.
+// It runs anywhere.
+// Build:
+//   g++ -O2 -std=c++14 -I../clientapp settlebench.cpp ../clientapp/dir_change_queue.cpp -o settlebench
+// Usage:
+//   settlebench [--minutes N] [--seed N]
+//   settlebench --trace FILE
+// A trace is a sequence of lines `<milliseconds> <operation> <name> <size>` in the order of time, where the operation is `C` (the file is created), `M` (it is
+// written and a notification comes), `W` (it is written silently: the notification is delayed, as for writes through a handle which is kept open) or `D`
+// (it is deleted), and the size is the one after the operation. Without `--trace` a trace of `--minutes` is generated: `small` files are written by
+// a few quick writes, `large` files of gigabytes are written slowly with a notification every few seconds, `download` files are written in bursts with
+// stalls between them, and a `db` file is touched again and again without a change of its size. Then a `revisit` trace follows, where large files are
+// written again 2 hours after they have settled while nothing else changes (the queue must have forgotten them, or it would wait for such a gap again).
+// Files are simulated (a probe sees the size and the time of the last write), and changes are taken the old way (every 250 ms, changes without events
+// for 500 ms) and by the queue (woken up by a push into an empty intake or when the next change is to be checked, as the applier is). For every group
+// of files (the first component of names) and for all of them in each trace it prints one JSON object per line with, for both: the number of copies (taken creations
+// and modifications), partial copies (taken while the file was written again later, so the copy was not of its final content), the median and 99th
+// percentile of the latency of pickup (from the last write of a file to the copy after it) and, for the queue, the number of probes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "dir_change_queue.h"
+
+const uint32_t TAKE_INTERVAL = 250, SETTLE_TIME = 500;
+
+struct Options
+{
+    int minutes = 20;
+    uint64_t seed = 1;
+    const char *trace = nullptr;
+};
+
+struct TraceEvent
+{
+    uint32_t time;
+    char operation; // C, M, W or D
+    std::string name;
+    uint64_t size;
+};
+
+static bool read_trace(const char *path, std::vector<TraceEvent> &events)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return false;
+    char line[4096], name[4096];
+    TraceEvent e;
+    unsigned long long size;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "%u %c %4095s %llu", &e.time, &e.operation, name, &size) == 4) {
+            e.name = name;
+            e.size = size;
+            events.push_back(e);
+        }
+    fclose(f);
+    std::stable_sort(events.begin(), events.end(), [](const TraceEvent &a, const TraceEvent &b) {return a.time < b.time;});
+    return true;
+}
+
+static std::vector<TraceEvent> make_trace(int minutes, std::mt19937_64 &rng)
+{
+    const uint64_t KB = 1024, MB = 1024*1024;
+    uint32_t duration = uint32_t(minutes) * 60000;
+    std::vector<TraceEvent> events;
+    auto uniform = [&rng](uint64_t a, uint64_t b) {return std::uniform_int_distribution<uint64_t>(a, b)(rng);};
+    auto add = [&events](uint32_t time, char operation, const std::string &name, uint64_t size) {
+        TraceEvent e = {time, operation, name, size};
+        events.push_back(e);
+    };
+
+    for (int i = 0; i < 3000; i++) { // documents saved, sources compiled, mail stored
+        std::string name = "small/dir" + std::to_string(i % 50) + "/file" + std::to_string(i);
+        uint32_t time = uint32_t(uniform(0, duration - 10000));
+        uint64_t size = uniform(1, 500) * KB;
+        int writes = int(uniform(1, 3));
+        add(time, 'C', name, 0);
+        for (int w = 1; w <= writes; w++)
+            add(time += uint32_t(uniform(1, 10)), 'M', name, size * w / writes);
+    }
+
+    for (int i = 0; i < 4; i++) { // videos rendered and disk images copied, chunk by chunk, while notifications come when the size is flushed
+        std::string name = "large/file" + std::to_string(i);
+        uint32_t time = uint32_t(uniform(0, duration / 2)), next_notification = time;
+        uint64_t size = 0, total = uniform(1024, 4096) * MB, rate = uniform(10, 40) * MB / 1000; // bytes per millisecond
+        add(time, 'C', name, 0);
+        while (size < total) {
+            time += 100;
+            size = std::min(size + rate * 100, total);
+            bool notified = size == total || time >= next_notification; // the last write is notified when the file is closed
+            if (notified)
+                next_notification = time + uint32_t(uniform(1000, 3000));
+            add(time, notified ? 'M' : 'W', name, size);
+        }
+    }
+
+    for (int i = 0; i < 30; i++) { // downloads which stall now and then
+        std::string name = "download/file" + std::to_string(i);
+        uint32_t time = uint32_t(uniform(0, duration / 2));
+        uint64_t size = 0, total = uniform(5, 200) * MB;
+        add(time, 'C', name, 0);
+        while (size < total) {
+            for (uint32_t burst_end = time + uint32_t(uniform(1000, 5000)); time < burst_end && size < total;) {
+                time += uint32_t(uniform(20, 40));
+                size = std::min(size + 64 * KB, total);
+                add(time, 'M', name, size);
+            }
+            time += uint32_t(uniform(1000, 10000));
+        }
+    }
+
+    std::string db = "db/mail.db"; // a database which is always open
+    add(0, 'C', db, 200 * MB);
+    for (uint32_t time = 0; time < duration; time += uint32_t(uniform(200, 3000)))
+        add(time, 'M', db, 200 * MB);
+
+    std::stable_sort(events.begin(), events.end(), [](const TraceEvent &a, const TraceEvent &b) {return a.time < b.time;});
+    return events;
+}
+
+static std::vector<TraceEvent> make_revisit_trace(std::mt19937_64 &rng) // a large file which is written again after hours while nothing else changes
+{
+    const uint64_t MB = 1024*1024;
+    const uint32_t HOUR = 3600000;
+    std::vector<TraceEvent> events;
+    auto uniform = [&rng](uint64_t a, uint64_t b) {return std::uniform_int_distribution<uint64_t>(a, b)(rng);};
+    for (int i = 0; i < 10; i++) {
+        std::string name = "revisit/file" + std::to_string(i);
+        uint32_t time = uint32_t(i) * 3 * HOUR;
+        uint64_t size = 0;
+        TraceEvent c = {time, 'C', name, 0};
+        events.push_back(c);
+        for (uint32_t start : {time, time + 2 * HOUR}) // written for a minute with a notification every second, then idle for 2 hours
+            for (time = start; time < start + 60000; time += uint32_t(uniform(900, 1100))) {
+                TraceEvent e = {time, 'M', name, size += 10 * MB};
+                events.push_back(e);
+            }
+    }
+    return events;
+}
+
+struct SimulatedFile
+{
+    uint64_t size, last_write_time;
+    bool exists;
+};
+
+struct FileStats
+{
+    uint32_t last_write_time; // of the whole trace
+    std::vector<uint32_t> writes; // times of writes, to find out whether a copy was partial
+    std::vector<uint32_t> copies;
+};
+
+struct GroupResult
+{
+    size_t copies = 0, partial_copies = 0, probes = 0;
+    std::vector<uint32_t> latencies;
+};
+
+typedef std::map<std::string, GroupResult> Results; // by group, "all" is the sum
+
+static std::string group_of(const std::string &name)
+{
+    size_t p = name.find('/');
+    return p == std::string::npos ? std::string("root") : name.substr(0, p);
+}
+
+// Copies of every file are compared with its writes: a copy is partial if the file is written after it, and the latency is from the last write to the first copy after it
+static void account(std::unordered_map<std::string, FileStats> &files, Results &results)
+{
+    for (auto &&f : files) {
+        GroupResult &g = results[group_of(f.first)], &all = results["all"];
+        for (auto &&c : f.second.copies) {
+            g.copies++, all.copies++;
+            if (c < f.second.last_write_time)
+                g.partial_copies++, all.partial_copies++;
+        }
+        auto c = std::lower_bound(f.second.copies.begin(), f.second.copies.end(), f.second.last_write_time);
+        if (c != f.second.copies.end()) {
+            g.latencies.push_back(*c - f.second.last_write_time);
+            all.latencies.push_back(*c - f.second.last_write_time);
+        }
+    }
+}
+
+// Replays the trace against the simulated files, `take` is called at every time when the consumer wakes up and returns the time when it wakes up next
+// (or `UINT32_MAX` if it sleeps until a push), `push` returns true if the consumer is to be woken up
+template <class Push, class Take> static void replay(const std::vector<TraceEvent> &trace, std::unordered_map<std::string, SimulatedFile> &fs, Push push, Take take)
+{
+    uint32_t wake = UINT32_MAX;
+    for (auto &&e : trace) {
+        while (wake <= e.time)
+            wake = take(wake);
+        SimulatedFile &f = fs[e.name];
+        if (e.operation == 'D')
+            f.exists = false;
+        else {
+            f.exists = true;
+            f.size = e.size;
+            f.last_write_time = e.time;
+        }
+        if (e.operation == 'W')
+            continue;
+
+        DirChange c;
+        c.tree = 0;
+        c.operation = e.operation == 'C' ? DirChange::Operation::CREATE : e.operation == 'M' ? DirChange::Operation::MODIFY : DirChange::Operation::DELETE;
+        c.fname = e.name;
+        c.time = e.time;
+        if (push(std::move(c)))
+            wake = std::min(wake, e.time);
+    }
+    while (wake != UINT32_MAX)
+        wake = take(wake);
+}
+
+static void record_copies(const std::vector<DirChange> &taken, uint32_t time, std::unordered_map<std::string, FileStats> &files)
+{
+    for (auto &&c : taken)
+        if (c.operation == DirChange::Operation::CREATE || c.operation == DirChange::Operation::MODIFY)
+            files[c.fname].copies.push_back(time);
+}
+
+static double percentile(std::vector<uint32_t> &v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(size_t(p * v.size()), v.size() - 1)];
+}
+
+// Takes changes of the trace the old way and by the queue, and prints results of both by group
+static void compare(const char *trace_name, const std::vector<TraceEvent> &trace)
+{
+    std::unordered_map<std::string, FileStats> file_stats; // writes are the same for both
+    for (auto &&e : trace)
+        if (e.operation != 'D')
+            file_stats[e.name].last_write_time = e.time;
+
+    // The old way: the list is polled, and a creation or modification is taken when there has been no event of the file for the settle time
+    Results old_results;
+    {
+        std::unordered_map<std::string, SimulatedFile> fs;
+        std::unordered_map<std::string, FileStats> files = file_stats;
+        std::map<std::string, DirChange> pending;
+        replay(trace, fs, [&](DirChange &&c) {
+            auto it = pending.find(c.fname);
+            if (c.operation == DirChange::Operation::DELETE && it != pending.end()) { // a deletion of a file which change has not been taken cancels it (or follows it)
+                pending.erase(it);
+                return false;
+            }
+            if (it != pending.end())
+                it->second.time = c.time;
+            else if (c.operation != DirChange::Operation::DELETE)
+                pending[c.fname] = std::move(c);
+            return pending.size() == 1; // the first pending change starts polling
+        }, [&](uint32_t time) {
+            std::vector<DirChange> taken;
+            for (auto it = pending.begin(); it != pending.end();)
+                if (int32_t(time - it->second.time) >= int32_t(SETTLE_TIME)) {
+                    taken.push_back(std::move(it->second));
+                    it = pending.erase(it);
+                }
+                else
+                    ++it;
+            record_copies(taken, time, files);
+            return pending.empty() ? UINT32_MAX : (time / TAKE_INTERVAL + 1) * TAKE_INTERVAL;
+        });
+        account(files, old_results);
+    }
+
+    Results new_results;
+    {
+        std::unordered_map<std::string, SimulatedFile> fs;
+        std::unordered_map<std::string, FileStats> files = file_stats;
+        std::map<std::string, size_t> probes;
+        DirChangeQueue q;
+        DirChangeQueue::Probe probe = [&](const DirChange &c, FileState &state) {
+            probes[group_of(c.fname)]++;
+            auto it = fs.find(c.fname);
+            if (it == fs.end() || !it->second.exists)
+                return false;
+            state.size = it->second.size;
+            state.last_write_time = it->second.last_write_time;
+            return true;
+        };
+        replay(trace, fs, [&](DirChange &&c) {return q.push(std::move(c));}, [&](uint32_t time) {
+            std::vector<DirChange> taken;
+            q.take_settled(time, probe, taken);
+            record_copies(taken, time, files);
+            uint32_t t = q.time_to_next_check(time);
+            return t == UINT32_MAX ? UINT32_MAX : time + std::max(t, 1u);
+        });
+        account(files, new_results);
+        for (auto &&p : probes) {
+            new_results[p.first].probes = p.second;
+            new_results["all"].probes += p.second;
+        }
+    }
+
+    for (auto &&r : new_results) {
+        GroupResult &old = old_results[r.first], &q = r.second;
+        printf("{\"trace\": \"%s\", \"group\": \"%s\", \"old_copies\": %zu, \"old_partial_copies\": %zu, \"old_median_latency_ms\": %.0f, \"old_p99_latency_ms\": %.0f, "
+               "\"queue_copies\": %zu, \"queue_partial_copies\": %zu, \"queue_median_latency_ms\": %.0f, \"queue_p99_latency_ms\": %.0f, \"queue_probes\": %zu}\n",
+               trace_name, r.first.c_str(), old.copies, old.partial_copies, percentile(old.latencies, 0.5), percentile(old.latencies, 0.99),
+               q.copies, q.partial_copies, percentile(q.latencies, 0.5), percentile(q.latencies, 0.99), q.probes);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Options o;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--minutes") == 0 && i + 1 < argc)    o.minutes = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)  o.seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) o.trace = argv[++i];
+        else {
+            fprintf(stderr, "Unknown option `%s`\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (o.trace != nullptr) {
+        std::vector<TraceEvent> trace;
+        if (!read_trace(o.trace, trace)) {
+            fprintf(stderr, "Can not read `%s`\n", o.trace);
+            return 1;
+        }
+        if (!trace.empty())
+            compare(o.trace, trace);
+        return 0;
+    }
+    std::mt19937_64 rng(o.seed);
+    compare("generated", make_trace(o.minutes, rng));
+    compare("revisit", make_revisit_trace(rng));
+
+    return 0;
+}
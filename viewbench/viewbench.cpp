@@ -0,0 +1,222 @@
+﻿// Benchmark of the tree view model (`DirTreeView`) on synthetic in-memory trees, no files are touched, so it runs anywhere.
+// Build:
+//   g++ -O2 -std=c++14 -pthread -I../clientapp viewbench.cpp ../clientapp/dir_tree_view.cpp ../clientapp/dir_entry.cpp ../clientapp/dir_snapshot.cpp ../clientapp/dir_name_index.cpp -o viewbench
+// Usage:
+//   viewbench [--max-rows N] [--visible-rows N] [--paints N] [--sort name|size] [--seed N]
+// For every total number of expanded rows (1000, 10000, ... up to `--max-rows`) it prints one JSON object per line with the time of one paint
+// (fetching of the visible rows at a random scroll position plus the row under the mouse) and of expanding and collapsing a directory,
+// together with the time of flattening of all expanded rows, which is what painting did before the view model. Rows are cross-checked against the flattening.
+// With `--sort size` it also prints the time of `update()` after the size of one subdirectory has changed, and of re-sorting of all expanded directories,
+// which is what painting did every 200 ms during a scan before orders were cached. `check` times are of finding the rows to repaint by a timer
+// (which repainted all visible rows every 200 ms before) while nothing changes and after a painted entry has changed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include "dir_tree_view.h"
+
+struct Options
+{
+    size_t max_rows = 1000000;
+    size_t visible_rows = 40;
+    int paints = 2000;
+    bool sort_by_size = false;
+    uint64_t seed = 1;
+};
+
+static int64_t size_key(const DirEntry &de) {return de.size;}
+
+// Flattening of all expanded rows as it was done on every paint
+static void fill_rows(std::vector<DirTreeView::Row> &rows, DirEntry &de, int level, bool sort_by_size)
+{
+    std::vector<DirEntry*> subdirs;
+    for (auto &&sd : de.subdirs())
+        subdirs.push_back(&sd);
+    if (sort_by_size)
+        std::sort(subdirs.begin(), subdirs.end(), [](const DirEntry *a, const DirEntry *b) {return a->size > b->size || (a->size == b->size && a->index < b->index);});
+    for (auto &&sd : subdirs) {
+        DirTreeView::Row r = {sd, level};
+        rows.push_back(r);
+        if (sd->expanded)
+            fill_rows(rows, *sd, level + 1, sort_by_size);
+    }
+}
+
+// Root with `n` expanded directories of 1000 subdirectories each (the last one has the remainder), and each of those has 4 collapsed subdirectories
+static DirEntry *generate(size_t num_of_rows, std::mt19937_64 &rng)
+{
+    dir_tree.clear();
+    DirEntry *root = dir_tree.add_root(PATH_LITERAL("root"));
+    root->expanded = true;
+
+    auto add_subdirs = [&rng](DirEntry &de, size_t n) {
+        std::vector<uint32_t> names;
+        for (size_t i = 0; i < n; i++) {
+            char name[32];
+            sprintf(name, "d%08llx", (unsigned long long)(rng() & 0xFFFFFFFF));
+            PathString s(name, name + strlen(name));
+            names.push_back(dir_tree.intern_name(s.c_str()));
+        }
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        dir_tree.set_subdirs(de, names);
+        for (auto &&sd : de.subdirs())
+            sd.size = int64_t(rng() % (1 << 30));
+    };
+
+    size_t rest = num_of_rows - 1;
+    size_t num_of_groups = (rest + 1000) / 1001;
+    add_subdirs(*root, num_of_groups);
+    rest -= root->subdirs().size();
+    for (auto &&group : root->subdirs()) {
+        size_t n = std::min<size_t>(rest, 1000);
+        add_subdirs(group, n);
+        rest -= group.subdirs().size();
+        group.expanded = group.subdirs().size() != 0;
+        for (auto &&sd : group.subdirs())
+            add_subdirs(sd, 4);
+    }
+    return root;
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) {
+            fprintf(stderr, "Value of `%s` is missing\n", arg.c_str());
+            return 1;
+        }
+        const char *value = argv[++i];
+        if      (arg == "--max-rows")     options.max_rows = strtoull(value, NULL, 10);
+        else if (arg == "--visible-rows") options.visible_rows = strtoull(value, NULL, 10);
+        else if (arg == "--paints")       options.paints = atoi(value);
+        else if (arg == "--sort")         options.sort_by_size = strcmp(value, "size") == 0;
+        else if (arg == "--seed")         options.seed = strtoull(value, NULL, 10);
+        else {
+            fprintf(stderr, "Unknown option `%s`\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    for (size_t total_rows = 1000; total_rows <= options.max_rows; total_rows *= 10) {
+        std::mt19937_64 rng(options.seed);
+        DirEntry *root = generate(total_rows, rng);
+        std::vector<DirEntry*> roots(1, root);
+
+        DirTreeView view;
+        auto start = std::chrono::steady_clock::now();
+        view.set_order(options.sort_by_size ? size_key : nullptr);
+        view.reset(roots);
+        double reset_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::vector<DirTreeView::Row> all_rows(1, DirTreeView::Row());
+        all_rows[0].de = root;
+        all_rows[0].level = 0;
+        start = std::chrono::steady_clock::now();
+        fill_rows(all_rows, *root, 1, options.sort_by_size);
+        double flatten_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (all_rows.size() != view.num_of_rows()) {
+            fprintf(stderr, "Mismatch: %llu rows in the view, %llu rows flattened\n", (unsigned long long)view.num_of_rows(), (unsigned long long)all_rows.size());
+            return 1;
+        }
+
+        // Paint: visible rows at a random scroll position and the row under the mouse
+        std::vector<DirTreeView::Row> rows;
+        std::vector<size_t> firsts;
+        for (int i = 0; i < options.paints; i++)
+            firsts.push_back(size_t(rng() % all_rows.size()));
+        size_t checksum = 0;
+        start = std::chrono::steady_clock::now();
+        for (auto &&first : firsts) {
+            view.update();
+            view.get_rows(first, options.visible_rows, rows);
+            DirTreeView::Row hover;
+            if (view.row(first + options.visible_rows / 2, hover))
+                checksum += hover.level;
+            checksum += rows.size();
+        }
+        double paint_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / options.paints;
+        for (auto &&first : firsts) {
+            view.get_rows(first, options.visible_rows, rows);
+            for (size_t i = 0; i < rows.size(); i++)
+                if (rows[i].de != all_rows[first + i].de || rows[i].level != all_rows[first + i].level) {
+                    fprintf(stderr, "Mismatch at row %llu\n", (unsigned long long)(first + i));
+                    return 1;
+                }
+        }
+
+        // Expanding and collapsing of a directory in the middle of the tree
+        DirEntry *group = &root->subdirs()[root->subdirs().size() / 2];
+        DirEntry *dir = &group->subdirs()[group->subdirs().size() / 2];
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < options.paints; i++) {
+            view.set_expanded(*dir, true);
+            view.set_expanded(*dir, false);
+        }
+        double toggle_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / options.paints;
+
+        // Finding of the rows to repaint
+        DirTreeViewChanges changes;
+        changes.get_rows(view, firsts[0], options.visible_rows, rows);
+        std::vector<size_t> changed_rows;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < options.paints; i++) {
+            view.update();
+            changes.find_changed_rows(view, changed_rows);
+            checksum += changed_rows.size();
+        }
+        double idle_check_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / options.paints;
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < options.paints; i++) {
+            dir_tree.changed(*rows[size_t(i) % rows.size()].de);
+            view.update();
+            changes.find_changed_rows(view, changed_rows);
+            checksum += changed_rows.size();
+        }
+        double change_check_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / options.paints;
+
+        // Change of the size of one subdirectory (as during a scan) and re-sorting of everything
+        double update_seconds = 0, resort_seconds = 0;
+        if (options.sort_by_size) {
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < options.paints; i++) {
+                DirEntry &g = root->subdirs()[size_t(rng() % root->subdirs().size())];
+                DirEntry &sd = g.subdirs()[size_t(rng() % g.subdirs().size())];
+                sd.size += int64_t(rng() % 1000);
+                dir_tree.totals_changed(sd);
+                view.update();
+            }
+            update_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / options.paints;
+
+            int resorts = std::max(1, options.paints / 100);
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < resorts; i++)
+                view.set_order(size_key);
+            resort_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / resorts;
+
+            all_rows.resize(1);
+            fill_rows(all_rows, *root, 1, true);
+            std::vector<DirTreeView::Row> check;
+            view.get_rows(0, all_rows.size(), check);
+            for (size_t i = 0; i < all_rows.size(); i++)
+                if (i >= check.size() || check[i].de != all_rows[i].de) {
+                    fprintf(stderr, "Mismatch at row %llu after sizes have changed\n", (unsigned long long)i);
+                    return 1;
+                }
+        }
+
+        printf("{\"rows\": %llu, \"expanded_dirs\": %llu, \"visible_rows\": %llu, \"sort\": \"%s\", \"reset_seconds\": %.6f, "
+               "\"paint_seconds\": %.9f, \"toggle_seconds\": %.9f, \"idle_check_seconds\": %.9f, \"change_check_seconds\": %.9f, \"update_seconds\": %.9f, \"resort_seconds\": %.6f, \"flatten_seconds\": %.6f, \"checksum\": %llu}\n",
+               (unsigned long long)all_rows.size(), (unsigned long long)view.num_of_expanded_dirs(), (unsigned long long)options.visible_rows, options.sort_by_size ? "size" : "name",
+               reset_seconds, paint_seconds, toggle_seconds, idle_check_seconds, change_check_seconds, update_seconds, resort_seconds, flatten_seconds, (unsigned long long)checksum);
+        fflush(stdout);
+    }
+    return 0;
+}